@@ -0,0 +1,290 @@
+/**
+ * @file access_log.c
+ * @brief Asynchronous structured access log of the imgFS server.
+ *
+ * There are ACCESS_LOG_RINGS single-producer single-consumer rings. A
+ * connection thread claims a free ring with one atomic exchange, copies
+ * its line in and releases the ring: as connection threads serve a single
+ * request, a ring is owned by one thread at a time and the producer side
+ * needs no lock. The writer thread is the only consumer; it wakes up every
+ * FLUSH_INTERVAL_MS, gathers the content of all the rings into one buffer
+ * and issues a single write() per WRITE_CHUNK.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h> // PRIu64
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "error.h"
+#include "util.h" // _unused, block_stop_signals
+
+#define ACCESS_LOG_RINGS 64
+#define RING_SIZE (64 * 1024) // must be a power of two
+#define LINE_SIZE 1024        // enough for any line, even with a fully escaped id
+#define WRITE_CHUNK (256 * 1024)
+#define FLUSH_INTERVAL_MS 50
+#define CACHE_LINE 64
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+struct ring {
+    atomic_int busy;                                   // claimed by a producer
+    _Atomic uint64_t head __attribute__((aligned(CACHE_LINE))); // written by the producer
+    _Atomic uint64_t tail __attribute__((aligned(CACHE_LINE))); // written by the writer thread
+    char data[RING_SIZE];
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct ring rings[ACCESS_LOG_RINGS];
+static atomic_uint next_ring;
+static _Atomic uint64_t dropped;
+
+static int log_fd = -1;
+static atomic_int running;
+static pthread_t writer;
+static char* chunk = NULL; // only used by the writer thread
+static size_t chunk_len = 0;
+
+/********************************************************************
+ * Producers
+ */
+
+/**
+ * @brief Claims a free ring, or returns NULL if all of them are busy.
+ */
+static struct ring* claim_ring(void)
+{
+    const unsigned int first = atomic_fetch_add_explicit(&next_ring, 1, memory_order_relaxed);
+    for (unsigned int i = 0; i < ACCESS_LOG_RINGS; ++i) {
+        struct ring* const r = &rings[(first + i) % ACCESS_LOG_RINGS];
+        if (atomic_load_explicit(&r->busy, memory_order_relaxed) == 0 &&
+            atomic_exchange_explicit(&r->busy, 1, memory_order_acquire) == 0) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Appends a line to a claimed ring.
+ *
+ * @return 0 if the line was appended, -1 if there was not enough room.
+ */
+static int ring_push(struct ring* r, const char* line, size_t len)
+{
+    const uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    const uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (RING_SIZE - (head - tail) < len) return -1;
+
+    const size_t pos = (size_t) (head & (RING_SIZE - 1));
+    const size_t first = len < RING_SIZE - pos ? len : RING_SIZE - pos;
+    memcpy(r->data + pos, line, first);
+    memcpy(r->data, line + first, len - first);
+    atomic_store_explicit(&r->head, head + len, memory_order_release);
+    return 0;
+}
+
+/**
+ * @brief Writes a JSON string (with its quotes) of at most max bytes.
+ *
+ * @return The number of bytes written.
+ */
+static size_t json_string(char* out, size_t max, const char* s)
+{
+    static const char hex[] = "0123456789abcdef";
+    size_t n = 0;
+    if (max < 3) return 0;
+    out[n++] = '"';
+    for (; *s != '\0' && n + 7 < max; ++s) {
+        const unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            out[n++] = '\\';
+            out[n++] = (char) c;
+        } else if (c < 0x20) {
+            memcpy(out + n, "\\u00", 4);
+            out[n + 4] = hex[c >> 4];
+            out[n + 5] = hex[c & 0xf];
+            n += 6;
+        } else {
+            out[n++] = (char) c;
+        }
+    }
+    out[n++] = '"';
+    return n;
+}
+
+static uint64_t us(uint64_t ns)
+{
+    return ns / 1000;
+}
+
+/**
+ * @brief Formats the log line of a request.
+ *
+ * @return The length of the line, 0 on error.
+ */
+static size_t format_line(char* line, size_t size, const struct request_ctx* ctx)
+{
+    struct timespec now;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &now);
+    gmtime_r(&now.tv_sec, &tm);
+
+    size_t n = strftime(line, size, "{\"ts\":\"%Y-%m-%dT%H:%M:%S", &tm);
+    if (n == 0) return 0;
+
+    char id[LINE_SIZE / 2];
+    if (ctx->img_id[0] != '\0') {
+        id[json_string(id, sizeof(id) - 1, ctx->img_id)] = '\0';
+    } else {
+        strcpy(id, "null");
+    }
+
+    char cache[8] = "null";
+    if (ctx->cache_hit >= 0) strcpy(cache, ctx->cache_hit ? "\"hit\"" : "\"miss\"");
+
+    const uint64_t recv = ctx->parsed_ns != 0 ? ctx->parsed_ns - ctx->start_ns : 0;
+    const int res = ctx->resolution;
+    const int written =
+        snprintf(line + n, size - n,
+                 ".%03ldZ\",\"method\":\"%s\",\"route\":\"%s\",\"img_id\":%s,"
+                 "\"res\":%s%s%s,\"status\":%d,\"bytes\":%zu,\"cache\":%s,"
+                 "\"recv_us\":%" PRIu64 ",\"wait_us\":%" PRIu64 ",\"op_us\":%" PRIu64
+                 ",\"send_us\":%" PRIu64 ",\"total_us\":%" PRIu64 "}\n",
+                 now.tv_nsec / 1000000, ctx->method, request_route_name(ctx->route), id,
+                 res >= 0 && res < NB_RES ? "\"" : "",
+                 res >= 0 && res < NB_RES ? res_names[res] : "null",
+                 res >= 0 && res < NB_RES ? "\"" : "",
+                 ctx->status, ctx->bytes, cache,
+                 us(recv), us(ctx->wait_ns), us(ctx->op_ns), us(ctx->send_ns),
+                 us(ctx->end_ns - ctx->start_ns));
+    if (written < 0 || (size_t) written >= size - n) return 0;
+    return n + (size_t) written;
+}
+
+void access_log_request(const struct request_ctx* ctx)
+{
+    if (ctx == NULL || !atomic_load_explicit(&running, memory_order_acquire)) return;
+
+    char line[LINE_SIZE];
+    const size_t len = format_line(line, sizeof(line), ctx);
+    if (len == 0) return;
+
+    struct ring* const r = claim_ring();
+    if (r == NULL || ring_push(r, line, len) != 0) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+    }
+    if (r != NULL) atomic_store_explicit(&r->busy, 0, memory_order_release);
+}
+
+uint64_t access_log_dropped(void)
+{
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+/********************************************************************
+ * Writer thread
+ */
+
+static void write_chunk(void)
+{
+    size_t done = 0;
+    while (done < chunk_len) {
+        const ssize_t w = write(log_fd, chunk + done, chunk_len - done);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            perror("access log write()");
+            break;
+        }
+        done += (size_t) w;
+    }
+    chunk_len = 0;
+}
+
+/**
+ * @brief Moves the content of all the rings to the output, in chunks.
+ */
+static void drain(void)
+{
+    for (size_t i = 0; i < ACCESS_LOG_RINGS; ++i) {
+        struct ring* const r = &rings[i];
+        const uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        while (tail != head) {
+            if (chunk_len == WRITE_CHUNK) write_chunk();
+            const size_t pos = (size_t) (tail & (RING_SIZE - 1));
+            size_t len = (size_t) (head - tail);
+            if (len > RING_SIZE - pos) len = RING_SIZE - pos;
+            if (len > WRITE_CHUNK - chunk_len) len = WRITE_CHUNK - chunk_len;
+            memcpy(chunk + chunk_len, r->data + pos, len);
+            chunk_len += len;
+            tail += len;
+        }
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+    if (chunk_len > 0) write_chunk();
+}
+
+static void* writer_main(void* arg _unused)
+{
+    block_stop_signals();
+
+    const struct timespec interval = { 0, FLUSH_INTERVAL_MS * 1000000L };
+    while (atomic_load_explicit(&running, memory_order_acquire)) {
+        drain();
+        nanosleep(&interval, NULL);
+    }
+    drain();
+    return NULL;
+}
+
+int access_log_open(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+    if (atomic_load(&running)) return ERR_INVALID_ARGUMENT;
+
+    chunk = malloc(WRITE_CHUNK);
+    if (chunk == NULL) return ERR_OUT_OF_MEMORY;
+
+    log_fd = strcmp(path, "-") == 0 ? STDERR_FILENO
+             : open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) {
+        perror("access log open()");
+        free(chunk);
+        chunk = NULL;
+        return ERR_IO;
+    }
+
+    atomic_store(&running, 1);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        if (log_fd != STDERR_FILENO) close(log_fd);
+        log_fd = -1;
+        free(chunk);
+        chunk = NULL;
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+void access_log_close(void)
+{
+    if (!atomic_exchange(&running, 0)) return;
+    pthread_join(writer, NULL);
+
+    const uint64_t lost = access_log_dropped();
+    if (lost > 0) {
+        fprintf(stderr, "Access log: %" PRIu64 " lines dropped\n", lost);
+    }
+    if (log_fd != STDERR_FILENO) close(log_fd);
+    log_fd = -1;
+    free(chunk);
+    chunk = NULL;
+}
@@ -0,0 +1,42 @@
+/**
+ * @file access_log.h
+ * @brief Asynchronous structured access log of the imgFS server.
+ *
+ * The log has one JSON line per request: method, route, image id,
+ * resolution, status, bytes, latency breakdown and derivative cache hit.
+ * Connection threads format their line into a lock-free ring buffer and
+ * return; a background thread drains the rings and writes them to the log
+ * file in large chunks. Logging never blocks a request: a line that does
+ * not fit in any ring is dropped, and counted.
+ */
+
+#pragma once
+
+#include <stdint.h> // uint64_t
+
+#include "request_ctx.h"
+
+#define ACCESS_LOG_ENV "IMGFS_ACCESS_LOG"
+
+/**
+ * @brief Opens the access log and starts its background writer.
+ *
+ * @param path The log file, appended to; "-" for the standard error.
+ * @return Some error code. 0 if no error.
+ */
+int access_log_open(const char* path);
+
+/**
+ * @brief Logs a finished request. Does nothing if the log is not open.
+ */
+void access_log_request(const struct request_ctx* ctx);
+
+/**
+ * @brief Returns the number of lines dropped because the rings were full.
+ */
+uint64_t access_log_dropped(void);
+
+/**
+ * @brief Stops the background writer, flushes what is left and closes the log.
+ */
+void access_log_close(void);
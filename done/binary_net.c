@@ -0,0 +1,385 @@
+/**
+ * @file binary_net.c
+ * @brief Binary protocol endpoint of the imgFS server (see binary_net.h).
+ *
+ * A connection has a reader thread, which reads the frames and queues
+ * them, and BINARY_CONN_WORKERS threads, which serve them and send the
+ * responses, one at a time (send_lock). The reader stops reading while
+ * BINARY_MAX_IN_FLIGHT requests wait for their response. Once the client
+ * is done sending, the requests queued are still answered; then the reader
+ * joins the workers and closes the connection.
+ *
+ * Each request is a request of the server for the metrics and the logs
+ * (request_ctx.h), of method "BIN", with the status 200 or 500.
+ */
+
+#define _GNU_SOURCE // for accept4()
+
+#include <arpa/inet.h> // htonl
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "binary_net.h"
+#include "error.h"
+#include "imgfs.h" // for MAX_IMG_ID
+#include "metrics.h" // connections
+#include "request_ctx.h"
+#include "socket_layer.h"
+#include "util.h" // _unused, block_stop_signals
+
+#define POLL_MS 100 // how often the listener checks whether to stop
+
+static int passive_socket = -1;
+static binary_handler handler = NULL;
+static pthread_t listener;
+static atomic_int running;
+
+/**
+ * @brief A request read, waiting for a worker.
+ */
+struct frame {
+    struct frame* next;
+    char* bytes; // the frame, after its length
+    size_t size;
+};
+
+struct binary_conn {
+    int socket;
+    pthread_t workers[BINARY_CONN_WORKERS];
+    unsigned nb_workers;
+    // plain mutexes, not profiled: a prof_mutex per connection would only be
+    // reported while it is open, each under the same name
+    pthread_mutex_t send_lock;
+    // the following fields are protected by lock
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct frame* first;
+    struct frame* last;
+    unsigned in_flight; // queued or being served
+    int done; // no more frames will be queued
+    int broken; // a response could not be sent: the others are dropped
+};
+
+/**
+ * @return 1 if len bytes were read, 0 if the connection was closed before
+ *         the first, ERR_IO otherwise.
+ */
+static int recv_all(int socket, void* data, size_t len)
+{
+    char* p = data;
+    size_t got = 0;
+    while (got < len) {
+        const ssize_t n = recv(socket, p + got, len - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return got == 0 && n == 0 ? 0 : ERR_IO;
+        got += (size_t) n;
+    }
+    return 1;
+}
+
+static uint32_t get_u32(const char* bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return ntohl(value);
+}
+
+static void put_u32(char* bytes, uint32_t value)
+{
+    value = htonl(value);
+    memcpy(bytes, &value, sizeof(value));
+}
+
+// ======================================================================
+// Serving
+
+/**
+ * @brief Sends a response: its header and its data, without copying them.
+ */
+static int send_response(struct binary_conn* conn, uint32_t id, const struct binary_reply* reply)
+{
+    char header[BINARY_RESPONSE_HEADER_SIZE];
+    put_u32(header, (uint32_t) (BINARY_RESPONSE_HEADER_SIZE - 4 + reply->size));
+    put_u32(header + 4, id);
+    put_u32(header + 8, (uint32_t) reply->status);
+    put_u32(header + 12, (uint32_t) reply->size);
+
+    struct iovec parts[2] = {
+        { header, sizeof(header) },
+        { reply->data, reply->size }
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = reply->size > 0 ? 2 : 1;
+
+    pthread_mutex_lock(&conn->send_lock);
+    int err = ERR_NONE;
+    while (msg.msg_iovlen > 0) {
+        const ssize_t sent = sendmsg(conn->socket, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) {
+            err = ERR_IO;
+            break;
+        }
+        // skips what was sent
+        size_t left = (size_t) sent;
+        while (msg.msg_iovlen > 0 && left >= msg.msg_iov->iov_len) {
+            left -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + left;
+            msg.msg_iov->iov_len -= left;
+        }
+    }
+    pthread_mutex_unlock(&conn->send_lock);
+    return err;
+}
+
+/**
+ * @brief Serves the request of a frame.
+ *
+ * @return Some error code (of sending the response). 0 if no error.
+ */
+static int serve_frame(struct binary_conn* conn, const struct frame* f)
+{
+    request_begin();
+    request_parsed("BIN", strlen("BIN"));
+
+    const uint32_t id = get_u32(f->bytes);
+    struct binary_reply reply;
+    memset(&reply, 0, sizeof(reply));
+
+    const size_t id_len = (unsigned char) f->bytes[6];
+    char img_id[MAX_IMG_ID + 1] = "";
+    if (BINARY_REQUEST_HEADER_SIZE - 4 + id_len > f->size || id_len > MAX_IMG_ID || f->bytes[7] != 0) {
+        reply.status = ERR_INVALID_ARGUMENT;
+    } else {
+        memcpy(img_id, f->bytes + BINARY_REQUEST_HEADER_SIZE - 4, id_len);
+        const size_t payload_start = BINARY_REQUEST_HEADER_SIZE - 4 + id_len;
+        const struct binary_request request = {
+            id, (uint8_t) f->bytes[4], (uint8_t) f->bytes[5], img_id,
+            f->bytes + payload_start, f->size - payload_start
+        };
+        if (strlen(img_id) != id_len) reply.status = ERR_INVALID_IMGID; // a NUL in the id
+        else handler(&request, &reply);
+    }
+
+    const uint64_t send_start = request_now_ns();
+    const int err = send_response(conn, id, &reply);
+    request_reply(reply.status == ERR_NONE ? "200" : "500", err == ERR_NONE ? reply.size : 0,
+                  request_now_ns() - send_start);
+    request_end();
+    free(reply.data);
+    return err;
+}
+
+static void* worker_main(void* arg)
+{
+    block_stop_signals();
+    struct binary_conn* const conn = arg;
+    pthread_mutex_lock(&conn->lock);
+    for (;;) {
+        while (conn->first == NULL && !conn->done) pthread_cond_wait(&conn->changed, &conn->lock);
+        struct frame* const f = conn->first;
+        if (f == NULL) break;
+        conn->first = f->next;
+        if (conn->first == NULL) conn->last = NULL;
+        const int broken = conn->broken;
+        pthread_mutex_unlock(&conn->lock);
+
+        const int err = broken ? ERR_IO : serve_frame(conn, f);
+        free(f->bytes);
+        free(f);
+
+        pthread_mutex_lock(&conn->lock);
+        if (err != ERR_NONE) conn->broken = 1;
+        --conn->in_flight;
+        pthread_cond_broadcast(&conn->changed);
+    }
+    pthread_mutex_unlock(&conn->lock);
+    return NULL;
+}
+
+/**
+ * @brief Reads a frame.
+ *
+ * @return 1 if read, 0 if the client is done sending, some error code otherwise.
+ */
+static int read_frame(int socket, struct frame** read)
+{
+    char length[4];
+    int ret = recv_all(socket, length, sizeof(length));
+    if (ret <= 0) return ret;
+    const uint32_t size = get_u32(length);
+    if (size < BINARY_REQUEST_HEADER_SIZE - 4 || size > BINARY_MAX_FRAME) return ERR_INVALID_ARGUMENT;
+
+    struct frame* const f = calloc(1, sizeof(*f));
+    char* const bytes = malloc(size);
+    if (f == NULL || bytes == NULL) {
+        free(f);
+        free(bytes);
+        return ERR_OUT_OF_MEMORY;
+    }
+    ret = recv_all(socket, bytes, size);
+    if (ret != 1) {
+        free(f);
+        free(bytes);
+        return ERR_IO;
+    }
+    f->bytes = bytes;
+    f->size = size;
+    *read = f;
+    return 1;
+}
+
+static void* connection_main(void* arg)
+{
+    block_stop_signals();
+    struct binary_conn* const conn = arg;
+    metrics_connection_opened();
+    for (;;) {
+        pthread_mutex_lock(&conn->lock);
+        while (conn->in_flight >= BINARY_MAX_IN_FLIGHT && !conn->broken) {
+            pthread_cond_wait(&conn->changed, &conn->lock);
+        }
+        const int broken = conn->broken;
+        pthread_mutex_unlock(&conn->lock);
+        if (broken) break;
+
+        struct frame* f = NULL;
+        if (read_frame(conn->socket, &f) != 1) break;
+
+        pthread_mutex_lock(&conn->lock);
+        if (conn->last != NULL) conn->last->next = f;
+        else conn->first = f;
+        conn->last = f;
+        ++conn->in_flight;
+        pthread_cond_signal(&conn->changed);
+        pthread_mutex_unlock(&conn->lock);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    conn->done = 1;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+    for (unsigned i = 0; i < conn->nb_workers; ++i) pthread_join(conn->workers[i], NULL);
+
+    close(conn->socket);
+    pthread_cond_destroy(&conn->changed);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+    metrics_connection_closed();
+    return NULL;
+}
+
+/**
+ * @brief Starts serving a connection, in threads of its own.
+ */
+static int add_connection(int socket)
+{
+    struct binary_conn* const conn = calloc(1, sizeof(struct binary_conn));
+    if (conn == NULL) return ERR_OUT_OF_MEMORY;
+    conn->socket = socket;
+    if (pthread_mutex_init(&conn->lock, NULL) != 0 || pthread_mutex_init(&conn->send_lock, NULL) != 0
+        || pthread_cond_init(&conn->changed, NULL) != 0) {
+        free(conn);
+        return ERR_THREADING;
+    }
+
+    int err = ERR_NONE;
+    for (; conn->nb_workers < BINARY_CONN_WORKERS; ++conn->nb_workers) {
+        if (pthread_create(&conn->workers[conn->nb_workers], NULL, worker_main, conn) != 0) {
+            err = ERR_THREADING;
+            break;
+        }
+    }
+    pthread_attr_t attr;
+    pthread_t reader;
+    if (err == ERR_NONE && (pthread_attr_init(&attr) != 0
+                            || pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) != 0
+                            || pthread_create(&reader, &attr, connection_main, conn) != 0)) {
+        err = ERR_THREADING;
+    }
+    if (err == ERR_NONE) {
+        pthread_attr_destroy(&attr);
+        return ERR_NONE;
+    }
+
+    // the workers started wait for frames: done
+    pthread_mutex_lock(&conn->lock);
+    conn->done = 1;
+    pthread_cond_broadcast(&conn->changed);
+    pthread_mutex_unlock(&conn->lock);
+    for (unsigned i = 0; i < conn->nb_workers; ++i) pthread_join(conn->workers[i], NULL);
+    pthread_cond_destroy(&conn->changed);
+    pthread_mutex_destroy(&conn->lock);
+    pthread_mutex_destroy(&conn->send_lock);
+    free(conn);
+    return err;
+}
+
+// ======================================================================
+// Listening
+
+static void* listener_main(void* arg _unused)
+{
+    block_stop_signals();
+    while (atomic_load(&running)) {
+        struct pollfd ready = { passive_socket, POLLIN, 0 };
+        if (poll(&ready, 1, POLL_MS) <= 0) continue;
+        // nonblocking: another worker may have taken the connection
+        const int socket = accept4(passive_socket, NULL, NULL, SOCK_CLOEXEC);
+        if (socket < 0) continue;
+        if (add_connection(socket) != ERR_NONE) close(socket);
+    }
+    return NULL;
+}
+
+int binary_init(uint16_t port, binary_handler callback)
+{
+    M_REQUIRE_NON_NULL(callback);
+    if (passive_socket >= 0 || port == 0) return ERR_INVALID_ARGUMENT;
+    const int socket = tcp_server_init(port);
+    if (socket < 0) return ERR_IO;
+    const int flags = fcntl(socket, F_GETFL);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) != 0) {
+        close(socket);
+        return ERR_IO;
+    }
+    passive_socket = socket;
+    handler = callback;
+    return passive_socket;
+}
+
+int binary_start(void)
+{
+    if (passive_socket < 0 || atomic_load(&running)) return ERR_NONE;
+    atomic_store(&running, 1);
+    if (pthread_create(&listener, NULL, listener_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+void binary_close(void)
+{
+    if (atomic_exchange(&running, 0)) pthread_join(listener, NULL);
+    if (passive_socket >= 0) {
+        close(passive_socket);
+        passive_socket = -1;
+    }
+}
@@ -0,0 +1,94 @@
+/**
+ * @file binary_net.h
+ * @brief Binary protocol endpoint of the imgFS server, for internal traffic.
+ *
+ * On a port of its own (BINARY_PORT_ENV), the server takes compact frames
+ * instead of HTTP text. Integers are in network byte order. A request is
+ *
+ *     u32 length       bytes that follow this field: 8 + id_len + payload
+ *     u32 request id   chosen by the client, given back in the response
+ *     u8  opcode       BINARY_LIST, BINARY_READ, BINARY_INSERT or BINARY_DELETE
+ *     u8  resolution   THUMB_RES, SMALL_RES or ORIG_RES (read)
+ *     u8  id_len       length of the image id (0 for list)
+ *     u8  flags        0
+ *     id_len bytes     the image id
+ *     payload          the image (insert)
+ *
+ * and its response is
+ *
+ *     u32 length       bytes that follow this field: 12 + size
+ *     u32 request id
+ *     i32 status       ERR_NONE, or the error code (error.h)
+ *     u32 size
+ *     size bytes       the image (read), the list in JSON (list)
+ *
+ * A client may send requests without waiting for their responses: each
+ * connection serves up to BINARY_CONN_WORKERS of them at once, and their
+ * responses come as they are ready, to be matched by request id. A frame
+ * that cannot be read (length out of bounds) closes the connection.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint8_t, uint16_t, uint32_t
+
+#define BINARY_PORT_ENV "IMGFS_BINARY_PORT" // port of the binary protocol, if set
+#define BINARY_REQUEST_HEADER_SIZE 12
+#define BINARY_RESPONSE_HEADER_SIZE 16
+#define BINARY_MAX_FRAME (8 * 1024 * 1024 + 256) // an image of up to 8 MB, as over HTTP, and its header
+#define BINARY_CONN_WORKERS 4 // requests of a connection served at once
+#define BINARY_MAX_IN_FLIGHT 64 // requests of a connection read before their response is sent
+
+enum binary_opcode {
+    BINARY_LIST = 1,
+    BINARY_READ = 2,
+    BINARY_INSERT = 3,
+    BINARY_DELETE = 4
+};
+
+/**
+ * @brief A request, as read from its frame.
+ */
+struct binary_request {
+    uint32_t id;
+    uint8_t opcode;
+    uint8_t resolution;
+    const char* img_id; // NUL-terminated, empty if none
+    const char* payload;
+    size_t payload_size;
+};
+
+/**
+ * @brief The response to a request, set by the handler.
+ */
+struct binary_reply {
+    int status; // ERR_NONE, or the error code
+    char* data; // malloc()ed, freed once sent; NULL if none
+    size_t size;
+};
+
+typedef void (*binary_handler)(const struct binary_request* request, struct binary_reply* reply);
+
+/**
+ * @brief Listens on a port for the binary protocol; the requests are
+ *        served once binary_start() is called.
+ *
+ * @param handler Serves each request.
+ * @return The passive socket, or some (negative) error code.
+ */
+int binary_init(uint16_t port, binary_handler handler);
+
+/**
+ * @brief Starts accepting connections, in the process that serves them
+ *        (each worker, in prefork mode). Does nothing if binary_init()
+ *        was not called.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int binary_start(void);
+
+/**
+ * @brief Stops accepting connections, and closes the passive socket.
+ */
+void binary_close(void);
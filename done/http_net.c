@@ -5,23 +5,58 @@
  * @author Konstantinos Prasopoulos
  */
 
+#define _GNU_SOURCE // for F_GET_SEALS
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/socket.h>
 #include <string.h>
 #include <stdint.h>
 #include <unistd.h>
-#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "http_prot.h"
 #include "http_net.h"
 #include "socket_layer.h"
 #include "error.h"
-#include "util.h"
+#include "util.h" // block_stop_signals
+#include "metrics.h" // connections
+#include "request_ctx.h"
+#include "trace.h"
 #include <pthread.h>
 
 static int passive_socket = -1;
+static int unix_socket = -1; // for the clients on the same machine, if listening
+static char unix_path[108]; // sizeof(sun_path)
+static pid_t unix_owner = 0; // the process that created the socket file, to remove it
+static unsigned next_listener = 0; // the one accepted first when both are ready
 static EventCallback cb;
+static _Thread_local int keeping_alive = 0; // whether the reply being sent leaves the connection open
+
+#define KEEP_ALIVE_HEADER "Connection: keep-alive" HTTP_LINE_DELIM
+#define KEEP_ALIVE_IDLE_MS 5000 // before closing a connection kept alive
+
+/**
+ * @brief The bytes of a connection kept alive read past the message being
+ *        served: the start of the next ones, pipelined by the client.
+ */
+struct pending_bytes {
+    char* data;
+    size_t size;
+};
+
+/**
+ * @brief The body of a request passed as a file descriptor, on a Unix
+ *        domain socket.
+ */
+struct passed_body {
+    int fd; // -1 if none
+    void* map; // if mapped rather than read
+    size_t map_size;
+};
 
 #define MK_OUR_ERR(X) \
 static int our_ ## X = X
@@ -33,45 +68,134 @@ MK_OUR_ERR(ERR_IO);
 
 #define MAX_SIZE_T_STRING_SIZE 19
 
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010 // Linux 5.1, missing from older headers
+#endif
+
+
+/**
+ * @brief Gets the body of content_len bytes from the file passed along the
+ *        header, instead of from the socket.
+ *
+ * A memory file sealed against shrinking and writing (memfd, F_SEAL_SHRINK
+ * and F_SEAL_WRITE or F_SEAL_FUTURE_WRITE) is mapped; any other regular
+ * file is read into the buffer, after the header: the client could
+ * truncate a mapped file under us, or change the image once its SHA is
+ * computed, so that the content stored no longer matches it.
+ *
+ * @param passed The file, and where to keep the mapping.
+ * @param buffer The message, of room enough for its header and body.
+ * @param header_size Where the body goes in buffer.
+ * @param content_len The size of the body.
+ * @param body Set to the body.
+ * @return Some error code. 0 if no error.
+ */
+static int get_passed_body(struct passed_body* passed, char* buffer, size_t header_size,
+                           size_t content_len, const char** body)
+{
+    struct stat st;
+    if (fstat(passed->fd, &st) != 0 || !S_ISREG(st.st_mode) || (size_t) st.st_size < content_len) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    const int seals = fcntl(passed->fd, F_GET_SEALS);
+    if (seals >= 0 && (seals & F_SEAL_SHRINK) && (seals & (F_SEAL_WRITE | F_SEAL_FUTURE_WRITE))) {
+        void* const map = mmap(NULL, content_len, PROT_READ, MAP_SHARED, passed->fd, 0);
+        if (map == MAP_FAILED) return ERR_IO;
+        passed->map = map;
+        passed->map_size = content_len;
+        *body = map;
+        return ERR_NONE;
+    }
+
+    size_t done = 0;
+    while (done < content_len) {
+        const ssize_t got = pread(passed->fd, buffer + header_size + done, content_len - done, (off_t) done);
+        if (got <= 0) return ERR_IO;
+        done += (size_t) got;
+    }
+    *body = buffer + header_size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Whether a message asks for its connection to be kept open
+ *        ("Connection: keep-alive"); it is closed by default.
+ */
+static int wants_keep_alive(const struct http_message* message)
+{
+    const struct http_string* const connection = http_get_header(message, "Connection");
+    return connection != NULL && connection->len == strlen("keep-alive")
+           && strncasecmp(connection->val, "keep-alive", connection->len) == 0;
+}
+
+/**
+ * @brief Waits for the next message of a connection kept alive, up to
+ *        KEEP_ALIVE_IDLE_MS: a client that sends none is disconnected.
+ *
+ * @return 1 if there is something to read, 0 otherwise.
+ */
+static int wait_next_message(int client_socket)
+{
+    struct pollfd pfd = { client_socket, POLLIN, 0 };
+    return poll(&pfd, 1, KEEP_ALIVE_IDLE_MS) > 0;
+}
 
 /**
- * @brief Handles a client connection for HTTP message processing.
+ * @brief Reads, parses and dispatches the HTTP message of a client connection.
  *
  * It manages the entire process of handling a client connection, including reading HTTP headers, parsing the
  * HTTP message, and reading the message content.
  *
- * @param arg Pointer to the client socket file descriptor.
+ * On a Unix domain socket, the body may also come as a file descriptor
+ * passed along the header (SCM_RIGHTS), with no body bytes on the socket:
+ * Content-Length bytes are then taken from the start of the file.
+ *
+ * A message asking for it ("Connection: keep-alive") is answered so, and
+ * the connection left open for the next ones; the bytes read past the
+ * message are kept in pending. Otherwise, the connection is closed.
+ *
+ * @param client_socket The client socket file descriptor.
+ * @param passed The body passed as a file, if any, to be released by the caller.
+ * @param pending The bytes read past the previous message, in, and past this one, out.
+ * @param keep_alive Set to 1 if the connection was left open.
  * @return Pointer to the error on failure, or our_ERR_NONE on success.
  */
-static void *handle_connection(void *arg)
+static void *serve_connection(int client_socket, struct passed_body* passed,
+                              struct pending_bytes* pending, int* keep_alive)
 {
-    sigset_t mask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGINT );
-    sigaddset(&mask, SIGTERM);
-    pthread_sigmask(SIG_BLOCK, &mask, NULL);
-
-    if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
-
-    int client_socket = *(int*)arg;
-    free(arg);
     int err = our_ERR_NONE;
-    char *buffer = (char*)malloc(MAX_HEADER_SIZE + 1);
+    *keep_alive = 0;
+    char *buffer = (char*)malloc(MAX(MAX_HEADER_SIZE, pending->size) + 1);
     if (buffer == NULL) {
+        close(client_socket);
         return &our_ERR_OUT_OF_MEMORY;
     }
     zero_init_ptr(buffer);
     ssize_t received = 0;
-    size_t total_received = 0;
+    size_t total_received = pending->size;
+    if (pending->size > 0) memcpy(buffer, pending->data, pending->size);
+    buffer[total_received] = '\0';
+    free(pending->data);
+    pending->data = NULL;
+    pending->size = 0;
     size_t actual_header_size = 0;
     int content_len = 0;
     int parse_result = 0;
     struct http_message message;
+    const int read_span = trace_span_begin("read_request");
 
     // Load header until HTTP_HDR_END_DELIM is reached
     while (strstr(buffer, HTTP_HDR_END_DELIM) == NULL && total_received < MAX_HEADER_SIZE) {
-        received = tcp_read(client_socket, buffer + total_received, MAX_HEADER_SIZE - total_received);
-        if (received < 0) {
+        received = socket_read_fd(client_socket, buffer + total_received, MAX_HEADER_SIZE - total_received,
+                                  &passed->fd);
+        if (received < 0 && total_received == 0) {
+            // nothing to answer
+            perror("Error while reading\n");
+            close(client_socket);
+            free(buffer);
+            return &our_ERR_IO;
+        } else if (received < 0) {
             err = our_ERR_IO;
             perror("Error while reading\n");
             break;
@@ -82,6 +206,7 @@ static void *handle_connection(void *arg)
             return &our_ERR_NONE;
         }
         total_received += (size_t)received;
+        buffer[total_received] = '\0'; // the buffer is reused memory: never search past what was read
     }
 
     // Finding the actual header size
@@ -96,10 +221,31 @@ static void *handle_connection(void *arg)
     size_t buffer_received = 0;
     if (parse_result == 0) {
         // reallocate buffer for content based on Content-Length and read the content
-        buffer = (char*)realloc(buffer, actual_header_size + (size_t) content_len + 1);
+        // (keeping what may already be there of the next messages)
+        buffer = (char*)realloc(buffer, MAX(actual_header_size + (size_t) content_len, total_received) + 1);
         if (buffer == NULL) {
+            close(client_socket);
             return &our_ERR_OUT_OF_MEMORY;
         }
+    }
+    if (parse_result == 0 && passed->fd >= 0 && content_len > 0 && total_received == actual_header_size) {
+        // the body is the file passed along the header: nothing more on the socket
+        const char* body = NULL;
+        // parsed again, the buffer has moved
+        http_parse_message(buffer, actual_header_size, &message, &content_len);
+        if (content_len > 0 && get_passed_body(passed, buffer, actual_header_size, (size_t) content_len, &body) == ERR_NONE) {
+            message.body.val = body;
+            message.body.len = (size_t) content_len;
+            parse_result = 1;
+        } else {
+            trace_span_end(read_span);
+            http_reply(client_socket, HTTP_BAD_REQUEST, "", "", 0);
+            close(client_socket);
+            free(buffer);
+            return &our_ERR_INVALID_ARGUMENT;
+        }
+    }
+    if (parse_result == 0) {
         buffer_received = total_received - actual_header_size;
         debug_printf("content_len: %d\n", content_len);
         debug_printf("buffer_received: %zu\n", buffer_received);
@@ -115,8 +261,31 @@ static void *handle_connection(void *arg)
             buffer_received += (size_t)received;
             total_received += (size_t)received;
         }
+        buffer[total_received] = '\0';
+
+        debug_printf("buffer_received: %zu\n", buffer_received);
+        debug_printf("content_len: %d\n", content_len);
+        debug_printf("total_received: %zu\n", buffer_received + actual_header_size);
+        debug_printf("total_received: %zu\n", total_received);
+        if (buffer_received >= (size_t) content_len) {
+            // parse again now everything is received
+            parse_result = http_parse_message(buffer, total_received, &message, &content_len);
+            debug_printf("Parse result: %d\n", parse_result);
+            if (parse_result == 1) {
+                request_parsed(message.method.val, message.method.len);
+                err = our_ERR_NONE;
+            } else {
+                err = our_ERR_IO;
+            }
+        } else {
+            err = our_ERR_IO;
+        }
+    } else if (parse_result == 1) {
+        // complete without a body, or with the one passed
+        request_parsed(message.method.val, message.method.len);
     } else {
         // Invoke callback on message parsing error
+        trace_span_end(read_span);
         err = cb(&message, client_socket);
         debug_printf("Callback returned: %d\n", err);
         close(client_socket);
@@ -124,24 +293,12 @@ static void *handle_connection(void *arg)
         return &our_ERR_INVALID_ARGUMENT;
     }
 
-    debug_printf("buffer_received: %zu\n", buffer_received);
-    debug_printf("content_len: %d\n", content_len);
-    debug_printf("total_received: %zu\n", buffer_received + actual_header_size);
-    debug_printf("total_received: %zu\n", total_received);
-    if (buffer_received == (size_t) content_len) {
-        // parse again now everything is received
-        parse_result = http_parse_message(buffer, total_received, &message, &content_len);
-        debug_printf("Parse result: %d\n", parse_result);
-        if (parse_result == 1) {
-            err = our_ERR_NONE;
-        } else {
-            err = our_ERR_IO;
-        }
-    } else {
-        err = our_ERR_IO;
-    }
-
+    trace_span_end(read_span);
+    const size_t message_size = actual_header_size + (size_t) content_len;
+    keeping_alive = err == ERR_NONE && wants_keep_alive(&message);
     err = cb(&message, client_socket);
+    const int kept_alive = keeping_alive;
+    keeping_alive = 0;
     if (err != ERR_NONE) {
         perror("Error while invoking callback\n");
         if (buffer != NULL) {
@@ -151,14 +308,68 @@ static void *handle_connection(void *arg)
         return &our_ERR_IO;
     }
 
+    if (kept_alive && total_received > message_size) {
+        // pipelined: the next messages have started
+        pending->size = total_received - message_size;
+        pending->data = malloc(pending->size);
+        if (pending->data == NULL) {
+            pending->size = 0;
+            free(buffer);
+            close(client_socket);
+            return &our_ERR_OUT_OF_MEMORY;
+        }
+        memcpy(pending->data, buffer + message_size, pending->size);
+    }
+
     if (buffer != NULL) {
         free(buffer);
     }
 
+    if (kept_alive) {
+        *keep_alive = 1;
+        return &our_ERR_NONE;
+    }
     close(client_socket);
     return &our_ERR_NONE;
 }
 
+/**
+ * @brief Thread entry point handling a client connection.
+ *
+ * @param arg Pointer to the client socket file descriptor.
+ * @return Pointer to the error on failure, or our_ERR_NONE on success.
+ */
+static void *handle_connection(void *arg)
+{
+    block_stop_signals();
+
+    if (arg == NULL) return &our_ERR_INVALID_ARGUMENT;
+
+    int client_socket = *(int*)arg;
+    free(arg);
+
+    metrics_connection_opened();
+    // one message at a time, as long as the client keeps the connection alive
+    struct pending_bytes pending = { NULL, 0 };
+    int keep_alive = 0;
+    void* ret = NULL;
+    do {
+        if (keep_alive && pending.size == 0 && !wait_next_message(client_socket)) {
+            close(client_socket);
+            break;
+        }
+        struct passed_body passed = { -1, NULL, 0 };
+        request_begin();
+        ret = serve_connection(client_socket, &passed, &pending, &keep_alive);
+        request_end();
+        if (passed.map != NULL) munmap(passed.map, passed.map_size);
+        if (passed.fd >= 0) close(passed.fd);
+    } while (keep_alive);
+    free(pending.data);
+    metrics_connection_closed();
+    return ret;
+}
+
 
 /**
  * @brief Initializes the HTTP server.
@@ -177,6 +388,39 @@ int http_init(uint16_t port, EventCallback callback)
     return passive_socket;
 }
 
+/**
+ * @brief Removes the socket file of http_listen_unix(), in the process that
+ *        created it only: the workers (prefork.h) inherit the socket, and
+ *        their master exits without closing the server.
+ */
+static void remove_unix_socket(void)
+{
+    if (unix_owner == getpid()) {
+        unlink(unix_path);
+        unix_owner = 0;
+    }
+}
+
+/**
+ * @brief Also listens on a Unix domain socket, for the clients on the same
+ *        machine; its connections are served as those of http_init().
+ *
+ * @param path The path of the socket file.
+ * @return The passive socket file descriptor on success, some error code otherwise.
+ */
+int http_listen_unix(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+    if (unix_socket >= 0 || strlen(path) >= sizeof(unix_path)) return ERR_INVALID_ARGUMENT;
+    const int fd = unix_server_init(path);
+    if (fd < 0) return fd;
+    strcpy(unix_path, path);
+    unix_socket = fd;
+    unix_owner = getpid();
+    atexit(remove_unix_socket);
+    return fd;
+}
+
 /**
  * @brief Closes the HTTP server.
  */
@@ -188,20 +432,47 @@ void http_close(void)
         else
             passive_socket = -1;
     }
+    if (unix_socket >= 0) {
+        close(unix_socket);
+        unix_socket = -1;
+        remove_unix_socket();
+    }
+}
+
+/**
+ * @brief Accepts a connection on the TCP socket, or on the Unix domain one
+ *        if listening; the two take turns when both have connections waiting.
+ */
+static int accept_connection(void)
+{
+    if (unix_socket < 0) return tcp_accept(passive_socket);
+
+    struct pollfd listeners[2] = { { passive_socket, POLLIN, 0 }, { unix_socket, POLLIN, 0 } };
+    // interrupted as accept() would be, by a signal to stop
+    if (poll(listeners, 2, -1) <= 0) return -1;
+
+    const unsigned first = next_listener;
+    next_listener = 1 - next_listener;
+    for (unsigned i = 0; i < 2; ++i) {
+        const struct pollfd* const l = &listeners[(first + i) % 2];
+        if (l->revents & POLLIN) return tcp_accept(l->fd);
+    }
+    return -1;
 }
 
 
 /**
  * @brief Receives and handles HTTP connections.
  *
- * This function accepts a connection using tcp_accept() and
+ * This function accepts a connection using tcp_accept(), on the TCP
+ * socket or the Unix domain one (http_listen_unix()), and
  * creates a thread to handle the connection using the function handle_connection().
  *
  * @return The error (ERR_NONE = 0 if success).
  */
 int http_receive(void)
 {
-    int client_socket = tcp_accept(passive_socket);
+    int client_socket = accept_connection();
     if (client_socket < 0) {
         perror("Accept failed in client socket\n");
         return ERR_IO;
@@ -322,11 +593,12 @@ int http_reply(int connection, const char* status, const char* headers, const ch
     if ((body == NULL && body_len > 0)) {
         return ERR_INVALID_ARGUMENT;
     }
+    const int reply_span = trace_span_begin("http_reply");
 
     // Calculate the maximum total length of the HTTP response
     size_t max_total_len = strlen(HTTP_PROTOCOL_ID) + strlen(" ") + strlen(status) +
                            strlen(HTTP_LINE_DELIM) + strlen(headers) + strlen(HTTP_LINE_DELIM) +
-                           strlen("Content-Length: ") + MAX_SIZE_T_STRING_SIZE +
+                           strlen(KEEP_ALIVE_HEADER) + strlen("Content-Length: ") + MAX_SIZE_T_STRING_SIZE +
                            strlen(HTTP_LINE_DELIM) + (body_len > 0 ? body_len : 0) + strlen("\0");
 
     char* response = (char *) malloc(max_total_len + 1);
@@ -337,9 +609,9 @@ int http_reply(int connection, const char* status, const char* headers, const ch
 
     // Format the HTTP response header
     size_t currentLen = (size_t) snprintf(response, max_total_len + 1,
-                                          "%s%s%s%sContent-Length: %zu%s",
-                                          HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM,
-                                          headers, body_len, HTTP_HDR_END_DELIM);
+                                          "%s%s%s%s%sContent-Length: %zu%s",
+                                          HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
+                                          keeping_alive ? KEEP_ALIVE_HEADER : "", body_len, HTTP_HDR_END_DELIM);
 
     // We copy the body content into the response buffer if there is one
     if (body_len > 0) {
@@ -347,9 +619,12 @@ int http_reply(int connection, const char* status, const char* headers, const ch
         currentLen += body_len;
     }
 
+    const uint64_t send_start = request_now_ns();
     ssize_t sent = tcp_send(connection, response, currentLen);
 
     free(response);
+    request_reply(status, sent < 0 ? 0 : body_len, request_now_ns() - send_start);
+    trace_span_end(reply_span);
 
     if (sent < 0) {
         perror("Error while sending response to http request\n");
@@ -361,11 +636,58 @@ int http_reply(int connection, const char* status, const char* headers, const ch
         return ERR_IO;
     }
 
-    // Ensure the connection is correctly closed
-    if (shutdown(connection, SHUT_WR) < 0) {
+    // Ensure the connection is correctly closed, unless kept alive
+    if (!keeping_alive && shutdown(connection, SHUT_WR) < 0) {
         perror("shutdown() failed");
         return ERR_IO;
     }
 
     return ERR_NONE;
 }
+
+int http_send(int connection, const char* bytes, size_t size)
+{
+    M_REQUIRE_NON_NULL(bytes);
+    while (size > 0) {
+        const ssize_t sent = tcp_send(connection, bytes, size);
+        if (sent <= 0) return ERR_IO;
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+    return ERR_NONE;
+}
+
+int http_reply_stream(int connection, const char* status, const char* headers, size_t body_len,
+                      http_body_writer writer, void* arg)
+{
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(headers);
+    M_REQUIRE_NON_NULL(writer);
+    const int reply_span = trace_span_begin("http_reply");
+
+    const size_t max_len = strlen(HTTP_PROTOCOL_ID) + strlen(status) + strlen(HTTP_LINE_DELIM)
+                           + strlen(headers) + strlen(KEEP_ALIVE_HEADER) + strlen("Content-Length: ") + MAX_SIZE_T_STRING_SIZE
+                           + strlen(HTTP_HDR_END_DELIM);
+    char* const head = malloc(max_len + 1);
+    if (head == NULL) {
+        trace_span_end(reply_span);
+        return ERR_OUT_OF_MEMORY;
+    }
+    const int head_len = snprintf(head, max_len + 1, "%s%s%s%s%sContent-Length: %zu%s",
+                                  HTTP_PROTOCOL_ID, status, HTTP_LINE_DELIM, headers,
+                                  keeping_alive ? KEEP_ALIVE_HEADER : "", body_len, HTTP_HDR_END_DELIM);
+
+    const uint64_t send_start = request_now_ns();
+    int err = head_len < 0 ? ERR_RUNTIME : http_send(connection, head, (size_t) head_len);
+    free(head);
+    if (err == ERR_NONE) err = writer(connection, arg);
+    request_reply(status, err == ERR_NONE ? body_len : 0, request_now_ns() - send_start);
+    trace_span_end(reply_span);
+    if (err != ERR_NONE) return err;
+
+    if (!keeping_alive && shutdown(connection, SHUT_WR) < 0) {
+        perror("shutdown() failed");
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
@@ -15,12 +15,47 @@
 
 typedef int (*EventCallback)(struct http_message* message, int eventType);
 
+#define UNIX_SOCKET_ENV "IMGFS_UNIX_SOCKET" // path of the Unix domain socket to listen on too, if set
+
 int http_init(uint16_t port, EventCallback cb);
 
+/**
+ * @brief Also listens on a Unix domain socket at path, for the clients on
+ *        the same machine, after http_init(). The requests are the same;
+ *        the body of one may be passed as a file descriptor instead
+ *        (SCM_RIGHTS, along the header, Content-Length bytes from the start
+ *        of the file; a memfd sealed with F_SEAL_SHRINK and F_SEAL_WRITE or
+ *        F_SEAL_FUTURE_WRITE is not copied).
+ *
+ * @return The passive socket, or some (negative) error code.
+ */
+int http_listen_unix(const char* path);
+
 int http_receive(void);
 
 int http_serve_file(int connection, const char* filename);
 
 int http_reply(int connection, const char* status, const char* headers, const char* body, size_t body_len);
 
+/**
+ * @brief Sends the body of a reply streamed by http_reply_stream(), part by part.
+ *
+ * @return Some error code. 0 if no error.
+ */
+typedef int (*http_body_writer)(int connection, void* arg);
+
+/**
+ * @brief Sends an HTTP reply whose body, of known length, is too large to
+ *        be built in memory: the writer sends it with http_send().
+ */
+int http_reply_stream(int connection, const char* status, const char* headers, size_t body_len,
+                      http_body_writer writer, void* arg);
+
+/**
+ * @brief Sends bytes over a connection, all of them.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int http_send(int connection, const char* bytes, size_t size);
+
 void http_close(void);
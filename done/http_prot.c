@@ -7,6 +7,8 @@
  */
 
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include "http_prot.h"
 #include "error.h"
 #include <stdlib.h>
@@ -64,25 +66,25 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
     M_REQUIRE_NON_NULL(name);
     M_REQUIRE_NON_NULL(out);
 
-    const char *query_start = strchr(url->val, '?');
+    // url->val is not NUL-terminated at the end of the URI: stay within url->len
+    const char* const url_end = url->val + url->len;
+    const char *query_start = memchr(url->val, '?', url->len);
     if (!query_start) return 0; // it means that there is no query in url
 
-    char param[strlen(name) + 2];
-    snprintf(param, sizeof(param), "%s=", name);
-
-    const char *start = strstr(query_start, param);
-    while (start) {
-        // check if the parameter is right after '?' or '&'
-        if (start == query_start + 1 || *(start - 1) == '&') {
-            start += strlen(param);
-            const char *end = strchr(start, '&');
-            size_t len = end ? (size_t)(end - start) : (url->len - (size_t)(start - url->val));
+    const size_t name_len = strlen(name);
+    const char *param = query_start + 1;
+    while (param < url_end) {
+        const char *end = memchr(param, '&', (size_t)(url_end - param));
+        if (end == NULL) end = url_end;
+        if ((size_t)(end - param) > name_len && strncmp(param, name, name_len) == 0 && param[name_len] == '=') {
+            const char *start = param + name_len + 1;
+            size_t len = (size_t)(end - start);
             if (len >= out_len) return ERR_RUNTIME;
-            strncpy(out, start, len);
+            memcpy(out, start, len);
             out[len] = '\0';
             return (int)len;
         }
-        start = strstr(start + 1, param);
+        param = end + 1;
     }
     return 0; // Param not found
 }
@@ -265,3 +267,134 @@ int http_parse_message(const char *stream, size_t bytes_received, struct http_me
 
     return 1;
 }
+
+/**
+ * @brief Parses the header of an HTTP response (status line and headers).
+ *
+ * @param stream The input stream, NUL-terminated.
+ * @param out Where to put the headers; method is the protocol and uri the
+ *            reason phrase of the status line. The body is not set.
+ * @param status Pointer to store the status code.
+ * @param content_len Pointer to store the length of the body (0 if not given).
+ * @return 1 if the header is fully parsed, 0 if it is incomplete, error code otherwise.
+ */
+int http_parse_response(const char* stream, struct http_message* out, int* status, size_t* content_len)
+{
+    M_REQUIRE_NON_NULL(stream);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(status);
+    M_REQUIRE_NON_NULL(content_len);
+    if (strstr(stream, HTTP_HDR_END_DELIM) == NULL) return 0;
+
+    struct http_string code;
+    const char* current = get_next_token(stream, " ", &out->method);
+    if (current != NULL) current = get_next_token(current, " ", &code);
+    if (current != NULL) current = get_next_token(current, HTTP_LINE_DELIM, &out->uri);
+    if (current == NULL || out->method.len < strlen("HTTP/") || strncmp(out->method.val, "HTTP/", strlen("HTTP/")) != 0
+        || code.len != 3 || !isdigit((unsigned char) code.val[0])) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *status = atoi(code.val);
+
+    out->num_headers = 0;
+    out->body.val = NULL;
+    out->body.len = 0;
+    if (http_parse_headers(current, out) == NULL) return ERR_INVALID_ARGUMENT;
+
+    *content_len = 0;
+    const struct http_string* const length = http_get_header(out, "Content-Length");
+    if (length != NULL) {
+        char* end = NULL;
+        const unsigned long long value = strtoull(length->val, &end, 10);
+        if (end == length->val) return ERR_INVALID_ARGUMENT;
+        *content_len = (size_t) value;
+    }
+    return 1;
+}
+
+/**
+ * @brief Finds a header of an HTTP message by its (case-insensitive) name.
+ *
+ * @param message Pointer to the HTTP message structure.
+ * @param key The name of the header.
+ * @return Pointer to the value of the header, or NULL if not found.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key)
+{
+    if (message == NULL || key == NULL) return NULL;
+
+    const size_t key_len = strlen(key);
+    for (size_t i = 0; i < message->num_headers; ++i) {
+        const struct http_header* const header = &message->headers[i];
+        if (header->key.len == key_len && strncasecmp(header->key.val, key, key_len) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Parses a quality value ("0", "0.8", "1.000"...) into thousandths.
+ */
+static int parse_quality(const char* value, const char* end)
+{
+    if (value >= end || (*value != '0' && *value != '1')) return 0;
+    int quality = (*value - '0') * 1000;
+    ++value;
+    if (value < end && *value == '.') {
+        ++value;
+        for (int scale = 100; scale > 0 && value < end && isdigit((unsigned char) *value); scale /= 10) {
+            quality += (*value - '0') * scale;
+            ++value;
+        }
+    }
+    return quality > 1000 ? 1000 : quality;
+}
+
+/**
+ * @brief Gives the quality an Accept header value gives to a media type.
+ *
+ * The value is a comma-separated list of media ranges, each optionally
+ * followed by parameters ("image/webp;q=0.8"). Only the ranges equal to
+ * the media type (case-insensitive) are considered.
+ *
+ * @param accept The value of the Accept header.
+ * @param mime_type The media type, e.g. "image/webp".
+ * @return The quality in thousandths, or -1 if the type is not listed.
+ */
+int http_accept_quality(const struct http_string* accept, const char* mime_type)
+{
+    if (accept == NULL || accept->val == NULL || mime_type == NULL) return -1;
+
+    const size_t mime_len = strlen(mime_type);
+    const char* const end = accept->val + accept->len;
+    const char* range = accept->val;
+    while (range < end) {
+        const char* range_end = memchr(range, ',', (size_t) (end - range));
+        if (range_end == NULL) range_end = end;
+
+        while (range < range_end && isspace((unsigned char) *range)) ++range;
+        const char* type_end = memchr(range, ';', (size_t) (range_end - range));
+        if (type_end == NULL) type_end = range_end;
+        const char* params = type_end;
+        while (type_end > range && isspace((unsigned char) type_end[-1])) --type_end;
+
+        if ((size_t) (type_end - range) == mime_len && strncasecmp(range, mime_type, mime_len) == 0) {
+            // the q parameter, if any
+            int quality = 1000;
+            while (params < range_end) {
+                ++params; // skip ';'
+                while (params < range_end && isspace((unsigned char) *params)) ++params;
+                const char* param_end = memchr(params, ';', (size_t) (range_end - params));
+                if (param_end == NULL) param_end = range_end;
+                if (range_end - params >= 2 && (params[0] == 'q' || params[0] == 'Q') && params[1] == '=') {
+                    quality = parse_quality(params + 2, param_end);
+                }
+                params = param_end;
+            }
+            return quality;
+        }
+        range = range_end + (range_end < end ? 1 : 0);
+    }
+    return -1;
+}
@@ -60,6 +60,17 @@ int http_match_uri(const struct http_message *message, const char *target_uri);
  */
 int http_parse_message(const char *stream, size_t bytes_received, struct http_message *out, int *content_len);
 
+/**
+ * @brief Parses the header of an HTTP response, for the clients: status
+ *        code, headers, and the content length of the body that follows.
+ *
+ * Returns:
+ *  a negative int if there was an error
+ *  0 if the header has not been received completely
+ *  1 if the header was fully received and parsed
+ */
+int http_parse_response(const char* stream, struct http_message* out, int* status, size_t* content_len);
+
 /**
  * @brief Writes the value of parameter `name` from URL in message to buffer out.
  *
@@ -72,3 +83,19 @@ int http_get_var(const struct http_string* url, const char* name, char* out, siz
  * @brief Compare method with verb and return 1 if they are equal, 0 otherwise
  */
 int http_match_verb(const struct http_string* method, const char* verb);
+
+/**
+ * @brief Finds the value of the header `key` (case-insensitive) in message.
+ *
+ * Returns: a pointer to the value (in message), or NULL if there is no such header.
+ */
+const struct http_string* http_get_header(const struct http_message* message, const char* key);
+
+/**
+ * @brief Gives the quality value ("q=", in thousandths) the Accept header
+ *        value `accept` gives to the media type `mime_type`, listed as
+ *        such: ranges with a wildcard are not considered.
+ *
+ * Returns: the quality (0 to 1000, 1000 if not given), or -1 if the type is not listed.
+ */
+int http_accept_quality(const struct http_string* accept, const char* mime_type);
@@ -6,12 +6,216 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_ext.h"
+#include "image_phash.h"
+#include "resize_sandbox.h"
 #include "error.h"
+#include "trace.h"
+#include <inttypes.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <vips/vips.h>
 
+// number of derivatives created by lazily_resize() in the current thread
+static _Thread_local unsigned long resize_count = 0;
+
+unsigned long lazily_resize_count(void)
+{
+    return resize_count;
+}
+
+// whether the derivatives created are appended to the volume
+static atomic_int store_derivatives = 1;
+
+void lazily_resize_store(int store)
+{
+    atomic_store(&store_derivatives, store != 0);
+}
+
+int lazily_resize_stores(void)
+{
+    return atomic_load(&store_derivatives);
+}
+
+/**
+ * @brief Encodes a derivative as JPEG with the given settings.
+ *
+ * @param image The resized image.
+ * @param encoding The ENC_* settings; 0 for the libvips defaults.
+ * @param buffer Where to put the JPEG (to be freed with g_free()).
+ * @param size Where to put its size.
+ * @return 0 on success, -1 on error (like libvips).
+ */
+static int encode_derivative(VipsImage* image, uint16_t encoding, void** buffer, size_t* size)
+{
+    if (encoding == 0) return vips_jpegsave_buffer(image, buffer, size, NULL);
+
+    const int quality = (encoding & ENC_QUALITY) != 0 ? (encoding & ENC_QUALITY) : ENC_DEFAULT_QUALITY;
+    VipsForeignSubsample subsample = VIPS_FOREIGN_SUBSAMPLE_AUTO;
+    if ((encoding & ENC_SUBSAMPLE) == ENC_SUBSAMPLE_ON) subsample = VIPS_FOREIGN_SUBSAMPLE_ON;
+    if ((encoding & ENC_SUBSAMPLE) == ENC_SUBSAMPLE_OFF) subsample = VIPS_FOREIGN_SUBSAMPLE_OFF;
+
+    return vips_jpegsave_buffer(image, buffer, size,
+                                "Q", quality,
+                                "strip", (encoding & ENC_STRIP) != 0,
+                                "interlace", (encoding & ENC_PROGRESSIVE) != 0,
+                                "subsample_mode", subsample,
+                                "optimize_coding", (encoding & ENC_OPTIMIZE) != 0,
+                                NULL);
+}
+
+#define WEBP_DEFAULT_QUALITY 75
+#define AVIF_DEFAULT_QUALITY 50 // AVIF reaches the same visual quality at a lower Q
+
+/**
+ * @brief Encodes a derivative as WebP or AVIF. Of the settings of the
+ *        resolution (ENC_*), only the quality and ENC_STRIP apply.
+ *
+ * @return 0 on success, -1 on error (like libvips).
+ */
+static int encode_alt_derivative(VipsImage* image, int format, uint16_t encoding,
+                                 void** buffer, size_t* size)
+{
+    const int strip = (encoding & ENC_STRIP) != 0;
+    if (format == FORMAT_WEBP) {
+        const int quality = (encoding & ENC_QUALITY) != 0 ? (encoding & ENC_QUALITY) : WEBP_DEFAULT_QUALITY;
+        return vips_webpsave_buffer(image, buffer, size, "Q", quality, "strip", strip, NULL);
+    }
+    const int quality = (encoding & ENC_QUALITY) != 0 ? (encoding & ENC_QUALITY) : AVIF_DEFAULT_QUALITY;
+    return vips_heifsave_buffer(image, buffer, size, "Q", quality, "strip", strip,
+                                "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1, NULL);
+}
+
+int resize_original(const void* original, size_t original_size, uint16_t width, int format,
+                    uint16_t encoding, uint64_t max_memory, void** resized, size_t* resized_size)
+{
+    M_REQUIRE_NON_NULL(original);
+    M_REQUIRE_NON_NULL(resized);
+    M_REQUIRE_NON_NULL(resized_size);
+    if (format < FORMAT_JPEG || format >= NB_FORMATS || width == 0) return ERR_INVALID_ARGUMENT;
+
+    VipsImage* image = NULL;
+    VipsImage* thumbnail = NULL;
+    int err = ERR_NONE;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) original, original_size, &image, NULL) != 0) {
+#pragma GCC diagnostic pop
+        err = ERR_IMGLIB;
+    } else if (max_memory != 0
+               && (uint64_t) vips_image_get_width(image) * (uint64_t) vips_image_get_height(image)
+               * (uint64_t) vips_image_get_bands(image) > max_memory) {
+        // only its header is decoded so far
+        debug_printf("Original of %d x %d refused: over %" PRIu64 " bytes\n",
+                     vips_image_get_width(image), vips_image_get_height(image), max_memory);
+        err = ERR_IMGLIB;
+    } else if (vips_thumbnail_image(image, &thumbnail, width, "size", VIPS_SIZE_BOTH, NULL) != 0
+               || (format == FORMAT_JPEG
+                   ? encode_derivative(thumbnail, encoding, resized, resized_size)
+                   : encode_alt_derivative(thumbnail, format, encoding, resized, resized_size)) != 0) {
+        debug_printf("Cannot encode %s: %s\n", format_name(format), vips_error_buffer());
+        err = ERR_IMGLIB;
+    }
+    if (err != ERR_NONE) vips_error_clear();
+
+    if (thumbnail != NULL) g_object_unref(thumbnail);
+    if (image != NULL) g_object_unref(image);
+    return err;
+}
+
+/**
+ * @brief A derivative being created: by a helper of the resize sandbox if
+ *        started (resize_sandbox.h), in this process otherwise.
+ */
+struct derivative {
+    const char* bytes;
+    size_t size;
+    void* resized; // if created in this process (g_free())
+    struct resize_job job; // if created by a helper
+    int sandboxed;
+};
+
+static void derivative_release(struct derivative* derivative)
+{
+    if (derivative->sandboxed) resize_job_end(&derivative->job);
+    g_free(derivative->resized);
+    memset(derivative, 0, sizeof(*derivative));
+}
+
+/**
+ * @brief Reads the original of an image, resizes it to a resized resolution
+ *        and encodes it in the given format (FORMAT_JPEG included). With the
+ *        sandbox, the original is read straight into the memory of the
+ *        helper, where the derivative is left.
+ *
+ * @param derivative Where to put the derivative, to be released with
+ *                   derivative_release() if no error.
+ */
+static int derivative_create(const struct imgfs_file* imgfs_file, size_t position, int resolution,
+                             int format, struct derivative* derivative)
+{
+    const struct img_metadata* const md = &imgfs_file->metadata[position];
+    const uint16_t width = imgfs_file->header.resized_res[2 * resolution];
+    const uint16_t encoding = imgfs_file->header.encoding[resolution];
+    memset(derivative, 0, sizeof(*derivative));
+
+    const int read_span = trace_span_begin("read_original");
+    char* original = NULL;
+    if (resize_sandbox_enabled()) {
+        const int err = resize_job_begin(&derivative->job, md->size[ORIG_RES], width, format, encoding);
+        if (err != ERR_NONE) return err;
+        derivative->sandboxed = 1;
+        original = derivative->job.original;
+    } else {
+        original = malloc(md->size[ORIG_RES]);
+        if (original == NULL) return ERR_OUT_OF_MEMORY;
+    }
+    int err = ERR_NONE;
+    if (fseek(imgfs_file->file, (long) md->offset[ORIG_RES], SEEK_SET) != 0
+        || fread(original, md->size[ORIG_RES], 1, imgfs_file->file) != 1) {
+        err = ERR_IO;
+    }
+    trace_span_end(read_span);
+
+    if (err == ERR_NONE) {
+        const int vips_span = trace_span_begin("vips_resize");
+        if (derivative->sandboxed) {
+            err = resize_job_run(&derivative->job);
+            derivative->bytes = derivative->job.resized;
+            derivative->size = derivative->job.resized_size;
+        } else {
+            err = resize_original(original, md->size[ORIG_RES], width, format, encoding, 0,
+                                  &derivative->resized, &derivative->size);
+            derivative->bytes = derivative->resized;
+        }
+        trace_span_end(vips_span);
+    }
+
+    if (!derivative->sandboxed) free(original);
+    if (err != ERR_NONE) derivative_release(derivative);
+    return err;
+}
+
+/**
+ * @brief Hashes a thumbnail just created, for near-duplicates (image_phash.h).
+ */
+static int phash_thumbnail(struct imgfs_file* imgfs_file, size_t position, const char* bytes, size_t size)
+{
+    VipsImage* thumbnail = NULL;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual"
+    if (vips_jpegload_buffer((void*) bytes, size, &thumbnail, NULL) != 0) {
+#pragma GCC diagnostic pop
+        vips_error_clear();
+        return ERR_IMGLIB;
+    }
+    const int err = phash_record(imgfs_file, position, thumbnail);
+    g_object_unref(thumbnail);
+    return err;
+}
+
 /**
  * @brief Create a new resolution for an image in the file system if it does not already exist.
  *
@@ -27,7 +231,7 @@
  *         Returns other error codes in case of error.
  */
 
-int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t position)
+static int resize_derivative(int resolution, struct imgfs_file *imgfs_file, size_t position)
 {
     // Check argument validity
     M_REQUIRE_NON_NULL(imgfs_file);
@@ -52,114 +256,228 @@ int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t position
         return ERR_NONE;
     }
 
-    // Load image with original resolution
-    int err = fseek(imgfs_file->file, (long)imgfs_file->metadata[position].offset[ORIG_RES], SEEK_SET);
-    if (err != 0) return ERR_IO;
+    struct derivative derivative;
+    int err = derivative_create(imgfs_file, position, resolution, FORMAT_JPEG, &derivative);
+    if (err != ERR_NONE) return err;
+    const int write_span = trace_span_begin("write_derivative");
 
+    // Write the new image with the given resolution at the end of the file
+    long offset = -1;
+    if (fseek(imgfs_file->file, 0L, SEEK_END) != 0
+        || (offset = ftell(imgfs_file->file)) < 0
+        || fwrite(derivative.bytes, derivative.size, 1, imgfs_file->file) != 1) {
+        err = ERR_IO;
+    } else {
+        // Update the metadata, then write it
+        imgfs_file->metadata[position].offset[resolution] = (uint64_t) offset;
+        imgfs_file->metadata[position].size[resolution] = (uint32_t) derivative.size;
+        if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + position * sizeof(struct img_metadata)),
+                  SEEK_SET) != 0
+            || fwrite(&imgfs_file->metadata[position], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+            err = ERR_IO;
+        }
+    }
 
-    void *original_buffer = malloc(imgfs_file->metadata[position].size[ORIG_RES]);
-    if (original_buffer == NULL) return ERR_OUT_OF_MEMORY;
+    // for near-duplicates (image_phash.h): the image is served without it
+    if (err == ERR_NONE && resolution == THUMB_RES && phash_enabled()
+        && phash_thumbnail(imgfs_file, position, derivative.bytes, derivative.size) != ERR_NONE) {
+        debug_printf("Cannot hash the thumbnail of image %zu\n", position);
+    }
 
+    derivative_release(&derivative);
+    trace_span_end(write_span);
 
-    size_t read_items = fread(original_buffer, imgfs_file->metadata[position].size[ORIG_RES], 1, imgfs_file->file);
-    size_t write_items;
-    if (read_items != 1) {
-        free(original_buffer);
-        return ERR_IO;
-    }
+    if (err == ERR_NONE) ++resize_count;
+    return err;
+}
 
-    // Create the VipsImage with the original resolution
-    VipsImage *original_vips_image = NULL;
-    if (vips_jpegload_buffer(original_buffer, imgfs_file->metadata[position].size[ORIG_RES], &original_vips_image, NULL) != 0) {
-        free(original_buffer);
-        perror("Error creating the vipsimage\n");
-        return ERR_IMGLIB;
-    }
+/**
+ * @brief Creates a new resolution of an image if needed (see resize_derivative()), traced.
+ */
+int lazily_resize(int resolution, struct imgfs_file *imgfs_file, size_t position)
+{
+    const int span = trace_span_begin("lazily_resize");
+    const int err = resize_derivative(resolution, imgfs_file, position);
+    trace_span_end(span);
+    return err;
+}
 
-    // Create the VipsImage with the new resolution
-    VipsImage *new_vips_image = NULL;
-    uint16_t width = imgfs_file->header.resized_res[2 * resolution];
-    // uint16_t height = imgfs_file->header.resized_res[2 * resolution + 1];
-    if (vips_thumbnail_image(original_vips_image, &new_vips_image, width, "size", VIPS_SIZE_BOTH, NULL) != 0) {
-        g_object_unref(original_vips_image);
-        free(original_buffer);
-        perror("Error creating the vipsimage 2\n");
-        return ERR_IMGLIB;
-    }
+/**
+ * @brief Creates a resized image in another format than JPEG if it does
+ *        not exist yet, appends it to the file and records it in the
+ *        extension table (created if needed).
+ */
+static int resize_alt_derivative(int resolution, int format, struct imgfs_file* imgfs_file,
+                                 size_t position)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (resolution < THUMB_RES || resolution >= ORIG_RES) return ERR_RESOLUTIONS;
+    if (format <= FORMAT_JPEG || format >= NB_FORMATS) return ERR_INVALID_ARGUMENT;
+    if (position >= imgfs_file->header.max_files) return ERR_INVALID_IMGID;
 
-    // Convert the new VipsImage in a tab
-    size_t resolution_size = 0;
-    void *new_buffer = NULL;
-    if (vips_jpegsave_buffer(new_vips_image, &new_buffer, &resolution_size, NULL) != 0) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
-        free(original_buffer);
-        perror("Error creating the vipsimage 3\n");
-        return ERR_IMGLIB;
-    }
+    struct imgfs_ext_record* records = NULL;
+    int err = imgfs_ext_get(imgfs_file, 1, &records);
+    if (err != ERR_NONE) return err;
+    struct imgfs_ext_record* const record = &records[position];
+    if (record->alt_size[resolution][format - 1] != 0) return ERR_NONE;
 
-    // Write the new image with the given resoltution at the end of the file
-    // Explicitly cast the result of ftell to uint64_t
-    // Store the offset of the image at the given resolution
-    err = fseek(imgfs_file->file, 0L, SEEK_END);
-    if (err != 0) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
-        free(original_buffer);
-        g_free(new_buffer);
-        return ERR_IO;
-    }
+    struct derivative derivative;
+    err = derivative_create(imgfs_file, position, resolution, format, &derivative);
+    if (err != ERR_NONE) return err;
 
-    uint64_t new_offset = (uint64_t)ftell(imgfs_file->file);
-    if (new_offset == (uint64_t)-1) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
-        free(original_buffer);
-        g_free(new_buffer);
-        return ERR_IO;
+    const int write_span = trace_span_begin("write_derivative");
+    long offset = -1;
+    if (fseek(imgfs_file->file, 0L, SEEK_END) != 0
+        || (offset = ftell(imgfs_file->file)) < 0
+        || fwrite(derivative.bytes, derivative.size, 1, imgfs_file->file) != 1) {
+        err = ERR_IO;
+    } else {
+        record->alt_offset[resolution][format - 1] = (uint64_t) offset;
+        record->alt_size[resolution][format - 1] = (uint32_t) derivative.size;
+        err = imgfs_ext_store(imgfs_file, position);
     }
+    trace_span_end(write_span);
+    derivative_release(&derivative);
 
-    write_items = fwrite(new_buffer, resolution_size, 1, imgfs_file->file);
-    if (write_items != 1) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
-        free(original_buffer);
-        g_free(new_buffer);
-        return ERR_IO;
+    if (err == ERR_NONE) ++resize_count;
+    return err;
+}
+
+int lazily_resize_format(int resolution, int format, struct imgfs_file* imgfs_file, size_t position)
+{
+    if (format == FORMAT_JPEG) return lazily_resize(resolution, imgfs_file, position);
+
+    const int span = trace_span_begin("lazily_resize");
+    const int err = resize_alt_derivative(resolution, format, imgfs_file, position);
+    trace_span_end(span);
+    return err;
+}
+
+int resize_transient(int resolution, int format, const struct imgfs_file* imgfs_file, size_t position,
+                     char** image_buffer, uint32_t* image_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(image_size);
+    if (resolution < THUMB_RES || resolution >= ORIG_RES) return ERR_RESOLUTIONS;
+    if (format < FORMAT_JPEG || format >= NB_FORMATS) return ERR_INVALID_ARGUMENT;
+    if (position >= imgfs_file->header.max_files) return ERR_INVALID_IMGID;
+
+    const int span = trace_span_begin("lazily_resize");
+    struct derivative derivative;
+    int err = derivative_create(imgfs_file, position, resolution, format, &derivative);
+    if (err == ERR_NONE) {
+        *image_buffer = malloc(derivative.size);
+        if (*image_buffer == NULL) {
+            err = ERR_OUT_OF_MEMORY;
+        } else {
+            memcpy(*image_buffer, derivative.bytes, derivative.size);
+            *image_size = (uint32_t) derivative.size;
+            ++resize_count;
+        }
+        derivative_release(&derivative);
     }
+    trace_span_end(span);
+    return err;
+}
+
 
-    // Update the metadata
-    imgfs_file->metadata[position].offset[resolution] = new_offset;
-    imgfs_file->metadata[position].size[resolution] = (uint32_t) resolution_size;
+/**
+ * @brief Bytes of the derivatives of one resolution, for do_encoding_report().
+ */
+struct encoding_totals {
+    uint32_t images;
+    uint64_t stored;
+    uint64_t with_default;
+    uint64_t with_settings;
+};
 
-    // Write the new metadata of the image with the offset at the given resolution
-    err = fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + position * sizeof(struct img_metadata)), SEEK_SET);
-    if (err != 0) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
+/**
+ * @brief Encodes the derivatives of one original with the default and the
+ *        configured settings, and adds their sizes to the totals.
+ */
+static int measure_encodings(const struct imgfs_file* imgfs_file, size_t position,
+                             struct encoding_totals* totals)
+{
+    const struct img_metadata* const md = &imgfs_file->metadata[position];
+    if (fseek(imgfs_file->file, (long) md->offset[ORIG_RES], SEEK_SET) != 0) return ERR_IO;
+    void* original_buffer = malloc(md->size[ORIG_RES]);
+    if (original_buffer == NULL) return ERR_OUT_OF_MEMORY;
+    if (fread(original_buffer, md->size[ORIG_RES], 1, imgfs_file->file) != 1) {
         free(original_buffer);
-        g_free(new_buffer);
         return ERR_IO;
     }
 
-    write_items = fwrite(&imgfs_file->metadata[position], sizeof(struct img_metadata), 1, imgfs_file->file);
-    if (write_items != 1) {
-        g_object_unref(original_vips_image);
-        g_object_unref(new_vips_image);
+    VipsImage* original = NULL;
+    if (vips_jpegload_buffer(original_buffer, md->size[ORIG_RES], &original, NULL) != 0) {
         free(original_buffer);
-        g_free(new_buffer);
-        return ERR_IO;
+        return ERR_IMGLIB;
     }
 
-    g_object_unref(original_vips_image);
-    g_object_unref(new_vips_image);
-    free(original_buffer);
-    g_free(new_buffer);
+    int err = ERR_NONE;
+    for (int res = THUMB_RES; res < ORIG_RES && err == ERR_NONE; ++res) {
+        VipsImage* resized = NULL;
+        void* with_default = NULL;
+        void* with_settings = NULL;
+        size_t default_size = 0;
+        size_t settings_size = 0;
+        // same resizing as resize_derivative()
+        if (vips_thumbnail_image(original, &resized, imgfs_file->header.resized_res[2 * res],
+                                 "size", VIPS_SIZE_BOTH, NULL) != 0
+            || encode_derivative(resized, 0, &with_default, &default_size) != 0
+            || encode_derivative(resized, imgfs_file->header.encoding[res],
+                                 &with_settings, &settings_size) != 0) {
+            err = ERR_IMGLIB;
+        } else {
+            totals[res].images++;
+            totals[res].stored += md->size[res];
+            totals[res].with_default += default_size;
+            totals[res].with_settings += settings_size;
+        }
+        g_free(with_default);
+        g_free(with_settings);
+        if (resized != NULL) g_object_unref(resized);
+    }
 
-    return ERR_NONE;
+    g_object_unref(original);
+    free(original_buffer);
+    return err;
 }
 
+int do_encoding_report(const struct imgfs_file* imgfs_file, uint32_t max_images)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    struct encoding_totals totals[NB_RES - 1];
+    memset(totals, 0, sizeof(totals));
+
+    uint32_t measured = 0;
+    for (size_t i = 0; i < imgfs_file->header.max_files
+         && (max_images == 0 || measured < max_images); ++i) {
+        if (imgfs_file->metadata[i].is_valid != NON_EMPTY) continue;
+        const int err = measure_encodings(imgfs_file, i, totals);
+        if (err != ERR_NONE) return err;
+        ++measured;
+    }
 
+    static const char* const names[NB_RES - 1] = { "thumb", "small" };
+    printf("%-6s %6s %12s %12s %12s %12s %7s  %s\n", "RES", "IMAGES", "STORED", "DEFAULT",
+           "CONFIGURED", "SAVED", "SAVED%", "ENCODING");
+    for (int res = THUMB_RES; res < ORIG_RES; ++res) {
+        const struct encoding_totals* const t = &totals[res];
+        const long long saved = (long long) t->with_default - (long long) t->with_settings;
+        char encoding[MAX_ENCODING_STR + 1];
+        encoding_to_string(imgfs_file->header.encoding[res], encoding);
+        printf("%-6s %6" PRIu32 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12lld %6.1f%%  %s\n",
+               names[res], t->images, t->stored, t->with_default, t->with_settings, saved,
+               t->with_default > 0 ? 100.0 * (double) saved / (double) t->with_default : 0.0,
+               encoding);
+    }
+    return ERR_NONE;
+}
 
 /**
  * @brief Retrieves the resolution of an image.
@@ -36,6 +36,84 @@ int get_resolution(uint32_t *height, uint32_t *width, const char *image_buffer,
  */
 int lazily_resize(int resolution, struct imgfs_file* imgfs_file, size_t index);
 
+/**
+ * @brief Same as lazily_resize(), for a resized image in the given format
+ *        (FORMAT_*). Those other than JPEG are recorded in the extension
+ *        table of the imgFS (imgfs_ext.h).
+ *
+ * @param resolution THUMB_RES or SMALL_RES (any resolution for FORMAT_JPEG)
+ * @param format The format of the resized image
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @return Some error code. 0 if no error.
+ */
+int lazily_resize_format(int resolution, int format, struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Resizes an image as lazily_resize_format() does, but returns the
+ *        derivative instead of storing it: the volume is not modified.
+ *
+ * @param resolution THUMB_RES or SMALL_RES
+ * @param format The format of the resized image
+ * @param imgfs_file The main in-memory structure
+ * @param index The index of the image in the metadata array
+ * @param image_buffer Where to put the image (to be freed with free()).
+ * @param image_size Where to put its size.
+ * @return Some error code. 0 if no error.
+ */
+int resize_transient(int resolution, int format, const struct imgfs_file* imgfs_file, size_t index,
+                     char** image_buffer, uint32_t* image_size);
+
+/**
+ * @brief Resizes an original to fit in width x width and encodes it, as the
+ *        derivatives are (in the calling process, see resize_sandbox.h).
+ *
+ * @param original The JPEG original.
+ * @param original_size Its size.
+ * @param width The resized resolution (resized_res of the header).
+ * @param format The format of the result (FORMAT_*).
+ * @param encoding The encoding settings of the resolution (ENC_*).
+ * @param max_memory Bytes the decoded original may take; larger originals
+ *                   are rejected before decoding. 0 for no limit.
+ * @param resized Where to put the result (to be freed with g_free()).
+ * @param resized_size Where to put its size.
+ * @return Some error code. 0 if no error.
+ */
+int resize_original(const void* original, size_t original_size, uint16_t width, int format,
+                    uint16_t encoding, uint64_t max_memory, void** resized, size_t* resized_size);
+
+/**
+ * @brief Sets whether the reads store the derivatives they create (the
+ *        default), or create them with resize_transient() on each read,
+ *        e.g. for a volume that only its primary writes (replication.h).
+ */
+void lazily_resize_store(int store);
+
+/**
+ * @brief Whether the reads store the derivatives they create.
+ */
+int lazily_resize_stores(void);
+
+/**
+ * @brief Prints, per resized resolution, the bytes of the derivatives encoded
+ *        with the default settings and with those of the header, and the
+ *        bytes the latter save. The derivatives are encoded again from the
+ *        originals; the stored ones are counted too but not modified.
+ *
+ * @param imgfs_file The main in-memory structure
+ * @param max_images How many images to measure, 0 for all of them.
+ * @return Some error code. 0 if no error.
+ */
+int do_encoding_report(const struct imgfs_file* imgfs_file, uint32_t max_images);
+
+/**
+ * @brief Number of derivatives created by lazily_resize() in the calling thread.
+ *
+ * Comparing it before and after a do_read() tells whether the read was
+ * served from an already stored resolution.
+ */
+unsigned long lazily_resize_count(void);
+
 #ifdef __cplusplus
 }
 #endif
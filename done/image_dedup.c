@@ -5,6 +5,7 @@
 
 #include "image_dedup.h"
 #include "imgfs.h"
+#include "imgfs_ext.h"
 #include "error.h"
 #include <string.h>
 
@@ -17,6 +18,7 @@
  * If a duplicate name is found, it returns ERR_DUPLICATE_ID.
  * If a duplicate content is found, it updates the metadata at the index to reference the attributes of the found copy.
  * If no duplicate content is found, it sets the ORIG_RES offset to 0.
+ * The extension record of the image, if the imgFS has a table, is reset or copied likewise.
  * If no duplicate name is found, it returns ERR_NONE.
  *
  * @param imgfs_file A pointer to the imgfs_file structure where the images and metadata are stored.
@@ -41,6 +43,7 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
     }
 
     target_metadata->offset[ORIG_RES] = 0;
+    long same_content = -1L;
     for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
         if (i != index && imgfs_file->metadata[i].is_valid) {
             debug_printf("target img_id: %s\n", target_metadata->img_id);
@@ -55,9 +58,10 @@ int do_name_and_content_dedup(struct imgfs_file* imgfs_file, uint32_t index)
                     target_metadata->offset[res] = imgfs_file->metadata[i].offset[res];
                     target_metadata->size[res] = imgfs_file->metadata[i].size[res];
                 }
+                same_content = (long) i;
             }
         }
     }
 
-    return ERR_NONE;
+    return imgfs_ext_reset(imgfs_file, index, same_content);
 }
@@ -0,0 +1,327 @@
+/**
+ * @file image_optimize.c
+ * @brief Lossless recompression of the stored originals (see image_optimize.h).
+ */
+
+#include "image_optimize.h"
+#include "imgfs_ext.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <jpeglib.h>
+#include <openssl/sha.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*******************************************************************
+ * EXIF
+ */
+#define EXIF_ID_SIZE 6 // "Exif\0\0"
+#define TIFF_TAG_THUMBNAIL_OFFSET 0x0201
+#define TIFF_TAG_THUMBNAIL_LENGTH 0x0202
+#define TIFF_ENTRY_SIZE 12
+
+static uint32_t tiff_get(const unsigned char* p, int bytes, int big_endian)
+{
+    uint32_t value = 0;
+    for (int i = 0; i < bytes; ++i) {
+        const unsigned char byte = big_endian ? p[i] : p[bytes - 1 - i];
+        value = (value << 8) | byte;
+    }
+    return value;
+}
+
+static void tiff_put32(unsigned char* p, uint32_t value, int big_endian)
+{
+    for (int i = 0; i < 4; ++i) {
+        const unsigned char byte = (unsigned char) (value >> (8 * (3 - i)));
+        p[big_endian ? i : 3 - i] = byte;
+    }
+}
+
+/**
+ * @brief Removes the thumbnail (IFD1) of an EXIF segment, in place.
+ *
+ * IFD1 is unlinked from IFD0; the thumbnail bytes are cut off if they end
+ * the segment, as they almost always do. Segments that cannot be parsed
+ * are left as they are.
+ *
+ * @return The new length of the segment.
+ */
+static unsigned int exif_strip_thumbnail(unsigned char* data, unsigned int len)
+{
+    static const unsigned char exif_id[EXIF_ID_SIZE] = { 'E', 'x', 'i', 'f', 0, 0 };
+    if (len < EXIF_ID_SIZE + 8 || memcmp(data, exif_id, EXIF_ID_SIZE) != 0) return len;
+
+    unsigned char* const tiff = data + EXIF_ID_SIZE;
+    const uint64_t size = len - EXIF_ID_SIZE;
+    if (memcmp(tiff, "MM", 2) != 0 && memcmp(tiff, "II", 2) != 0) return len;
+    const int big_endian = tiff[0] == 'M';
+
+    const uint64_t ifd0 = tiff_get(tiff + 4, 4, big_endian);
+    if (ifd0 + 2 > size) return len;
+    const uint64_t next = ifd0 + 2 + TIFF_ENTRY_SIZE * (uint64_t) tiff_get(tiff + ifd0, 2, big_endian);
+    if (next + 4 > size) return len;
+    const uint64_t ifd1 = tiff_get(tiff + next, 4, big_endian);
+    if (ifd1 == 0) return len;
+    tiff_put32(tiff + next, 0, big_endian);
+
+    if (ifd1 + 2 > size) return len;
+    const uint64_t nb_entries = tiff_get(tiff + ifd1, 2, big_endian);
+    if (ifd1 + 2 + TIFF_ENTRY_SIZE * nb_entries > size) return len;
+    uint64_t thumb_offset = 0;
+    uint64_t thumb_length = 0;
+    for (uint64_t i = 0; i < nb_entries; ++i) {
+        const unsigned char* const entry = tiff + ifd1 + 2 + TIFF_ENTRY_SIZE * i;
+        const uint32_t tag = tiff_get(entry, 2, big_endian);
+        if (tag == TIFF_TAG_THUMBNAIL_OFFSET) thumb_offset = tiff_get(entry + 8, 4, big_endian);
+        if (tag == TIFF_TAG_THUMBNAIL_LENGTH) thumb_length = tiff_get(entry + 8, 4, big_endian);
+    }
+    if (thumb_length > 0 && thumb_offset > ifd1 && thumb_offset + thumb_length == size) {
+        return EXIF_ID_SIZE + (unsigned int) thumb_offset;
+    }
+    return len;
+}
+
+/*******************************************************************
+ * Transcoding
+ */
+struct jpeg_error {
+    struct jpeg_error_mgr mgr; // first, as libjpeg only knows about it
+    jmp_buf jump;
+};
+
+static void on_jpeg_error(j_common_ptr cinfo)
+{
+    struct jpeg_error* const err = (struct jpeg_error*) (void*) cinfo->err;
+    longjmp(err->jump, 1);
+}
+
+static void on_jpeg_message(j_common_ptr cinfo, int msg_level)
+{
+    // warnings are counted (and make the transcoding fail), not printed
+    if (msg_level < 0) cinfo->err->num_warnings++;
+}
+
+/**
+ * @brief Copies the markers of the source that are kept (see image_optimize.h).
+ */
+static void copy_markers(j_decompress_ptr src, j_compress_ptr dst)
+{
+    static const char icc_id[] = "ICC_PROFILE";
+    for (jpeg_saved_marker_ptr m = src->marker_list; m != NULL; m = m->next) {
+        if (m->marker == JPEG_APP0 + 1 && m->data_length >= EXIF_ID_SIZE
+            && memcmp(m->data, "Exif", 4) == 0) {
+            jpeg_write_marker(dst, m->marker, m->data, exif_strip_thumbnail(m->data, m->data_length));
+        } else if (m->marker == JPEG_APP0 + 2 && m->data_length >= sizeof(icc_id)
+                   && memcmp(m->data, icc_id, sizeof(icc_id)) == 0) {
+            jpeg_write_marker(dst, m->marker, m->data, m->data_length);
+        }
+    }
+}
+
+int jpeg_optimize_lossless(const char* image_buffer, size_t image_size,
+                           unsigned char** out, size_t* out_size)
+{
+    M_REQUIRE_NON_NULL(image_buffer);
+    M_REQUIRE_NON_NULL(out);
+    M_REQUIRE_NON_NULL(out_size);
+    if (image_size == 0) return ERR_INVALID_ARGUMENT;
+
+    struct jpeg_decompress_struct src;
+    struct jpeg_compress_struct dst;
+    struct jpeg_error err;
+    src.err = dst.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = on_jpeg_error;
+    err.mgr.emit_message = on_jpeg_message;
+
+    // in memory rather than in registers, since they are used after a longjmp()
+    struct {
+        unsigned char* buffer;
+        unsigned long size;
+    } dest = { NULL, 0 };
+
+    jpeg_create_decompress(&src);
+    jpeg_create_compress(&dst);
+    if (setjmp(err.jump) != 0) {
+        jpeg_destroy_compress(&dst);
+        jpeg_destroy_decompress(&src);
+        free(dest.buffer);
+        return ERR_IMGLIB;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wcast-qual" // older libjpeg versions take a non-const buffer
+    jpeg_mem_src(&src, (const unsigned char*) image_buffer, image_size);
+#pragma GCC diagnostic pop
+    jpeg_save_markers(&src, JPEG_APP0 + 1, 0xFFFF);
+    jpeg_save_markers(&src, JPEG_APP0 + 2, 0xFFFF);
+    (void) jpeg_read_header(&src, TRUE);
+    jvirt_barray_ptr* const coefficients = jpeg_read_coefficients(&src);
+
+    jpeg_copy_critical_parameters(&src, &dst);
+    dst.optimize_coding = TRUE;
+    if (src.progressive_mode) jpeg_simple_progression(&dst);
+    jpeg_mem_dest(&dst, &dest.buffer, &dest.size);
+    jpeg_write_coefficients(&dst, coefficients);
+    copy_markers(&src, &dst);
+    jpeg_finish_compress(&dst);
+    (void) jpeg_finish_decompress(&src);
+
+    const long warnings = err.mgr.num_warnings;
+    jpeg_destroy_compress(&dst);
+    jpeg_destroy_decompress(&src);
+    if (warnings > 0) {
+        // e.g. truncated data: what was decoded is not the whole image
+        free(dest.buffer);
+        return ERR_IMGLIB;
+    }
+
+    *out = dest.buffer;
+    *out_size = dest.size;
+    return ERR_NONE;
+}
+
+/*******************************************************************
+ * Volume
+ */
+int optimize_record(struct imgfs_file* imgfs_file, size_t index, uint32_t uploaded_size,
+                    const unsigned char* stored, size_t stored_size)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(stored);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    struct imgfs_ext_record* records = NULL;
+    const int err = imgfs_ext_get(imgfs_file, 1, &records);
+    if (err != ERR_NONE) return err;
+    records[index].uploaded_size = uploaded_size;
+    SHA256(stored, stored_size, records[index].stored_SHA);
+    return imgfs_ext_store(imgfs_file, index);
+}
+
+/**
+ * @brief Recompresses the original of an image, appended at the end of the
+ *        file if it gets smaller, and records the result for all the images
+ *        sharing it. Bytes already written are never overwritten: readers
+ *        of a shared volume may still be reading the previous original.
+ */
+static int optimize_original(struct imgfs_file* imgfs_file, size_t index)
+{
+    const uint64_t offset = imgfs_file->metadata[index].offset[ORIG_RES];
+    const uint32_t size = imgfs_file->metadata[index].size[ORIG_RES];
+
+    char* const original = malloc(size);
+    if (original == NULL) return ERR_OUT_OF_MEMORY;
+    if (fseek(imgfs_file->file, (long) offset, SEEK_SET) != 0
+        || fread(original, size, 1, imgfs_file->file) != 1) {
+        free(original);
+        return ERR_IO;
+    }
+
+    unsigned char* optimized = NULL;
+    size_t optimized_size = 0;
+    int err = jpeg_optimize_lossless(original, size, &optimized, &optimized_size);
+    const unsigned char* stored = (const unsigned char*) original;
+    size_t stored_size = size;
+    uint64_t stored_offset = offset;
+    if (err == ERR_NONE && optimized_size < size) {
+        const long end = fseek(imgfs_file->file, 0L, SEEK_END) == 0 ? ftell(imgfs_file->file) : -1L;
+        if (end == -1L || fwrite(optimized, optimized_size, 1, imgfs_file->file) != 1) {
+            err = ERR_IO;
+        } else {
+            stored = optimized;
+            stored_size = optimized_size;
+            stored_offset = (uint64_t) end;
+        }
+    } else if (err == ERR_IMGLIB) {
+        // not transcodable: kept as uploaded, but processed all the same
+        err = ERR_NONE;
+    }
+
+    // the images deduplicated with this one share its original
+    for (size_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE; ++i) {
+        struct img_metadata* const md = &imgfs_file->metadata[i];
+        if (md->is_valid != NON_EMPTY || md->offset[ORIG_RES] != offset) continue;
+        md->offset[ORIG_RES] = stored_offset;
+        md->size[ORIG_RES] = (uint32_t) stored_size;
+        md->version = imgfs_file->header.version + 1; // that of the end of the pass
+        if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + i * sizeof(struct img_metadata)),
+                  SEEK_SET) != 0
+            || fwrite(md, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+            err = ERR_IO;
+        } else {
+            err = optimize_record(imgfs_file, i, size, stored, stored_size);
+        }
+    }
+
+    free(optimized);
+    free(original);
+    return err;
+}
+
+int do_optimize_originals(struct imgfs_file* imgfs_file, uint32_t max_images)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    struct imgfs_ext_record* records = NULL;
+    int err = imgfs_ext_get(imgfs_file, 1, &records);
+    if (err != ERR_NONE) return err;
+
+    uint32_t processed = 0;
+    for (size_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE
+         && (max_images == 0 || processed < max_images); ++i) {
+        if (imgfs_file->metadata[i].is_valid != NON_EMPTY || records[i].uploaded_size != 0) continue;
+        err = optimize_original(imgfs_file, i);
+        ++processed;
+    }
+    if (processed == 0) return ERR_NONE;
+
+    // even after an error: the entries already rewritten have the version of the end of the pass
+    imgfs_file->header.version++;
+    if (fseek(imgfs_file->file, 0L, SEEK_SET) != 0
+        || fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return err != ERR_NONE ? err : ERR_IO;
+    }
+    return err;
+}
+
+int do_optimize_report(struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+
+    struct imgfs_ext_record* records = NULL;
+    const int err = imgfs_ext_get(imgfs_file, 0, &records);
+    if (err != ERR_NONE) return err;
+
+    uint32_t images = 0;
+    uint32_t processed = 0;
+    uint32_t recompressed = 0;
+    uint64_t uploaded = 0;
+    uint64_t stored = 0;
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* const md = &imgfs_file->metadata[i];
+        if (md->is_valid != NON_EMPTY) continue;
+        ++images;
+        stored += md->size[ORIG_RES];
+        if (records != NULL && records[i].uploaded_size != 0) {
+            ++processed;
+            if (records[i].uploaded_size != md->size[ORIG_RES]) ++recompressed;
+            uploaded += records[i].uploaded_size;
+        } else {
+            uploaded += md->size[ORIG_RES];
+        }
+    }
+
+    // images sharing an original (deduplicated) count once each
+    const long long saved = (long long) uploaded - (long long) stored;
+    printf("%8s %10s %13s %14s %14s %12s %7s\n", "IMAGES", "PROCESSED", "RECOMPRESSED",
+           "UPLOADED", "STORED", "SAVED", "SAVED%");
+    printf("%8" PRIu32 " %10" PRIu32 " %13" PRIu32 " %14" PRIu64 " %14" PRIu64 " %12lld %6.1f%%\n",
+           images, processed, recompressed, uploaded, stored, saved,
+           uploaded > 0 ? 100.0 * (double) saved / (double) uploaded : 0.0);
+    return ERR_NONE;
+}
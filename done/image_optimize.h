@@ -0,0 +1,77 @@
+/**
+ * @file image_optimize.h
+ * @brief Lossless recompression of the stored originals.
+ *
+ * The JPEG is transcoded at the DCT coefficient level (as jpegtran does):
+ * the pixels do not change, only the entropy coding (optimized Huffman
+ * tables) and the metadata. EXIF (without its embedded thumbnail) and ICC
+ * profiles are kept since they affect the display; other metadata (XMP,
+ * IPTC, comments, MPF previews) is dropped.
+ *
+ * img_metadata.SHA stays the SHA of the uploaded bytes, so that the same
+ * upload is still deduplicated; the uploaded size and the SHA of the stored
+ * bytes are kept in the extension table (imgfs_ext.h).
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Recompresses a JPEG losslessly.
+ *
+ * @param image_buffer The JPEG.
+ * @param image_size Its size.
+ * @param out Where to put the recompressed JPEG (to be freed with free()).
+ * @param out_size Where to put its size, which may be larger than the input.
+ * @return Some error code (ERR_IMGLIB if the JPEG cannot be transcoded
+ *         exactly, e.g. if it is corrupt). 0 if no error.
+ */
+int jpeg_optimize_lossless(const char* image_buffer, size_t image_size,
+                           unsigned char** out, size_t* out_size);
+
+/**
+ * @brief Records in the extension table (created if needed) that the
+ *        original of an image was processed.
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing.
+ * @param index The index of the image in the metadata array.
+ * @param uploaded_size The size of the original as uploaded.
+ * @param stored The original as stored.
+ * @param stored_size Its size.
+ * @return Some error code. 0 if no error.
+ */
+int optimize_record(struct imgfs_file* imgfs_file, size_t index, uint32_t uploaded_size,
+                    const unsigned char* stored, size_t stored_size);
+
+/**
+ * @brief Recompresses the originals not processed yet: an original is
+ *        replaced only if it gets smaller, by a copy appended at the end of
+ *        the file, and the bytes of the previous one stay unused in the
+ *        file until it is compacted.
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing.
+ * @param max_images How many originals to process, 0 for all of them.
+ * @return Some error code. 0 if no error.
+ */
+int do_optimize_originals(struct imgfs_file* imgfs_file, uint32_t max_images);
+
+/**
+ * @brief Prints how many originals were recompressed, their uploaded and
+ *        stored sizes and the bytes saved, for the whole volume.
+ *
+ * @param imgfs_file The main in-memory structure.
+ * @return Some error code. 0 if no error.
+ */
+int do_optimize_report(struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,277 @@
+/**
+ * @file image_phash.c
+ * @brief Perceptual hashes and near-duplicates (see image_phash.h).
+ */
+
+#include "image_phash.h"
+#include "image_content.h"
+#include "imgfs_ext.h"
+#include "phash_index.h"
+#include "error.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+#define PHASH_LOW 8 // lowest frequencies kept, per dimension: 8 x 8 = PHASH_BITS
+#define PI 3.14159265358979323846
+
+static atomic_int enabled = 0;
+
+void phash_enable(int on)
+{
+    atomic_store_explicit(&enabled, on != 0, memory_order_relaxed);
+}
+
+int phash_enabled(void)
+{
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+static int compare_doubles(const void* a, const void* b)
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+uint64_t phash_of_pixels(const unsigned char* pixels)
+{
+    if (pixels == NULL) return 0;
+
+    // DCT-II, unnormalized (only the order of the coefficients matters)
+    double basis[PHASH_LOW][PHASH_SIDE];
+    for (int u = 0; u < PHASH_LOW; ++u) {
+        for (int x = 0; x < PHASH_SIDE; ++x) {
+            basis[u][x] = cos((2 * x + 1) * u * PI / (2 * PHASH_SIDE));
+        }
+    }
+
+    // rows, then columns, for the lowest frequencies only
+    double rows[PHASH_SIDE][PHASH_LOW];
+    for (int y = 0; y < PHASH_SIDE; ++y) {
+        for (int v = 0; v < PHASH_LOW; ++v) {
+            double sum = 0;
+            for (int x = 0; x < PHASH_SIDE; ++x) sum += pixels[y * PHASH_SIDE + x] * basis[v][x];
+            rows[y][v] = sum;
+        }
+    }
+    double low[PHASH_LOW * PHASH_LOW];
+    for (int u = 0; u < PHASH_LOW; ++u) {
+        for (int v = 0; v < PHASH_LOW; ++v) {
+            double sum = 0;
+            for (int y = 0; y < PHASH_SIDE; ++y) sum += basis[u][y] * rows[y][v];
+            low[u * PHASH_LOW + v] = sum;
+        }
+    }
+
+    double sorted[PHASH_LOW * PHASH_LOW];
+    memcpy(sorted, low, sizeof(sorted));
+    qsort(sorted, PHASH_LOW * PHASH_LOW, sizeof(double), compare_doubles);
+    const double median = (sorted[PHASH_LOW * PHASH_LOW / 2 - 1] + sorted[PHASH_LOW * PHASH_LOW / 2]) / 2;
+
+    uint64_t hash = 0;
+    for (int i = 0; i < PHASH_LOW * PHASH_LOW; ++i) {
+        if (low[i] > median) hash |= (uint64_t) 1 << i;
+    }
+    return hash;
+}
+
+int phash_of_image(VipsImage* image, uint64_t* hash)
+{
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(hash);
+
+    VipsImage* gray = NULL;
+    VipsImage* band = NULL;
+    VipsImage* small = NULL;
+    VipsImage* bytes = NULL;
+    int err = ERR_IMGLIB;
+    if (vips_colourspace(image, &gray, VIPS_INTERPRETATION_B_W, NULL) == 0
+        && vips_extract_band(gray, &band, 0, NULL) == 0 // without the alpha, if any
+        && vips_resize(band, &small, (double) PHASH_SIDE / vips_image_get_width(band),
+                       "vscale", (double) PHASH_SIDE / vips_image_get_height(band), NULL) == 0
+        && vips_cast_uchar(small, &bytes, NULL) == 0) {
+        size_t size = 0;
+        unsigned char* const pixels = vips_image_write_to_memory(bytes, &size);
+        if (pixels != NULL && size == PHASH_SIDE * PHASH_SIDE) {
+            *hash = phash_of_pixels(pixels);
+            err = ERR_NONE;
+        }
+        g_free(pixels);
+    }
+    if (bytes != NULL) g_object_unref(bytes);
+    if (small != NULL) g_object_unref(small);
+    if (band != NULL) g_object_unref(band);
+    if (gray != NULL) g_object_unref(gray);
+    return err;
+}
+
+int phash_record(struct imgfs_file* imgfs_file, size_t index, VipsImage* thumbnail)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    uint64_t hash = 0;
+    int err = phash_of_image(thumbnail, &hash);
+    if (err != ERR_NONE) return err;
+
+    struct imgfs_ext_record* records = NULL;
+    err = imgfs_ext_get(imgfs_file, 1, &records);
+    if (err != ERR_NONE) return err;
+    records[index].phash = hash;
+    records[index].flags |= EXT_PHASH;
+    return imgfs_ext_store(imgfs_file, index);
+}
+
+/**
+ * @brief Hashes the stored thumbnail of an image.
+ */
+static int hash_thumbnail(struct imgfs_file* imgfs_file, size_t index)
+{
+    const struct img_metadata* const md = &imgfs_file->metadata[index];
+    char* const buffer = malloc(md->size[THUMB_RES]);
+    if (buffer == NULL) return ERR_OUT_OF_MEMORY;
+    if (fseek(imgfs_file->file, (long) md->offset[THUMB_RES], SEEK_SET) != 0
+        || fread(buffer, md->size[THUMB_RES], 1, imgfs_file->file) != 1) {
+        free(buffer);
+        return ERR_IO;
+    }
+
+    VipsImage* thumbnail = NULL;
+    int err = ERR_IMGLIB;
+    if (vips_jpegload_buffer(buffer, md->size[THUMB_RES], &thumbnail, NULL) == 0) {
+        err = phash_record(imgfs_file, index, thumbnail);
+        g_object_unref(thumbnail);
+    }
+    free(buffer);
+    return err;
+}
+
+/**
+ * @brief Hashes the images which have no hash yet, creating their thumbnail if needed.
+ */
+static int hash_missing(struct imgfs_file* imgfs_file, const struct imgfs_ext_record* records)
+{
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid != NON_EMPTY || (records[i].flags & EXT_PHASH) != 0) continue;
+        // hashed on the way if phash_enabled()
+        int err = lazily_resize(THUMB_RES, imgfs_file, i);
+        if (err == ERR_NONE && (records[i].flags & EXT_PHASH) == 0) err = hash_thumbnail(imgfs_file, i);
+        if (err != ERR_NONE) return err;
+    }
+    return ERR_NONE;
+}
+
+static uint64_t pixels_of(const struct img_metadata* md)
+{
+    return (uint64_t) md->orig_res[0] * md->orig_res[1];
+}
+
+/**
+ * @brief Makes an image, and those deduplicated with it, share the content
+ *        of another one.
+ */
+static int alias_content(struct imgfs_file* imgfs_file, size_t index, size_t target, uint64_t* freed)
+{
+    const struct img_metadata* const to = &imgfs_file->metadata[target];
+    const uint64_t offset = imgfs_file->metadata[index].offset[ORIG_RES];
+    for (int res = 0; res < NB_RES; ++res) *freed += imgfs_file->metadata[index].size[res];
+
+    for (size_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        struct img_metadata* const md = &imgfs_file->metadata[i];
+        if (md->is_valid != NON_EMPTY || md->offset[ORIG_RES] != offset) continue;
+        memcpy(md->orig_res, to->orig_res, sizeof(md->orig_res));
+        memcpy(md->size, to->size, sizeof(md->size));
+        memcpy(md->offset, to->offset, sizeof(md->offset));
+        md->version = imgfs_file->header.version + 1; // that of the end of the pass
+        if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header) + i * sizeof(struct img_metadata)),
+                  SEEK_SET) != 0
+            || fwrite(md, sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+        const int err = imgfs_ext_reset(imgfs_file, i, (long) target);
+        if (err != ERR_NONE) return err;
+    }
+    return ERR_NONE;
+}
+
+int do_near_duplicates(struct imgfs_file* imgfs_file, unsigned max_distance, int policy)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (max_distance >= PHASH_BITS || (policy != NEAR_DUP_REPORT && policy != NEAR_DUP_ALIAS)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_ext_record* records = NULL;
+    int err = imgfs_ext_get(imgfs_file, 1, &records);
+    if (err == ERR_NONE) err = hash_missing(imgfs_file, records);
+    if (err != ERR_NONE) return err;
+
+    struct phash_match* const matches = calloc(imgfs_file->header.max_files, sizeof(struct phash_match));
+    if (matches == NULL) return ERR_OUT_OF_MEMORY;
+    struct phash_index index;
+    phash_index_init(&index);
+
+    // each image is compared with those before it; only the images kept
+    // with their own content are indexed
+    uint32_t pairs = 0;
+    uint32_t aliased = 0;
+    uint64_t freed = 0;
+    for (size_t i = 0; i < imgfs_file->header.max_files && err == ERR_NONE; ++i) {
+        const struct img_metadata* const md = &imgfs_file->metadata[i];
+        if (md->is_valid != NON_EMPTY) continue;
+
+        size_t nb_matches = 0;
+        err = phash_index_query(&index, records[i].phash, max_distance, matches,
+                                imgfs_file->header.max_files, &nb_matches);
+        if (err != ERR_NONE) break;
+
+        const struct phash_match* nearest = NULL;
+        int same_content = 0;
+        for (size_t m = 0; m < nb_matches; ++m) {
+            if (imgfs_file->metadata[matches[m].id].offset[ORIG_RES] == md->offset[ORIG_RES]) {
+                same_content = 1; // already deduplicated
+            } else if (nearest == NULL || matches[m].distance < nearest->distance) {
+                nearest = &matches[m];
+            }
+        }
+        if (same_content) continue;
+        if (nearest == NULL) {
+            err = phash_index_add(&index, records[i].phash, (uint32_t) i);
+            continue;
+        }
+
+        ++pairs;
+        const struct img_metadata* const original = &imgfs_file->metadata[nearest->id];
+        const char* outcome = "";
+        if (policy == NEAR_DUP_ALIAS && pixels_of(md) <= pixels_of(original)) {
+            err = alias_content(imgfs_file, i, nearest->id, &freed);
+            ++aliased;
+            outcome = ": aliased";
+        } else {
+            if (policy == NEAR_DUP_ALIAS) outcome = ": kept, larger";
+            err = phash_index_add(&index, records[i].phash, (uint32_t) i);
+        }
+        printf("%s ~ %s (distance %u)%s\n", md->img_id, original->img_id, nearest->distance, outcome);
+    }
+    phash_index_free(&index);
+    free(matches);
+    if (err != ERR_NONE) return err;
+
+    printf("%8s %8s %14s\n", "PAIRS", "ALIASED", "FREED");
+    printf("%8" PRIu32 " %8" PRIu32 " %14" PRIu64 "\n", pairs, aliased, freed);
+    if (aliased == 0) return ERR_NONE;
+
+    imgfs_file->header.version++;
+    if (fseek(imgfs_file->file, 0L, SEEK_SET) != 0
+        || fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
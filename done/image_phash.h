@@ -0,0 +1,94 @@
+/**
+ * @file image_phash.h
+ * @brief Perceptual hashes of the images and near-duplicate detection.
+ *
+ * do_name_and_content_dedup() only shares the content of byte-identical
+ * uploads. A copy of a photo which was re-encoded or re-saved differs in
+ * its bytes but not in its perceptual hash: the thumbnail, in grays and
+ * reduced to 32x32, goes through a DCT, and each of its 8x8 lowest
+ * frequencies gives a bit, set if it is above their median. Such copies
+ * are within a few bits of each other (phash_index.h).
+ *
+ * The hash is computed when the thumbnail is created, if enabled, and kept
+ * in the extension table (imgfs_ext.h); do_near_duplicates() computes the
+ * missing ones.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PHASH_SIDE 32 // side of the image hashed
+#define PHASH_DEFAULT_DISTANCE 8 // bits, for re-encoded copies
+
+#define NEAR_DUP_REPORT 0 // near-duplicates are listed only
+#define NEAR_DUP_ALIAS 1  // and share the content of the image they are a copy of
+
+struct _VipsImage;
+
+/**
+ * @brief Enables (1) or disables (0) the hashing of the thumbnails
+ *        created by lazily_resize(); disabled by default.
+ */
+void phash_enable(int enabled);
+
+/**
+ * @brief Returns whether the thumbnails are hashed when created.
+ */
+int phash_enabled(void);
+
+/**
+ * @brief Computes the perceptual hash of an image in grays.
+ *
+ * @param pixels PHASH_SIDE x PHASH_SIDE pixels, row by row.
+ * @return The hash.
+ */
+uint64_t phash_of_pixels(const unsigned char* pixels);
+
+/**
+ * @brief Computes the perceptual hash of an image.
+ *
+ * @param image The image, e.g. a thumbnail.
+ * @param hash Where to put the hash.
+ * @return Some error code. 0 if no error.
+ */
+int phash_of_image(struct _VipsImage* image, uint64_t* hash);
+
+/**
+ * @brief Hashes the thumbnail of an image and records the hash in the
+ *        extension table (created if needed).
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing.
+ * @param index The index of the image in the metadata array.
+ * @param thumbnail Its thumbnail.
+ * @return Some error code. 0 if no error.
+ */
+int phash_record(struct imgfs_file* imgfs_file, size_t index, struct _VipsImage* thumbnail);
+
+/**
+ * @brief Lists the images which are near-duplicates of another one, with the
+ *        distance of their hashes, after computing the missing hashes.
+ *
+ * Each image is compared with those before it in the metadata array. With
+ * NEAR_DUP_ALIAS, an image (and those deduplicated with it) then shares
+ * the content of the nearest one, unless it has more pixels: its bytes
+ * stay unused in the file until it is compacted. Its name and the SHA of
+ * its upload are kept.
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing.
+ * @param max_distance The largest distance, in bits, of a near-duplicate.
+ * @param policy NEAR_DUP_REPORT or NEAR_DUP_ALIAS.
+ * @return Some error code. 0 if no error.
+ */
+int do_near_duplicates(struct imgfs_file* imgfs_file, unsigned max_distance, int policy);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,340 @@
+/**
+ * @file image_sprite.c
+ * @brief Sprite sheets of thumbnails (see image_sprite.h).
+ */
+
+#include "image_sprite.h"
+#include "error.h"
+#include "lock_prof.h"
+
+#include <json-c/json.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+struct sprite_tile {
+    const char* img_id;
+    char* jpeg; // the thumbnail, which libvips reads lazily
+    VipsImage* image;
+    int x, y, width, height;
+};
+
+struct sprite_entry {
+    char* key; // the sorted ids, NULL if the entry is free
+    const struct imgfs_file* owner;
+    uint32_t version;
+    char* image;
+    size_t image_size;
+    char* map;
+    uint64_t last_used;
+};
+
+static struct sprite_entry cache[SPRITE_CACHE_SIZE];
+static uint64_t cache_clock = 0;
+static struct prof_mutex cache_lock = PROF_MUTEX_INITIALIZER("sprite_cache");
+
+static int compare_ids(const void* a, const void* b)
+{
+    return strcmp(*(const char* const*) a, *(const char* const*) b);
+}
+
+/**
+ * @brief Splits the ids in place, then sorts them and drops the duplicates.
+ */
+static int split_ids(char* list, const char** ids, size_t* nb_ids)
+{
+    *nb_ids = 0;
+    for (char* id = list; id != NULL; ) {
+        char* const comma = strchr(id, ',');
+        if (comma != NULL) *comma = '\0';
+        if (strlen(id) > MAX_IMG_ID) return ERR_INVALID_IMGID;
+        if (id[0] != '\0') {
+            if (*nb_ids == MAX_SPRITE_IMAGES) return ERR_INVALID_ARGUMENT;
+            ids[(*nb_ids)++] = id;
+        }
+        id = comma != NULL ? comma + 1 : NULL;
+    }
+    if (*nb_ids == 0) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    qsort(ids, *nb_ids, sizeof(const char*), compare_ids);
+    size_t kept = 1;
+    for (size_t i = 1; i < *nb_ids; ++i) {
+        if (strcmp(ids[i], ids[kept - 1]) != 0) ids[kept++] = ids[i];
+    }
+    *nb_ids = kept;
+    return ERR_NONE;
+}
+
+static char* make_map(uint32_t version, const struct sprite_tile* tiles, size_t nb_tiles, int width, int height)
+{
+    json_object* jobj = json_object_new_object();
+    json_object* jtiles = json_object_new_object();
+    json_object_object_add(jobj, "version", json_object_new_int64(version));
+    json_object_object_add(jobj, "width", json_object_new_int(width));
+    json_object_object_add(jobj, "height", json_object_new_int(height));
+    for (size_t i = 0; i < nb_tiles; ++i) {
+        json_object* jtile = json_object_new_object();
+        json_object_object_add(jtile, "x", json_object_new_int(tiles[i].x));
+        json_object_object_add(jtile, "y", json_object_new_int(tiles[i].y));
+        json_object_object_add(jtile, "width", json_object_new_int(tiles[i].width));
+        json_object_object_add(jtile, "height", json_object_new_int(tiles[i].height));
+        json_object_object_add(jtiles, tiles[i].img_id, jtile);
+    }
+    json_object_object_add(jobj, "tiles", jtiles);
+    char* const map = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+    return map;
+}
+
+/**
+ * @brief Places the tiles in a grid whose cells fit the largest thumbnail,
+ *        then draws them on a black sheet.
+ */
+static int compose(struct sprite_tile* tiles, size_t nb_tiles, VipsImage** sheet)
+{
+    int cell_width = 1;
+    int cell_height = 1;
+    for (size_t i = 0; i < nb_tiles; ++i) {
+        if (tiles[i].width > cell_width) cell_width = tiles[i].width;
+        if (tiles[i].height > cell_height) cell_height = tiles[i].height;
+    }
+    int columns = 1; // a square grid, with the last row possibly incomplete
+    while ((size_t) columns * (size_t) columns < nb_tiles) ++columns;
+    const int rows = ((int) nb_tiles + columns - 1) / columns;
+
+    VipsImage* canvas = NULL;
+    if (vips_black(&canvas, columns * cell_width, rows * cell_height, "bands", 3, NULL) != 0) {
+        return ERR_IMGLIB;
+    }
+    for (size_t i = 0; i < nb_tiles; ++i) {
+        tiles[i].x = (int) i % columns * cell_width;
+        tiles[i].y = (int) i / columns * cell_height;
+        VipsImage* next = NULL;
+        const int ret = vips_insert(canvas, tiles[i].image, &next, tiles[i].x, tiles[i].y, NULL);
+        g_object_unref(canvas);
+        if (ret != 0) return ERR_IMGLIB;
+        canvas = next;
+    }
+    *sheet = canvas;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the thumbnails of the (sorted) ids, creating the missing
+ *        ones; the caller holds the volume lock.
+ */
+static int read_tiles(struct imgfs_file* imgfs_file, const char* const* ids, size_t nb_ids,
+                      struct sprite_tile* tiles, uint32_t* sizes)
+{
+    for (size_t i = 0; i < nb_ids; ++i) {
+        tiles[i].img_id = ids[i];
+        const int err = do_read(ids[i], THUMB_RES, &tiles[i].jpeg, &sizes[i], imgfs_file);
+        if (err != ERR_NONE) return err;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Composes the sheet of thumbnails read and its map, without the
+ *        volume lock.
+ */
+static int make_sheet(struct sprite_tile* tiles, const uint32_t* sizes, size_t nb_tiles, uint32_t version,
+                      char** image, size_t* image_size, char** map)
+{
+    int err = ERR_NONE;
+    for (size_t i = 0; i < nb_tiles && err == ERR_NONE; ++i) {
+        if (vips_jpegload_buffer(tiles[i].jpeg, sizes[i], &tiles[i].image, NULL) != 0) {
+            err = ERR_IMGLIB;
+        } else {
+            tiles[i].width = vips_image_get_width(tiles[i].image);
+            tiles[i].height = vips_image_get_height(tiles[i].image);
+        }
+    }
+
+    VipsImage* sheet = NULL;
+    if (err == ERR_NONE) err = compose(tiles, nb_tiles, &sheet);
+    if (err == ERR_NONE) {
+        void* jpeg = NULL;
+        size_t jpeg_size = 0;
+        if (vips_jpegsave_buffer(sheet, &jpeg, &jpeg_size, NULL) != 0) {
+            err = ERR_IMGLIB;
+        } else {
+            *image = malloc(jpeg_size);
+            *map = make_map(version, tiles, nb_tiles, vips_image_get_width(sheet),
+                            vips_image_get_height(sheet));
+            if (*image == NULL || *map == NULL) {
+                err = ERR_OUT_OF_MEMORY;
+            } else {
+                memcpy(*image, jpeg, jpeg_size);
+                *image_size = jpeg_size;
+            }
+            g_free(jpeg);
+        }
+        g_object_unref(sheet);
+    }
+    if (err != ERR_NONE) {
+        free(*image);
+        free(*map);
+        *image = NULL;
+        *map = NULL;
+    }
+    return err;
+}
+
+static void free_tiles(struct sprite_tile* tiles, size_t nb_tiles)
+{
+    for (size_t i = 0; i < nb_tiles; ++i) {
+        if (tiles[i].image != NULL) g_object_unref(tiles[i].image);
+        free(tiles[i].jpeg);
+    }
+    free(tiles);
+}
+
+static void free_entry(struct sprite_entry* entry)
+{
+    free(entry->key);
+    free(entry->image);
+    free(entry->map);
+    memset(entry, 0, sizeof(*entry));
+}
+
+/**
+ * @brief Copies the requested parts of a cached sheet; the caller holds cache_lock.
+ */
+static int copy_entry(const struct sprite_entry* entry, char** image, size_t* image_size, char** map)
+{
+    if (image != NULL) {
+        *image = malloc(entry->image_size);
+        if (*image == NULL) return ERR_OUT_OF_MEMORY;
+        memcpy(*image, entry->image, entry->image_size);
+        *image_size = entry->image_size;
+    }
+    if (map != NULL) {
+        *map = strdup(entry->map);
+        if (*map == NULL) {
+            if (image != NULL) free(*image);
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Copies the requested parts of the sheet cached for these ids at
+ *        this version, if any.
+ *
+ * @return 1 if cached (err set), 0 otherwise.
+ */
+static int lookup(const struct imgfs_file* imgfs_file, const char* key, uint32_t version,
+                  char** image, size_t* image_size, char** map, int* err)
+{
+    int found = 0;
+    prof_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE && !found; ++i) {
+        struct sprite_entry* const entry = &cache[i];
+        if (entry->key != NULL && entry->owner == imgfs_file
+            && entry->version == version && strcmp(entry->key, key) == 0) {
+            entry->last_used = ++cache_clock;
+            *err = copy_entry(entry, image, image_size, map);
+            found = 1;
+        }
+    }
+    prof_mutex_unlock(&cache_lock);
+    return found;
+}
+
+int sprite_get(struct imgfs_file* imgfs_file, void (*lock)(void), void (*unlock)(void),
+               const char* img_ids, char** image, size_t* image_size, char** map, int* cached)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(lock);
+    M_REQUIRE_NON_NULL(unlock);
+    M_REQUIRE_NON_NULL(img_ids);
+    if (image != NULL) M_REQUIRE_NON_NULL(image_size);
+
+    // the key: the sorted ids, joined by commas
+    const size_t list_len = strlen(img_ids);
+    char* const list = malloc(list_len + 1);
+    char* const key = malloc(list_len + 1);
+    if (list == NULL || key == NULL) {
+        free(list);
+        free(key);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(list, img_ids, list_len + 1);
+    const char* ids[MAX_SPRITE_IMAGES];
+    size_t nb_ids = 0;
+    int err = split_ids(list, ids, &nb_ids);
+    if (err != ERR_NONE) {
+        free(list);
+        free(key);
+        return err;
+    }
+    key[0] = '\0';
+    for (size_t i = 0; i < nb_ids; ++i) {
+        if (i > 0) strcat(key, ",");
+        strcat(key, ids[i]);
+    }
+
+    // the cache, at the version of the volume
+    lock();
+    uint32_t version = imgfs_file->header.version;
+    unlock();
+    if (lookup(imgfs_file, key, version, image, image_size, map, &err)) {
+        free(list);
+        free(key);
+        if (cached != NULL) *cached = 1;
+        return err;
+    }
+    if (cached != NULL) *cached = 0;
+
+    // only the thumbnails are read under the volume lock, not decoded
+    struct sprite_tile* const tiles = calloc(nb_ids, sizeof(struct sprite_tile));
+    uint32_t sizes[MAX_SPRITE_IMAGES];
+    if (tiles == NULL) {
+        free(list);
+        free(key);
+        return ERR_OUT_OF_MEMORY;
+    }
+    lock();
+    err = read_tiles(imgfs_file, ids, nb_ids, tiles, sizes);
+    version = imgfs_file->header.version; // once the missing thumbnails are created
+    unlock();
+
+    struct sprite_entry added;
+    memset(&added, 0, sizeof(added));
+    if (err == ERR_NONE) {
+        err = make_sheet(tiles, sizes, nb_ids, version, &added.image, &added.image_size, &added.map);
+    }
+    free_tiles(tiles, nb_ids);
+    free(list);
+    if (err != ERR_NONE) {
+        free(key);
+        return err;
+    }
+    added.key = key;
+    added.owner = imgfs_file;
+    added.version = version;
+
+    prof_mutex_lock(&cache_lock);
+    err = copy_entry(&added, image, image_size, map);
+    // replaces the least recently used entry (free ones never were)
+    struct sprite_entry* oldest = &cache[0];
+    for (size_t i = 1; i < SPRITE_CACHE_SIZE; ++i) {
+        if (cache[i].last_used < oldest->last_used) oldest = &cache[i];
+    }
+    free_entry(oldest);
+    *oldest = added;
+    oldest->last_used = ++cache_clock;
+    prof_mutex_unlock(&cache_lock);
+    return err;
+}
+
+void sprite_cache_clear(void)
+{
+    prof_mutex_lock(&cache_lock);
+    for (size_t i = 0; i < SPRITE_CACHE_SIZE; ++i) free_entry(&cache[i]);
+    prof_mutex_unlock(&cache_lock);
+}
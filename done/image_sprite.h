@@ -0,0 +1,56 @@
+/**
+ * @file image_sprite.h
+ * @brief Sprite sheets: the thumbnails of several images in one JPEG.
+ *
+ * A gallery then needs one image request, and the map of the sheet (JSON)
+ * tells where each thumbnail is. The thumbnails are laid out in a square
+ * grid, in the order of their ids, so that any permutation of the same ids
+ * gives the same sheet. Sheets are cached by their set of ids and the
+ * version of the imgFS header, which any insertion or deletion changes.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stddef.h> // for size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MAX_SPRITE_IMAGES 64 // thumbnails in a sheet
+#define SPRITE_CACHE_SIZE 16 // sheets kept, the least recently used ones are dropped
+
+/**
+ * @brief Gets the sprite sheet of some images, composed if not cached.
+ *
+ * The map is a JSON object: {"version": <header version>, "width": <px>,
+ * "height": <px>, "tiles": {"<img_id>": {"x", "y", "width", "height"}, ...}}.
+ *
+ * The volume lock is only held to read the thumbnails (copies): they are
+ * decoded, composed and encoded without it.
+ *
+ * @param imgfs_file The main in-memory structure, opened for writing
+ *                   (missing thumbnails are created).
+ * @param lock Takes the volume lock; not held by the caller.
+ * @param unlock Releases it.
+ * @param img_ids The ids of the images, separated by commas.
+ * @param image Where to put the sheet, a JPEG (to be freed with free()), or NULL.
+ * @param image_size Where to put its size (if image is not NULL).
+ * @param map Where to put the map (to be freed with free()), or NULL.
+ * @param cached Where to put whether the sheet was cached, or NULL.
+ * @return Some error code (ERR_INVALID_ARGUMENT for more than
+ *         MAX_SPRITE_IMAGES ids). 0 if no error.
+ */
+int sprite_get(struct imgfs_file* imgfs_file, void (*lock)(void), void (*unlock)(void),
+               const char* img_ids, char** image, size_t* image_size, char** map, int* cached);
+
+/**
+ * @brief Drops all the cached sheets.
+ */
+void sprite_cache_clear(void);
+
+#ifdef __cplusplus
+}
+#endif
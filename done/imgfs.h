@@ -40,6 +40,25 @@
 #define ORIG_RES  2
 #define NB_RES    3
 
+// Encoding settings of the derivatives, one per resized resolution
+// (imgfs_header.encoding). 0 means the libvips defaults.
+#define ENC_QUALITY        0x007F // JPEG quality factor, 1 to 100; 0 for the default (75)
+#define ENC_STRIP          0x0080 // remove EXIF, ICC and other metadata
+#define ENC_PROGRESSIVE    0x0100 // progressive JPEG rather than baseline
+#define ENC_SUBSAMPLE      0x0600 // chroma subsampling, one of:
+#define ENC_SUBSAMPLE_AUTO 0x0000 //   4:2:0 unless Q >= 90
+#define ENC_SUBSAMPLE_ON   0x0200 //   always 4:2:0
+#define ENC_SUBSAMPLE_OFF  0x0400 //   never (4:4:4)
+#define ENC_OPTIMIZE       0x0800 // optimized Huffman tables
+#define ENC_DEFAULT_QUALITY 75
+#define MAX_ENCODING_STR   64 // max. size of an encoding description
+
+/* Formats of the resized images (originals are always JPEG) */
+#define FORMAT_JPEG 0
+#define FORMAT_WEBP 1
+#define FORMAT_AVIF 2
+#define NB_FORMATS  3
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -50,8 +69,8 @@ struct imgfs_header {
     uint32_t nb_files;
     uint32_t max_files;
     uint16_t resized_res[2 * (NB_RES - 1)]; // Array for resized resolutions
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint16_t encoding[NB_RES - 1]; // encoding settings of the resized resolutions (ENC_*)
+    uint64_t ext_offset; // offset of the extension table (imgfs_ext.h), 0 if none
 };
 
 struct img_metadata {
@@ -59,6 +78,7 @@ struct img_metadata {
     unsigned char SHA[SHA256_DIGEST_LENGTH];
     uint32_t orig_res[2]; // Resolution of original image (width, height)
     uint32_t size[NB_RES]; // mem sizes for thumbnail, small, and original res
+    uint32_t version; // header version that last changed the entry (0: before versions were recorded)
     uint64_t offset[NB_RES]; // pos in the img db file for each res
     uint16_t is_valid; // whether the img is in use (NON_EMPTY) or not (EMPTY)
     uint16_t unused_16;
@@ -84,6 +104,25 @@ void print_header(const struct imgfs_header* header);
  */
 void print_metadata(const struct img_metadata* metadata);
 
+/**
+ * @brief Parses encoding settings, as comma-separated options among
+ *        "q=<1-100>", "strip", "progressive", "baseline",
+ *        "subsample=<auto|on|off>", "optimize" and "default".
+ *
+ * @param spec The settings, e.g. "q=60,strip,optimize".
+ * @param encoding Where to put the ENC_* bits.
+ * @return ERR_NONE, or ERR_INVALID_ARGUMENT if spec is malformed.
+ */
+int encoding_parse(const char* spec, uint16_t* encoding);
+
+/**
+ * @brief Describes encoding settings in the format of encoding_parse().
+ *
+ * @param encoding The ENC_* bits.
+ * @param out The description, of at least MAX_ENCODING_STR + 1 bytes.
+ */
+void encoding_to_string(uint16_t encoding, char* out);
+
 /**
  * @brief Open imgFS file, read the header and all the metadata.
  *
@@ -157,6 +196,29 @@ int do_delete(const char* img_id, struct imgfs_file* imgfs_file);
  */
 int resolution_atoi(const char* resolution);
 
+/**
+ * @brief Transforms format string to its int value.
+ *
+ * @param format The format string. Shall be "jpeg", "jpg", "webp" or "avif".
+ * @return The corresponding value or -1 if error.
+ */
+int format_atoi(const char* format);
+
+/**
+ * @brief Gives the name of a format ("jpeg", "webp" or "avif"), which is
+ *        also its file extension.
+ *
+ * @return The name, or NULL if format is not valid.
+ */
+const char* format_name(int format);
+
+/**
+ * @brief Gives the MIME type of a format (e.g. "image/webp").
+ *
+ * @return The MIME type, or NULL if format is not valid.
+ */
+const char* format_mime_type(int format);
+
 /**
  * @brief Reads the content of an image from a imgFS.
  *
@@ -170,6 +232,18 @@ int resolution_atoi(const char* resolution);
 int do_read(const char* img_id, int resolution, char** image_buffer,
             uint32_t* image_size, struct imgfs_file* imgfs_file);
 
+/**
+ * @brief Reads the content of an image from a imgFS, in a given format.
+ *
+ * Same as do_read() for FORMAT_JPEG. The other formats exist only for the
+ * resized resolutions; they are created on first read, as JPEG ones are.
+ *
+ * @param format The desired format (FORMAT_*).
+ * @return Some error code. 0 if no error.
+ */
+int do_read_format(const char* img_id, int resolution, int format, char** image_buffer,
+                   uint32_t* image_size, struct imgfs_file* imgfs_file);
+
 /**
  * @brief Insert image in the imgFS file
  *
@@ -181,6 +255,18 @@ int do_read(const char* img_id, int resolution, char** image_buffer,
 int do_insert(const char* image_buffer, size_t image_size,
               const char* img_id, struct imgfs_file* imgfs_file);
 
+/* Options of do_insert_flags() */
+#define INSERT_OPTIMIZE 0x1 // recompress the original losslessly (image_optimize.h)
+
+/**
+ * @brief Same as do_insert(), with options.
+ *
+ * @param flags The INSERT_* options.
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_flags(const char* image_buffer, size_t image_size,
+                    const char* img_id, struct imgfs_file* imgfs_file, unsigned flags);
+
 /**
  * @brief Removes the deleted images by moving the existing ones
  *
@@ -0,0 +1,640 @@
+/**
+ * @file imgfs_client.c
+ * @brief Client library of the imgFS server (see imgfs_client.h).
+ *
+ * A connection runs its requests with one poll() loop: it sends while
+ * fewer than pipeline_depth requests wait for their response and the
+ * socket takes more, and reads the responses as they come, so that a
+ * large request and a large response cannot wait for each other. The
+ * header of a response is looked at before being taken from the socket
+ * (MSG_PEEK), so that not a byte of the body is read before its buffer is
+ * known.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "imgfs_client.h"
+#include "imgfs.h" // for MAX_IMG_ID, *_RES
+#include "http_prot.h"
+#include "http_net.h" // for MAX_HEADER_SIZE
+#include "socket_layer.h"
+#include "error.h"
+#include "util.h" // for MIN
+
+#define REQUEST_HEAD_SIZE (512 + 3 * MAX_IMG_ID)
+#define ERROR_TEXT_SIZE 256 // of an error replied, "Error: <message>"
+#define DISCARD_SIZE (64 * 1024)
+
+struct imgfs_client {
+    char host[256];
+    uint16_t port;
+    char unix_path[108]; // sizeof(sun_path); empty for TCP
+    unsigned max_connections;
+    _Atomic unsigned pipeline_depth; // 1 once the server is seen not to keep connections alive
+    unsigned timeout_ms;
+    int keep_alive;
+
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+    int* idle; // connections of the pool not in use
+    unsigned nb_idle;
+    unsigned nb_open;
+    _Atomic uint64_t reconnects;
+};
+
+/**
+ * @brief The requests given to a connection, and how far they went.
+ */
+struct exchange {
+    struct imgfs_request* requests;
+    size_t count;
+
+    // sending
+    size_t sent; // requests fully sent
+    char head[REQUEST_HEAD_SIZE]; // of the request being sent
+    size_t head_size;
+    size_t offset; // in the head and body of the request being sent
+
+    // receiving
+    size_t answered; // responses fully read
+    char response[MAX_HEADER_SIZE + 1]; // header of the response being read
+    size_t response_filled; // bytes of it taken from the socket
+    int in_body;
+    size_t body_size;
+    size_t body_read;
+    char error_text[ERROR_TEXT_SIZE];
+    int server_closes; // the last response did not keep the connection alive
+    int started; // some bytes of the response being read were received
+};
+
+static char discard[DISCARD_SIZE]; // bodies nobody wants; never read
+
+/********************************************************************
+ * Pool
+ */
+
+static int connect_server(struct imgfs_client* client)
+{
+    return client->unix_path[0] != '\0' ? unix_connect(client->unix_path)
+           : tcp_connect(client->host, client->port);
+}
+
+/**
+ * @brief Takes a connection of the pool, or opens one if the pool is not
+ *        full, or waits for one.
+ *
+ * @param reused Set to 1 if the connection was used before.
+ * @return The connection, or ERR_IO.
+ */
+static int take_connection(struct imgfs_client* client, int* reused)
+{
+    pthread_mutex_lock(&client->lock);
+    while (client->nb_idle == 0 && client->nb_open >= client->max_connections) {
+        pthread_cond_wait(&client->released, &client->lock);
+    }
+    if (client->nb_idle > 0) {
+        const int fd = client->idle[--client->nb_idle];
+        pthread_mutex_unlock(&client->lock);
+        *reused = 1;
+        return fd;
+    }
+    ++client->nb_open;
+    pthread_mutex_unlock(&client->lock);
+
+    *reused = 0;
+    const int fd = connect_server(client);
+    if (fd < 0) {
+        pthread_mutex_lock(&client->lock);
+        --client->nb_open;
+        pthread_cond_signal(&client->released);
+        pthread_mutex_unlock(&client->lock);
+        return ERR_IO;
+    }
+    return fd;
+}
+
+/**
+ * @brief Gives a connection back to the pool, or closes it if it cannot
+ *        be used again.
+ */
+static void release_connection(struct imgfs_client* client, int fd, int reusable)
+{
+    pthread_mutex_lock(&client->lock);
+    if (reusable && client->keep_alive) {
+        client->idle[client->nb_idle++] = fd;
+    } else {
+        close(fd);
+        --client->nb_open;
+    }
+    pthread_cond_signal(&client->released);
+    pthread_mutex_unlock(&client->lock);
+}
+
+int imgfs_client_open(const struct imgfs_client_config* config, struct imgfs_client** client)
+{
+    M_REQUIRE_NON_NULL(config);
+    M_REQUIRE_NON_NULL(client);
+    const char* const host = config->host != NULL ? config->host : "localhost";
+    if (strlen(host) >= sizeof((*client)->host) || config->max_connections > CLIENT_MAX_CONNECTIONS
+        || (config->unix_path == NULL && config->port == 0)
+        || (config->unix_path != NULL && strlen(config->unix_path) >= sizeof((*client)->unix_path))) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_client* const c = calloc(1, sizeof(*c));
+    if (c == NULL) return ERR_OUT_OF_MEMORY;
+    strcpy(c->host, host);
+    c->port = config->port;
+    if (config->unix_path != NULL) strcpy(c->unix_path, config->unix_path);
+    c->max_connections = config->max_connections > 0 ? config->max_connections : CLIENT_DEFAULT_CONNECTIONS;
+    c->keep_alive = !config->no_keep_alive;
+    atomic_init(&c->pipeline_depth, !c->keep_alive ? 1
+                : config->pipeline_depth > 0 ? config->pipeline_depth : CLIENT_DEFAULT_PIPELINE_DEPTH);
+    c->timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : CLIENT_DEFAULT_TIMEOUT_MS;
+    atomic_init(&c->reconnects, 0);
+
+    c->idle = calloc(c->max_connections, sizeof(int));
+    if (c->idle == NULL) {
+        free(c);
+        return ERR_OUT_OF_MEMORY;
+    }
+    if (pthread_mutex_init(&c->lock, NULL) != 0 || pthread_cond_init(&c->released, NULL) != 0) {
+        free(c->idle);
+        free(c);
+        return ERR_THREADING;
+    }
+    *client = c;
+    return ERR_NONE;
+}
+
+void imgfs_client_close(struct imgfs_client* client)
+{
+    if (client == NULL) return;
+    for (unsigned i = 0; i < client->nb_idle; ++i) close(client->idle[i]);
+    pthread_cond_destroy(&client->released);
+    pthread_mutex_destroy(&client->lock);
+    free(client->idle);
+    free(client);
+}
+
+uint64_t imgfs_client_reconnects(struct imgfs_client* client)
+{
+    return client == NULL ? 0 : atomic_load(&client->reconnects);
+}
+
+/********************************************************************
+ * Requests
+ */
+
+/**
+ * @brief Whether an image id can go in a URI as is (the server does not
+ *        decode them).
+ */
+static int valid_img_id(const char* img_id)
+{
+    if (img_id == NULL || img_id[0] == '\0' || strlen(img_id) > MAX_IMG_ID) return 0;
+    for (const char* c = img_id; *c != '\0'; ++c) {
+        if (*c <= ' ' || *c == '&' || *c == '#' || *c == '?' || *c == '%' || *c == 0x7f) return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Writes the request line and headers of a request.
+ *
+ * @return The size of the head, or some (negative) error code.
+ */
+static int format_request(const struct imgfs_client* client, const struct imgfs_request* r,
+                          char* head, size_t size)
+{
+    static const char* const resolutions[NB_RES] = { "thumb", "small", "orig" };
+    const char* const connection = client->keep_alive ? "keep-alive" : "close";
+    if (r->op != CLIENT_LIST && !valid_img_id(r->img_id)) return ERR_INVALID_IMGID;
+
+    int len = -1;
+    switch (r->op) {
+    case CLIENT_LIST:
+        len = snprintf(head, size, "GET /imgfs/list HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+                       client->host, connection);
+        break;
+    case CLIENT_READ:
+        if (r->resolution < 0 || r->resolution >= NB_RES) return ERR_RESOLUTIONS;
+        len = snprintf(head, size, "GET /imgfs/read?res=%s&img_id=%s HTTP/1.1\r\n"
+                       "Host: %s\r\nConnection: %s\r\n\r\n",
+                       resolutions[r->resolution], r->img_id, client->host, connection);
+        break;
+    case CLIENT_INSERT:
+        if (r->image == NULL || r->image_size == 0) return ERR_INVALID_ARGUMENT;
+        len = snprintf(head, size, "POST /imgfs/insert?name=%s HTTP/1.1\r\n"
+                       "Host: %s\r\nConnection: %s\r\nContent-Length: %zu\r\n\r\n",
+                       r->img_id, client->host, connection, r->image_size);
+        break;
+    case CLIENT_DELETE:
+        len = snprintf(head, size, "GET /imgfs/delete?img_id=%s HTTP/1.1\r\n"
+                       "Host: %s\r\nConnection: %s\r\n\r\n",
+                       r->img_id, client->host, connection);
+        break;
+    default:
+        return ERR_INVALID_COMMAND;
+    }
+    return len < 0 || (size_t) len >= size ? ERR_INVALID_ARGUMENT : len;
+}
+
+/**
+ * @brief The error of a response: none for 2xx and 3xx, the one the
+ *        server replied ("Error: <message>") if known.
+ */
+static int response_error(int status, const char* text)
+{
+    if (status / 100 == 2 || status / 100 == 3) return ERR_NONE;
+    static const char prefix[] = "Error: ";
+    if (strncmp(text, prefix, strlen(prefix)) == 0) {
+        const char* const message = text + strlen(prefix);
+        const size_t len = strcspn(message, "\n");
+        for (int err = ERR_FIRST + 1; err < ERR_LAST; ++err) {
+            if (strlen(ERR_MSG(err)) == len && strncmp(ERR_MSG(err), message, len) == 0) return err;
+        }
+    }
+    return status / 100 == 4 ? ERR_INVALID_ARGUMENT : ERR_IO;
+}
+
+/********************************************************************
+ * Exchange on one connection
+ */
+
+/**
+ * @brief Passes over the invalid requests, which get no response.
+ */
+static void skip_unsent(struct exchange* x)
+{
+    while (x->answered < x->sent && x->requests[x->answered].status < 0) ++x->answered;
+}
+
+/**
+ * @brief Sends what the socket takes of the requests.
+ *
+ * @return Some error code. 0 if no error (even if nothing was sent).
+ */
+static int send_some(struct imgfs_client* client, int fd, struct exchange* x)
+{
+    struct imgfs_request* const r = &x->requests[x->sent];
+    if (x->head_size == 0) {
+        const int len = format_request(client, r, x->head, sizeof(x->head));
+        if (len < 0) {
+            // not sent, and so not answered: the others go on
+            r->err = len;
+            r->status = -1;
+            ++x->sent;
+            skip_unsent(x);
+            return ERR_NONE;
+        }
+        x->head_size = (size_t) len;
+        x->offset = 0;
+    }
+
+    const size_t body_size = r->op == CLIENT_INSERT ? r->image_size : 0;
+    struct iovec parts[2];
+    int nb_parts = 0;
+    if (x->offset < x->head_size) {
+        parts[nb_parts].iov_base = x->head + x->offset;
+        parts[nb_parts++].iov_len = x->head_size - x->offset;
+    }
+    if (body_size > 0) {
+        const size_t body_offset = x->offset > x->head_size ? x->offset - x->head_size : 0;
+        parts[nb_parts].iov_base = (char*) (uintptr_t) r->image + body_offset;
+        parts[nb_parts++].iov_len = body_size - body_offset;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = parts;
+    msg.msg_iovlen = (size_t) nb_parts;
+    const ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? ERR_NONE : ERR_IO;
+
+    x->offset += (size_t) sent;
+    if (x->offset == x->head_size + body_size) {
+        ++x->sent;
+        x->head_size = 0;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Takes the header of a response from the socket once complete,
+ *        and no byte more.
+ *
+ * @return 1 once the header is taken, 0 if it is not complete yet, or
+ *         some error code (ERR_IO if the connection was closed).
+ */
+static int receive_header(int fd, struct exchange* x)
+{
+    const size_t room = sizeof(x->response) - 1 - x->response_filled;
+    if (room == 0) return ERR_INVALID_ARGUMENT; // too large a header
+    const ssize_t peeked = recv(fd, x->response + x->response_filled, room, MSG_PEEK | MSG_DONTWAIT);
+    if (peeked == 0) return ERR_IO;
+    if (peeked < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : ERR_IO;
+    x->started = 1;
+
+    const size_t filled = x->response_filled + (size_t) peeked;
+    x->response[filled] = '\0';
+    // the end of the header may straddle what was taken and what was peeked
+    const size_t from = x->response_filled >= 3 ? x->response_filled - 3 : 0;
+    const char* const end = strstr(x->response + from, HTTP_HDR_END_DELIM);
+    const size_t header_size = end != NULL ? (size_t) (end - x->response) + strlen(HTTP_HDR_END_DELIM)
+                               : filled;
+
+    // takes it all, or all of what was peeked, which is header only
+    const size_t take = header_size - x->response_filled;
+    const ssize_t got = recv(fd, x->response + x->response_filled, take, MSG_DONTWAIT);
+    if (got != (ssize_t) take) return ERR_IO;
+    x->response_filled = header_size;
+    x->response[header_size] = '\0';
+    return end != NULL;
+}
+
+/**
+ * @brief Sets the request of the response whose header was received up,
+ *        for its body.
+ */
+static int start_body(struct exchange* x)
+{
+    struct imgfs_request* const r = &x->requests[x->answered];
+    struct http_message message;
+    int status = 0;
+    size_t content_len = 0;
+    if (http_parse_response(x->response, &message, &status, &content_len) != 1) return ERR_IO;
+
+    const struct http_string* const connection = http_get_header(&message, "Connection");
+    x->server_closes = connection == NULL || connection->len != strlen("keep-alive")
+                       || strncasecmp(connection->val, "keep-alive", connection->len) != 0;
+    r->status = status;
+    r->body_size = content_len;
+    x->in_body = 1;
+    x->body_size = content_len;
+    x->body_read = 0;
+    x->error_text[0] = '\0';
+    return ERR_NONE;
+}
+
+/**
+ * @brief Ends the response being read.
+ */
+static void end_response(struct exchange* x)
+{
+    struct imgfs_request* const r = &x->requests[x->answered];
+    r->err = response_error(r->status, x->error_text);
+    if (r->err == ERR_NONE && r->body != NULL && r->body_size > r->body_capacity) {
+        r->err = ERR_OUT_OF_MEMORY;
+    }
+    if (r->err != ERR_NONE && r->status / 100 != 2) r->body_size = 0;
+    ++x->answered;
+    x->in_body = 0;
+    x->started = 0;
+    x->response_filled = 0;
+    skip_unsent(x);
+}
+
+/**
+ * @brief Reads what came of the responses: the bodies go to the buffers
+ *        of their requests (those of the errors, to error_text).
+ *
+ * @return Some error code (ERR_IO if the connection was closed). 0 if no error.
+ */
+static int receive_some(int fd, struct exchange* x)
+{
+    for (;;) {
+        if (x->answered == x->count || (x->answered > 0 && x->server_closes && !x->in_body)) {
+            return ERR_NONE;
+        }
+        if (!x->in_body) {
+            const int ret = receive_header(fd, x);
+            if (ret <= 0) return ret;
+            const int err = start_body(x);
+            if (err != ERR_NONE) return err;
+        }
+
+        struct imgfs_request* const r = &x->requests[x->answered];
+        while (x->body_read < x->body_size) {
+            const size_t left = x->body_size - x->body_read;
+            char* target = discard;
+            size_t room = MIN(left, sizeof(discard));
+            if (r->status / 100 == 2 && r->body != NULL && x->body_read < r->body_capacity) {
+                target = (char*) r->body + x->body_read;
+                room = MIN(left, r->body_capacity - x->body_read);
+            } else if (r->status >= 400 && x->body_read < sizeof(x->error_text) - 1) {
+                target = x->error_text + x->body_read;
+                room = MIN(left, sizeof(x->error_text) - 1 - x->body_read);
+            }
+            const ssize_t got = recv(fd, target, room, MSG_DONTWAIT);
+            if (got == 0) return ERR_IO;
+            if (got < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? ERR_NONE : ERR_IO;
+            if (target == x->error_text + x->body_read) x->error_text[x->body_read + (size_t) got] = '\0';
+            x->body_read += (size_t) got;
+        }
+        end_response(x);
+    }
+}
+
+/**
+ * @brief Runs requests on a connection, until all are answered, the
+ *        server closes it, or it fails.
+ *
+ * @return Some error code. 0 if no error (all answered, or the server
+ *         announced it closes the connection).
+ */
+static int exchange_on(struct imgfs_client* client, int fd, struct exchange* x)
+{
+    while (x->answered < x->count) {
+        if (x->server_closes && !x->in_body && x->answered > 0) return ERR_NONE;
+        const unsigned depth = atomic_load(&client->pipeline_depth);
+        const int can_send = x->sent < x->count && x->sent - x->answered < depth && !x->server_closes;
+        struct pollfd pfd = { fd, (short) (POLLIN | (can_send ? POLLOUT : 0)), 0 };
+        const int ready = poll(&pfd, 1, (int) client->timeout_ms);
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready <= 0) return ERR_IO; // timed out
+
+        if (pfd.revents & POLLOUT) {
+            const int err = send_some(client, fd, x);
+            if (err != ERR_NONE) return err;
+        }
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            const int err = receive_some(fd, x);
+            if (err != ERR_NONE) return err;
+        }
+    }
+    return ERR_NONE;
+}
+
+int imgfs_client_run(struct imgfs_client* client, struct imgfs_request* requests, size_t count)
+{
+    M_REQUIRE_NON_NULL(client);
+    M_REQUIRE_NON_NULL(requests);
+    for (size_t i = 0; i < count; ++i) {
+        requests[i].status = 0;
+        requests[i].body_size = 0;
+        requests[i].err = ERR_IO;
+    }
+
+    struct exchange* const x = malloc(sizeof(*x));
+    if (x == NULL) return ERR_OUT_OF_MEMORY;
+    int first_err = ERR_NONE;
+    size_t done = 0;
+    while (done < count) {
+        int reused = 0;
+        const int fd = take_connection(client, &reused);
+        if (fd < 0) {
+            first_err = fd;
+            break;
+        }
+
+        memset(x, 0, offsetof(struct exchange, response));
+        x->response_filled = 0;
+        x->in_body = 0;
+        x->server_closes = 0;
+        x->started = 0;
+        x->requests = requests + done;
+        x->count = count - done;
+        const int err = exchange_on(client, fd, x);
+        done += x->answered;
+        release_connection(client, fd, err == ERR_NONE && !x->server_closes);
+        if (done == count) break;
+
+        if (err == ERR_NONE) {
+            // the server closes connections after each response: no pipelining then
+            atomic_store(&client->pipeline_depth, 1);
+            atomic_fetch_add(&client->reconnects, 1);
+        } else if (reused && x->answered == 0 && !x->started && err == ERR_IO) {
+            // closed by the server while idle: the requests were not served
+            atomic_fetch_add(&client->reconnects, 1);
+        } else if (err == ERR_IO && x->answered > 0 && !x->started) {
+            // closed after some responses: the next request may not have been served
+            requests[done].err = ERR_IO;
+            if (first_err == ERR_NONE) first_err = ERR_IO;
+            ++done;
+        } else {
+            // a failed connection: the others are not sent
+            for (size_t i = done; i < count; ++i) requests[i].err = err;
+            if (first_err == ERR_NONE) first_err = err;
+            break;
+        }
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (requests[i].status < 0) requests[i].status = 0;
+    }
+    free(x);
+    return first_err;
+}
+
+/********************************************************************
+ * Helpers
+ */
+
+static void request_init(struct imgfs_request* r, enum client_op op, const char* img_id)
+{
+    memset(r, 0, sizeof(*r));
+    r->op = op;
+    r->img_id = img_id;
+}
+
+int imgfs_client_list(struct imgfs_client* client, char* json, size_t capacity, size_t* size)
+{
+    M_REQUIRE_NON_NULL(json);
+    M_REQUIRE_NON_NULL(size);
+    if (capacity == 0) return ERR_INVALID_ARGUMENT;
+    struct imgfs_request r;
+    request_init(&r, CLIENT_LIST, NULL);
+    r.body = json;
+    r.body_capacity = capacity - 1;
+    const int err = imgfs_client_run(client, &r, 1);
+    *size = r.body_size;
+    json[MIN(r.body_size, capacity - 1)] = '\0';
+    return err != ERR_NONE ? err : r.err;
+}
+
+int imgfs_client_read(struct imgfs_client* client, const char* img_id, int resolution,
+                      void* image, size_t capacity, size_t* size)
+{
+    M_REQUIRE_NON_NULL(image);
+    M_REQUIRE_NON_NULL(size);
+    struct imgfs_request r;
+    request_init(&r, CLIENT_READ, img_id);
+    r.resolution = resolution;
+    r.body = image;
+    r.body_capacity = capacity;
+    const int err = imgfs_client_run(client, &r, 1);
+    *size = r.body_size;
+    return err != ERR_NONE ? err : r.err;
+}
+
+int imgfs_client_insert(struct imgfs_client* client, const char* img_id, const void* image, size_t size)
+{
+    struct imgfs_request r;
+    request_init(&r, CLIENT_INSERT, img_id);
+    r.image = image;
+    r.image_size = size;
+    const int err = imgfs_client_run(client, &r, 1);
+    return err != ERR_NONE ? err : r.err;
+}
+
+int imgfs_client_delete(struct imgfs_client* client, const char* img_id)
+{
+    struct imgfs_request r;
+    request_init(&r, CLIENT_DELETE, img_id);
+    const int err = imgfs_client_run(client, &r, 1);
+    return err != ERR_NONE ? err : r.err;
+}
+
+/**
+ * @brief Runs the requests of a batch, and gives each item its result.
+ */
+static int run_batch(struct imgfs_client* client, struct imgfs_request* requests,
+                     struct imgfs_batch_item* items, size_t count)
+{
+    int err = imgfs_client_run(client, requests, count);
+    for (size_t i = 0; i < count; ++i) {
+        items[i].err = requests[i].err;
+        if (requests[i].op == CLIENT_READ) items[i].size = requests[i].body_size;
+        if (err == ERR_NONE) err = requests[i].err;
+    }
+    free(requests);
+    return err;
+}
+
+int imgfs_client_read_batch(struct imgfs_client* client, int resolution,
+                            struct imgfs_batch_item* items, size_t count)
+{
+    M_REQUIRE_NON_NULL(items);
+    struct imgfs_request* const requests = calloc(count > 0 ? count : 1, sizeof(*requests));
+    if (requests == NULL) return ERR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < count; ++i) {
+        request_init(&requests[i], CLIENT_READ, items[i].img_id);
+        requests[i].resolution = resolution;
+        requests[i].body = items[i].data;
+        requests[i].body_capacity = items[i].size;
+    }
+    return run_batch(client, requests, items, count);
+}
+
+int imgfs_client_insert_batch(struct imgfs_client* client, struct imgfs_batch_item* items, size_t count)
+{
+    M_REQUIRE_NON_NULL(items);
+    struct imgfs_request* const requests = calloc(count > 0 ? count : 1, sizeof(*requests));
+    if (requests == NULL) return ERR_OUT_OF_MEMORY;
+    for (size_t i = 0; i < count; ++i) {
+        request_init(&requests[i], CLIENT_INSERT, items[i].img_id);
+        requests[i].image = items[i].data;
+        requests[i].image_size = items[i].size;
+    }
+    return run_batch(client, requests, items, count);
+}
@@ -0,0 +1,157 @@
+/**
+ * @file imgfs_client.h
+ * @brief Client library of the imgFS server.
+ *
+ * A client keeps a pool of connections to one server, on TCP or on its
+ * Unix domain socket (IMGFS_UNIX_SOCKET), kept alive between requests.
+ * The requests given together are pipelined on one connection: up to
+ * pipeline_depth of them are sent before their responses are read. The
+ * body of a response is read straight into the buffer of its request.
+ *
+ * A connection the server closed while idle is replaced, and the requests
+ * sent on it again; a request whose response was cut short fails with
+ * ERR_IO. The error a server replies ("500", "Error: <message>") is given
+ * back as its code. A client may be used by several threads at once: each
+ * takes a connection of the pool (or waits for one) for its requests.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint16_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CLIENT_DEFAULT_CONNECTIONS 4
+#define CLIENT_DEFAULT_PIPELINE_DEPTH 16
+#define CLIENT_DEFAULT_TIMEOUT_MS 30000
+#define CLIENT_MAX_CONNECTIONS 1024
+
+/**
+ * @brief Where and how to connect; the fields left at 0 take their default.
+ */
+struct imgfs_client_config {
+    const char* host; // "localhost" by default
+    uint16_t port;
+    const char* unix_path; // Unix domain socket of the server, instead of host:port
+    unsigned max_connections; // in the pool
+    unsigned pipeline_depth; // requests sent on a connection before their responses are read
+    unsigned timeout_ms; // for a response to come
+    int no_keep_alive; // a connection per request, closed by the server after it
+};
+
+enum client_op {
+    CLIENT_LIST,
+    CLIENT_READ,
+    CLIENT_INSERT,
+    CLIENT_DELETE
+};
+
+/**
+ * @brief A request, and its response once run.
+ */
+struct imgfs_request {
+    enum client_op op;
+    const char* img_id; // read, insert, delete
+    int resolution; // read: THUMB_RES, SMALL_RES or ORIG_RES
+    const void* image; // insert
+    size_t image_size;
+    void* body; // where the body of the response goes, NULL to drop it
+    size_t body_capacity;
+
+    // set once run
+    int status; // HTTP status, 0 if no response
+    size_t body_size; // of the response, even if more than body_capacity
+    int err; // ERR_NONE, the error replied, ERR_OUT_OF_MEMORY if the body did not fit, or ERR_IO
+};
+
+/**
+ * @brief An image of a batch.
+ */
+struct imgfs_batch_item {
+    const char* img_id;
+    void* data; // read: where the image goes; insert: the image
+    size_t size; // read: the capacity of data, then the size of the image; insert: its size
+    int err; // set once run
+};
+
+struct imgfs_client;
+
+/**
+ * @brief Creates a client; no connection is made before the first request.
+ *
+ * @param config Where and how to connect.
+ * @param client Set to the client, to be closed with imgfs_client_close().
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_client_open(const struct imgfs_client_config* config, struct imgfs_client** client);
+
+/**
+ * @brief Closes the connections of a client and frees it (does nothing if NULL).
+ */
+void imgfs_client_close(struct imgfs_client* client);
+
+/**
+ * @brief Runs requests, pipelined on one connection of the pool, and sets
+ *        their status, body_size and err.
+ *
+ * @return ERR_NONE if every request got a response (which may be an
+ *         error, see their err), the error of the first one that did not
+ *         otherwise.
+ */
+int imgfs_client_run(struct imgfs_client* client, struct imgfs_request* requests, size_t count);
+
+/**
+ * @brief How many times a request was sent again, on a new connection,
+ *        because the server had closed the one it was sent on.
+ */
+uint64_t imgfs_client_reconnects(struct imgfs_client* client);
+
+/**
+ * @brief Lists the images, as the JSON the server replies, NUL-terminated.
+ *
+ * @param size Set to the size of the JSON, even if more than capacity - 1.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_client_list(struct imgfs_client* client, char* json, size_t capacity, size_t* size);
+
+/**
+ * @brief Reads an image into image, of capacity bytes.
+ *
+ * @param size Set to the size of the image, even if more than capacity
+ *             (then ERR_OUT_OF_MEMORY).
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_client_read(struct imgfs_client* client, const char* img_id, int resolution,
+                      void* image, size_t capacity, size_t* size);
+
+/**
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_client_insert(struct imgfs_client* client, const char* img_id, const void* image, size_t size);
+
+/**
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_client_delete(struct imgfs_client* client, const char* img_id);
+
+/**
+ * @brief Reads images at a resolution, pipelined; each item gets its err.
+ *
+ * @return ERR_NONE if all were read, the first error otherwise.
+ */
+int imgfs_client_read_batch(struct imgfs_client* client, int resolution,
+                            struct imgfs_batch_item* items, size_t count);
+
+/**
+ * @brief Inserts images, pipelined; each item gets its err.
+ *
+ * @return ERR_NONE if all were inserted, the first error otherwise.
+ */
+int imgfs_client_insert_batch(struct imgfs_client* client, struct imgfs_batch_item* items, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,6 +30,7 @@ int do_delete(const char *imgID, struct imgfs_file *imgfs_file)
     for (uint32_t i = 0; i < imgfs_file->header.max_files; i++) {
         if (imgfs_file->metadata[i].is_valid && strcmp(imgfs_file->metadata[i].img_id, imgID) == 0) {
             imgfs_file->metadata[i].is_valid = EMPTY; // Mark the image as deleted
+            imgfs_file->metadata[i].version = imgfs_file->header.version + 1;
             fseek(imgfs_file->file,sizeof(struct imgfs_header)+sizeof(struct img_metadata) * i, SEEK_SET);
             if (fwrite(&imgfs_file->metadata[i], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
                 return ERR_IO;
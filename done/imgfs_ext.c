@@ -0,0 +1,258 @@
+/**
+ * @file imgfs_ext.c
+ * @brief Extension table of an imgFS (see imgfs_ext.h).
+ */
+
+#include "imgfs_ext.h"
+#include "error.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CONVERT_CHUNK 4096 // records converted at once when loading an older table
+
+struct loaded_ext {
+    const struct imgfs_file* owner;
+    const FILE* file;          // to detect a table left over by a missing do_close()
+    uint32_t disk_record_size; // size of the records in the imgFS file
+    struct imgfs_ext_record* records;
+    struct loaded_ext* next;
+};
+
+static struct loaded_ext* loaded = NULL;
+static pthread_mutex_t loaded_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Finds the table loaded for an imgFS; the caller holds loaded_lock.
+ */
+static struct loaded_ext* find_loaded(const struct imgfs_file* imgfs_file)
+{
+    for (struct loaded_ext* ext = loaded; ext != NULL; ext = ext->next) {
+        if (ext->owner == imgfs_file) return ext;
+    }
+    return NULL;
+}
+
+static void unlink_loaded(const struct imgfs_file* imgfs_file)
+{
+    pthread_mutex_lock(&loaded_lock);
+    for (struct loaded_ext** p = &loaded; *p != NULL; p = &(*p)->next) {
+        if ((*p)->owner == imgfs_file) {
+            struct loaded_ext* const ext = *p;
+            *p = ext->next;
+            free(ext->records);
+            free(ext);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loaded_lock);
+}
+
+/**
+ * @brief Appends the whole table at the end of the imgFS file, then points
+ *        the header to it.
+ */
+static int write_table(struct imgfs_file* imgfs_file, struct loaded_ext* ext)
+{
+    struct imgfs_ext_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, IMGFS_EXT_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct imgfs_ext_record);
+    header.nb_records = imgfs_file->header.max_files;
+
+    if (fseek(imgfs_file->file, 0L, SEEK_END) != 0) return ERR_IO;
+    const long offset = ftell(imgfs_file->file);
+    if (offset <= 0) return ERR_IO;
+    if (fwrite(&header, sizeof(header), 1, imgfs_file->file) != 1
+        || fwrite(ext->records, sizeof(struct imgfs_ext_record), header.nb_records,
+                  imgfs_file->file) != header.nb_records) {
+        return ERR_IO;
+    }
+
+    imgfs_file->header.ext_offset = (uint64_t) offset;
+    if (fseek(imgfs_file->file, 0L, SEEK_SET) != 0
+        || fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    ext->disk_record_size = header.record_size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the table of the imgFS file, converting older records.
+ */
+static int read_table(const struct imgfs_file* imgfs_file, struct loaded_ext* ext)
+{
+    struct imgfs_ext_header header;
+    if (fseek(imgfs_file->file, (long) imgfs_file->header.ext_offset, SEEK_SET) != 0
+        || fread(&header, sizeof(header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    if (memcmp(header.magic, IMGFS_EXT_MAGIC, sizeof(header.magic)) != 0
+        || header.nb_records != imgfs_file->header.max_files || header.record_size == 0) {
+        return ERR_IO;
+    }
+    ext->disk_record_size = header.record_size;
+
+    if (header.record_size == sizeof(struct imgfs_ext_record)) {
+        return fread(ext->records, sizeof(struct imgfs_ext_record), header.nb_records,
+                     imgfs_file->file) == header.nb_records ? ERR_NONE : ERR_IO;
+    }
+
+    // written with other records: keep the fields both have
+    const size_t kept = header.record_size < sizeof(struct imgfs_ext_record)
+                        ? header.record_size : sizeof(struct imgfs_ext_record);
+    char* const chunk = malloc((size_t) CONVERT_CHUNK * header.record_size);
+    if (chunk == NULL) return ERR_OUT_OF_MEMORY;
+    int err = ERR_NONE;
+    for (uint32_t first = 0; first < header.nb_records && err == ERR_NONE; first += CONVERT_CHUNK) {
+        const uint32_t n = header.nb_records - first < CONVERT_CHUNK ? header.nb_records - first : CONVERT_CHUNK;
+        if (fread(chunk, header.record_size, n, imgfs_file->file) != n) {
+            err = ERR_IO;
+            break;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            memcpy(&ext->records[first + i], chunk + (size_t) i * header.record_size, kept);
+        }
+    }
+    free(chunk);
+    return err;
+}
+
+int imgfs_ext_get(struct imgfs_file* imgfs_file, int create, struct imgfs_ext_record** records)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(records);
+
+    pthread_mutex_lock(&loaded_lock);
+    struct loaded_ext* ext = find_loaded(imgfs_file);
+    pthread_mutex_unlock(&loaded_lock);
+    if (ext != NULL && ext->file == imgfs_file->file) {
+        *records = ext->records;
+        return ERR_NONE;
+    }
+    if (ext != NULL) unlink_loaded(imgfs_file);
+
+    *records = NULL;
+    if (imgfs_file->header.ext_offset == 0 && !create) return ERR_NONE;
+
+    ext = calloc(1, sizeof(struct loaded_ext));
+    if (ext == NULL) return ERR_OUT_OF_MEMORY;
+    ext->records = calloc(imgfs_file->header.max_files, sizeof(struct imgfs_ext_record));
+    if (ext->records == NULL) {
+        free(ext);
+        return ERR_OUT_OF_MEMORY;
+    }
+    ext->owner = imgfs_file;
+    ext->file = imgfs_file->file;
+
+    const int err = imgfs_file->header.ext_offset != 0 ? read_table(imgfs_file, ext)
+                    : write_table(imgfs_file, ext);
+    if (err != ERR_NONE) {
+        free(ext->records);
+        free(ext);
+        return err;
+    }
+
+    pthread_mutex_lock(&loaded_lock);
+    ext->next = loaded;
+    loaded = ext;
+    pthread_mutex_unlock(&loaded_lock);
+    *records = ext->records;
+    return ERR_NONE;
+}
+
+int imgfs_ext_store(struct imgfs_file* imgfs_file, size_t index)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (index >= imgfs_file->header.max_files) return ERR_INVALID_ARGUMENT;
+
+    pthread_mutex_lock(&loaded_lock);
+    struct loaded_ext* const ext = find_loaded(imgfs_file);
+    pthread_mutex_unlock(&loaded_lock);
+    if (ext == NULL || imgfs_file->header.ext_offset == 0) return ERR_INVALID_ARGUMENT;
+
+    // an older table is rewritten with the current records
+    if (ext->disk_record_size != sizeof(struct imgfs_ext_record)) return write_table(imgfs_file, ext);
+
+    const long offset = (long) (imgfs_file->header.ext_offset + sizeof(struct imgfs_ext_header)
+                                + index * sizeof(struct imgfs_ext_record));
+    if (fseek(imgfs_file->file, offset, SEEK_SET) != 0
+        || fwrite(&ext->records[index], sizeof(struct imgfs_ext_record), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int imgfs_ext_reset(struct imgfs_file* imgfs_file, size_t index, long from)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    if (index >= imgfs_file->header.max_files
+        || (from >= 0 && (size_t) from >= imgfs_file->header.max_files)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    if (imgfs_file->header.ext_offset == 0) return ERR_NONE; // no table
+
+    struct imgfs_ext_record* records = NULL;
+    const int err = imgfs_ext_get(imgfs_file, 0, &records);
+    if (err != ERR_NONE || records == NULL) return err;
+
+    if (from >= 0) {
+        records[index] = records[from];
+    } else {
+        memset(&records[index], 0, sizeof(struct imgfs_ext_record));
+    }
+    return imgfs_ext_store(imgfs_file, index);
+}
+
+int imgfs_ext_load(const struct imgfs_file* imgfs_file, struct imgfs_ext_record** records)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(records);
+
+    *records = NULL;
+    if (imgfs_file->header.ext_offset == 0) return ERR_NONE;
+
+    struct loaded_ext ext;
+    memset(&ext, 0, sizeof(ext));
+    ext.records = calloc(imgfs_file->header.max_files, sizeof(struct imgfs_ext_record));
+    if (ext.records == NULL) return ERR_OUT_OF_MEMORY;
+    const int err = read_table(imgfs_file, &ext);
+    if (err != ERR_NONE) {
+        free(ext.records);
+        return err;
+    }
+    *records = ext.records;
+    return ERR_NONE;
+}
+
+int imgfs_ext_adopt(const struct imgfs_file* imgfs_file, struct imgfs_ext_record* records)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+
+    unlink_loaded(imgfs_file);
+    if (records == NULL) return ERR_NONE;
+    struct loaded_ext* const ext = calloc(1, sizeof(struct loaded_ext));
+    if (ext == NULL) {
+        free(records);
+        return ERR_OUT_OF_MEMORY;
+    }
+    ext->owner = imgfs_file;
+    ext->file = imgfs_file->file;
+    ext->disk_record_size = sizeof(struct imgfs_ext_record); // as converted
+    ext->records = records;
+    pthread_mutex_lock(&loaded_lock);
+    ext->next = loaded;
+    loaded = ext;
+    pthread_mutex_unlock(&loaded_lock);
+    return ERR_NONE;
+}
+
+void imgfs_ext_release(const struct imgfs_file* imgfs_file)
+{
+    if (imgfs_file != NULL) unlink_loaded(imgfs_file);
+}
@@ -0,0 +1,108 @@
+/**
+ * @file imgfs_ext.h
+ * @brief Extension table of an imgFS: per-image data that does not fit in
+ *        struct img_metadata, whose layout is fixed.
+ *
+ * The table is created on first use and appended to the imgFS file; the
+ * header's ext_offset tells where it is (0 if there is none, as in every
+ * volume that never needed it). It has one record per metadata slot. Its
+ * header gives the size of the records, so that a table written with
+ * smaller records is still read (the missing fields are zero) and is
+ * moved to the end of the file the first time one of its records is
+ * written.
+ *
+ * struct imgfs_file cannot hold the table either, so the loaded tables
+ * are kept aside, by imgfs_file, until do_close().
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IMGFS_EXT_MAGIC "IMGFSEXT"
+
+struct imgfs_ext_header {
+    char magic[8];        // IMGFS_EXT_MAGIC, without the null terminator
+    uint32_t record_size; // sizeof(struct imgfs_ext_record) when written
+    uint32_t nb_records;  // imgfs_header.max_files
+};
+
+struct imgfs_ext_record {
+    // resized images in the formats other than JPEG (index: format - 1)
+    uint64_t alt_offset[NB_RES - 1][NB_FORMATS - 1];
+    uint32_t alt_size[NB_RES - 1][NB_FORMATS - 1];
+    // original recompressed by the lossless pass (image_optimize.h); 0 if not processed yet
+    uint32_t uploaded_size; // size as uploaded (img_metadata.SHA is that of the uploaded bytes)
+    unsigned char stored_SHA[SHA256_DIGEST_LENGTH]; // SHA of the stored bytes
+    uint32_t flags; // EXT_*
+    uint64_t phash; // perceptual hash of the thumbnail (image_phash.h), if EXT_PHASH
+};
+
+#define EXT_PHASH 0x1 // phash is set
+
+/**
+ * @brief Gets the extension table of an imgFS, loading it if needed.
+ *
+ * @param imgfs_file The imgFS, opened.
+ * @param create Whether to create the table if the imgFS has none.
+ * @param records Where to put the table (max_files records), or NULL if
+ *                the imgFS has none and create is 0.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_ext_get(struct imgfs_file* imgfs_file, int create, struct imgfs_ext_record** records);
+
+/**
+ * @brief Writes the record of an image to the imgFS file.
+ *
+ * @param imgfs_file The imgFS, whose table is loaded (imgfs_ext_get()).
+ * @param index The index of the image in the metadata array.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_ext_store(struct imgfs_file* imgfs_file, size_t index);
+
+/**
+ * @brief Resets the record of an image, or copies that of another one
+ *        (whose content it shares), if the imgFS has a table.
+ *
+ * @param imgfs_file The imgFS.
+ * @param index The index of the image in the metadata array.
+ * @param from The index of the image to copy, or -1 to reset.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_ext_reset(struct imgfs_file* imgfs_file, size_t index, long from);
+
+/**
+ * @brief Reads the extension table described by the header of an imgFS,
+ *        without keeping it as its loaded table (see imgfs_ext_adopt()).
+ *
+ * @param imgfs_file The imgFS, opened; only its file and header are used.
+ * @param records Where to put the table (max_files records, to be freed
+ *                by the caller), or NULL if the imgFS has none.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_ext_load(const struct imgfs_file* imgfs_file, struct imgfs_ext_record** records);
+
+/**
+ * @brief Makes a table read by imgfs_ext_load() the loaded table of an
+ *        imgFS, in place of the one loaded, if any. Not to be written.
+ *
+ * @param imgfs_file The imgFS.
+ * @param records The table, freed with the imgFS; NULL if it has none.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_ext_adopt(const struct imgfs_file* imgfs_file, struct imgfs_ext_record* records);
+
+/**
+ * @brief Frees the table loaded for an imgFS, if any (called by do_close()).
+ */
+void imgfs_ext_release(const struct imgfs_file* imgfs_file);
+
+#ifdef __cplusplus
+}
+#endif
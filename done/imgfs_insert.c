@@ -5,12 +5,68 @@
 
 #include "imgfs.h"
 #include "error.h"
+#include "trace.h"
 #include "image_content.h"
 #include "image_dedup.h"
+#include "image_optimize.h"
 #include "util.h"
 #include <openssl/sha.h>
+#include <stdlib.h>
 #include <string.h>
 
+/**
+ * @brief Writes a new image: its content, appended unless deduplicated,
+ *        then the header, with a new version, and its metadata.
+ *
+ * @param imgfs_file The imgFS file system.
+ * @param index The index of the image in the metadata array.
+ * @param stored The content to store.
+ * @param stored_size Its size in bytes.
+ * @return ERR_NONE if the function executed successfully, ERR_IO otherwise.
+ */
+static int write_image(struct imgfs_file* imgfs_file, uint32_t index, const char* stored, size_t stored_size)
+{
+    if (imgfs_file->metadata[index].offset[ORIG_RES] == 0) {
+
+        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
+            return ERR_IO;
+        }
+
+        long offset = ftell(imgfs_file->file);
+
+        if (offset == -1L) {
+            return ERR_IO;
+        }
+        imgfs_file->metadata[index].offset[ORIG_RES] = (uint64_t) offset;
+        if (fwrite(stored, stored_size, 1, imgfs_file->file) != 1) {
+            return ERR_IO;
+        }
+        // update the metadata
+        imgfs_file->metadata[index].size[ORIG_RES] = (uint32_t) stored_size;
+    }
+
+    // update header version
+    imgfs_file->header.version += 1;
+    imgfs_file->metadata[index].version = imgfs_file->header.version;
+
+    // Write the new header
+    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) {
+        return ERR_IO;
+    }
+    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+
+    // Write the new metadata
+    if (fseek(imgfs_file->file, sizeof(struct imgfs_header) + index * sizeof(struct img_metadata), SEEK_SET) != 0) {
+        return ERR_IO;
+    }
+    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
 /**
  * @brief Inserts an image into the imgFS file system.
  *
@@ -21,16 +77,19 @@
  * - Copies the image ID into the metadata.
  * - Stores the image size and original resolution (width and height) in the metadata.
  * - Calls the do_name_and_content_dedup() function to handle name and content deduplication.
- * - If the image is not a duplicate, writes the image content and metadata to the file.
+ * - If the image is not a duplicate, writes the image content and metadata to the file,
+ *   the content recompressed losslessly first if INSERT_OPTIMIZE is set and it gets smaller.
  *
  * @param image_buffer Pointer to the raw image content.
  * @param image_size Size of the image in bytes.
  * @param img_id Unique identifier for the image.
  * @param imgfs_file Pointer to the imgfs_file structure representing the imgFS file system.
+ * @param flags The INSERT_* options.
  * @return ERR_NONE if the function executed successfully.
  *         Returns other error codes in case of error. see 'error.h' for more details.
  */
-int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
+static int insert_image(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file,
+                        unsigned flags)
 {
     M_REQUIRE_NON_NULL(imgfs_file);
     M_REQUIRE_NON_NULL(img_id);
@@ -96,43 +155,43 @@ int do_insert(const char* image_buffer, size_t image_size, const char* img_id, s
         }
     }
 
-    if (imgfs_file->metadata[index].offset[ORIG_RES] == 0) {
-
-        if (fseek(imgfs_file->file, 0, SEEK_END) != 0) {
-            return ERR_IO;
-        }
-
-        long offset = ftell(imgfs_file->file);
-
-        if (offset == -1L) {
-            return ERR_IO;
-        }
-        imgfs_file->metadata[index].offset[ORIG_RES] = (uint64_t) offset;
-        if (fwrite(image_buffer, image_size, 1, imgfs_file->file) != 1) {
-            return ERR_IO;
-        }
-        // update the metadata
-        imgfs_file->metadata[index].size[ORIG_RES] = (uint32_t) image_size;
+    // the content to store, if recompressed (kept as uploaded if it cannot be)
+    unsigned char* optimized = NULL;
+    size_t optimized_size = 0;
+    const int optimize = (flags & INSERT_OPTIMIZE) != 0 && imgfs_file->metadata[index].offset[ORIG_RES] == 0;
+    if (optimize && (jpeg_optimize_lossless(image_buffer, image_size, &optimized, &optimized_size) != ERR_NONE
+                     || optimized_size >= image_size)) {
+        free(optimized);
+        optimized = NULL;
     }
+    const char* const stored = optimized != NULL ? (const char*) optimized : image_buffer;
+    const size_t stored_size = optimized != NULL ? optimized_size : image_size;
 
-    // update header version
-    imgfs_file->header.version += 1;
-
-    // Write the new header
-    if (fseek(imgfs_file->file, 0, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    if (fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
+    err = write_image(imgfs_file, index, stored, stored_size);
+    if (err == ERR_NONE && optimize) {
+        // Record the uploaded size and the SHA of what is stored
+        err = optimize_record(imgfs_file, index, (uint32_t) image_size, (const unsigned char*) stored, stored_size);
     }
+    free(optimized);
+    return err;
+}
 
-    // Write the new metadata
-    if (fseek(imgfs_file->file, sizeof(struct imgfs_header) + index * sizeof(struct img_metadata), SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    if (fwrite(&imgfs_file->metadata[index], sizeof(struct img_metadata), 1, imgfs_file->file) != 1) {
-        return ERR_IO;
-    }
+/**
+ * @brief Inserts an image with options (see insert_image()), traced.
+ */
+int do_insert_flags(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file,
+                    unsigned flags)
+{
+    const int span = trace_span_begin("do_insert");
+    const int err = insert_image(image_buffer, image_size, img_id, imgfs_file, flags);
+    trace_span_end(span);
+    return err;
+}
 
-    return ERR_NONE;
+/**
+ * @brief Inserts an image as uploaded.
+ */
+int do_insert(const char* image_buffer, size_t image_size, const char* img_id, struct imgfs_file* imgfs_file)
+{
+    return do_insert_flags(image_buffer, image_size, img_id, imgfs_file, 0);
 }
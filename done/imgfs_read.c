@@ -4,7 +4,9 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_ext.h"
 #include "error.h"
+#include "trace.h"
 #include "image_content.h"
 #include <stdlib.h>
 #include <string.h>
@@ -29,14 +31,16 @@ static long find_pos_by_id(struct imgfs_file* imgfs_file, const char* img_id)
 
 
 /**
- * @brief Reads an image from the imgFS file system at a given resolution.
+ * @brief Reads an image from the imgFS file system at a given resolution and format.
  *
  * This function finds the metadata entry for the given image ID, checks if the image exists
- * at the requested resolution, and if not, calls lazily_resize() to create it. The image
- * is then read into a dynamically allocated buffer.
+ * at the requested resolution and format, and if not, calls lazily_resize_format() to create
+ * it (or resize_transient() if the derivatives are not stored, see lazily_resize_store()).
+ * The image is then read into a dynamically allocated buffer.
  *
  * @param img_id The ID of the image to read.
  * @param resolution The resolution at which to read the image.
+ * @param format The format in which to read the image (FORMAT_*).
  * @param image_buffer Pointer to the buffer where the image will be stored.
  * @param image_size Pointer to the variable where the size of the image will be stored.
  * @param imgfs_file The imgFS file system from which to read the image.
@@ -44,7 +48,7 @@ static long find_pos_by_id(struct imgfs_file* imgfs_file, const char* img_id)
  *         Returns other error codes in case of error. see 'error.h' for more details.
  */
 
-int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+static int read_image(const char* img_id, int resolution, int format, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
 {
     M_REQUIRE_NON_NULL(img_id);
     M_REQUIRE_NON_NULL(image_buffer);
@@ -56,14 +60,42 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
 
     size_t position = (size_t) pos;
 
-    // call lazily resize if res doesn't already exist
-    if (resolution != ORIG_RES && (imgfs_file->metadata[position].offset[resolution] == 0 || imgfs_file->metadata[position].size[resolution] == EMPTY)) {
-        int err = lazily_resize(resolution, imgfs_file, position);
+    uint64_t offset = 0;
+    if (format != FORMAT_JPEG) {
+        // originals are only stored as JPEG
+        if (resolution == ORIG_RES || format < 0 || format >= NB_FORMATS) return ERR_INVALID_ARGUMENT;
+
+        if (!lazily_resize_stores()) {
+            struct imgfs_ext_record* records = NULL;
+            const int err = imgfs_ext_get(imgfs_file, 0, &records);
+            if (err != ERR_NONE) return err;
+            if (records == NULL || records[position].alt_size[resolution][format - 1] == 0) {
+                return resize_transient(resolution, format, imgfs_file, position, image_buffer, image_size);
+            }
+        }
+
+        // created (with the extension table) if it doesn't already exist
+        int err = lazily_resize_format(resolution, format, imgfs_file, position);
+        if (err != ERR_NONE) return err;
+        struct imgfs_ext_record* records = NULL;
+        err = imgfs_ext_get(imgfs_file, 0, &records);
         if (err != ERR_NONE) return err;
+        *image_size = records[position].alt_size[resolution][format - 1];
+        offset = records[position].alt_offset[resolution][format - 1];
+    } else {
+        // call lazily resize if res doesn't already exist
+        if (resolution != ORIG_RES && (imgfs_file->metadata[position].offset[resolution] == 0 || imgfs_file->metadata[position].size[resolution] == EMPTY)) {
+            if (!lazily_resize_stores()) {
+                return resize_transient(resolution, format, imgfs_file, position, image_buffer, image_size);
+            }
+            int err = lazily_resize(resolution, imgfs_file, position);
+            if (err != ERR_NONE) return err;
+        }
+        *image_size = imgfs_file->metadata[position].size[resolution];
+        offset = imgfs_file->metadata[position].offset[resolution];
     }
 
-    *image_size = imgfs_file->metadata[position].size[resolution];
-    if (fseek(imgfs_file->file, (long)imgfs_file->metadata[position].offset[resolution], SEEK_SET) != 0) return ERR_IO;
+    if (fseek(imgfs_file->file, (long) offset, SEEK_SET) != 0) return ERR_IO;
 
     *image_buffer = (char *)malloc(*image_size);
     if (*image_buffer == NULL) {
@@ -80,3 +112,23 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
 
     return ERR_NONE;
 }
+
+/**
+ * @brief Reads an image at a given resolution and format (see read_image()), traced.
+ */
+int do_read_format(const char* img_id, int resolution, int format, char** image_buffer,
+                   uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    const int span = trace_span_begin("do_read");
+    const int err = read_image(img_id, resolution, format, image_buffer, image_size, imgfs_file);
+    trace_span_end(span);
+    return err;
+}
+
+/**
+ * @brief Reads an image at a given resolution, as JPEG.
+ */
+int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* image_size, struct imgfs_file* imgfs_file)
+{
+    return do_read_format(img_id, resolution, FORMAT_JPEG, image_buffer, image_size, imgfs_file);
+}
@@ -0,0 +1,135 @@
+/**
+ * @file imgfs_resizer.c
+ * @brief Helper of the resize sandbox (resize_sandbox.h), started by the server.
+ *
+ * Runs the jobs it is sent on RESIZE_SOCKET_FD, one at a time, on the
+ * originals the server puts in the memory file RESIZE_MEMORY_FD, and puts
+ * the results there too. Exits when the server closes the socket.
+ *
+ * Usage: imgfs_resizer <max_memory>
+ */
+
+#define _GNU_SOURCE // for mremap()
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vips/vips.h>
+
+#include "error.h"
+#include "image_content.h"
+#include "resize_sandbox.h"
+
+// memory of the process beyond the decoded original: libvips, its threads, the result
+#define HEADROOM (256ULL * 1024 * 1024)
+
+#if defined(__SANITIZE_ADDRESS__)
+#define UNDER_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define UNDER_ASAN 1
+#endif
+#endif
+
+static char* memory = NULL; // shared with the server
+static size_t mapped = 0;
+static uint64_t max_memory = 0; // of a decoded original
+
+/**
+ * @brief Maps all the memory shared with the server, of at least size bytes.
+ */
+static int map_memory(size_t size)
+{
+    struct stat st;
+    if (fstat(RESIZE_MEMORY_FD, &st) != 0) return ERR_IO;
+    if ((size_t) st.st_size < size) {
+        if (ftruncate(RESIZE_MEMORY_FD, (off_t) size) != 0) return ERR_OUT_OF_MEMORY;
+    } else {
+        size = (size_t) st.st_size;
+    }
+    if (size <= mapped) return ERR_NONE;
+
+    void* const grown = memory == NULL
+                        ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, RESIZE_MEMORY_FD, 0)
+                        : mremap(memory, mapped, size, MREMAP_MAYMOVE);
+    if (grown == MAP_FAILED) return ERR_OUT_OF_MEMORY;
+    memory = grown;
+    mapped = size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Bounds the data of the process, as a last resort: the originals
+ *        too large are refused before decoding. Not under the address
+ *        sanitizer, whose shadow memory would exceed any limit.
+ */
+static void limit_memory(void)
+{
+#ifndef UNDER_ASAN
+    const rlim_t limit = (rlim_t) (max_memory + HEADROOM);
+    struct rlimit current;
+    if (getrlimit(RLIMIT_DATA, &current) == 0 && current.rlim_max != RLIM_INFINITY
+        && current.rlim_max < limit) {
+        return;
+    }
+    const struct rlimit data = { limit, limit };
+    if (setrlimit(RLIMIT_DATA, &data) != 0) perror("setrlimit()");
+#endif
+}
+
+/**
+ * @brief Runs one job, and puts the result after the original.
+ */
+static int run(const struct resize_request* request, struct resize_reply* reply)
+{
+    const size_t offset = resize_result_offset(request->original_size);
+    int err = map_memory(offset);
+    if (err != ERR_NONE) return err;
+
+    void* resized = NULL;
+    size_t size = 0;
+    err = resize_original(memory, request->original_size, request->width, request->format,
+                          request->encoding, max_memory, &resized, &size);
+    if (err == ERR_NONE && size > UINT32_MAX) err = ERR_IMGLIB;
+    if (err == ERR_NONE) err = map_memory(offset + size);
+    if (err == ERR_NONE) {
+        memcpy(memory + offset, resized, size);
+        reply->size = (uint32_t) size;
+    }
+    g_free(resized);
+    return err;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <max_memory>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    max_memory = strtoull(argv[1], NULL, 10);
+    if (max_memory == 0 || VIPS_INIT(argv[0]) != 0) return EXIT_FAILURE;
+    // nothing kept from one job to the next
+    vips_cache_set_max(0);
+    limit_memory();
+
+    for (;;) {
+        struct resize_request request;
+        const ssize_t n = recv(RESIZE_SOCKET_FD, &request, sizeof(request), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n != (ssize_t) sizeof(request)) break; // closed by the server
+
+        struct resize_reply reply = { ERR_NONE, 0 };
+        reply.err = run(&request, &reply);
+        if (send(RESIZE_SOCKET_FD, &reply, sizeof(reply), MSG_NOSIGNAL) != (ssize_t) sizeof(reply)) break;
+    }
+
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
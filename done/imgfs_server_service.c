@@ -9,22 +9,354 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h> // uint16_t
+#include <limits.h> // PATH_MAX
+#include <unistd.h> // readlink
 
 #include "error.h"
 #include "util.h" // atouint16
 #include "imgfs.h"
+#include "image_content.h" // lazily_resize_count
+#include "image_phash.h"
+#include "image_sprite.h"
+#include "imgfs_snapshot.h"
+#include "prefork.h"
+#include "prewarm.h"
+#include "replication.h"
+#include "resize_sandbox.h"
+#include "shared_volume.h"
+#include "volume_io.h"
 #include "http_net.h"
+#include "binary_net.h"
+#include "intake.h"
 #include "imgfs_server_service.h"
-#include <pthread.h>
+#include "metrics.h"
+#include "lock_prof.h"
+#include "request_ctx.h"
+#include "access_log.h"
+#include "slow_log.h"
+#include "trace.h"
 
-pthread_mutex_t lock;
+#define LOCK_PROF_ENV "IMGFS_LOCK_PROF"
+// comma-separated formats ("webp", "avif") served to the clients accepting them
+#define FORMATS_ENV "IMGFS_FORMATS"
+// if set (and not "0"), inserted originals are recompressed losslessly
+#define OPTIMIZE_ENV "IMGFS_OPTIMIZE_ORIGINALS"
+// if set (and not "0"), the thumbnails are hashed when created, for "imgfscmd similar"
+#define PHASH_ENV "IMGFS_PHASH"
+
+// Lock protecting fs_file
+static struct prof_mutex lock;
 
 // Main in-memory structure for imgFS
 static struct imgfs_file fs_file;
+static const char* fs_path = NULL; // its file
 static uint16_t server_port = 8000;
+// formats other than JPEG that reads may be served in (bit 1 << FORMAT_*); 0: JPEG only, no Vary
+static unsigned served_formats = 0;
+// options of the inserts (INSERT_*)
+static unsigned insert_flags = 0;
+// replicas and readers of a shared volume reject inserts and deletes
+static int read_only = 0;
 
 #define URI_ROOT "/imgfs"
 
+/**
+ * @brief Takes the volume lock, accounting the wait in the request context;
+ *        a worker then takes the lock of the workers, and a reader of a
+ *        shared volume the last published snapshot.
+ */
+#define lock_volume() \
+    do { \
+        request_locked(prof_mutex_lock(&lock)); \
+        prefork_lock(&fs_file); \
+        shared_volume_refresh(&fs_file); \
+    } while (0)
+
+/**
+ * @brief Releases the volume lock, publishing the volume gauges first.
+ */
+static void unlock_volume(void)
+{
+    shared_volume_end();
+    prefork_unlock(&fs_file);
+    repl_commit(fs_file.header.version);
+    metrics_volume(fs_file.header.nb_files, fs_file.header.max_files, fs_file.header.version);
+    request_unlocked();
+    prof_mutex_unlock(&lock);
+}
+
+/**
+ * @brief Takes the volume lock, for the replication and the sprite sheets
+ *        (a function, unlike lock_volume()).
+ */
+static void lock_volume_fn(void)
+{
+    lock_volume();
+}
+
+/**
+ * @brief Starts the replication if configured: as a replica if
+ *        REPL_PRIMARY_ENV is set, as a primary if REPL_PORT_ENV is.
+ */
+static int start_replication(const char* imgfs_path)
+{
+    const char* primary = getenv(REPL_PRIMARY_ENV);
+    const char* repl_port = getenv(REPL_PORT_ENV);
+    int ret = ERR_NONE;
+    if (primary != NULL && primary[0] != '\0') {
+        // the primary writes the volume: the missing derivatives are resized on each read
+        lazily_resize_store(0);
+        read_only = 1;
+        const struct repl_volume volume = { &fs_file, imgfs_path, lock_volume_fn, unlock_volume };
+        ret = repl_replica_start(&volume, primary);
+        if (ret == ERR_NONE) printf("Replica of %s\n", primary);
+    } else if (repl_port != NULL && repl_port[0] != '\0') {
+        ret = repl_primary_start(&fs_file, atouint16(repl_port));
+        if (ret == ERR_NONE) printf("Replication on port %s\n", repl_port);
+    }
+    if (ret != ERR_NONE) fprintf(stderr, "Failed to start the replication: %s\n", ERR_MSG(ret));
+    return ret;
+}
+
+static int env_flag(const char* name)
+{
+    const char* value = getenv(name);
+    return value != NULL && value[0] != '\0' && strcmp(value, "0") != 0;
+}
+
+/**
+ * @brief Shares the volume with other servers if configured (shared_volume.h):
+ *        as its writer if SHARED_WRITER_ENV is set, as a reader if
+ *        SHARED_READER_ENV is (then the volume is opened read-only).
+ */
+static int share_volume(const char* imgfs_path)
+{
+    int ret = ERR_NONE;
+    if (env_flag(SHARED_READER_ENV)) {
+        lazily_resize_store(0);
+        read_only = 1;
+        ret = shared_volume_attach(&fs_file, imgfs_path);
+        if (ret == ERR_NONE) printf("Reader of %s, at version %u\n", imgfs_path, fs_file.header.version);
+    } else if (env_flag(SHARED_WRITER_ENV)) {
+        // a replica reopens its volume on each commit, which would drop the wrapper
+        ret = repl_is_replica() ? ERR_INVALID_ARGUMENT : shared_volume_publish(&fs_file, imgfs_path);
+        if (ret == ERR_NONE) printf("Writer of %s\n", imgfs_path);
+    }
+    if (ret != ERR_NONE) fprintf(stderr, "Failed to share the volume: %s\n", ERR_MSG(ret));
+    return ret;
+}
+
+/**
+ * @brief Reads an image as a client would, creating the derivative if
+ *        needed, and drops it: what the page cache keeps is what matters.
+ */
+static int warm_image(const char* img_id, int resolution)
+{
+    char* image_buffer = NULL;
+    uint32_t image_size = 0;
+    lock_volume();
+    const int err = do_read(img_id, resolution, &image_buffer, &image_size, &fs_file);
+    unlock_volume();
+    free(image_buffer);
+    return err;
+}
+
+/**
+ * @brief Parses the list of formats of FORMATS_ENV into served_formats.
+ */
+static int parse_formats(const char* list)
+{
+    char copy[64];
+    if (strlen(list) >= sizeof(copy)) return ERR_INVALID_ARGUMENT;
+    strcpy(copy, list);
+
+    char* saveptr = NULL;
+    for (const char* name = strtok_r(copy, ", ", &saveptr); name != NULL;
+         name = strtok_r(NULL, ", ", &saveptr)) {
+        const int format = format_atoi(name);
+        if (format < 0) return ERR_INVALID_ARGUMENT;
+        if (format != FORMAT_JPEG) served_formats |= 1U << format;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Opens the access log and the slow log if configured; in each
+ *        worker in prefork mode (the access log has a writer thread).
+ */
+static int open_logs(void)
+{
+    int ret = ERR_NONE;
+    const char* access_log = getenv(ACCESS_LOG_ENV);
+    if (access_log != NULL && access_log[0] != '\0') {
+        ret = access_log_open(access_log);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "Failed to open the access log %s: %s\n", access_log, ERR_MSG(ret));
+            return ret;
+        }
+    }
+
+    const char* slow_ms = getenv(SLOW_LOG_THRESHOLD_ENV);
+    if (slow_ms != NULL && slow_ms[0] != '\0') {
+        const uint64_t threshold_ns = (uint64_t) atouint32(slow_ms) * 1000000ULL;
+        const char* trace_path = getenv(SLOW_LOG_TRACE_ENV);
+        char worker_trace_path[PATH_MAX];
+        unsigned worker = 0;
+        if (trace_path != NULL && prefork_is_worker(&worker)) {
+            // a JSON document per worker, or they would truncate and interleave one file
+            const char* const slash = strrchr(trace_path, '/');
+            const char* const dot = strrchr(slash != NULL ? slash : trace_path, '.');
+            const int base_len = (int) (dot != NULL ? (size_t) (dot - trace_path) : strlen(trace_path));
+            const int len = snprintf(worker_trace_path, sizeof(worker_trace_path), "%.*s.%u%s",
+                                     base_len, trace_path, worker, dot != NULL ? dot : "");
+            if (len < 0 || (size_t) len >= sizeof(worker_trace_path)) return ERR_INVALID_ARGUMENT;
+            trace_path = worker_trace_path;
+        }
+        ret = slow_log_open(threshold_ns, getenv(SLOW_LOG_ENV), trace_path);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "Failed to open the slow log: %s\n", ERR_MSG(ret));
+            return ret;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int insert_durably(const char* img_id, const char* image, size_t image_size);
+static int image_in_volume(const char* img_id);
+
+/**
+ * @brief The intake log, NULL if INTAKE_LOG_ENV is unset or empty.
+ */
+static const char* intake_log_path(void)
+{
+    const char* path = getenv(INTAKE_LOG_ENV);
+    return path == NULL || path[0] == '\0' ? NULL : path;
+}
+
+/**
+ * @brief Starts the intake mode if INTAKE_LOG_ENV is set (intake.h): the
+ *        inserts are then acknowledged once in the intake log.
+ */
+static int start_intake(void)
+{
+    const char* path = intake_log_path();
+    if (path == NULL) return ERR_NONE;
+    if (read_only) {
+        fprintf(stderr, "%s cannot be combined with a read-only volume\n", INTAKE_LOG_ENV);
+        return ERR_INVALID_ARGUMENT;
+    }
+    const int ret = intake_start(path, insert_durably, image_in_volume);
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "Failed to open the intake log %s: %s\n", path, ERR_MSG(ret));
+    } else {
+        printf("Intake log %s\n", path);
+    }
+    return ret;
+}
+
+static void handle_binary_request(const struct binary_request* request, struct binary_reply* reply);
+
+/**
+ * @brief Listens on the port, on the Unix domain socket at UNIX_SOCKET_ENV
+ *        if set, and on the port of the binary protocol at BINARY_PORT_ENV
+ *        if set (binary_net.h).
+ */
+static int start_listening(void)
+{
+    int ret = http_init(server_port, handle_http_message);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to initialize HTTP connection: %s\n", ERR_MSG(ret));
+        return ret;
+    }
+    const char* unix_path = getenv(UNIX_SOCKET_ENV);
+    if (unix_path != NULL && unix_path[0] != '\0') {
+        ret = http_listen_unix(unix_path);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to listen on %s: %s\n", unix_path, ERR_MSG(ret));
+            return ret;
+        }
+        printf("Listening on unix:%s\n", unix_path);
+    }
+    const char* binary_port = getenv(BINARY_PORT_ENV);
+    if (binary_port != NULL && binary_port[0] != '\0') {
+        ret = binary_init(atouint16(binary_port), handle_binary_request);
+        if (ret < 0) {
+            fprintf(stderr, "Failed to listen on the binary port %s: %s\n", binary_port, ERR_MSG(ret));
+            return ret;
+        }
+        printf("Binary protocol on port %s\n", binary_port);
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Forks the workers if PREFORK_WORKERS_ENV is set (prefork.h), once
+ *        listening: only the workers return.
+ */
+static int start_workers(void)
+{
+    const char* workers = getenv(PREFORK_WORKERS_ENV);
+    if (workers == NULL || workers[0] == '\0' || strcmp(workers, "0") == 0) return ERR_NONE;
+
+    const uint32_t nb_workers = atouint32(workers);
+    if (nb_workers == 0 || nb_workers > PREFORK_MAX_WORKERS) {
+        fprintf(stderr, "Invalid %s: %s (expected 1 to %d)\n", PREFORK_WORKERS_ENV, workers, PREFORK_MAX_WORKERS);
+        return ERR_INVALID_ARGUMENT;
+    }
+    const char* primary = getenv(REPL_PRIMARY_ENV);
+    const char* repl_port = getenv(REPL_PORT_ENV);
+    if ((primary != NULL && primary[0] != '\0') || (repl_port != NULL && repl_port[0] != '\0')
+        || env_flag(SHARED_READER_ENV) || env_flag(SHARED_WRITER_ENV) || intake_log_path() != NULL) {
+        fprintf(stderr, "%s cannot be combined with the replication, a shared volume or the intake log\n",
+                PREFORK_WORKERS_ENV);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    int ret = start_listening();
+    if (ret != ERR_NONE) return ret;
+    ret = prefork_start(nb_workers, &fs_file);
+    if (ret != ERR_NONE) fprintf(stderr, "Failed to start the workers: %s\n", ERR_MSG(ret));
+    return ret;
+}
+
+/**
+ * @brief Starts the resize helpers if RESIZE_HELPERS_ENV is set
+ *        (resize_sandbox.h); their executable is next to that of the server.
+ */
+static int start_resize_helpers(void)
+{
+    const char* helpers = getenv(RESIZE_HELPERS_ENV);
+    if (helpers == NULL || helpers[0] == '\0' || strcmp(helpers, "0") == 0) return ERR_NONE;
+
+    const uint32_t nb_helpers = atouint32(helpers);
+    if (nb_helpers == 0 || nb_helpers > RESIZE_MAX_HELPERS) {
+        fprintf(stderr, "Invalid %s: %s (expected 1 to %d)\n", RESIZE_HELPERS_ENV, helpers, RESIZE_MAX_HELPERS);
+        return ERR_INVALID_ARGUMENT;
+    }
+    const char* memory = getenv(RESIZE_MEMORY_ENV);
+    const uint64_t memory_mb = memory != NULL && memory[0] != '\0' ? atouint32(memory) : RESIZE_DEFAULT_MEMORY_MB;
+    const char* timeout = getenv(RESIZE_TIMEOUT_ENV);
+    const unsigned timeout_ms = timeout != NULL && timeout[0] != '\0' ? atouint32(timeout) : RESIZE_DEFAULT_TIMEOUT_MS;
+
+    char path[PATH_MAX];
+    const ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (len <= 0) return ERR_IO;
+    path[len] = '\0';
+    char* const slash = strrchr(path, '/');
+    if (slash == NULL || (size_t) (slash - path) + sizeof("/" RESIZE_HELPER_NAME) > sizeof(path)) {
+        return ERR_INVALID_FILENAME;
+    }
+    strcpy(slash + 1, RESIZE_HELPER_NAME);
+
+    const int ret = resize_sandbox_start(nb_helpers, path, memory_mb * 1024 * 1024, timeout_ms);
+    if (ret != ERR_NONE) {
+        fprintf(stderr, "Failed to start the resize helpers %s: %s\n", path, ERR_MSG(ret));
+    } else {
+        printf("%u resize helpers (%s)\n", nb_helpers, path);
+    }
+    return ret;
+}
+
 /**
  * @brief Startup function. Create imgFS file and load in-memory structure.
  *
@@ -37,14 +369,30 @@ int server_startup(int argc, char **argv)
 {
     if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
 
-    pthread_mutex_init(&lock, NULL);
-    int ret = do_open(argv[1], "rb+", &fs_file);
+    int ret = prof_mutex_init(&lock, "volume");
+    if (ret != ERR_NONE) return ret;
+
+    const char* prof = getenv(LOCK_PROF_ENV);
+    lock_prof_enable(prof != NULL && strcmp(prof, "0") != 0);
+
+    if (env_flag(OPTIMIZE_ENV)) insert_flags |= INSERT_OPTIMIZE;
+    phash_enable(env_flag(PHASH_ENV));
+
+    const char* formats = getenv(FORMATS_ENV);
+    if (formats != NULL && parse_formats(formats) != ERR_NONE) {
+        fprintf(stderr, "Invalid %s: %s (expected e.g. webp,avif)\n", FORMATS_ENV, formats);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    fs_path = argv[1];
+    ret = do_open(fs_path, env_flag(SHARED_READER_ENV) ? "rb" : "rb+", &fs_file);
     if (ret != ERR_NONE) {
         fprintf(stderr, "Failed to open ImgFS file: %s\n", ERR_MSG(ret));
         return ret;
     }
 
     print_header(&fs_file.header);
+    metrics_volume(fs_file.header.nb_files, fs_file.header.max_files, fs_file.header.version);
 
     if (argc > 2) {
         uint16_t port = atouint16(argv[2]); // Convert port number
@@ -56,12 +404,47 @@ int server_startup(int argc, char **argv)
         }
     }
 
-    ret = http_init(server_port, handle_http_message);
-    if (ret < 0) {
-        fprintf(stderr, "Failed to initialize HTTP connection: %s\n", ERR_MSG(ret));
-        return ret;
+    const char* prewarm_file = getenv(PREWARM_FILE_ENV);
+    if (prewarm_file != NULL && prewarm_file[0] != '\0') {
+        ret = prewarm_merge(prewarm_file); // before the workers save theirs
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "Failed to merge the prewarming summaries of %s: %s\n", prewarm_file, ERR_MSG(ret));
+            return ret;
+        }
+    }
+
+    ret = start_workers();
+    // before any thread, and in each worker
+    if (ret == ERR_NONE) ret = start_resize_helpers();
+    if (ret == ERR_NONE) ret = open_logs();
+    if (ret == ERR_NONE) ret = start_replication(argv[1]);
+    if (ret == ERR_NONE) ret = share_volume(argv[1]);
+    if (ret == ERR_NONE) ret = start_intake();
+    if (ret != ERR_NONE) return ret;
+
+    unsigned worker = 0;
+    const int is_worker = prefork_is_worker(&worker);
+
+    // the replay runs in the background, while the server serves (every worker records)
+    if (prewarm_file != NULL && prewarm_file[0] != '\0') {
+        const char* rate = getenv(PREWARM_RATE_ENV);
+        const unsigned prewarm_rate = rate != NULL ? atouint32(rate) : PREWARM_DEFAULT_RATE;
+        ret = prewarm_start(prewarm_file, is_worker ? (int) worker : -1, prewarm_rate, warm_image);
+        if (ret != ERR_NONE) {
+            fprintf(stderr, "Failed to start prewarming from %s: %s\n", prewarm_file, ERR_MSG(ret));
+            return ret;
+        }
     }
 
+    if (is_worker) {
+        printf("ImgFS server worker %u started on http://localhost:%d\n", worker, server_port);
+        return binary_start();
+    }
+
+    ret = start_listening();
+    if (ret == ERR_NONE) ret = binary_start();
+    if (ret != ERR_NONE) return ret;
+
     printf("ImgFS server started on http://localhost:%d\n", server_port);
 
     return ERR_NONE;
@@ -74,10 +457,150 @@ void server_shutdown(void)
 {
     fprintf(stderr, "Shutting down the imgfs server...\n");
     http_close();
+    binary_close();
+    intake_stop();
+    prewarm_stop();
+    repl_stop();
+    if (lock_prof_enabled()) {
+        char* json = NULL;
+        if (lock_prof_dump_json(&json) == ERR_NONE) {
+            fprintf(stderr, "Lock profile: %s\n", json);
+        }
+        free(json);
+    }
+    access_log_close();
+    slow_log_close();
+    sprite_cache_clear();
+    resize_sandbox_stop();
+    prefork_detach(&fs_file);
     do_close(&fs_file);
-    pthread_mutex_destroy(&lock);
+    shared_volume_close();
+    prof_mutex_destroy(&lock);
+}
+
+/********************************************************************
+ * Operations, whichever the protocol
+ */
+
+/**
+ * @brief Lists the images, in JSON.
+ *
+ * @param json Set to the list, to be freed by the caller.
+ * @return Some error code. 0 if no error.
+ */
+static int list_images(char** json)
+{
+    lock_volume();
+    const int err = do_list(&fs_file, JSON, json);
+    unlock_volume();
+    if (err != ERR_NONE) {
+        free(*json);
+        *json = NULL;
+    }
+    return err;
+}
+
+/**
+ * @brief Reads an image, in a format; resized images fall back to JPEG
+ *        if the format cannot be encoded.
+ *
+ * @param format The desired format (FORMAT_*), set to the one served.
+ * @param image Set to the image, to be freed by the caller.
+ * @return Some error code. 0 if no error.
+ */
+static int read_image(const char* img_id, int resolution, int* format, char** image, uint32_t* image_size)
+{
+    const unsigned long resizes = lazily_resize_count();
+    request_set_image(img_id, resolution);
+    lock_volume();
+    int ret = do_read_format(img_id, resolution, *format, image, image_size, &fs_file);
+    if (ret == ERR_IMGLIB && *format != FORMAT_JPEG) {
+        // e.g. libvips built without this encoder
+        debug_printf("Cannot encode %s, serving JPEG\n", format_name(*format));
+        *format = FORMAT_JPEG;
+        ret = do_read(img_id, resolution, image, image_size, &fs_file);
+    }
+    unlock_volume();
+    if (ret != ERR_NONE) {
+        debug_printf("Error reading image: %s\n", ERR_MSG(ret));
+        return ret;
+    }
+    request_set_cache_hit(lazily_resize_count() == resizes);
+    prewarm_record(img_id, resolution);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Inserts an image.
+ *
+ * @return Some error code. 0 if no error.
+ */
+static int insert_image(const char* img_id, const char* image, size_t image_size)
+{
+    if (read_only) return ERR_INVALID_COMMAND;
+    if (image_size == 0) return ERR_INVALID_ARGUMENT;
+    request_set_image(img_id, -1);
+    lock_volume();
+    const int err = do_insert_flags(image, image_size, img_id, &fs_file, insert_flags);
+    unlock_volume();
+    if (err != ERR_NONE) debug_printf("Error inserting image: %s\n", ERR_MSG(err));
+    return err;
+}
+
+/**
+ * @brief Inserts an image, and syncs the volume to disk: the intake log
+ *        may then forget the upload.
+ *
+ * @return Some error code. 0 if no error.
+ */
+static int insert_durably(const char* img_id, const char* image, size_t image_size)
+{
+    int err = insert_image(img_id, image, image_size);
+    if (err != ERR_NONE) return err;
+    lock_volume();
+    err = volume_io_sync(fs_file.file); // also through the wrapper of the replication or the shared volume
+    unlock_volume();
+    return err;
+}
+
+/**
+ * @brief Deletes an image.
+ *
+ * @return Some error code. 0 if no error.
+ */
+static int delete_image(const char* img_id)
+{
+    if (read_only) return ERR_INVALID_COMMAND;
+    debug_printf("Deleting image with id: %s\n", img_id);
+    request_set_image(img_id, -1);
+    lock_volume();
+    const int err = do_delete(img_id, &fs_file);
+    unlock_volume();
+    return err;
 }
 
+/**
+ * @brief Whether an image is in the volume. Only called by the intake for
+ *        ids it does not know of, which it looks up first.
+ */
+static int image_in_volume(const char* img_id)
+{
+    int found = 0;
+    lock_volume();
+    // up to the last image, not the end of the table
+    for (uint32_t i = 0, seen = 0; i < fs_file.header.max_files && seen < fs_file.header.nb_files && !found; ++i) {
+        if (fs_file.metadata[i].is_valid != NON_EMPTY) continue;
+        ++seen;
+        found = strcmp(fs_file.metadata[i].img_id, img_id) == 0;
+    }
+    unlock_volume();
+    return found;
+}
+
+/********************************************************************
+ * HTTP
+ */
+
 /**
  * @brief Sends an error message as an HTTP response.
  *
@@ -117,6 +640,25 @@ static int reply_302_msg(int connection)
     return http_reply(connection, "302 Found", location, "\n", 0);
 }
 
+/**
+ * @brief Sends a 202 Accepted message as an HTTP response, pointing to
+ *        the status of the upload.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @param img_id The id of the upload.
+ * @return int Error code indicating success or type of error.
+ */
+static int reply_202_msg(int connection, const char* img_id)
+{
+    char location[ERR_MSG_SIZE + MAX_IMG_ID];
+    if (snprintf(location, sizeof(location), "Location: http://localhost:%d" URI_ROOT "/intake?img_id=%s"
+                 HTTP_LINE_DELIM, server_port, img_id) < 0) {
+        fprintf(stderr, "reply_202_msg(): sprintf() failed...\n");
+        return ERR_RUNTIME;
+    }
+    return http_reply(connection, "202 Accepted", location, "\n", 0);
+}
+
 /**
  * @brief Handles a request to list images.
  *
@@ -127,13 +669,8 @@ static int handle_list_call(int connection)
 {
     debug_printf("handle_list_call() on connection %d\n", connection);
     char* json_output = NULL;
-    pthread_mutex_lock(&lock);
-    int err = do_list(&fs_file, JSON, &json_output);
-    pthread_mutex_unlock(&lock);
-    if (err != ERR_NONE) {
-        free(json_output);
-        return reply_error_msg(connection, err);
-    }
+    int err = list_images(&json_output);
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
 
     int ret = http_reply(connection, HTTP_OK,
                          "Content-Type: application/json" HTTP_LINE_DELIM,
@@ -142,9 +679,38 @@ static int handle_list_call(int connection)
     return ret;
 }
 
+/**
+ * @brief Chooses the format of a resized image from the Accept header of
+ *        the request: the served format with the highest quality value,
+ *        AVIF rather than WebP rather than JPEG for equal ones.
+ */
+static int negotiate_format(const struct http_message* msg)
+{
+    const struct http_string* accept = http_get_header(msg, "Accept");
+    if (accept == NULL) return FORMAT_JPEG;
+
+    int best = FORMAT_JPEG;
+    int best_quality = http_accept_quality(accept, format_mime_type(FORMAT_JPEG));
+    static const int preference[] = { FORMAT_WEBP, FORMAT_AVIF }; // least preferred first
+    for (size_t i = 0; i < sizeof(preference) / sizeof(preference[0]); ++i) {
+        const int format = preference[i];
+        if ((served_formats & (1U << format)) == 0) continue;
+        const int quality = http_accept_quality(accept, format_mime_type(format));
+        if (quality > 0 && quality >= best_quality) {
+            best = format;
+            best_quality = quality;
+        }
+    }
+    return best;
+}
+
 /**
  * @brief Handles a request to read an image.
  *
+ * Resized images are served in the format negotiate_format() chooses
+ * if other formats than JPEG are enabled (FORMATS_ENV), with a
+ * "Vary: Accept" header.
+ *
  * @param connection The HTTP connection file descriptor.
  * @param msg Pointer to the HTTP message structure containing the request details.
  * @return Error which is indicating success or type of error.
@@ -172,24 +738,68 @@ static int handle_read_call(int connection, struct http_message* msg)
         return reply_error_msg(connection, ERR_RESOLUTIONS);
     }
 
+    const int negotiated = served_formats != 0 && resolution != ORIG_RES;
+    int format = negotiated ? negotiate_format(msg) : FORMAT_JPEG;
+
     char *image_buffer = NULL;
     uint32_t image_size = 0;
-    pthread_mutex_lock(&lock);
-    int ret = do_read(img_id_value, resolution, &image_buffer, &image_size, &fs_file);
-    pthread_mutex_unlock(&lock);
-    if (ret != ERR_NONE) {
-        debug_printf("Error reading image: %s\n", ERR_MSG(ret));
-        return reply_error_msg(connection, ret);
-    }
+    int ret = read_image(img_id_value, resolution, &format, &image_buffer, &image_size);
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
 
-    ret = http_reply(connection, HTTP_OK,
-                     "Content-Type: image/jpeg" HTTP_LINE_DELIM,
-                     image_buffer, image_size);
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Content-Type: %s" HTTP_LINE_DELIM "%s",
+             format_mime_type(format), negotiated ? "Vary: Accept" HTTP_LINE_DELIM : "");
+    ret = http_reply(connection, HTTP_OK, headers, image_buffer, image_size);
     free(image_buffer);
 
     return ret;
 }
 
+/**
+ * @brief Handles a request for the sprite sheet of some images (image_sprite.h).
+ *
+ * Parameters: ids, the ids of the images separated by commas; map=1 to get
+ * the map of the sheet (JSON) instead of the sheet (JPEG).
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @param msg Pointer to the HTTP message structure containing the request details.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_sprite_call(int connection, struct http_message* msg)
+{
+    char ids[MAX_SPRITE_IMAGES * (MAX_IMG_ID + 1)] = {0};
+    const int ids_get_var = http_get_var(&msg->uri, "ids", ids, sizeof(ids));
+    if (ids_get_var < 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    } else if (ids_get_var == 0) {
+        return reply_error_msg(connection, ERR_NOT_ENOUGH_ARGUMENTS);
+    }
+    char map_value[2] = {0};
+    const int want_map = http_get_var(&msg->uri, "map", map_value, sizeof(map_value)) > 0
+                         && map_value[0] == '1';
+
+    char* image = NULL;
+    size_t image_size = 0;
+    char* map = NULL;
+    int cached = 0;
+    // the volume lock is only taken to read the thumbnails
+    int ret = want_map ? sprite_get(&fs_file, lock_volume_fn, unlock_volume, ids, NULL, NULL, &map, &cached)
+              : sprite_get(&fs_file, lock_volume_fn, unlock_volume, ids, &image, &image_size, NULL, &cached);
+    if (ret != ERR_NONE) return reply_error_msg(connection, ret);
+    request_set_cache_hit(cached);
+
+    if (want_map) {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                         map, strlen(map));
+    } else {
+        ret = http_reply(connection, HTTP_OK, "Content-Type: image/jpeg" HTTP_LINE_DELIM,
+                         image, image_size);
+    }
+    free(map);
+    free(image);
+    return ret;
+}
+
 /**
  * @brief Handles a request to delete an image.
  *
@@ -210,13 +820,7 @@ static int handle_delete_call(int connection, struct http_message* msg)
     }
 
     img_id_value[MAX_IMG_ID] = '\0';
-
-    debug_printf("Deleting image with id: %s\n", img_id_value);
-
-    pthread_mutex_lock(&lock);
-    int err = do_delete(img_id_value, &fs_file);
-    pthread_mutex_unlock(&lock);
-
+    int err = delete_image(img_id_value);
     if (err != ERR_NONE) {
         return reply_error_msg(connection, err);
     }
@@ -248,31 +852,196 @@ static int handle_insert_call(int connection, struct http_message* msg)
     }
 
     img_id_value[MAX_IMG_ID] = '\0';
+    if (intake_enabled()) {
+        // inserted in the background, once in the intake log
+        request_set_image(img_id_value, -1);
+        const int err = intake_submit(img_id_value, msg->body.val, msg->body.len);
+        return err != ERR_NONE ? reply_error_msg(connection, err) : reply_202_msg(connection, img_id_value);
+    }
+    int err = insert_image(img_id_value, msg->body.val, msg->body.len);
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
 
-    // retrieve the image content
-    char* image_buffer = (char*)malloc(msg->body.len);
-    if (image_buffer == NULL) {
-        debug_printf("Error allocating memory for image\n", NULL);
-        return reply_error_msg(connection, ERR_OUT_OF_MEMORY);
+    return reply_302_msg(connection);
+}
+
+/**
+ * @brief Handles a request for the server metrics.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_metrics_call(int connection)
+{
+    char* text = NULL;
+    size_t text_len = 0;
+    int err = metrics_render(&text, &text_len);
+    if (err == ERR_NONE) {
+        err = lock_prof_append_prometheus(&text, &text_len);
+    }
+    if (err != ERR_NONE) {
+        free(text);
+        return reply_error_msg(connection, err);
     }
-    memcpy(image_buffer, msg->body.val, msg->body.len);
 
-    // insert the image into the ImgFS
-    pthread_mutex_lock(&lock);
-    int err = do_insert(image_buffer, msg->body.len, img_id_value, &fs_file);
-    pthread_mutex_unlock(&lock);
-    free(image_buffer);
+    err = http_reply(connection, HTTP_OK, METRICS_CONTENT_TYPE HTTP_LINE_DELIM, text, text_len);
+    free(text);
+    return err;
+}
 
+/**
+ * @brief Handles a request for the lock profile.
+ *
+ * Optional parameters: enable=0|1 switches hold time and call site
+ * profiling, reset=1 clears the statistics. Replies the profile in JSON.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @param msg Pointer to the HTTP message structure containing the request details.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_lockprof_call(int connection, struct http_message* msg)
+{
+    char value[2] = {0};
+    if (http_get_var(&msg->uri, "enable", value, sizeof(value)) > 0) {
+        lock_prof_enable(value[0] == '1');
+    }
+    if (http_get_var(&msg->uri, "reset", value, sizeof(value)) > 0 && value[0] == '1') {
+        lock_prof_reset();
+    }
+
+    char* json = NULL;
+    int err = lock_prof_dump_json(&json);
     if (err != ERR_NONE) {
-        debug_printf("Error inserting image: %s\n", ERR_MSG(err));
+        free(json);
         return reply_error_msg(connection, err);
     }
 
-    return reply_302_msg(connection);
+    err = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                     json, strlen(json));
+    free(json);
+    return err;
 }
 
 /**
- * @brief Handles incoming HTTP messages and routes them to the appropriate handler.
+ * @brief Handles a request for the state of the replication (replication.h),
+ *        in JSON: the lag of the replicas, or of this one.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_replication_call(int connection)
+{
+    char* json = NULL;
+    int err = repl_status_json(&json);
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
+
+    err = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                     json, strlen(json));
+    free(json);
+    return err;
+}
+
+/**
+ * @brief Handles a request for the status of the intake (intake.h), in
+ *        JSON: of the upload of img_id if given, of the intake otherwise.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @param msg Pointer to the HTTP message structure containing the request details.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_intake_call(int connection, struct http_message* msg)
+{
+    if (!intake_enabled()) return reply_error_msg(connection, ERR_INVALID_COMMAND);
+    char img_id_value[MAX_IMG_ID + 1] = {0};
+    const int img_id_get_var = http_get_var(&msg->uri, "img_id", img_id_value, sizeof(img_id_value));
+    if (img_id_get_var < 0) return reply_error_msg(connection, img_id_get_var);
+
+    char* json = NULL;
+    int err = intake_status_json(img_id_get_var > 0 ? img_id_value : NULL, &json);
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
+
+    err = http_reply(connection, HTTP_OK, "Content-Type: application/json" HTTP_LINE_DELIM,
+                     json, strlen(json));
+    free(json);
+    return err;
+}
+
+/**
+ * @brief Sends a pinned snapshot, for http_reply_stream().
+ */
+static int send_snapshot_part(void* connection, const char* bytes, size_t size)
+{
+    return http_send(*(const int*) connection, bytes, size);
+}
+
+static int send_snapshot(int connection, void* snapshot)
+{
+    return imgfs_snapshot_stream(snapshot, send_snapshot_part, &connection);
+}
+
+struct snapshot_export {
+    const struct imgfs_snapshot* snapshot;
+    uint32_t since;
+};
+
+static int send_export(int connection, void* arg)
+{
+    const struct snapshot_export* const incremental = arg;
+    return imgfs_export(incremental->snapshot, incremental->since, send_snapshot_part, &connection);
+}
+
+/**
+ * @brief Handles a request for a consistent copy of the volume
+ *        (imgfs_snapshot.h), streamed while the other requests go on.
+ *
+ * The copy is the volume as of the version given in the
+ * X-Imgfs-Version header. With since=<version>, it is the incremental
+ * export of the images changed after that version instead.
+ *
+ * @param connection The HTTP connection file descriptor.
+ * @param msg Pointer to the HTTP message structure containing the request details.
+ * @return Error code indicating success or type of error.
+ */
+static int handle_snapshot_call(int connection, struct http_message* msg)
+{
+    char since_value[11] = {0};
+    const int since_get_var = http_get_var(&msg->uri, "since", since_value, sizeof(since_value));
+    if (since_get_var < 0) return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    const uint32_t since = since_get_var > 0 ? atouint32(since_value) : 0;
+    if (since_get_var > 0 && since == 0 && strcmp(since_value, "0") != 0) {
+        return reply_error_msg(connection, ERR_INVALID_ARGUMENT);
+    }
+
+    struct imgfs_snapshot snapshot;
+    lock_volume();
+    int err = imgfs_snapshot_pin(&fs_file, fs_path, &snapshot);
+    unlock_volume();
+    if (err != ERR_NONE) return reply_error_msg(connection, err);
+
+    uint64_t size = snapshot.size;
+    if (since_get_var > 0) err = imgfs_export_size(&snapshot, since, &size);
+    if (err != ERR_NONE) {
+        imgfs_snapshot_release(&snapshot);
+        return reply_error_msg(connection, err);
+    }
+
+    char headers[160];
+    snprintf(headers, sizeof(headers),
+             "Content-Type: application/octet-stream" HTTP_LINE_DELIM
+             "Content-Disposition: attachment; filename=\"%s\"" HTTP_LINE_DELIM
+             "X-Imgfs-Version: %u" HTTP_LINE_DELIM,
+             since_get_var > 0 ? "export.imgfsinc" : "snapshot.imgfs", snapshot.header.version);
+    if (since_get_var > 0) {
+        struct snapshot_export incremental = { &snapshot, since };
+        err = http_reply_stream(connection, HTTP_OK, headers, (size_t) size, send_export, &incremental);
+    } else {
+        err = http_reply_stream(connection, HTTP_OK, headers, (size_t) size, send_snapshot, &snapshot);
+    }
+    imgfs_snapshot_release(&snapshot);
+    return err;
+}
+
+/**
+ * @brief Routes incoming HTTP messages to the appropriate handler.
  *
  * This function processes incoming HTTP messages and routes them to the appropriate
  * handler function based on the URI and method.
@@ -281,28 +1050,129 @@ static int handle_insert_call(int connection, struct http_message* msg)
  * @param connection The HTTP connection file descriptor.
  * @return Error code indicating success or type of error.
  */
-int handle_http_message(struct http_message* msg, int connection)
+static int route_http_message(struct http_message* msg, int connection)
 {
-    M_REQUIRE_NON_NULL(msg);
     debug_printf("handle_http_message() on connection %d. URI: %.*s\n", connection, (int) msg->uri.len, msg->uri.val);
 
     // Serve the base file if the URI matches
     if (http_match_verb(&msg->uri, "/") || http_match_verb(&msg->uri, "/index.html")) {
         debug_printf("Serving base file\n", NULL);
+        request_set_route(ROUTE_INDEX);
         return http_serve_file(connection, BASE_FILE);
     }
 
     // Route to the appropriate handler based on the URI
     if (http_match_uri(msg, URI_ROOT "/list")) {
+        request_set_route(ROUTE_LIST);
         return handle_list_call(connection);
     } else if (http_match_uri(msg, URI_ROOT "/read")) {
+        request_set_route(ROUTE_READ);
         return handle_read_call(connection, msg);
+    } else if (http_match_uri(msg, URI_ROOT "/sprite")) {
+        request_set_route(ROUTE_SPRITE);
+        return handle_sprite_call(connection, msg);
     } else if (http_match_uri(msg, URI_ROOT "/delete")) {
+        request_set_route(ROUTE_DELETE);
         return handle_delete_call(connection, msg);
     } else if (http_match_uri(msg, URI_ROOT "/insert") && http_match_verb(&msg->method, "POST")) {
+        request_set_route(ROUTE_INSERT);
         return handle_insert_call(connection, msg);
+    } else if (http_match_uri(msg, METRICS_URI)) {
+        request_set_route(ROUTE_METRICS);
+        return handle_metrics_call(connection);
+    } else if (http_match_uri(msg, URI_ROOT "/lockprof")) {
+        request_set_route(ROUTE_LOCKPROF);
+        return handle_lockprof_call(connection, msg);
+    } else if (http_match_uri(msg, URI_ROOT "/replication")) {
+        request_set_route(ROUTE_REPLICATION);
+        return handle_replication_call(connection);
+    } else if (http_match_uri(msg, URI_ROOT "/snapshot")) {
+        request_set_route(ROUTE_SNAPSHOT);
+        return handle_snapshot_call(connection, msg);
+    } else if (http_match_uri(msg, URI_ROOT "/intake")) {
+        request_set_route(ROUTE_INTAKE);
+        return handle_intake_call(connection, msg);
     } else {
         perror("Invalid command\n");
         return reply_error_msg(connection, ERR_INVALID_COMMAND);
     }
 }
+
+/**
+ * @brief Handles incoming HTTP messages, tracing the time spent in the handler.
+ *
+ * @param msg Pointer to the HTTP message structure containing the request details.
+ * @param connection The HTTP connection file descriptor.
+ * @return Error code indicating success or type of error.
+ */
+int handle_http_message(struct http_message* msg, int connection)
+{
+    M_REQUIRE_NON_NULL(msg);
+    const int span = trace_span_begin("handle_http_message");
+    const int ret = route_http_message(msg, connection);
+    trace_span_end(span);
+    return ret;
+}
+
+/********************************************************************
+ * Binary protocol
+ */
+
+/**
+ * @brief Serves a request of the binary protocol (binary_net.h), with the
+ *        operations of the HTTP handlers; resized images are served in JPEG.
+ */
+static void serve_binary_request(const struct binary_request* request, struct binary_reply* reply)
+{
+    const int has_id = request->img_id[0] != '\0';
+    switch (request->opcode) {
+    case BINARY_LIST:
+        request_set_route(ROUTE_LIST);
+        reply->status = list_images(&reply->data);
+        reply->size = reply->data != NULL ? strlen(reply->data) : 0;
+        break;
+    case BINARY_READ: {
+        request_set_route(ROUTE_READ);
+        int format = FORMAT_JPEG;
+        uint32_t size = 0;
+        reply->status = !has_id ? ERR_NOT_ENOUGH_ARGUMENTS
+                        : request->resolution >= NB_RES ? ERR_RESOLUTIONS
+                        : read_image(request->img_id, request->resolution, &format, &reply->data, &size);
+        reply->size = size;
+        break;
+    }
+    case BINARY_INSERT:
+        request_set_route(ROUTE_INSERT);
+        if (!has_id) {
+            reply->status = ERR_NOT_ENOUGH_ARGUMENTS;
+        } else if (intake_enabled()) {
+            // as over HTTP: inserted in the background, once in the intake log
+            reply->status = intake_submit(request->img_id, request->payload, request->payload_size);
+        } else {
+            reply->status = insert_image(request->img_id, request->payload, request->payload_size);
+        }
+        break;
+    case BINARY_DELETE:
+        request_set_route(ROUTE_DELETE);
+        reply->status = !has_id ? ERR_NOT_ENOUGH_ARGUMENTS : delete_image(request->img_id);
+        break;
+    default:
+        request_set_route(ROUTE_OTHER);
+        reply->status = ERR_INVALID_COMMAND;
+    }
+    if (reply->status != ERR_NONE) {
+        free(reply->data);
+        reply->data = NULL;
+        reply->size = 0;
+    }
+}
+
+/**
+ * @brief Handles a request of the binary protocol, tracing the time spent in the handler.
+ */
+static void handle_binary_request(const struct binary_request* request, struct binary_reply* reply)
+{
+    const int span = trace_span_begin("handle_binary_request");
+    serve_binary_request(request, reply);
+    trace_span_end(span);
+}
@@ -0,0 +1,371 @@
+/**
+ * @file imgfs_snapshot.c
+ * @brief Consistent copies of an imgFS that keeps changing (see imgfs_snapshot.h).
+ */
+
+#define _GNU_SOURCE // for fseeko(), posix_fadvise()
+
+#include "imgfs_snapshot.h"
+#include "imgfs_ext.h"
+#include "error.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/**
+ * @brief A region of the volume replaced by its pinned copy when streaming.
+ */
+struct pinned_region {
+    uint64_t offset;
+    const char* bytes;
+    size_t size;
+};
+
+/**
+ * @brief Copies the extension table of the volume as it is in the file,
+ *        whatever the size of its records.
+ */
+static int pin_ext(struct imgfs_snapshot* snapshot)
+{
+    struct imgfs_ext_header header;
+    if (fseeko(snapshot->file, (off_t) snapshot->header.ext_offset, SEEK_SET) != 0
+        || fread(&header, sizeof(header), 1, snapshot->file) != 1
+        || memcmp(header.magic, IMGFS_EXT_MAGIC, sizeof(header.magic)) != 0) {
+        return ERR_IO;
+    }
+    // appended after the metadata, as the streaming expects
+    if (snapshot->header.ext_offset < sizeof(struct imgfs_header)
+        + snapshot->header.max_files * sizeof(struct img_metadata)) {
+        return ERR_IO;
+    }
+
+    snapshot->ext_size = sizeof(header) + (size_t) header.record_size * header.nb_records;
+    if (snapshot->header.ext_offset + snapshot->ext_size > snapshot->size) return ERR_IO;
+    snapshot->ext = malloc(snapshot->ext_size);
+    if (snapshot->ext == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(snapshot->ext, &header, sizeof(header));
+    if (fread(snapshot->ext + sizeof(header), snapshot->ext_size - sizeof(header), 1,
+              snapshot->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+int imgfs_snapshot_pin(struct imgfs_file* imgfs_file, const char* imgfs_path,
+                       struct imgfs_snapshot* snapshot)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_path);
+    M_REQUIRE_NON_NULL(snapshot);
+
+    memset(snapshot, 0, sizeof(*snapshot));
+    // what the volume buffers must be in the file, read through another FILE
+    if (fflush(imgfs_file->file) != 0) return ERR_IO;
+    snapshot->file = fopen(imgfs_path, "rb");
+    if (snapshot->file == NULL) return ERR_IO;
+
+    struct stat st;
+    if (fstat(fileno(snapshot->file), &st) != 0) {
+        imgfs_snapshot_release(snapshot);
+        return ERR_IO;
+    }
+    snapshot->size = (uint64_t) st.st_size;
+    snapshot->header = imgfs_file->header;
+    const size_t metadata_size = imgfs_file->header.max_files * sizeof(struct img_metadata);
+    if (sizeof(struct imgfs_header) + metadata_size > snapshot->size) {
+        imgfs_snapshot_release(snapshot);
+        return ERR_IO;
+    }
+    snapshot->metadata = malloc(metadata_size);
+    if (snapshot->metadata == NULL) {
+        imgfs_snapshot_release(snapshot);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(snapshot->metadata, imgfs_file->metadata, metadata_size);
+
+    const int err = snapshot->header.ext_offset != 0 ? pin_ext(snapshot) : ERR_NONE;
+    if (err != ERR_NONE) {
+        imgfs_snapshot_release(snapshot);
+        return err;
+    }
+    return ERR_NONE;
+}
+
+int imgfs_snapshot_stream(const struct imgfs_snapshot* snapshot, snapshot_sink sink, void* arg)
+{
+    M_REQUIRE_NON_NULL(snapshot);
+    M_REQUIRE_NON_NULL(snapshot->file);
+    M_REQUIRE_NON_NULL(sink);
+
+    // in the order of the file; the extension table is after the metadata
+    const struct pinned_region regions[] = {
+        { 0, (const char*) &snapshot->header, sizeof(struct imgfs_header) },
+        {
+            sizeof(struct imgfs_header), (const char*) snapshot->metadata,
+            snapshot->header.max_files * sizeof(struct img_metadata)
+        },
+        { snapshot->header.ext_offset, snapshot->ext, snapshot->ext_size },
+    };
+    const size_t nb_regions = snapshot->ext != NULL ? 3 : 2;
+
+    char* const chunk = malloc(SNAPSHOT_CHUNK);
+    if (chunk == NULL) return ERR_OUT_OF_MEMORY;
+    (void) posix_fadvise(fileno(snapshot->file), 0, (off_t) snapshot->size, POSIX_FADV_SEQUENTIAL);
+
+    int err = ERR_NONE;
+    uint64_t position = 0;
+    size_t next = 0; // first region not streamed yet
+    int seek = 1;
+    while (position < snapshot->size && err == ERR_NONE) {
+        if (next < nb_regions && position == regions[next].offset) {
+            err = sink(arg, regions[next].bytes, regions[next].size);
+            position += regions[next].size;
+            ++next;
+            seek = 1;
+            continue;
+        }
+
+        uint64_t end = next < nb_regions ? regions[next].offset : snapshot->size;
+        if (end - position > SNAPSHOT_CHUNK) end = position + SNAPSHOT_CHUNK;
+        const size_t size = (size_t) (end - position);
+        if ((seek && fseeko(snapshot->file, (off_t) position, SEEK_SET) != 0)
+            || fread(chunk, size, 1, snapshot->file) != 1) {
+            err = ERR_IO;
+            break;
+        }
+        seek = 0;
+        err = sink(arg, chunk, size);
+        position = end;
+    }
+
+    free(chunk);
+    return err;
+}
+
+/**
+ * @brief Whether an entry of a snapshot is exported: as a tombstone
+ *        (returns -1), with its original (1), or not (0).
+ */
+static int exported(const struct img_metadata* md, uint32_t since)
+{
+    if (md->is_valid == NON_EMPTY) return since == 0 || md->version > since ? 1 : 0;
+    return since != 0 && md->version > since ? -1 : 0;
+}
+
+int imgfs_export_size(const struct imgfs_snapshot* snapshot, uint32_t since, uint64_t* size)
+{
+    M_REQUIRE_NON_NULL(snapshot);
+    M_REQUIRE_NON_NULL(snapshot->metadata);
+    M_REQUIRE_NON_NULL(size);
+
+    *size = sizeof(struct imgfs_export_header);
+    for (uint32_t i = 0; i < snapshot->header.max_files; ++i) {
+        const int how = exported(&snapshot->metadata[i], since);
+        if (how != 0) *size += sizeof(struct imgfs_export_entry);
+        if (how > 0) *size += snapshot->metadata[i].size[ORIG_RES];
+    }
+    return ERR_NONE;
+}
+
+struct exported_original {
+    uint64_t offset;
+    uint32_t index;
+};
+
+static int by_offset(const void* a, const void* b)
+{
+    const uint64_t x = ((const struct exported_original*) a)->offset;
+    const uint64_t y = ((const struct exported_original*) b)->offset;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * @brief Streams the record of an entry, then its original if it has one.
+ */
+static int export_entry(const struct imgfs_snapshot* snapshot, uint32_t index, char** buffer,
+                        size_t* buffer_size, snapshot_sink sink, void* arg)
+{
+    struct imgfs_export_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.index = index;
+    entry.metadata = snapshot->metadata[index];
+    memset(entry.metadata.size, 0, sizeof(entry.metadata.size));
+    memset(entry.metadata.offset, 0, sizeof(entry.metadata.offset));
+    if (entry.metadata.is_valid != NON_EMPTY) return sink(arg, (const char*) &entry, sizeof(entry));
+
+    const struct img_metadata* const md = &snapshot->metadata[index];
+    entry.size = md->size[ORIG_RES];
+    if (entry.size > *buffer_size) {
+        char* const grown = realloc(*buffer, entry.size);
+        if (grown == NULL) return ERR_OUT_OF_MEMORY;
+        *buffer = grown;
+        *buffer_size = entry.size;
+    }
+    if (md->offset[ORIG_RES] + entry.size > snapshot->size
+        || fseeko(snapshot->file, (off_t) md->offset[ORIG_RES], SEEK_SET) != 0
+        || (entry.size > 0 && fread(*buffer, entry.size, 1, snapshot->file) != 1)) {
+        return ERR_IO;
+    }
+    const int err = sink(arg, (const char*) &entry, sizeof(entry));
+    return err != ERR_NONE || entry.size == 0 ? err : sink(arg, *buffer, entry.size);
+}
+
+int imgfs_export(const struct imgfs_snapshot* snapshot, uint32_t since, snapshot_sink sink, void* arg)
+{
+    M_REQUIRE_NON_NULL(snapshot);
+    M_REQUIRE_NON_NULL(snapshot->file);
+    M_REQUIRE_NON_NULL(snapshot->metadata);
+    M_REQUIRE_NON_NULL(sink);
+
+    struct imgfs_export_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, sizeof(header.magic));
+    header.since = since;
+    header.version = snapshot->header.version;
+    header.max_files = snapshot->header.max_files;
+
+    // the originals, in the order of the file
+    struct exported_original* const originals = calloc(snapshot->header.max_files,
+                                                       sizeof(struct exported_original));
+    if (originals == NULL) return ERR_OUT_OF_MEMORY;
+    uint32_t nb_originals = 0;
+    for (uint32_t i = 0; i < snapshot->header.max_files; ++i) {
+        const int how = exported(&snapshot->metadata[i], since);
+        if (how != 0) ++header.nb_entries;
+        if (how > 0) {
+            originals[nb_originals].offset = snapshot->metadata[i].offset[ORIG_RES];
+            originals[nb_originals].index = i;
+            ++nb_originals;
+        }
+    }
+    qsort(originals, nb_originals, sizeof(struct exported_original), by_offset);
+    (void) posix_fadvise(fileno(snapshot->file), 0, (off_t) snapshot->size, POSIX_FADV_SEQUENTIAL);
+
+    char* buffer = NULL;
+    size_t buffer_size = 0;
+    int err = sink(arg, (const char*) &header, sizeof(header));
+    // the tombstones first, so that an image deleted then inserted again
+    // in another entry is never found twice
+    for (uint32_t i = 0; i < snapshot->header.max_files && err == ERR_NONE; ++i) {
+        if (exported(&snapshot->metadata[i], since) < 0) {
+            err = export_entry(snapshot, i, &buffer, &buffer_size, sink, arg);
+        }
+    }
+    for (uint32_t o = 0; o < nb_originals && err == ERR_NONE; ++o) {
+        err = export_entry(snapshot, originals[o].index, &buffer, &buffer_size, sink, arg);
+    }
+
+    free(buffer);
+    free(originals);
+    return err;
+}
+
+/**
+ * @brief Gives an entry the original of another one with the same SHA, if
+ *        the volume has one.
+ */
+static int share_original(const struct imgfs_file* imgfs_file, struct img_metadata* md, long* from)
+{
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        const struct img_metadata* const other = &imgfs_file->metadata[i];
+        if (other->is_valid == NON_EMPTY && other->offset[ORIG_RES] != 0
+            && memcmp(other->SHA, md->SHA, SHA256_DIGEST_LENGTH) == 0) {
+            memcpy(md->size, other->size, sizeof(md->size));
+            memcpy(md->offset, other->offset, sizeof(md->offset));
+            *from = (long) i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Applies one record of an export.
+ */
+static int import_entry(struct imgfs_file* imgfs_file, const struct imgfs_export_entry* entry,
+                        FILE* in, char** buffer, size_t* buffer_size)
+{
+    if (entry->index >= imgfs_file->header.max_files
+        || (entry->metadata.is_valid != NON_EMPTY && entry->size != 0)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct img_metadata md = entry->metadata;
+    memset(md.size, 0, sizeof(md.size));
+    memset(md.offset, 0, sizeof(md.offset));
+
+    if (entry->size > *buffer_size) {
+        char* const grown = realloc(*buffer, entry->size);
+        if (grown == NULL) return ERR_OUT_OF_MEMORY;
+        *buffer = grown;
+        *buffer_size = entry->size;
+    }
+    if (entry->size > 0 && fread(*buffer, entry->size, 1, in) != 1) return ERR_IO;
+
+    long from = -1;
+    if (md.is_valid == NON_EMPTY && !share_original(imgfs_file, &md, &from)) {
+        if (fseek(imgfs_file->file, 0L, SEEK_END) != 0) return ERR_IO;
+        const long offset = ftell(imgfs_file->file);
+        if (offset <= 0 || fwrite(*buffer, entry->size, 1, imgfs_file->file) != 1) return ERR_IO;
+        md.offset[ORIG_RES] = (uint64_t) offset;
+        md.size[ORIG_RES] = entry->size;
+    }
+
+    imgfs_file->metadata[entry->index] = md;
+    if (fseek(imgfs_file->file, (long) (sizeof(struct imgfs_header)
+                                        + entry->index * sizeof(struct img_metadata)), SEEK_SET) != 0
+        || fwrite(&md, sizeof(md), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return imgfs_ext_reset(imgfs_file, entry->index, from);
+}
+
+int imgfs_import(struct imgfs_file* imgfs_file, FILE* in)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(in);
+
+    struct imgfs_export_header header;
+    if (fread(&header, sizeof(header), 1, in) != 1) return ERR_IO;
+    if (memcmp(header.magic, EXPORT_MAGIC, sizeof(header.magic)) != 0
+        || header.max_files != imgfs_file->header.max_files
+        || header.since != imgfs_file->header.version || header.version < header.since) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    char* buffer = NULL;
+    size_t buffer_size = 0;
+    int err = ERR_NONE;
+    for (uint32_t e = 0; e < header.nb_entries && err == ERR_NONE; ++e) {
+        struct imgfs_export_entry entry;
+        err = fread(&entry, sizeof(entry), 1, in) == 1
+              ? import_entry(imgfs_file, &entry, in, &buffer, &buffer_size) : ERR_IO;
+    }
+    free(buffer);
+    if (err != ERR_NONE) return err;
+
+    imgfs_file->header.nb_files = 0;
+    for (uint32_t i = 0; i < imgfs_file->header.max_files; ++i) {
+        if (imgfs_file->metadata[i].is_valid == NON_EMPTY) ++imgfs_file->header.nb_files;
+    }
+    imgfs_file->header.version = header.version;
+    if (fseek(imgfs_file->file, 0L, SEEK_SET) != 0
+        || fwrite(&imgfs_file->header, sizeof(struct imgfs_header), 1, imgfs_file->file) != 1) {
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
+
+void imgfs_snapshot_release(struct imgfs_snapshot* snapshot)
+{
+    if (snapshot == NULL) return;
+    if (snapshot->file != NULL) fclose(snapshot->file);
+    free(snapshot->metadata);
+    free(snapshot->ext);
+    memset(snapshot, 0, sizeof(*snapshot));
+}
@@ -0,0 +1,140 @@
+/**
+ * @file imgfs_snapshot.h
+ * @brief Consistent copies of an imgFS that keeps changing.
+ *
+ * Copying the file of a volume while it is written mixes states: the
+ * header, the metadata and the extension table are rewritten in place. A
+ * snapshot pins them instead, copying them in memory when the volume is
+ * not being changed (under the lock of the caller), together with the end
+ * of the file at that time. The rest of the file is only appended to, so
+ * that its first bytes, up to that end, hold everything the pinned metadata
+ * refers to. Streaming a snapshot reads them sequentially, through its own
+ * FILE, and puts the pinned copies in place of the rewritten regions: the
+ * result is the volume as it was when pinned, while the writes go on.
+ *
+ * "imgfscmd gc", which moves images in place, must not run while a
+ * snapshot is streamed.
+ *
+ * A snapshot can also be exported incrementally: only the entries changed
+ * after a given version (img_metadata.version), as a header (struct
+ * imgfs_export_header) followed by one record per entry (struct
+ * imgfs_export_entry): first the deleted ones (tombstones), then the
+ * others, each followed by its original. Derivatives and the extension
+ * table are not exported; they are made again when needed. Importing the
+ * exports since 0, then since the version of each one, in order, gives
+ * the images of the volume.
+ */
+
+#pragma once
+
+#include "imgfs.h"
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAPSHOT_CHUNK (1024 * 1024) // bytes read at once when streaming
+
+#define EXPORT_MAGIC "IMGFSINC"
+
+struct imgfs_export_header {
+    char magic[8]; // EXPORT_MAGIC, without the null terminator
+    uint32_t since; // the entries changed after this version are exported (0: all the images)
+    uint32_t version; // version of the exported volume
+    uint32_t max_files; // that of the exported volume
+    uint32_t nb_entries; // records that follow
+};
+
+struct imgfs_export_entry {
+    uint32_t index; // in the metadata array
+    uint32_t size; // bytes of the original that follow (0 for a tombstone)
+    struct img_metadata metadata; // without derivatives
+};
+
+struct imgfs_snapshot {
+    FILE* file; // the volume, opened again, read-only
+    uint64_t size; // size of the volume when pinned
+    struct imgfs_header header; // pinned header
+    struct img_metadata* metadata; // pinned metadata (header.max_files)
+    char* ext; // pinned extension table, as in the file (NULL if none)
+    size_t ext_size;
+};
+
+/**
+ * @brief Where streamed bytes go.
+ *
+ * @param arg The argument given to imgfs_snapshot_stream().
+ * @return Some error code. 0 if no error; streaming stops otherwise.
+ */
+typedef int (*snapshot_sink)(void* arg, const char* bytes, size_t size);
+
+/**
+ * @brief Pins the current state of a volume. The caller must keep it from
+ *        changing meanwhile (this flushes its FILE).
+ *
+ * @param imgfs_file The volume, opened.
+ * @param imgfs_path Its file.
+ * @param snapshot Where to put the snapshot, to be released with
+ *                 imgfs_snapshot_release().
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_snapshot_pin(struct imgfs_file* imgfs_file, const char* imgfs_path,
+                       struct imgfs_snapshot* snapshot);
+
+/**
+ * @brief Streams a pinned snapshot: snapshot->size bytes forming a volume,
+ *        in order. The volume may change meanwhile.
+ *
+ * @param snapshot The snapshot, pinned.
+ * @param sink Called with each part of the volume, in order.
+ * @param arg Given to sink.
+ * @return Some error code (that of sink if it failed). 0 if no error.
+ */
+int imgfs_snapshot_stream(const struct imgfs_snapshot* snapshot, snapshot_sink sink, void* arg);
+
+/**
+ * @brief Gives the size of the incremental export of a snapshot.
+ *
+ * @param snapshot The snapshot, pinned.
+ * @param since The export contains the entries changed after this version;
+ *              0 for all the images.
+ * @param size Where to put the size, in bytes.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_export_size(const struct imgfs_snapshot* snapshot, uint32_t since, uint64_t* size);
+
+/**
+ * @brief Streams the incremental export of a snapshot. The originals are
+ *        read in the order of the file.
+ *
+ * @param snapshot The snapshot, pinned.
+ * @param since See imgfs_export_size().
+ * @param sink Called with each part of the export, in order.
+ * @param arg Given to sink.
+ * @return Some error code (that of sink if it failed). 0 if no error.
+ */
+int imgfs_export(const struct imgfs_snapshot* snapshot, uint32_t since, snapshot_sink sink, void* arg);
+
+/**
+ * @brief Applies an incremental export to a volume, which must be at the
+ *        version it was exported since (empty if since 0), with as many
+ *        entries. An image whose original the volume has already (same
+ *        SHA) shares it.
+ *
+ * @param imgfs_file The volume, opened for writing.
+ * @param in The export.
+ * @return Some error code. 0 if no error.
+ */
+int imgfs_import(struct imgfs_file* imgfs_file, FILE* in);
+
+/**
+ * @brief Releases a snapshot (does nothing if it is not pinned).
+ */
+void imgfs_snapshot_release(struct imgfs_snapshot* snapshot);
+
+#ifdef __cplusplus
+}
+#endif
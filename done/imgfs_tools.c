@@ -6,6 +6,7 @@
  */
 
 #include "imgfs.h"
+#include "imgfs_ext.h"
 #include "util.h"
 
 #include <inttypes.h>      // for PRIxN macros
@@ -44,10 +45,87 @@ THUMBNAIL: %" PRIu16 " x %" PRIu16 "\tSMALL: %" PRIu16 " x %" PRIu16 "\n",
            header->name, header->version, header->nb_files, header->max_files, header->resized_res[THUMB_RES * 2],
            header->resized_res[THUMB_RES * 2 + 1], header->resized_res[SMALL_RES * 2],
            header->resized_res[SMALL_RES * 2 + 1]);
+    if (header->encoding[THUMB_RES] != 0 || header->encoding[SMALL_RES] != 0) {
+        char thumb[MAX_ENCODING_STR + 1];
+        char small[MAX_ENCODING_STR + 1];
+        encoding_to_string(header->encoding[THUMB_RES], thumb);
+        encoding_to_string(header->encoding[SMALL_RES], small);
+        printf("THUMBNAIL ENCODING: %s\nSMALL ENCODING: %s\n", thumb, small);
+    }
+    if (header->ext_offset != 0) {
+        printf("EXTENSION TABLE AT: %" PRIu64 "\n", header->ext_offset);
+    }
     printf("*********** IMGFS HEADER END ************\n\
 *****************************************\n");
 }
 
+/*******************************************************************
+ * Derivative encoding settings.
+ */
+static const char* const subsample_names[] = { "auto", "on", "off" };
+
+int encoding_parse(const char* spec, uint16_t* encoding)
+{
+    M_REQUIRE_NON_NULL(spec);
+    M_REQUIRE_NON_NULL(encoding);
+
+    uint16_t enc = 0;
+    const char* option = spec;
+    while (*option != '\0') {
+        const char* end = strchr(option, ',');
+        const size_t len = end != NULL ? (size_t) (end - option) : strlen(option);
+        char word[MAX_ENCODING_STR + 1];
+        if (len == 0 || len > MAX_ENCODING_STR) return ERR_INVALID_ARGUMENT;
+        memcpy(word, option, len);
+        word[len] = '\0';
+
+        if (strncmp(word, "q=", 2) == 0) {
+            const uint16_t q = atouint16(word + 2);
+            if (q == 0 || q > 100) return ERR_INVALID_ARGUMENT;
+            enc = (uint16_t) ((enc & ~ENC_QUALITY) | q);
+        } else if (strncmp(word, "subsample=", 10) == 0) {
+            uint16_t mode = 0;
+            while (mode < 3 && strcmp(word + 10, subsample_names[mode]) != 0) ++mode;
+            if (mode == 3) return ERR_INVALID_ARGUMENT;
+            enc = (uint16_t) ((enc & ~ENC_SUBSAMPLE) | (mode * ENC_SUBSAMPLE_ON));
+        } else if (strcmp(word, "strip") == 0) {
+            enc |= ENC_STRIP;
+        } else if (strcmp(word, "progressive") == 0) {
+            enc |= ENC_PROGRESSIVE;
+        } else if (strcmp(word, "baseline") == 0) {
+            enc &= (uint16_t) ~ENC_PROGRESSIVE;
+        } else if (strcmp(word, "optimize") == 0) {
+            enc |= ENC_OPTIMIZE;
+        } else if (strcmp(word, "default") == 0) {
+            enc = 0;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+        option += len;
+        if (*option == ',') ++option;
+    }
+
+    *encoding = enc;
+    return ERR_NONE;
+}
+
+void encoding_to_string(uint16_t encoding, char* out)
+{
+    if (out == NULL) return;
+    if (encoding == 0) {
+        strcpy(out, "default");
+        return;
+    }
+    const unsigned int q = encoding & ENC_QUALITY;
+    const unsigned int mode = (encoding & ENC_SUBSAMPLE) / ENC_SUBSAMPLE_ON;
+    snprintf(out, MAX_ENCODING_STR + 1, "q=%u%s%s,subsample=%s%s",
+             q != 0 ? q : ENC_DEFAULT_QUALITY,
+             encoding & ENC_STRIP ? ",strip" : "",
+             encoding & ENC_PROGRESSIVE ? ",progressive" : ",baseline",
+             mode < 3 ? subsample_names[mode] : "auto",
+             encoding & ENC_OPTIMIZE ? ",optimize" : "");
+}
+
 /*******************************************************************
  * Metadata display.
  */
@@ -111,6 +189,8 @@ void do_close(struct imgfs_file* imgfs_file)
         return;
     }
 
+    imgfs_ext_release(imgfs_file);
+
     if (imgfs_file->file != NULL) {
         fclose(imgfs_file->file);
         imgfs_file->file = NULL;
@@ -136,3 +216,27 @@ int resolution_atoi (const char* str)
     }
     return -1;
 }
+
+static const char* const format_names[NB_FORMATS] = { "jpeg", "webp", "avif" };
+static const char* const format_mime_types[NB_FORMATS] = { "image/jpeg", "image/webp", "image/avif" };
+
+int format_atoi(const char* str)
+{
+    if (str == NULL) return -1;
+
+    if (!strcmp(str, "jpg")) return FORMAT_JPEG;
+    for (int format = 0; format < NB_FORMATS; ++format) {
+        if (!strcmp(str, format_names[format])) return format;
+    }
+    return -1;
+}
+
+const char* format_name(int format)
+{
+    return format >= 0 && format < NB_FORMATS ? format_names[format] : NULL;
+}
+
+const char* format_mime_type(int format)
+{
+    return format >= 0 && format < NB_FORMATS ? format_mime_types[format] : NULL;
+}
@@ -31,6 +31,12 @@ command_mapping_t commands[] = {
     {"delete", *do_delete_cmd},
     {"insert", *do_insert_cmd},
     {"read", *do_read_cmd},
+    {"encoding", *do_encoding_cmd},
+    {"savings", *do_savings_cmd},
+    {"optimize", *do_optimize_cmd},
+    {"similar", *do_similar_cmd},
+    {"export", *do_export_cmd},
+    {"import", *do_import_cmd},
     {NULL, NULL}
 };
 
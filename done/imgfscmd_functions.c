@@ -7,6 +7,10 @@
 
 #include "imgfs.h"
 #include "imgfscmd_functions.h"
+#include "image_content.h" // for do_encoding_report
+#include "image_optimize.h" // for do_optimize_originals
+#include "image_phash.h" // for do_near_duplicates
+#include "imgfs_snapshot.h" // for imgfs_export, imgfs_import
 #include "util.h"   // for _unused
 #include <stdint.h>
 #include <stdlib.h>
@@ -50,10 +54,34 @@ int help(int _unused argc, char** _unused argv)
     "          -small_res <X_RES> <Y_RES>: resolution for small images.\n"
     "                                  default value is 256x256\n"
     "                                  maximum value is 512x512\n"
+    "          -thumb_enc <ENCODING>: encoding of thumbnail images.\n"
+    "          -small_enc <ENCODING>: encoding of small images.\n"
+    "                                  default value is \"default\" (libvips defaults)\n"
+    "  encoding <imgFS_filename> [thumbnail|thumb|small <ENCODING>]:\n"
+    "      display or change the encoding of the images resized from now on.\n"
+    "      ENCODING is a comma-separated list among q=<1-100>, strip,\n"
+    "      progressive, baseline, subsample=<auto|on|off>, optimize, default.\n"
+    "  savings <imgFS_filename> [max_images]: show the bytes the encoding\n"
+    "      saves over the default one, by encoding the resized images again.\n"
     "  read   <imgFS_filename> <imgID> [original|orig|thumbnail|thumb|small]:\n"
     "      read an image from the imgFS and save it to a file.\n"
     "      default resolution is \"original\".\n"
+    "      a format jpeg|webp|avif may follow a resized resolution;\n"
+    "      default format is \"jpeg\".\n"
     "  insert <imgFS_filename> <imgID> <filename>: insert a new image in the imgFS.\n"
+    "      -optimize after the filename recompresses it losslessly.\n"
+    "  optimize <imgFS_filename> [max_images|report]: recompress the originals\n"
+    "      losslessly (smaller entropy coding, no thumbnail nor extra metadata)\n"
+    "      and show the bytes saved; \"report\" only shows them.\n"
+    "  similar <imgFS_filename> [max_distance] [-alias]: list the images which\n"
+    "      are near-duplicates of another one (perceptual hash of the thumbnail).\n"
+    "      default max_distance is 8 bits (out of 64).\n"
+    "      -alias makes them share the content of the other one, if not larger.\n"
+    "  export <imgFS_filename> <filename> [since_version]: write the images\n"
+    "      changed after since_version, and the deletions, to a file.\n"
+    "      default since_version is 0 (all the images).\n"
+    "  import <imgFS_filename> <filename>: apply an export to the imgFS,\n"
+    "      which must be at the version it was exported since.\n"
     "  delete <imgFS_filename> <imgID>: delete image imgID from imgFS.\n";
     printf("%s", help_message);
     return 0;
@@ -156,6 +184,11 @@ int do_create_cmd(int argc, char** argv)
             if (res_x == 0 || res_y == 0 || res_x > MAX_SMALL_RES || res_y > MAX_SMALL_RES) return ERR_RESOLUTIONS;
             imgfs_file.header.resized_res[2] = res_x;
             imgfs_file.header.resized_res[3] = res_y;
+        } else if (strcmp(argv[i], "-thumb_enc") == 0 || strcmp(argv[i], "-small_enc") == 0) {
+            if (i + 1 >= argc) return ERR_NOT_ENOUGH_ARGUMENTS;
+            const int res = argv[i][1] == 't' ? THUMB_RES : SMALL_RES;
+            int err = encoding_parse(argv[++i], &imgfs_file.header.encoding[res]);
+            if (err != ERR_NONE) return err;
         } else {
             return ERR_INVALID_ARGUMENT;
         }
@@ -216,18 +249,22 @@ int do_delete_cmd(int argc, char **argv)
  * @brief Creates a new name for the image based on the resolution.
  *
  * This function generates a new name for the image appending the appropriate
- * resolution to the img_id and adding the ".jpg" extension.
+ * resolution to the img_id and adding the extension of the format (".jpg" for JPEG).
  *
  * @param img_id The image ID.
  * @param resolution The resolution of the image.
+ * @param format The format of the image.
  * @param new_name Pointer to the buffer where the new name will be stored.
  */
-static void create_name(const char* img_id, int resolution, char** new_name)
+static void create_name(const char* img_id, int resolution, int format, char** new_name)
 {
     if (img_id == NULL) return;
     if (resolution < THUMB_RES || resolution > ORIG_RES) return;
+    if (format < 0 || format >= NB_FORMATS) return;
     if (strlen(img_id) > MAX_IMG_ID) return;
 
+    const char* const extension = format == FORMAT_JPEG ? "jpg" : format_name(format);
+
     const char* suffix;
     switch (resolution) {
     case ORIG_RES:
@@ -244,10 +281,10 @@ static void create_name(const char* img_id, int resolution, char** new_name)
         break;
     }
 
-    size_t name_length = strlen(img_id) + strlen(suffix) + 5; // dot + jpg + end terminator
+    size_t name_length = strlen(img_id) + strlen(suffix) + strlen(extension) + 2; // dot + end terminator
     *new_name = (char*)malloc(name_length);
     if (*new_name != NULL) {
-        snprintf(*new_name, name_length, "%s%s.jpg", img_id, suffix);
+        snprintf(*new_name, name_length, "%s%s.%s", img_id, suffix, extension);
     } else {
         return;
     }
@@ -345,13 +382,16 @@ static int read_disk_image(const char *path, char **image_buffer, uint32_t *imag
 int do_read_cmd(int argc, char **argv)
 {
     M_REQUIRE_NON_NULL(argv);
-    if (argc != 2 && argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc < 2 || argc > 4) return ERR_NOT_ENOUGH_ARGUMENTS;
 
     const char* img_id = argv[1];
 
-    int resolution = (argc == 3) ? resolution_atoi(argv[2]) : ORIG_RES;
+    int resolution = (argc >= 3) ? resolution_atoi(argv[2]) : ORIG_RES;
     if (resolution == -1) return ERR_RESOLUTIONS;
 
+    const int format = (argc == 4) ? format_atoi(argv[3]) : FORMAT_JPEG;
+    if (format == -1 || (format != FORMAT_JPEG && resolution == ORIG_RES)) return ERR_INVALID_ARGUMENT;
+
     struct imgfs_file myfile;
     zero_init_var(myfile);
     int error = do_open(argv[0], "rb+", &myfile);
@@ -359,7 +399,7 @@ int do_read_cmd(int argc, char **argv)
 
     char *image_buffer = NULL;
     uint32_t image_size = 0;
-    error = do_read(img_id, resolution, &image_buffer, &image_size, &myfile);
+    error = do_read_format(img_id, resolution, format, &image_buffer, &image_size, &myfile);
     do_close(&myfile);
     if (error != ERR_NONE) {
         return error;
@@ -367,7 +407,7 @@ int do_read_cmd(int argc, char **argv)
 
     // Extracting to a separate image file.
     char* tmp_name = NULL;
-    create_name(img_id, resolution, &tmp_name);
+    create_name(img_id, resolution, format, &tmp_name);
     if (tmp_name == NULL) return ERR_OUT_OF_MEMORY;
     error = write_disk_image(tmp_name, image_buffer, image_size);
     free(tmp_name);
@@ -386,7 +426,13 @@ int do_read_cmd(int argc, char **argv)
 int do_insert_cmd(int argc, char **argv)
 {
     M_REQUIRE_NON_NULL(argv);
-    if (argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc != 3 && argc != 4) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    unsigned flags = 0;
+    if (argc == 4) {
+        if (strcmp(argv[3], "-optimize") != 0) return ERR_INVALID_ARGUMENT;
+        flags |= INSERT_OPTIMIZE;
+    }
 
     struct imgfs_file myfile;
     zero_init_var(myfile);
@@ -403,8 +449,234 @@ int do_insert_cmd(int argc, char **argv)
         return error;
     }
 
-    error = do_insert(image_buffer, image_size, argv[1], &myfile);
+    error = do_insert_flags(image_buffer, image_size, argv[1], &myfile, flags);
     free(image_buffer);
     do_close(&myfile);
     return error;
 }
+
+/**
+ * @brief Displays or changes the encoding of the resized images.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, then
+ *             optionally a resolution and its new encoding.
+ * @return The error code (ERR_NONE if none).
+ */
+int do_encoding_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 1 && argc != 3) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    int resolution = ORIG_RES;
+    uint16_t encoding = 0;
+    if (argc == 3) {
+        resolution = resolution_atoi(argv[1]);
+        if (resolution != THUMB_RES && resolution != SMALL_RES) return ERR_RESOLUTIONS;
+        int err = encoding_parse(argv[2], &encoding);
+        if (err != ERR_NONE) return err;
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], argc == 3 ? "rb+" : "rb", &myfile);
+    if (error != ERR_NONE) return error;
+
+    if (argc == 3) {
+        myfile.header.encoding[resolution] = encoding;
+        if (fseek(myfile.file, 0L, SEEK_SET) != 0
+            || fwrite(&myfile.header, sizeof(struct imgfs_header), 1, myfile.file) != 1) {
+            error = ERR_IO;
+        }
+    }
+
+    if (error == ERR_NONE) {
+        char description[MAX_ENCODING_STR + 1];
+        encoding_to_string(myfile.header.encoding[THUMB_RES], description);
+        printf("THUMBNAIL ENCODING: %s\n", description);
+        encoding_to_string(myfile.header.encoding[SMALL_RES], description);
+        printf("SMALL ENCODING: %s\n", description);
+    }
+
+    do_close(&myfile);
+    return error;
+}
+
+/**
+ * @brief Shows the bytes saved by the encoding of the resized images.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, then
+ *             optionally the maximum number of images to measure.
+ * @return The error code (ERR_NONE if none).
+ */
+int do_savings_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 1 && argc != 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    uint32_t max_images = 0;
+    if (argc == 2) {
+        max_images = atouint32(argv[1]);
+        if (max_images == 0) return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb", &myfile);
+    if (error != ERR_NONE) return error;
+
+    error = do_encoding_report(&myfile, max_images);
+    do_close(&myfile);
+    return error;
+}
+
+/**
+ * @brief Recompresses the originals losslessly, then shows the bytes saved.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, then
+ *             optionally how many originals to process, or "report".
+ * @return The error code (ERR_NONE if none).
+ */
+int do_optimize_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc != 1 && argc != 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+
+    const int report_only = argc == 2 && strcmp(argv[1], "report") == 0;
+    uint32_t max_images = 0;
+    if (argc == 2 && !report_only) {
+        max_images = atouint32(argv[1]);
+        if (max_images == 0) return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], report_only ? "rb" : "rb+", &myfile);
+    if (error != ERR_NONE) return error;
+
+    if (!report_only) error = do_optimize_originals(&myfile, max_images);
+    if (error == ERR_NONE) error = do_optimize_report(&myfile);
+    do_close(&myfile);
+    return error;
+}
+
+/**
+ * @brief Lists the near-duplicate images, after hashing those not hashed yet.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, then
+ *             optionally the largest distance and "-alias".
+ * @return The error code (ERR_NONE if none).
+ */
+int do_similar_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 1) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 3) return ERR_INVALID_COMMAND;
+
+    int policy = NEAR_DUP_REPORT;
+    if (argc > 1 && strcmp(argv[argc - 1], "-alias") == 0) {
+        policy = NEAR_DUP_ALIAS;
+        --argc;
+    }
+    if (argc > 2) return ERR_INVALID_ARGUMENT;
+
+    unsigned max_distance = PHASH_DEFAULT_DISTANCE;
+    if (argc == 2) {
+        if (strcmp(argv[1], "0") == 0) {
+            max_distance = 0;
+        } else {
+            max_distance = atouint16(argv[1]);
+            if (max_distance == 0) return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb+", &myfile);
+    if (error != ERR_NONE) return error;
+
+    error = do_near_duplicates(&myfile, max_distance, policy);
+    do_close(&myfile);
+    return error;
+}
+
+static int write_export(void* file, const char* bytes, size_t size)
+{
+    return fwrite(bytes, size, 1, file) == 1 ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * @brief Writes the images changed after a version to a file.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, the
+ *             file to write, then optionally the version.
+ * @return The error code (ERR_NONE if none).
+ */
+int do_export_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 3) return ERR_INVALID_COMMAND;
+
+    uint32_t since = 0;
+    if (argc == 3 && strcmp(argv[2], "0") != 0) {
+        since = atouint32(argv[2]);
+        if (since == 0) return ERR_INVALID_ARGUMENT;
+    }
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb", &myfile);
+    if (error != ERR_NONE) return error;
+
+    struct imgfs_snapshot snapshot;
+    error = imgfs_snapshot_pin(&myfile, argv[0], &snapshot);
+    do_close(&myfile);
+    if (error != ERR_NONE) return error;
+
+    FILE* out = fopen(argv[1], "wb");
+    if (out == NULL) {
+        imgfs_snapshot_release(&snapshot);
+        return ERR_IO;
+    }
+    error = imgfs_export(&snapshot, since, write_export, out);
+    if (fclose(out) != 0 && error == ERR_NONE) error = ERR_IO;
+    if (error == ERR_NONE) {
+        printf("Exported version %" PRIu32 " since %" PRIu32 "\n", snapshot.header.version, since);
+    }
+    imgfs_snapshot_release(&snapshot);
+    return error;
+}
+
+/**
+ * @brief Applies an export to an imgFS.
+ *
+ * @param argc Number of command line arguments.
+ * @param argv Array of command line arguments: the imgFS filename, then
+ *             the export.
+ * @return The error code (ERR_NONE if none).
+ */
+int do_import_cmd(int argc, char **argv)
+{
+    M_REQUIRE_NON_NULL(argv);
+    if (argc < 2) return ERR_NOT_ENOUGH_ARGUMENTS;
+    if (argc > 2) return ERR_INVALID_COMMAND;
+
+    FILE* in = fopen(argv[1], "rb");
+    if (in == NULL) return ERR_IO;
+
+    struct imgfs_file myfile;
+    zero_init_var(myfile);
+    int error = do_open(argv[0], "rb+", &myfile);
+    if (error == ERR_NONE) {
+        error = imgfs_import(&myfile, in);
+        if (error == ERR_NONE) printf("Imported up to version %" PRIu32 "\n", myfile.header.version);
+        do_close(&myfile);
+    }
+    fclose(in);
+    return error;
+}
@@ -36,3 +36,33 @@ int do_insert_cmd(int argc, char* argv[]);
  * Reads an image from the imgFS.
  *******************************************************************/
 int do_read_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Displays or changes the encoding of the resized images.
+ *******************************************************************/
+int do_encoding_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Shows the bytes saved by the encoding of the resized images.
+ *******************************************************************/
+int do_savings_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Recompresses the originals losslessly and shows the bytes saved.
+ *******************************************************************/
+int do_optimize_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Lists the near-duplicate images, and aliases them if asked.
+ *******************************************************************/
+int do_similar_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Writes the images changed after a version to a file.
+ *******************************************************************/
+int do_export_cmd(int argc, char* argv[]);
+
+/********************************************************************
+ * Applies an export to an imgFS.
+ *******************************************************************/
+int do_import_cmd(int argc, char* argv[]);
@@ -0,0 +1,432 @@
+/**
+ * @file intake.c
+ * @brief Asynchronous inserts through a durable intake log (see intake.h).
+ *
+ * The log is a header (its magic and the offset of the first upload not
+ * inserted) followed by the uploads, each a record header, the image id
+ * and the image. Records are in the byte order of the server, as the
+ * volume is. The uploads are appended and synced under intake_lock, so
+ * that the background thread only sees acknowledged ones; it reads each
+ * image back from the log, the part of the log before log_end never
+ * changing until the log is emptied, by that thread.
+ *
+ * The uploads, waiting and done, are kept in acceptance order in
+ * entries: [first, next) are done, [next, count) are waiting. The
+ * oldest done ones are forgotten past INTAKE_MAX_STATUSES.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <json-c/json.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "intake.h"
+#include "error.h"
+#include "lock_prof.h"
+#include "imgfs.h" // for MAX_IMG_ID
+#include "util.h" // _unused, block_stop_signals
+
+#define INTAKE_LOG_MAGIC "IMGFSIN1"
+#define INTAKE_RECORD_MAGIC 0x494e544bU // "INTK"
+
+struct intake_log_header {
+    char magic[8];
+    uint64_t applied; // offset of the first record not inserted
+};
+
+struct intake_record {
+    uint32_t magic;
+    uint32_t image_size;
+    uint32_t checksum; // of the id and the image
+    uint8_t id_len;
+    uint8_t unused[3];
+    int64_t accepted_ms;
+};
+
+enum intake_state { QUEUED, READABLE, FAILED };
+
+struct intake_entry {
+    char img_id[MAX_IMG_ID + 1];
+    uint64_t offset; // of its record in the log
+    uint64_t record_size; // with its id and image
+    uint32_t image_size;
+    int replayed; // found in the log at startup
+    enum intake_state state;
+    int error; // FAILED
+    int64_t accepted_ms;
+    int64_t readable_ms;
+};
+
+static struct prof_mutex intake_lock = PROF_MUTEX_INITIALIZER("intake");
+static pthread_cond_t queued = PTHREAD_COND_INITIALIZER;
+static pthread_t applier;
+static int running = 0;
+static int log_fd = -1;
+static uint64_t log_end = 0;
+static intake_insert_fn insert_image = NULL;
+static intake_exists_fn image_exists = NULL;
+
+static struct intake_entry* entries = NULL;
+static size_t capacity = 0;
+static size_t first = 0;
+static size_t next = 0;
+static size_t count = 0;
+static uint64_t nb_inserted = 0;
+static uint64_t nb_failed = 0;
+
+static int64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief FNV-1a, enough to tell a record cut short from a whole one.
+ */
+static uint32_t checksum(const char* img_id, size_t id_len, const char* image, size_t size)
+{
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < id_len; ++i) hash = (hash ^ (unsigned char) img_id[i]) * 16777619U;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ (unsigned char) image[i]) * 16777619U;
+    return hash;
+}
+
+static int pread_all(int fd, void* data, size_t size, uint64_t offset)
+{
+    char* p = data;
+    while (size > 0) {
+        const ssize_t n = pread(fd, p, size, (off_t) offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO;
+        p += n;
+        size -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return ERR_NONE;
+}
+
+static int write_header(uint64_t applied)
+{
+    struct intake_log_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INTAKE_LOG_MAGIC, sizeof(header.magic));
+    header.applied = applied;
+    return pwrite(log_fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * @brief Appends an entry, forgetting the oldest done ones if there are
+ *        too many. To be called with intake_lock held.
+ */
+static int push_entry(const struct intake_entry* entry)
+{
+    if (next - first > INTAKE_MAX_STATUSES) first = next - INTAKE_MAX_STATUSES;
+    if (count == capacity && first > 0) {
+        memmove(entries, entries + first, (count - first) * sizeof(*entries));
+        next -= first;
+        count -= first;
+        first = 0;
+    }
+    if (count == capacity) {
+        const size_t grown = capacity == 0 ? 64 : 2 * capacity;
+        struct intake_entry* const resized = realloc(entries, grown * sizeof(*entries));
+        if (resized == NULL) return ERR_OUT_OF_MEMORY;
+        entries = resized;
+        capacity = grown;
+    }
+    entries[count++] = *entry;
+    return ERR_NONE;
+}
+
+/**
+ * @brief The last entry of an id, NULL if none. To be called with intake_lock held.
+ */
+static const struct intake_entry* find_entry(const char* img_id)
+{
+    for (size_t i = count; i > first; --i) {
+        if (strcmp(entries[i - 1].img_id, img_id) == 0) return &entries[i - 1];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Reads the log: queues the uploads not inserted yet, and drops a
+ *        last one cut short.
+ */
+static int load_log(void)
+{
+    struct stat st;
+    if (fstat(log_fd, &st) != 0) return ERR_IO;
+    struct intake_log_header header;
+    if (st.st_size == 0) {
+        log_end = sizeof(header);
+        return write_header(log_end);
+    }
+    if (pread_all(log_fd, &header, sizeof(header), 0) != ERR_NONE
+        || memcmp(header.magic, INTAKE_LOG_MAGIC, sizeof(header.magic)) != 0
+        || header.applied < sizeof(header) || header.applied > (uint64_t) st.st_size) {
+        return ERR_INVALID_FILENAME;
+    }
+
+    uint64_t offset = header.applied;
+    while (offset + sizeof(struct intake_record) <= (uint64_t) st.st_size) {
+        struct intake_record record;
+        if (pread_all(log_fd, &record, sizeof(record), offset) != ERR_NONE) return ERR_IO;
+        const uint64_t record_size = sizeof(record) + record.id_len + (uint64_t) record.image_size;
+        if (record.magic != INTAKE_RECORD_MAGIC || record.id_len == 0 || record.id_len > MAX_IMG_ID
+            || offset + record_size > (uint64_t) st.st_size) {
+            break;
+        }
+        char* const bytes = malloc(record.id_len + (size_t) record.image_size);
+        if (bytes == NULL) return ERR_OUT_OF_MEMORY;
+        int err = pread_all(log_fd, bytes, record.id_len + (size_t) record.image_size, offset + sizeof(record));
+        if (err == ERR_NONE && checksum(bytes, record.id_len, bytes + record.id_len, record.image_size)
+            != record.checksum) {
+            free(bytes);
+            break;
+        }
+
+        struct intake_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.img_id, bytes, record.id_len);
+        free(bytes);
+        entry.offset = offset;
+        entry.record_size = record_size;
+        entry.image_size = record.image_size;
+        entry.replayed = 1;
+        entry.state = QUEUED;
+        entry.accepted_ms = record.accepted_ms;
+        if (err == ERR_NONE) err = push_entry(&entry);
+        if (err != ERR_NONE) return err;
+        offset += record_size;
+    }
+
+    if (offset < (uint64_t) st.st_size) {
+        fprintf(stderr, "Intake log: dropping %llu bytes of an upload cut short\n",
+                (unsigned long long) ((uint64_t) st.st_size - offset));
+        if (ftruncate(log_fd, (off_t) offset) != 0) return ERR_IO;
+    }
+    log_end = offset;
+    if (count > 0) {
+        printf("Intake log: %zu uploads to insert\n", count);
+    } else if (log_end > sizeof(header)) {
+        // all inserted, but not emptied yet
+        log_end = sizeof(header);
+        if (ftruncate(log_fd, (off_t) log_end) != 0) return ERR_IO;
+        return write_header(log_end);
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Inserts the upload of entries[next], then records its outcome.
+ *        To be called with intake_lock held, which is released meanwhile.
+ */
+static void apply_next(void)
+{
+    const struct intake_entry entry = entries[next];
+    prof_mutex_unlock(&intake_lock);
+
+    int err = ERR_OUT_OF_MEMORY;
+    char* const image = malloc(entry.image_size);
+    if (image != NULL) {
+        err = pread_all(log_fd, image, entry.image_size, entry.offset + entry.record_size - entry.image_size);
+        if (err == ERR_NONE) err = insert_image(entry.img_id, image, entry.image_size);
+        free(image);
+    }
+    // inserted before a crash, but not recorded as such
+    if (err == ERR_DUPLICATE_ID && entry.replayed) err = ERR_NONE;
+
+    prof_mutex_lock(&intake_lock);
+    struct intake_entry* const done = &entries[next]; // entries may have moved meanwhile
+    done->state = err == ERR_NONE ? READABLE : FAILED;
+    done->error = err;
+    done->readable_ms = err == ERR_NONE ? now_ms() : 0;
+    if (err == ERR_NONE) ++nb_inserted;
+    else ++nb_failed;
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Intake of %s failed: %s\n", entry.img_id, ERR_MSG(err));
+    }
+    ++next;
+
+    if (next == count) {
+        // all inserted: empties the log
+        log_end = sizeof(struct intake_log_header);
+        if (ftruncate(log_fd, (off_t) log_end) != 0 || write_header(log_end) != ERR_NONE) {
+            fprintf(stderr, "Intake log: cannot empty the log\n");
+        }
+    } else if (write_header(entry.offset + entry.record_size) != ERR_NONE) {
+        fprintf(stderr, "Intake log: cannot record the progress\n");
+    }
+}
+
+static void* applier_main(void* arg _unused)
+{
+    block_stop_signals();
+
+    prof_mutex_lock(&intake_lock);
+    while (running) {
+        if (next == count) {
+            prof_cond_wait(&queued, &intake_lock);
+            continue;
+        }
+        apply_next();
+    }
+    prof_mutex_unlock(&intake_lock);
+    return NULL;
+}
+
+int intake_start(const char* path, intake_insert_fn insert, intake_exists_fn exists)
+{
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(insert);
+    M_REQUIRE_NON_NULL(exists);
+    if (log_fd >= 0) return ERR_INVALID_ARGUMENT;
+
+    log_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (log_fd < 0) return ERR_IO;
+    insert_image = insert;
+    image_exists = exists;
+    int err = load_log();
+    if (err == ERR_NONE) {
+        running = 1;
+        if (pthread_create(&applier, NULL, applier_main, NULL) != 0) {
+            running = 0;
+            err = ERR_THREADING;
+        }
+    }
+    if (err != ERR_NONE) {
+        close(log_fd);
+        log_fd = -1;
+        free(entries);
+        entries = NULL;
+        capacity = first = next = count = 0;
+    }
+    return err;
+}
+
+int intake_enabled(void)
+{
+    return log_fd >= 0;
+}
+
+int intake_submit(const char* img_id, const char* image, size_t size)
+{
+    M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(image);
+    const size_t id_len = strlen(img_id);
+    if (id_len == 0 || id_len > MAX_IMG_ID) return ERR_INVALID_IMGID;
+    if (size == 0 || size > UINT32_MAX) return ERR_INVALID_ARGUMENT;
+    if (log_fd < 0) return ERR_INVALID_COMMAND;
+    // the queue first: the volume is only searched for ids not waiting
+    prof_mutex_lock(&intake_lock);
+    const struct intake_entry* const waiting = find_entry(img_id);
+    const int is_queued = waiting != NULL && waiting->state == QUEUED;
+    prof_mutex_unlock(&intake_lock);
+    if (is_queued || image_exists(img_id)) return ERR_DUPLICATE_ID;
+
+    struct intake_record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = INTAKE_RECORD_MAGIC;
+    record.image_size = (uint32_t) size;
+    record.checksum = checksum(img_id, id_len, image, size);
+    record.id_len = (uint8_t) id_len;
+    record.accepted_ms = now_ms();
+    struct iovec parts[3] = {
+        { &record, sizeof(record) },
+        { (char*) (uintptr_t) img_id, id_len },
+        { (char*) (uintptr_t) image, size }
+    };
+    const uint64_t record_size = sizeof(record) + id_len + size;
+
+    prof_mutex_lock(&intake_lock);
+    const struct intake_entry* const last = find_entry(img_id); // again: it may have been queued meanwhile
+    int err = last != NULL && last->state == QUEUED ? ERR_DUPLICATE_ID : ERR_NONE;
+    if (err == ERR_NONE
+        && (pwritev(log_fd, parts, 3, (off_t) log_end) != (ssize_t) record_size || fdatasync(log_fd) != 0)) {
+        err = ERR_IO;
+    }
+    if (err == ERR_NONE) {
+        struct intake_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        strcpy(entry.img_id, img_id);
+        entry.offset = log_end;
+        entry.record_size = record_size;
+        entry.image_size = (uint32_t) size;
+        entry.state = QUEUED;
+        entry.accepted_ms = record.accepted_ms;
+        err = push_entry(&entry);
+    }
+    if (err == ERR_NONE) {
+        log_end += record_size;
+        pthread_cond_signal(&queued);
+    }
+    prof_mutex_unlock(&intake_lock);
+    return err;
+}
+
+int intake_status_json(const char* img_id, char** json)
+{
+    M_REQUIRE_NON_NULL(json);
+
+    json_object* jobj = json_object_new_object();
+    if (img_id == NULL) {
+        prof_mutex_lock(&intake_lock);
+        json_object_object_add(jobj, "queued", json_object_new_int64((int64_t) (count - next)));
+        json_object_object_add(jobj, "inserted", json_object_new_int64((int64_t) nb_inserted));
+        json_object_object_add(jobj, "failed", json_object_new_int64((int64_t) nb_failed));
+        json_object_object_add(jobj, "log_bytes", json_object_new_int64((int64_t) log_end));
+        prof_mutex_unlock(&intake_lock);
+    } else {
+        json_object_object_add(jobj, "img_id", json_object_new_string(img_id));
+        prof_mutex_lock(&intake_lock);
+        const struct intake_entry* const entry = find_entry(img_id);
+        const char* state = "unknown";
+        if (entry != NULL) {
+            json_object_object_add(jobj, "accepted_ms", json_object_new_int64(entry->accepted_ms));
+            if (entry->state == QUEUED) {
+                state = "queued";
+                json_object_object_add(jobj, "ahead", json_object_new_int64((int64_t) (entry - entries) - (int64_t) next));
+            } else if (entry->state == READABLE) {
+                state = "readable";
+                json_object_object_add(jobj, "readable_ms", json_object_new_int64(entry->readable_ms));
+            } else {
+                state = "failed";
+                json_object_object_add(jobj, "error", json_object_new_string(ERR_MSG(entry->error)));
+            }
+        }
+        prof_mutex_unlock(&intake_lock);
+        // inserted otherwise, or long ago
+        if (entry == NULL && image_exists != NULL && image_exists(img_id)) state = "readable";
+        json_object_object_add(jobj, "state", json_object_new_string(state));
+    }
+
+    *json = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+    return *json != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+}
+
+void intake_stop(void)
+{
+    if (log_fd < 0) return;
+    prof_mutex_lock(&intake_lock);
+    running = 0;
+    pthread_cond_signal(&queued);
+    prof_mutex_unlock(&intake_lock);
+    pthread_join(applier, NULL);
+
+    close(log_fd);
+    log_fd = -1;
+    free(entries);
+    entries = NULL;
+    capacity = first = next = count = 0;
+}
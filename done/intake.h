@@ -0,0 +1,76 @@
+/**
+ * @file intake.h
+ * @brief Asynchronous inserts of the imgFS server, through a durable intake log.
+ *
+ * In intake mode (INTAKE_LOG_ENV), an upload is appended to the intake
+ * log and synced to disk, and the server answers 202 Accepted at once. A
+ * background thread then inserts the uploads in order (hashing,
+ * deduplication, validation and placement in the volume), and records
+ * when each image became readable, or why it failed.
+ *
+ * The log starts with the offset of its first upload not inserted yet,
+ * updated after each insert. At startup, the uploads from that offset on
+ * are inserted again; one whose id is then in the volume is taken as
+ * inserted before a crash. An upload cut short by a crash (never
+ * acknowledged) ends the log, and is dropped. Once every upload is
+ * inserted, the log is emptied.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+
+#define INTAKE_LOG_ENV "IMGFS_INTAKE_LOG" // the intake log; inserts are synchronous if unset
+#define INTAKE_MAX_STATUSES 4096 // ids whose outcome is kept, besides those waiting
+
+/**
+ * @brief Inserts an image in the volume; returns some error code.
+ */
+typedef int (*intake_insert_fn)(const char* img_id, const char* image, size_t size);
+
+/**
+ * @brief Whether an image is in the volume.
+ */
+typedef int (*intake_exists_fn)(const char* img_id);
+
+/**
+ * @brief Opens (or creates) the intake log, and starts the background
+ *        thread, which first inserts the uploads left from the last run.
+ *
+ * @param path The intake log.
+ * @return Some error code. 0 if no error.
+ */
+int intake_start(const char* path, intake_insert_fn insert, intake_exists_fn exists);
+
+/**
+ * @brief Whether the server is in intake mode.
+ */
+int intake_enabled(void);
+
+/**
+ * @brief Appends an upload to the intake log, durably.
+ *
+ * @return Some error code. 0 if no error: the image will be inserted.
+ *         ERR_DUPLICATE_ID if an image of this id is in the volume or
+ *         waiting to be inserted.
+ */
+int intake_submit(const char* img_id, const char* image, size_t size);
+
+/**
+ * @brief The status of an upload in JSON: its state ("queued",
+ *        "readable", "failed" or "unknown"), when it was accepted and
+ *        became readable (milliseconds since the epoch), or its error.
+ *        Without an id, the state of the intake: uploads waiting,
+ *        inserted and failed, and the size of the log.
+ *
+ * @param img_id The id of the upload, NULL for the intake.
+ * @param json Set to the JSON, to be freed by the caller.
+ * @return Some error code. 0 if no error.
+ */
+int intake_status_json(const char* img_id, char** json);
+
+/**
+ * @brief Stops the background thread once the insert in progress, if
+ *        any, is done; the uploads left are inserted at the next start.
+ */
+void intake_stop(void);
@@ -0,0 +1,623 @@
+/**
+ * @file loadgen.c
+ * @brief HTTP load generator for the imgFS server.
+ *
+ * Worker threads send a configurable mix of list, read (per resolution),
+ * insert and delete requests. Image ids follow a Zipf distribution over a
+ * fixed set of names, so that a few images are hot. With a target rate
+ * (-r), the load is open loop: request start times are scheduled in
+ * advance (Poisson or uniform arrivals) and latencies are measured from
+ * the scheduled time, so that a slow server cannot hide its queueing
+ * delay by slowing the generator down. Without a rate, each worker sends
+ * its next request as soon as the previous one is answered (closed loop).
+ *
+ * With -U, the server is reached on its Unix domain socket instead of
+ * host:port (IMGFS_UNIX_SOCKET), for comparing the latencies of the two
+ * transports on the same machine: the requests are the same.
+ *
+ * Each worker is a client of one connection (imgfs_client.h). With
+ * keep-alive (-k), it is reused as long as the server keeps it open; a
+ * request on a connection closed by the server is sent again on a new one
+ * and counted as a reconnect.
+ *
+ * Latencies are kept in log-linear histograms (1/32 relative precision),
+ * per operation, and reported as percentiles or as a full distribution.
+ */
+
+#include <errno.h>
+#include <inttypes.h> // PRIu64
+#include <json-c/json.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "imgfs.h" // for *_RES
+#include "imgfs_client.h"
+#include "util.h" // zero_init_var
+
+#define DEFAULT_PORT "8000"
+#define MAX_THREADS 1024
+#define MAX_ID_LEN 127
+
+// log-linear histogram: values below 2*SUB_BUCKETS are exact,
+// above, each power of two is split in SUB_BUCKETS buckets
+#define SUB_BITS 5
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define HIST_BUCKETS (2 * SUB_BUCKETS + 58 * SUB_BUCKETS)
+
+enum op { OP_LIST, OP_THUMB, OP_SMALL, OP_ORIG, OP_INSERT, OP_DELETE, NB_OPS };
+
+static const char* const op_names[NB_OPS] = {
+    "list", "thumb", "small", "orig", "insert", "delete"
+};
+
+struct options {
+    const char* host;
+    const char* port;
+    const char* unix_path; // Unix domain socket of the server, instead of host:port
+    double duration;     // seconds
+    double rate;         // requests per second, 0 for closed loop
+    int poisson;         // Poisson (1) or uniform (0) arrivals
+    unsigned int threads;
+    unsigned int weights[NB_OPS];
+    unsigned int nb_ids;
+    double zipf_s;
+    int keep_alive;
+    const char* prefix;
+    const char* image_path;
+    int prepopulate;
+    int json;
+    int full_histogram;
+};
+
+struct stats {
+    uint64_t hist[NB_OPS][HIST_BUCKETS]; // latencies in nanoseconds
+    uint64_t status[NB_OPS][6];          // 0: no answer, 1..5: status class
+    uint64_t bytes_received;
+    uint64_t reconnects;
+    uint64_t late;                       // open loop: requests sent after their schedule
+};
+
+struct worker {
+    pthread_t thread;
+    uint64_t rng;
+    struct imgfs_client* client; // of one connection
+    struct stats stats;
+};
+
+static struct options opt;
+static double* zipf_cdf = NULL;
+static char* image = NULL;
+static size_t image_size = 0;
+static uint64_t start_ns;
+static uint64_t end_ns;
+
+/********************************************************************
+ * Utilities
+ */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t_ns)
+{
+    struct timespec ts;
+    ts.tv_sec = (time_t) (t_ns / 1000000000ULL);
+    ts.tv_nsec = (long) (t_ns % 1000000000ULL);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+// xorshift64*
+static uint64_t next_random(uint64_t* state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+// uniform in [0, 1)
+static double random_unit(uint64_t* state)
+{
+    const uint64_t bits = next_random(state) >> 11;
+    return (double) bits / 9007199254740992.0;
+}
+
+/********************************************************************
+ * Histograms
+ */
+
+static size_t bucket_of(uint64_t v)
+{
+    if (v < 2 * SUB_BUCKETS) return (size_t) v;
+    const unsigned int msb = 63U - (unsigned int) __builtin_clzll(v);
+    const unsigned int shift = msb - SUB_BITS;
+    const size_t idx = (size_t) shift * SUB_BUCKETS + (size_t) (v >> shift);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// highest value counted in a bucket
+static uint64_t bucket_max(size_t idx)
+{
+    if (idx < 2 * SUB_BUCKETS) return idx;
+    const size_t shift = idx / SUB_BUCKETS - 1;
+    const uint64_t mantissa = idx % SUB_BUCKETS + SUB_BUCKETS;
+    return ((mantissa + 1) << shift) - 1;
+}
+
+static uint64_t hist_count(const uint64_t* hist)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) n += hist[i];
+    return n;
+}
+
+static uint64_t hist_percentile(const uint64_t* hist, double p)
+{
+    const uint64_t count = hist_count(hist);
+    if (count == 0) return 0;
+    const double exact_rank = ceil(p / 100.0 * (double) count);
+    uint64_t rank = (uint64_t) exact_rank;
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist[i];
+        if (seen >= rank) return bucket_max(i);
+    }
+    return bucket_max(HIST_BUCKETS - 1);
+}
+
+static double hist_mean(const uint64_t* hist)
+{
+    const uint64_t count = hist_count(hist);
+    if (count == 0) return 0.0;
+    double sum = 0.0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        const uint64_t value = bucket_max(i);
+        sum += (double) hist[i] * (double) value;
+    }
+    return sum / (double) count;
+}
+
+static double ms(uint64_t ns)
+{
+    return (double) ns / 1e6;
+}
+
+/********************************************************************
+ * Workload
+ */
+
+static int init_zipf(void)
+{
+    zipf_cdf = calloc(opt.nb_ids, sizeof(double));
+    if (zipf_cdf == NULL) return -1;
+    double sum = 0.0;
+    for (unsigned int k = 0; k < opt.nb_ids; ++k) {
+        sum += 1.0 / pow((double) k + 1.0, opt.zipf_s);
+        zipf_cdf[k] = sum;
+    }
+    for (unsigned int k = 0; k < opt.nb_ids; ++k) zipf_cdf[k] /= sum;
+    return 0;
+}
+
+static unsigned int pick_id(uint64_t* rng)
+{
+    const double u = random_unit(rng);
+    unsigned int lo = 0;
+    unsigned int hi = opt.nb_ids - 1;
+    while (lo < hi) {
+        const unsigned int mid = lo + (hi - lo) / 2;
+        if (zipf_cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo + 1; // ids are numbered from 1, the most popular first
+}
+
+static enum op pick_op(uint64_t* rng)
+{
+    unsigned int total = 0;
+    for (int o = 0; o < NB_OPS; ++o) total += opt.weights[o];
+    unsigned int r = (unsigned int) (next_random(rng) % total);
+    for (int o = 0; o < NB_OPS; ++o) {
+        if (r < opt.weights[o]) return (enum op) o;
+        r -= opt.weights[o];
+    }
+    return OP_LIST;
+}
+
+/********************************************************************
+ * HTTP
+ */
+
+/**
+ * @brief Sends one request and waits for its response, on the connection
+ *        of the worker (see imgfs_client.h).
+ *
+ * @return The HTTP status code, or 0 if there was no valid answer.
+ */
+static int do_request(struct worker* w, enum op o, unsigned int id)
+{
+    static const enum client_op ops[NB_OPS] = {
+        CLIENT_LIST, CLIENT_READ, CLIENT_READ, CLIENT_READ, CLIENT_INSERT, CLIENT_DELETE
+    };
+    static const int resolutions[NB_OPS] = { 0, THUMB_RES, SMALL_RES, ORIG_RES, 0, 0 };
+
+    char img_id[MAX_ID_LEN + 1];
+    snprintf(img_id, sizeof(img_id), "%s%u", opt.prefix, id);
+
+    struct imgfs_request r;
+    zero_init_var(r);
+    r.op = ops[o];
+    r.img_id = img_id;
+    r.resolution = resolutions[o];
+    r.image = image;
+    r.image_size = image_size;
+
+    imgfs_client_run(w->client, &r, 1); // the status tells how it went
+    w->stats.bytes_received += r.body_size;
+    return r.status;
+}
+
+static void* worker_main(void* arg)
+{
+    struct worker* const w = arg;
+    const double mean_gap_ns = opt.rate > 0 ? 1e9 * opt.threads / opt.rate : 0.0;
+    uint64_t scheduled = start_ns + (uint64_t) (random_unit(&w->rng) * mean_gap_ns);
+
+    while (1) {
+        uint64_t t0 = now_ns();
+        if (opt.rate > 0) {
+            if (scheduled >= end_ns) break;
+            if (scheduled > t0) sleep_until(scheduled);
+            else if (t0 - scheduled > 1000000ULL) ++w->stats.late;
+            t0 = scheduled; // measure from the intended start
+            const double gap = opt.poisson ? -log(1.0 - random_unit(&w->rng)) * mean_gap_ns : mean_gap_ns;
+            scheduled += (uint64_t) gap;
+        } else if (t0 >= end_ns) {
+            break;
+        }
+
+        const enum op o = pick_op(&w->rng);
+        const int status = do_request(w, o, pick_id(&w->rng));
+        const uint64_t latency = now_ns() - t0;
+
+        ++w->stats.hist[o][bucket_of(latency)];
+        const int class = status / 100;
+        ++w->stats.status[o][class >= 1 && class <= 5 ? class : 0];
+    }
+
+    return NULL;
+}
+
+/********************************************************************
+ * Setup and report
+ */
+
+static int load_image(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return -1;
+    int ret = -1;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        const long size = ftell(f);
+        if (size > 0 && fseek(f, 0, SEEK_SET) == 0 && (image = malloc((size_t) size)) != NULL) {
+            image_size = (size_t) size;
+            ret = fread(image, image_size, 1, f) == 1 ? 0 : -1;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+/**
+ * @brief Parses a mix such as "list=1,thumb=4,small=2,orig=1,insert=1,delete=1".
+ */
+static int parse_mix(const char* spec)
+{
+    unsigned int w[NB_OPS] = {0};
+    char* copy = strdup(spec);
+    if (copy == NULL) return -1;
+    int ret = 0;
+    char* save = NULL;
+    for (char* tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+        char* eq = strchr(tok, '=');
+        if (eq == NULL) {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        int found = 0;
+        for (int o = 0; o < NB_OPS; ++o) {
+            if (strcmp(tok, op_names[o]) == 0) {
+                w[o] = (unsigned int) strtoul(eq + 1, NULL, 10);
+                found = 1;
+            }
+        }
+        if (!found) {
+            ret = -1;
+            break;
+        }
+    }
+    free(copy);
+
+    unsigned int total = 0;
+    for (int o = 0; o < NB_OPS; ++o) total += w[o];
+    if (ret != 0 || total == 0) return -1;
+    memcpy(opt.weights, w, sizeof(w));
+    return 0;
+}
+
+static void usage(const char* prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -H host      server host (default localhost)\n"
+            "  -p port      server port (default " DEFAULT_PORT ")\n"
+            "  -U path      Unix domain socket of the server, instead of the port\n"
+            "  -d seconds   duration (default 10)\n"
+            "  -c threads   concurrent workers (default 8)\n"
+            "  -r rate      open loop at rate requests/s (default: closed loop)\n"
+            "  -u           uniform instead of Poisson arrivals (open loop)\n"
+            "  -m mix       weights, e.g. list=1,thumb=4,small=2,orig=1,insert=1,delete=1\n"
+            "  -n ids       number of distinct image ids (default 50)\n"
+            "  -s exponent  Zipf exponent of the id popularity (default 1.0, 0 = uniform)\n"
+            "  -x prefix    prefix of the image ids (default lg)\n"
+            "  -i image     JPEG file sent by inserts (required if inserts or -P)\n"
+            "  -P           insert all the ids before starting\n"
+            "  -k           keep connections alive between requests\n"
+            "  -a           print the full latency distribution\n"
+            "  -j           JSON output\n", prog);
+}
+
+static void merge(struct stats* total, const struct stats* s)
+{
+    for (int o = 0; o < NB_OPS; ++o) {
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) total->hist[o][b] += s->hist[o][b];
+        for (int c = 0; c < 6; ++c) total->status[o][c] += s->status[o][c];
+    }
+    total->bytes_received += s->bytes_received;
+    total->reconnects += s->reconnects;
+    total->late += s->late;
+}
+
+static const double percentiles[] = { 50, 75, 90, 95, 99, 99.9, 99.99, 100 };
+#define NB_PERCENTILES (sizeof(percentiles) / sizeof(percentiles[0]))
+
+static void report_text(const struct stats* t, const uint64_t* all, double elapsed)
+{
+    const uint64_t total = hist_count(all);
+    uint64_t errors = 0;
+    for (int o = 0; o < NB_OPS; ++o) errors += t->status[o][0] + t->status[o][4] + t->status[o][5];
+
+    printf("%" PRIu64 " requests in %.2f s: %.1f req/s, %" PRIu64 " errors, %.1f MB received\n",
+           total, elapsed, (double) total / elapsed, errors, (double) t->bytes_received / 1e6);
+    printf("%s loop, %s, %u workers, keep-alive %s, %" PRIu64 " reconnects",
+           opt.rate > 0 ? "open" : "closed", opt.unix_path != NULL ? "unix socket" : "tcp", opt.threads, opt.keep_alive ? "on" : "off", t->reconnects);
+    if (opt.rate > 0) printf(", %" PRIu64 " late sends", t->late);
+    printf("\n\n%-7s %9s %9s %6s %6s %6s %6s %9s %9s %9s %9s %9s\n",
+           "op", "count", "req/s", "2xx", "3xx", "4xx", "5xx", "mean ms", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (int o = 0; o <= NB_OPS; ++o) {
+        const uint64_t* h = o < NB_OPS ? t->hist[o] : all;
+        const uint64_t n = hist_count(h);
+        if (n == 0) continue;
+        uint64_t cls[6] = {0};
+        for (int c = 0; c < 6; ++c) {
+            if (o < NB_OPS) cls[c] = t->status[o][c];
+            else for (int k = 0; k < NB_OPS; ++k) cls[c] += t->status[k][c];
+        }
+        printf("%-7s %9" PRIu64 " %9.1f %6" PRIu64 " %6" PRIu64 " %6" PRIu64 " %6" PRIu64
+               " %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+               o < NB_OPS ? op_names[o] : "all", n, (double) n / elapsed,
+               cls[2], cls[3], cls[4], cls[5], hist_mean(h) / 1e6,
+               ms(hist_percentile(h, 50)), ms(hist_percentile(h, 99)),
+               ms(hist_percentile(h, 99.9)), ms(hist_percentile(h, 100)));
+    }
+
+    if (!opt.full_histogram) return;
+    printf("\nLatency distribution (all operations)\n%12s %12s %10s\n", "value ms", "percentile", "count");
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        if (all[b] == 0) continue;
+        seen += all[b];
+        printf("%12.3f %12.5f %10" PRIu64 "\n", ms(bucket_max(b)),
+               100.0 * (double) seen / (double) total, all[b]);
+    }
+}
+
+static json_object* hist_json(const uint64_t* h, const uint64_t* status, double elapsed)
+{
+    json_object* const jop = json_object_new_object();
+    const uint64_t n = hist_count(h);
+    json_object_object_add(jop, "count", json_object_new_uint64(n));
+    json_object_object_add(jop, "rps", json_object_new_double((double) n / elapsed));
+    json_object* const jstatus = json_object_new_object();
+    static const char* const classes[6] = { "none", "1xx", "2xx", "3xx", "4xx", "5xx" };
+    for (int c = 0; c < 6; ++c) {
+        json_object_object_add(jstatus, classes[c], json_object_new_uint64(status[c]));
+    }
+    json_object_object_add(jop, "status", jstatus);
+    json_object_object_add(jop, "mean_ns", json_object_new_double(hist_mean(h)));
+
+    json_object* const jpct = json_object_new_object();
+    for (size_t p = 0; p < NB_PERCENTILES; ++p) {
+        char key[16];
+        snprintf(key, sizeof(key), "p%g", percentiles[p]);
+        json_object_object_add(jpct, key, json_object_new_uint64(hist_percentile(h, percentiles[p])));
+    }
+    json_object_object_add(jop, "percentiles_ns", jpct);
+
+    json_object* const jbuckets = json_object_new_array();
+    for (size_t b = 0; b < HIST_BUCKETS; ++b) {
+        if (h[b] == 0) continue;
+        json_object* const pair = json_object_new_array();
+        json_object_array_add(pair, json_object_new_uint64(bucket_max(b)));
+        json_object_array_add(pair, json_object_new_uint64(h[b]));
+        json_object_array_add(jbuckets, pair);
+    }
+    json_object_object_add(jop, "histogram_ns", jbuckets);
+    return jop;
+}
+
+static void report_json(const struct stats* t, const uint64_t* all, double elapsed)
+{
+    json_object* const jobj = json_object_new_object();
+    json_object_object_add(jobj, "duration_s", json_object_new_double(elapsed));
+    json_object_object_add(jobj, "mode", json_object_new_string(opt.rate > 0 ? "open" : "closed"));
+    json_object_object_add(jobj, "target_rps", json_object_new_double(opt.rate));
+    json_object_object_add(jobj, "transport", json_object_new_string(opt.unix_path != NULL ? "unix" : "tcp"));
+    json_object_object_add(jobj, "workers", json_object_new_int((int) opt.threads));
+    json_object_object_add(jobj, "keep_alive", json_object_new_boolean(opt.keep_alive));
+    json_object_object_add(jobj, "zipf_s", json_object_new_double(opt.zipf_s));
+    json_object_object_add(jobj, "ids", json_object_new_int((int) opt.nb_ids));
+    json_object_object_add(jobj, "bytes_received", json_object_new_uint64(t->bytes_received));
+    json_object_object_add(jobj, "reconnects", json_object_new_uint64(t->reconnects));
+    json_object_object_add(jobj, "late", json_object_new_uint64(t->late));
+
+    uint64_t all_status[6] = {0};
+    json_object* const jops = json_object_new_object();
+    for (int o = 0; o < NB_OPS; ++o) {
+        for (int c = 0; c < 6; ++c) all_status[c] += t->status[o][c];
+        if (hist_count(t->hist[o]) == 0) continue;
+        json_object_object_add(jops, op_names[o], hist_json(t->hist[o], t->status[o], elapsed));
+    }
+    json_object_object_add(jobj, "ops", jops);
+    json_object_object_add(jobj, "all", hist_json(all, all_status, elapsed));
+
+    printf("%s\n", json_object_to_json_string(jobj));
+    json_object_put(jobj);
+}
+
+int main(int argc, char* argv[])
+{
+    opt.host = "localhost";
+    opt.port = DEFAULT_PORT;
+    opt.duration = 10.0;
+    opt.threads = 8;
+    opt.poisson = 1;
+    opt.nb_ids = 50;
+    opt.zipf_s = 1.0;
+    opt.prefix = "lg";
+    parse_mix("list=1,thumb=4,small=2,orig=1");
+
+    int c;
+    while ((c = getopt(argc, argv, "H:p:U:d:c:r:um:n:s:x:i:Pkajh")) != -1) {
+        switch (c) {
+        case 'H': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'U': opt.unix_path = optarg; break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'c': opt.threads = (unsigned int) strtoul(optarg, NULL, 10); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'u': opt.poisson = 0; break;
+        case 'm':
+            if (parse_mix(optarg) != 0) {
+                fprintf(stderr, "Invalid mix: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'n': opt.nb_ids = (unsigned int) strtoul(optarg, NULL, 10); break;
+        case 's': opt.zipf_s = atof(optarg); break;
+        case 'x': opt.prefix = optarg; break;
+        case 'i': opt.image_path = optarg; break;
+        case 'P': opt.prepopulate = 1; break;
+        case 'k': opt.keep_alive = 1; break;
+        case 'a': opt.full_histogram = 1; break;
+        case 'j': opt.json = 1; break;
+        default:
+            usage(argv[0]);
+            return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (opt.threads == 0 || opt.threads > MAX_THREADS || opt.nb_ids == 0 || opt.duration <= 0 ||
+        opt.rate < 0 || strlen(opt.prefix) + 10 > MAX_ID_LEN) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if ((opt.weights[OP_INSERT] > 0 || opt.prepopulate) &&
+        (opt.image_path == NULL || load_image(opt.image_path) != 0)) {
+        fprintf(stderr, "Inserts need a readable image (-i)\n");
+        return EXIT_FAILURE;
+    }
+    char* end = NULL;
+    const unsigned long port = strtoul(opt.port, &end, 10);
+    if (opt.unix_path == NULL && (*end != '\0' || port == 0 || port > UINT16_MAX)) {
+        fprintf(stderr, "Invalid port %s\n", opt.port);
+        return EXIT_FAILURE;
+    }
+    if (init_zipf() != 0) return EXIT_FAILURE;
+
+    struct worker* workers = calloc(opt.threads, sizeof(struct worker));
+    if (workers == NULL) return EXIT_FAILURE;
+    struct imgfs_client_config config;
+    zero_init_var(config);
+    config.host = opt.host;
+    config.port = (uint16_t) port;
+    config.unix_path = opt.unix_path;
+    config.max_connections = 1;
+    config.pipeline_depth = 1;
+    config.no_keep_alive = !opt.keep_alive;
+    for (unsigned int i = 0; i < opt.threads; ++i) {
+        workers[i].rng = (0x9E3779B97F4A7C15ULL * (i + 1)) ^ (uint64_t) time(NULL);
+        const int err = imgfs_client_open(&config, &workers[i].client);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Cannot reach the server: %s\n", ERR_MSG(err));
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (opt.prepopulate) {
+        unsigned int failed = 0;
+        for (unsigned int id = 1; id <= opt.nb_ids; ++id) {
+            const int status = do_request(&workers[0], OP_INSERT, id);
+            if (status / 100 != 2 && status / 100 != 3) ++failed;
+        }
+        if (failed > 0) fprintf(stderr, "Prepopulation: %u of %u inserts failed\n", failed, opt.nb_ids);
+        memset(&workers[0].stats, 0, sizeof(workers[0].stats));
+    }
+
+    start_ns = now_ns();
+    end_ns = start_ns + (uint64_t) (opt.duration * 1e9);
+    for (unsigned int i = 0; i < opt.threads; ++i) {
+        if (pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0) {
+            perror("pthread_create()");
+            return EXIT_FAILURE;
+        }
+    }
+
+    struct stats* total = calloc(1, sizeof(struct stats));
+    uint64_t* all = calloc(HIST_BUCKETS, sizeof(uint64_t));
+    if (total == NULL || all == NULL) return EXIT_FAILURE;
+    for (unsigned int i = 0; i < opt.threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+        workers[i].stats.reconnects = imgfs_client_reconnects(workers[i].client);
+        merge(total, &workers[i].stats);
+        imgfs_client_close(workers[i].client);
+    }
+    const double elapsed = (double) (now_ns() - start_ns) / 1e9;
+    for (int o = 0; o < NB_OPS; ++o) {
+        for (size_t b = 0; b < HIST_BUCKETS; ++b) all[b] += total->hist[o][b];
+    }
+
+    if (opt.json) report_json(total, all, elapsed);
+    else report_text(total, all, elapsed);
+
+    free(all);
+    free(total);
+    free(workers);
+    free(zipf_cdf);
+    free(image);
+    return EXIT_SUCCESS;
+}
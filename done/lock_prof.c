@@ -0,0 +1,386 @@
+/**
+ * @file lock_prof.c
+ * @brief Instrumented mutexes for lock contention profiling.
+ *
+ * The uncontended acquisition of a profiled mutex costs one trylock and one
+ * relaxed load of the "enabled" flag. Waiting is always accounted (it only
+ * adds two clock readings to an already slow path); hold times and call
+ * sites are only accounted while profiling is enabled.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <json-c/json.h>
+
+#include "error.h"
+#include "lock_prof.h"
+#include "util.h" // MAX
+
+static atomic_int enabled;
+
+// registered mutexes; only used when (un)registering and reporting
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_mutex* registry = NULL;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t load(_Atomic uint64_t* c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static void add(_Atomic uint64_t* c, uint64_t v)
+{
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+static void update_max(_Atomic uint64_t* c, uint64_t v)
+{
+    uint64_t cur = load(c);
+    while (v > cur && !atomic_compare_exchange_weak_explicit(c, &cur, v, memory_order_relaxed,
+            memory_order_relaxed));
+}
+
+/**
+ * @brief Finds (or claims) the statistics slot of a call site.
+ *
+ * @return The slot, or NULL if all the slots are taken by other sites.
+ */
+static struct lock_prof_site* find_site(struct prof_mutex* m, const char* site)
+{
+    for (size_t i = 0; i < LOCK_PROF_MAX_SITES; ++i) {
+        const char* cur = atomic_load_explicit(&m->sites[i].site, memory_order_acquire);
+        if (cur == NULL) {
+            if (atomic_compare_exchange_strong_explicit(&m->sites[i].site, &cur, site,
+                    memory_order_acq_rel, memory_order_acquire)) {
+                return &m->sites[i];
+            }
+            // someone else claimed it meanwhile: cur is now the other site
+        }
+        if (cur == site || strcmp(cur, site) == 0) {
+            return &m->sites[i];
+        }
+    }
+    return NULL;
+}
+
+static void register_mutex(struct prof_mutex* m)
+{
+    pthread_mutex_lock(&registry_lock);
+    if (!atomic_load_explicit(&m->registered, memory_order_relaxed)) {
+        m->next = registry;
+        registry = m;
+        atomic_store_explicit(&m->registered, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+int prof_mutex_init(struct prof_mutex* m, const char* name)
+{
+    M_REQUIRE_NON_NULL(m);
+    M_REQUIRE_NON_NULL(name);
+
+    memset(m, 0, sizeof(*m));
+    if (pthread_mutex_init(&m->mutex, NULL) != 0) {
+        return ERR_THREADING;
+    }
+    m->name = name;
+
+    register_mutex(m);
+    return ERR_NONE;
+}
+
+void prof_mutex_destroy(struct prof_mutex* m)
+{
+    if (m == NULL) return;
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct prof_mutex** cur = &registry; *cur != NULL; cur = &(*cur)->next) {
+        if (*cur == m) {
+            *cur = m->next;
+            break;
+        }
+    }
+    atomic_store_explicit(&m->registered, 0, memory_order_relaxed);
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_destroy(&m->mutex);
+}
+
+uint64_t prof_mutex_lock_at(struct prof_mutex* m, const char* site)
+{
+    uint64_t wait = 0;
+    if (pthread_mutex_trylock(&m->mutex) != 0) {
+        atomic_fetch_add_explicit(&m->waiters, 1, memory_order_relaxed);
+        const uint64_t start = now_ns();
+        pthread_mutex_lock(&m->mutex);
+        wait = now_ns() - start;
+        atomic_fetch_sub_explicit(&m->waiters, 1, memory_order_relaxed);
+
+        add(&m->contended, 1);
+        add(&m->wait_ns, wait);
+        update_max(&m->max_wait_ns, wait);
+    }
+    add(&m->acquisitions, 1);
+    if (!atomic_load_explicit(&m->registered, memory_order_relaxed)) {
+        register_mutex(m); // statically initialized
+    }
+
+    if (!atomic_load_explicit(&enabled, memory_order_relaxed)) {
+        m->acquired_ns = 0;
+        m->holder_site = NULL;
+        return wait;
+    }
+
+    m->holder_site = find_site(m, site);
+    if (m->holder_site != NULL) {
+        add(&m->holder_site->acquisitions, 1);
+        add(&m->holder_site->wait_ns, wait);
+    } else {
+        add(&m->dropped_sites, 1);
+    }
+    atomic_store_explicit(&m->holder, site, memory_order_relaxed);
+    m->acquired_ns = now_ns();
+    return wait;
+}
+
+/**
+ * @brief Accounts the end of the hold of the caller, if profiled.
+ *
+ * @return The call site of the holder, NULL if not profiled.
+ */
+static const char* end_hold(struct prof_mutex* m)
+{
+    const char* holder = NULL;
+    if (m->acquired_ns != 0) {
+        const uint64_t hold = now_ns() - m->acquired_ns;
+        add(&m->hold_ns, hold);
+        update_max(&m->max_hold_ns, hold);
+        if (m->holder_site != NULL) {
+            add(&m->holder_site->hold_ns, hold);
+            update_max(&m->holder_site->max_hold_ns, hold);
+        }
+        m->acquired_ns = 0;
+        holder = atomic_exchange_explicit(&m->holder, NULL, memory_order_relaxed);
+    }
+    return holder;
+}
+
+void prof_mutex_unlock(struct prof_mutex* m)
+{
+    end_hold(m);
+    pthread_mutex_unlock(&m->mutex);
+}
+
+/**
+ * @brief Accounts the hold of the caller again, after waiting on a condition.
+ */
+static void resume_hold(struct prof_mutex* m, const char* holder)
+{
+    if (holder != NULL) {
+        atomic_store_explicit(&m->holder, holder, memory_order_relaxed);
+        m->acquired_ns = now_ns();
+    }
+}
+
+void prof_cond_wait(pthread_cond_t* cond, struct prof_mutex* m)
+{
+    const char* const holder = end_hold(m);
+    pthread_cond_wait(cond, &m->mutex);
+    resume_hold(m, holder);
+}
+
+int prof_cond_timedwait(pthread_cond_t* cond, struct prof_mutex* m, const struct timespec* abstime)
+{
+    const char* const holder = end_hold(m);
+    const int ret = pthread_cond_timedwait(cond, &m->mutex, abstime);
+    resume_hold(m, holder);
+    return ret;
+}
+
+void lock_prof_enable(int on)
+{
+    atomic_store_explicit(&enabled, on != 0, memory_order_relaxed);
+}
+
+int lock_prof_enabled(void)
+{
+    return atomic_load_explicit(&enabled, memory_order_relaxed);
+}
+
+void lock_prof_reset(void)
+{
+    pthread_mutex_lock(&registry_lock);
+    for (struct prof_mutex* m = registry; m != NULL; m = m->next) {
+        atomic_store(&m->acquisitions, 0);
+        atomic_store(&m->contended, 0);
+        atomic_store(&m->wait_ns, 0);
+        atomic_store(&m->max_wait_ns, 0);
+        atomic_store(&m->hold_ns, 0);
+        atomic_store(&m->max_hold_ns, 0);
+        atomic_store(&m->dropped_sites, 0);
+        // the sites stay claimed: a holder may still point to one of them
+        for (size_t i = 0; i < LOCK_PROF_MAX_SITES; ++i) {
+            atomic_store(&m->sites[i].acquisitions, 0);
+            atomic_store(&m->sites[i].wait_ns, 0);
+            atomic_store(&m->sites[i].hold_ns, 0);
+            atomic_store(&m->sites[i].max_hold_ns, 0);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+/********************************************************************
+ * Reporting
+ */
+
+static double seconds(_Atomic uint64_t* c_ns)
+{
+    const uint64_t ns = load(c_ns);
+    return (double) ns / 1e9;
+}
+
+enum lock_stat {
+    STAT_ACQUISITIONS,
+    STAT_CONTENDED,
+    STAT_WAIT,
+    STAT_MAX_WAIT,
+    STAT_WAITERS,
+    STAT_HOLD,
+    STAT_MAX_HOLD,
+    NB_LOCK_STATS
+};
+
+static const struct {
+    const char* name;
+    const char* type;
+    const char* help;
+} lock_stats[NB_LOCK_STATS] = {
+    { "imgfs_lock_acquisitions_total", "counter", "Acquisitions of the lock." },
+    { "imgfs_lock_contended_total", "counter", "Acquisitions that had to wait." },
+    { "imgfs_lock_wait_seconds_total", "counter", "Time spent waiting for the lock." },
+    { "imgfs_lock_wait_seconds_max", "gauge", "Longest wait for the lock." },
+    { "imgfs_lock_waiters", "gauge", "Threads currently waiting for the lock." },
+    { "imgfs_lock_hold_seconds_total", "counter", "Time the lock was held (while profiling)." },
+    { "imgfs_lock_hold_seconds_max", "gauge", "Longest hold of the lock (while profiling)." },
+};
+
+static void print_stat(FILE* out, struct prof_mutex* m, enum lock_stat stat)
+{
+    fprintf(out, "%s{lock=\"%s\"} ", lock_stats[stat].name, m->name);
+    switch (stat) {
+    case STAT_ACQUISITIONS: fprintf(out, "%" PRIu64 "\n", load(&m->acquisitions)); break;
+    case STAT_CONTENDED:    fprintf(out, "%" PRIu64 "\n", load(&m->contended)); break;
+    case STAT_WAIT:         fprintf(out, "%.9f\n", seconds(&m->wait_ns)); break;
+    case STAT_MAX_WAIT:     fprintf(out, "%.9f\n", seconds(&m->max_wait_ns)); break;
+    case STAT_WAITERS:
+        fprintf(out, "%d\n", atomic_load_explicit(&m->waiters, memory_order_relaxed));
+        break;
+    case STAT_HOLD:         fprintf(out, "%.9f\n", seconds(&m->hold_ns)); break;
+    default:                fprintf(out, "%.9f\n", seconds(&m->max_hold_ns)); break;
+    }
+}
+
+int lock_prof_append_prometheus(char** text, size_t* text_len)
+{
+    M_REQUIRE_NON_NULL(text);
+    M_REQUIRE_NON_NULL(text_len);
+
+    FILE* out = NULL;
+    char* section = NULL;
+    size_t section_len = 0;
+    out = open_memstream(&section, &section_len);
+    if (out == NULL) return ERR_OUT_OF_MEMORY;
+
+    // each family is one group: its HELP and TYPE, then its samples
+    pthread_mutex_lock(&registry_lock);
+    for (int stat = 0; stat < NB_LOCK_STATS; ++stat) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", lock_stats[stat].name, lock_stats[stat].help,
+                lock_stats[stat].name, lock_stats[stat].type);
+        for (struct prof_mutex* m = registry; m != NULL; m = m->next) {
+            print_stat(out, m, (enum lock_stat) stat);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    if (fclose(out) != 0) {
+        free(section);
+        return ERR_IO;
+    }
+
+    char* const new_text = realloc(*text, *text_len + section_len + 1);
+    if (new_text == NULL) {
+        free(section);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(new_text + *text_len, section, section_len + 1);
+    *text = new_text;
+    *text_len += section_len;
+    free(section);
+    return ERR_NONE;
+}
+
+static json_object* json_ns(_Atomic uint64_t* c_ns)
+{
+    return json_object_new_int64((int64_t) load(c_ns));
+}
+
+int lock_prof_dump_json(char** json)
+{
+    M_REQUIRE_NON_NULL(json);
+    *json = NULL;
+
+    json_object* jobj = json_object_new_object();
+    json_object* jlocks = json_object_new_array();
+    json_object_object_add(jobj, "enabled", json_object_new_boolean(lock_prof_enabled()));
+
+    pthread_mutex_lock(&registry_lock);
+    for (struct prof_mutex* m = registry; m != NULL; m = m->next) {
+        json_object* jlock = json_object_new_object();
+        const char* holder = atomic_load_explicit(&m->holder, memory_order_relaxed);
+
+        json_object_object_add(jlock, "name", json_object_new_string(m->name));
+        json_object_object_add(jlock, "acquisitions", json_ns(&m->acquisitions));
+        json_object_object_add(jlock, "contended", json_ns(&m->contended));
+        json_object_object_add(jlock, "wait_ns", json_ns(&m->wait_ns));
+        json_object_object_add(jlock, "max_wait_ns", json_ns(&m->max_wait_ns));
+        json_object_object_add(jlock, "waiters",
+                               json_object_new_int(atomic_load_explicit(&m->waiters, memory_order_relaxed)));
+        json_object_object_add(jlock, "hold_ns", json_ns(&m->hold_ns));
+        json_object_object_add(jlock, "max_hold_ns", json_ns(&m->max_hold_ns));
+        json_object_object_add(jlock, "holder", holder != NULL ? json_object_new_string(holder) : NULL);
+        json_object_object_add(jlock, "dropped_sites", json_ns(&m->dropped_sites));
+
+        json_object* jsites = json_object_new_array();
+        for (size_t i = 0; i < LOCK_PROF_MAX_SITES; ++i) {
+            struct lock_prof_site* s = &m->sites[i];
+            const char* site = atomic_load_explicit(&s->site, memory_order_acquire);
+            if (site == NULL) break;
+
+            json_object* jsite = json_object_new_object();
+            json_object_object_add(jsite, "site", json_object_new_string(site));
+            json_object_object_add(jsite, "acquisitions", json_ns(&s->acquisitions));
+            json_object_object_add(jsite, "wait_ns", json_ns(&s->wait_ns));
+            json_object_object_add(jsite, "hold_ns", json_ns(&s->hold_ns));
+            json_object_object_add(jsite, "max_hold_ns", json_ns(&s->max_hold_ns));
+            json_object_array_add(jsites, jsite);
+        }
+        json_object_object_add(jlock, "sites", jsites);
+        json_object_array_add(jlocks, jlock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    json_object_object_add(jobj, "locks", jlocks);
+    *json = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+
+    return *json == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+}
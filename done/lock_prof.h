@@ -0,0 +1,136 @@
+/**
+ * @file lock_prof.h
+ * @brief Instrumented mutexes for lock contention profiling.
+ *
+ * A prof_mutex is a pthread mutex that always accounts how often and how
+ * long threads waited for it. When profiling is enabled (at runtime), it
+ * also accounts hold times, both globally and per call site, and remembers
+ * the call site of the current holder.
+ *
+ * A prof_mutex is either initialized with prof_mutex_init(), or statically
+ * with PROF_MUTEX_INITIALIZER: it is then registered (reported) from its
+ * first acquisition on.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+#include <time.h>   // struct timespec
+
+#define LOCK_PROF_MAX_SITES 16
+
+#define LOCK_PROF_STR(x) #x
+#define LOCK_PROF_XSTR(x) LOCK_PROF_STR(x)
+#define LOCK_PROF_SITE __FILE__ ":" LOCK_PROF_XSTR(__LINE__)
+
+#define PROF_MUTEX_INITIALIZER(lock_name) { .mutex = PTHREAD_MUTEX_INITIALIZER, .name = (lock_name) }
+
+/**
+ * @brief Statistics of one call site taking a lock.
+ */
+struct lock_prof_site {
+    _Atomic(const char*) site; // "file:line", NULL if the slot is free
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t hold_ns;
+    _Atomic uint64_t max_hold_ns;
+};
+
+struct prof_mutex {
+    pthread_mutex_t mutex;
+    const char* name;
+
+    // always accounted
+    _Atomic uint64_t acquisitions;
+    _Atomic uint64_t contended;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t max_wait_ns;
+    _Atomic int waiters;
+
+    // accounted while profiling is enabled
+    _Atomic uint64_t hold_ns;
+    _Atomic uint64_t max_hold_ns;
+    _Atomic(const char*) holder; // call site of the current holder, if known
+    uint64_t acquired_ns;        // only accessed by the holder
+    struct lock_prof_site* holder_site;
+    struct lock_prof_site sites[LOCK_PROF_MAX_SITES];
+    _Atomic uint64_t dropped_sites; // acquisitions from sites that did not fit
+
+    _Atomic int registered;
+    struct prof_mutex* next; // list of all the registered mutexes
+};
+
+/**
+ * @brief Initializes a profiled mutex and registers it under the given name.
+ *
+ * @return Some error code. 0 if no error.
+ */
+int prof_mutex_init(struct prof_mutex* m, const char* name);
+
+/**
+ * @brief Unregisters and destroys a profiled mutex.
+ */
+void prof_mutex_destroy(struct prof_mutex* m);
+
+/**
+ * @brief Locks a profiled mutex; site identifies the caller ("file:line").
+ *
+ * @return The time spent waiting for the mutex, in nanoseconds.
+ */
+uint64_t prof_mutex_lock_at(struct prof_mutex* m, const char* site);
+
+/**
+ * @brief Unlocks a profiled mutex.
+ */
+void prof_mutex_unlock(struct prof_mutex* m);
+
+#define prof_mutex_lock(m) prof_mutex_lock_at(m, LOCK_PROF_SITE)
+
+/**
+ * @brief Waits on a condition variable with a profiled mutex, held by the
+ *        caller; the wait is not accounted as holding the mutex.
+ */
+void prof_cond_wait(pthread_cond_t* cond, struct prof_mutex* m);
+
+/**
+ * @brief Same as prof_cond_wait(), until abstime at most.
+ *
+ * @return As pthread_cond_timedwait().
+ */
+int prof_cond_timedwait(pthread_cond_t* cond, struct prof_mutex* m, const struct timespec* abstime);
+
+/**
+ * @brief Enables (1) or disables (0) hold time and call site profiling.
+ */
+void lock_prof_enable(int enabled);
+
+/**
+ * @brief Returns whether hold time and call site profiling is enabled.
+ */
+int lock_prof_enabled(void);
+
+/**
+ * @brief Resets the statistics of all the registered mutexes.
+ */
+void lock_prof_reset(void);
+
+/**
+ * @brief Appends the statistics of all the registered mutexes, in the
+ *        Prometheus text format, to a dynamically allocated text.
+ *
+ * @param text Location of the text to append to (may point to NULL); reallocated.
+ * @param text_len Location of the length of the text; updated.
+ * @return Some error code. 0 if no error.
+ */
+int lock_prof_append_prometheus(char** text, size_t* text_len);
+
+/**
+ * @brief Dumps the statistics of all the registered mutexes in JSON.
+ *
+ * @param json Location of the dynamically allocated JSON string.
+ * @return Some error code. 0 if no error.
+ */
+int lock_prof_dump_json(char** json);
@@ -0,0 +1,259 @@
+/**
+ * @file metrics.c
+ * @brief Prometheus-style metrics of the imgFS server.
+ *
+ * Counters live in METRICS_SHARDS cache-line aligned shards. A thread is
+ * bound to one shard the first time it records something, and only does
+ * relaxed atomic additions on it afterwards. Connection threads are short
+ * lived, so several of them may share a shard over time: atomics keep
+ * the counts exact, and the sharding keeps the cache lines uncontended.
+ */
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+#include "imgfs.h" // NB_RES
+#include "metrics.h"
+
+#define METRICS_SHARDS 64
+#define CACHE_LINE 64
+
+#define NB_STATUS_CLASSES 5 // 1xx to 5xx
+
+// upper bounds of the latency histogram buckets, in nanoseconds
+static const uint64_t latency_bounds_ns[] = {
+    500000ULL, 1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL,
+    50000000ULL, 100000000ULL, 250000000ULL, 500000000ULL, 1000000000ULL,
+    2500000000ULL, 5000000000ULL, 10000000000ULL
+};
+#define NB_LATENCY_BUCKETS (sizeof(latency_bounds_ns) / sizeof(latency_bounds_ns[0]))
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+typedef _Atomic uint64_t counter_t;
+
+// all the members are counters, so that a set of counters can be summed as an array
+struct counters {
+    counter_t requests[NB_ROUTES][NB_STATUS_CLASSES];
+    counter_t latency_buckets[NB_ROUTES][NB_LATENCY_BUCKETS]; // non cumulative
+    counter_t latency_sum_ns[NB_ROUTES];
+    counter_t bytes_sent[NB_ROUTES];
+    counter_t derivative_hits[NB_RES];
+    counter_t derivative_misses[NB_RES];
+    counter_t connections_open;  // up/down counter, summed over shards
+    counter_t connections_total;
+};
+
+#define NB_COUNTERS (sizeof(struct counters) / sizeof(counter_t))
+
+struct metrics_shard {
+    struct counters c;
+} __attribute__((aligned(CACHE_LINE)));
+
+static struct metrics_shard shards[METRICS_SHARDS];
+static atomic_uint next_shard;
+
+static atomic_uint volume_nb_files;
+static atomic_uint volume_max_files;
+static atomic_uint volume_version;
+
+static _Thread_local struct counters* my_shard = NULL;
+
+/**
+ * @brief Returns the shard of the calling thread, binding one if needed.
+ */
+static struct counters* shard(void)
+{
+    if (my_shard == NULL) {
+        const unsigned int idx = atomic_fetch_add_explicit(&next_shard, 1, memory_order_relaxed);
+        my_shard = &shards[idx % METRICS_SHARDS].c;
+    }
+    return my_shard;
+}
+
+static void inc(counter_t* c, uint64_t v)
+{
+    atomic_fetch_add_explicit(c, v, memory_order_relaxed);
+}
+
+static void dec(counter_t* c, uint64_t v)
+{
+    atomic_fetch_sub_explicit(c, v, memory_order_relaxed);
+}
+
+void metrics_connection_opened(void)
+{
+    struct counters* s = shard();
+    inc(&s->connections_open, 1);
+    inc(&s->connections_total, 1);
+}
+
+void metrics_connection_closed(void)
+{
+    dec(&shard()->connections_open, 1);
+}
+
+void metrics_request(const struct request_ctx* ctx)
+{
+    if (ctx == NULL || ctx->status == 0) return; // nothing was answered
+
+    struct counters* s = shard();
+
+    const uint64_t latency = ctx->end_ns - ctx->start_ns;
+    size_t bucket = 0;
+    while (bucket < NB_LATENCY_BUCKETS && latency > latency_bounds_ns[bucket]) ++bucket;
+
+    const enum request_route route = (unsigned int) ctx->route < NB_ROUTES ? ctx->route : ROUTE_OTHER;
+    const int class = ctx->status / 100 - 1;
+    if (class >= 0 && class < NB_STATUS_CLASSES) {
+        inc(&s->requests[route][class], 1);
+    }
+    if (bucket < NB_LATENCY_BUCKETS) {
+        inc(&s->latency_buckets[route][bucket], 1);
+    }
+    inc(&s->latency_sum_ns[route], latency);
+    inc(&s->bytes_sent[route], ctx->bytes);
+
+    if (ctx->cache_hit >= 0 && ctx->resolution >= 0 && ctx->resolution < NB_RES) {
+        inc(ctx->cache_hit ? &s->derivative_hits[ctx->resolution]
+            : &s->derivative_misses[ctx->resolution], 1);
+    }
+}
+
+void metrics_volume(uint32_t nb_files, uint32_t max_files, uint32_t version)
+{
+    atomic_store_explicit(&volume_nb_files, nb_files, memory_order_relaxed);
+    atomic_store_explicit(&volume_max_files, max_files, memory_order_relaxed);
+    atomic_store_explicit(&volume_version, version, memory_order_relaxed);
+}
+
+/********************************************************************
+ * Rendering
+ */
+
+static uint64_t load(const counter_t* c)
+{
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+static double seconds(const counter_t* c_ns)
+{
+    const uint64_t ns = load(c_ns);
+    return (double) ns / 1e9;
+}
+
+/**
+ * @brief Sums all the shards into totals.
+ */
+static void aggregate(struct counters* totals)
+{
+    counter_t* const t = (counter_t*) totals;
+    for (size_t k = 0; k < NB_COUNTERS; ++k) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < METRICS_SHARDS; ++i) {
+            sum += load((const counter_t*) &shards[i].c + k);
+        }
+        atomic_init(&t[k], sum);
+    }
+}
+
+static void render_histogram(FILE* out, const struct counters* t)
+{
+    fprintf(out, "# HELP imgfs_request_duration_seconds Time from the start of the request to its end.\n"
+            "# TYPE imgfs_request_duration_seconds histogram\n");
+    for (enum request_route r = 0; r < NB_ROUTES; ++r) {
+        uint64_t cumulative = 0;
+        uint64_t count = 0;
+        for (int c = 0; c < NB_STATUS_CLASSES; ++c) count += load(&t->requests[r][c]);
+        for (size_t b = 0; b < NB_LATENCY_BUCKETS; ++b) {
+            cumulative += load(&t->latency_buckets[r][b]);
+            fprintf(out, "imgfs_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+                    request_route_name(r), (double) latency_bounds_ns[b] / 1e9,
+                    (unsigned long long) cumulative);
+        }
+        fprintf(out, "imgfs_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+                request_route_name(r), (unsigned long long) count);
+        fprintf(out, "imgfs_request_duration_seconds_sum{route=\"%s\"} %.9f\n",
+                request_route_name(r), seconds(&t->latency_sum_ns[r]));
+        fprintf(out, "imgfs_request_duration_seconds_count{route=\"%s\"} %llu\n",
+                request_route_name(r), (unsigned long long) count);
+    }
+}
+
+int metrics_render(char** out_text, size_t* out_len)
+{
+    M_REQUIRE_NON_NULL(out_text);
+    M_REQUIRE_NON_NULL(out_len);
+
+    struct counters totals;
+    aggregate(&totals);
+    const struct counters* const t = &totals;
+
+    *out_text = NULL;
+    FILE* const out = open_memstream(out_text, out_len);
+    if (out == NULL) return ERR_OUT_OF_MEMORY;
+
+    fprintf(out, "# HELP imgfs_requests_total Requests answered, by route and status class.\n"
+            "# TYPE imgfs_requests_total counter\n");
+    for (enum request_route r = 0; r < NB_ROUTES; ++r) {
+        for (int c = 0; c < NB_STATUS_CLASSES; ++c) {
+            const uint64_t n = load(&t->requests[r][c]);
+            if (n == 0) continue;
+            fprintf(out, "imgfs_requests_total{route=\"%s\",code=\"%dxx\"} %llu\n",
+                    request_route_name(r), c + 1, (unsigned long long) n);
+        }
+    }
+
+    render_histogram(out, &totals);
+
+    fprintf(out, "# HELP imgfs_sent_bytes_total Body bytes sent, by route.\n"
+            "# TYPE imgfs_sent_bytes_total counter\n");
+    for (enum request_route r = 0; r < NB_ROUTES; ++r) {
+        fprintf(out, "imgfs_sent_bytes_total{route=\"%s\"} %llu\n",
+                request_route_name(r), (unsigned long long) load(&t->bytes_sent[r]));
+    }
+
+    fprintf(out, "# HELP imgfs_derivative_hits_total Reads served from an already stored resolution.\n"
+            "# TYPE imgfs_derivative_hits_total counter\n");
+    for (int res = 0; res < NB_RES; ++res) {
+        fprintf(out, "imgfs_derivative_hits_total{res=\"%s\"} %llu\n",
+                res_names[res], (unsigned long long) load(&t->derivative_hits[res]));
+    }
+    fprintf(out, "# HELP imgfs_derivative_misses_total Reads that had to resize the original first.\n"
+            "# TYPE imgfs_derivative_misses_total counter\n");
+    for (int res = 0; res < NB_RES; ++res) {
+        fprintf(out, "imgfs_derivative_misses_total{res=\"%s\"} %llu\n",
+                res_names[res], (unsigned long long) load(&t->derivative_misses[res]));
+    }
+
+    fprintf(out, "# HELP imgfs_open_connections Connections currently being served.\n"
+            "# TYPE imgfs_open_connections gauge\n"
+            "imgfs_open_connections %lld\n",
+            (long long) load(&t->connections_open));
+    fprintf(out, "# HELP imgfs_connections_total Connections accepted.\n"
+            "# TYPE imgfs_connections_total counter\n"
+            "imgfs_connections_total %llu\n",
+            (unsigned long long) load(&t->connections_total));
+
+    fprintf(out, "# HELP imgfs_volume_images Valid images in the volume.\n"
+            "# TYPE imgfs_volume_images gauge\n"
+            "imgfs_volume_images %u\n"
+            "# HELP imgfs_volume_max_images Capacity of the volume.\n"
+            "# TYPE imgfs_volume_max_images gauge\n"
+            "imgfs_volume_max_images %u\n"
+            "# HELP imgfs_volume_version Version of the volume header.\n"
+            "# TYPE imgfs_volume_version gauge\n"
+            "imgfs_volume_version %u\n",
+            atomic_load_explicit(&volume_nb_files, memory_order_relaxed),
+            atomic_load_explicit(&volume_max_files, memory_order_relaxed),
+            atomic_load_explicit(&volume_version, memory_order_relaxed));
+
+    if (fclose(out) != 0) {
+        free(*out_text);
+        *out_text = NULL;
+        return ERR_IO;
+    }
+    return ERR_NONE;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file metrics.h
+ * @brief Prometheus-style metrics of the imgFS server.
+ *
+ * All the counters are kept in cache-line aligned shards that are only
+ * updated with relaxed atomic operations. Each thread writes to its own
+ * shard, and rendering the /metrics page only sums the shards: scraping
+ * never takes a lock and never blocks a request.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint32_t
+
+#include "request_ctx.h"
+
+#define METRICS_URI "/metrics"
+#define METRICS_CONTENT_TYPE "Content-Type: text/plain; version=0.0.4"
+
+/**
+ * @brief Accounts a new connection, served by the calling thread.
+ */
+void metrics_connection_opened(void);
+
+/**
+ * @brief Ends the accounting of the connection of the calling thread.
+ */
+void metrics_connection_closed(void);
+
+/**
+ * @brief Commits the counters of a request that ended, if it was answered.
+ */
+void metrics_request(const struct request_ctx* ctx);
+
+/**
+ * @brief Publishes the volume gauges (number of images, capacity, version).
+ */
+void metrics_volume(uint32_t nb_files, uint32_t max_files, uint32_t version);
+
+/**
+ * @brief Renders all the metrics in the Prometheus text exposition format.
+ *
+ * @param out_text Location of the rendered text; dynamically allocated, to be freed by the caller.
+ * @param out_len Location of the length of the rendered text.
+ * @return Some error code. 0 if no error.
+ */
+int metrics_render(char** out_text, size_t* out_len);
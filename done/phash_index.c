@@ -0,0 +1,96 @@
+/**
+ * @file phash_index.c
+ * @brief BK-tree of perceptual hashes (see phash_index.h).
+ */
+
+#include "phash_index.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 64
+
+void phash_index_init(struct phash_index* index)
+{
+    if (index != NULL) memset(index, 0, sizeof(*index));
+}
+
+void phash_index_free(struct phash_index* index)
+{
+    if (index == NULL) return;
+    free(index->nodes);
+    memset(index, 0, sizeof(*index));
+}
+
+int phash_index_add(struct phash_index* index, uint64_t hash, uint32_t id)
+{
+    M_REQUIRE_NON_NULL(index);
+    if (index->nb_nodes >= UINT32_MAX) return ERR_MAX_FILES;
+
+    if (index->nb_nodes == index->capacity) {
+        const size_t capacity = index->capacity == 0 ? INITIAL_CAPACITY : 2 * index->capacity;
+        struct phash_node* const nodes = realloc(index->nodes, capacity * sizeof(struct phash_node));
+        if (nodes == NULL) return ERR_OUT_OF_MEMORY;
+        index->nodes = nodes;
+        index->capacity = capacity;
+    }
+
+    const uint32_t added = (uint32_t) index->nb_nodes;
+    struct phash_node* const node = &index->nodes[added];
+    memset(node, 0, sizeof(*node));
+    node->hash = hash;
+    node->id = id;
+    ++index->nb_nodes;
+    if (added == 0) return ERR_NONE; // the root
+
+    // down the children at the same distance, until there is none
+    uint32_t current = 0;
+    for (;;) {
+        const unsigned d = phash_distance(hash, index->nodes[current].hash);
+        uint32_t child = index->nodes[current].first_child;
+        while (child != 0 && index->nodes[child].distance != d) child = index->nodes[child].next_sibling;
+        if (child == 0) {
+            node->distance = d;
+            node->next_sibling = index->nodes[current].first_child;
+            index->nodes[current].first_child = added;
+            return ERR_NONE;
+        }
+        current = child;
+    }
+}
+
+int phash_index_query(const struct phash_index* index, uint64_t hash, unsigned max_distance,
+                      struct phash_match* matches, size_t max_matches, size_t* nb_matches)
+{
+    M_REQUIRE_NON_NULL(index);
+    M_REQUIRE_NON_NULL(nb_matches);
+    if (max_matches > 0) M_REQUIRE_NON_NULL(matches);
+
+    *nb_matches = 0;
+    if (index->nb_nodes == 0) return ERR_NONE;
+
+    // every node is pushed at most once
+    uint32_t* const stack = malloc(index->nb_nodes * sizeof(uint32_t));
+    if (stack == NULL) return ERR_OUT_OF_MEMORY;
+    size_t top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        const struct phash_node* const node = &index->nodes[stack[--top]];
+        const unsigned d = phash_distance(hash, node->hash);
+        if (d <= max_distance && *nb_matches < max_matches) {
+            matches[*nb_matches].id = node->id;
+            matches[*nb_matches].distance = d;
+            ++*nb_matches;
+        }
+        const unsigned low = d > max_distance ? d - max_distance : 0;
+        const unsigned high = d + max_distance;
+        for (uint32_t child = node->first_child; child != 0; child = index->nodes[child].next_sibling) {
+            if (index->nodes[child].distance >= low && index->nodes[child].distance <= high) {
+                stack[top++] = child;
+            }
+        }
+    }
+    free(stack);
+    return ERR_NONE;
+}
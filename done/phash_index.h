@@ -0,0 +1,87 @@
+/**
+ * @file phash_index.h
+ * @brief In-memory index of 64-bit perceptual hashes by Hamming distance.
+ *
+ * The index is a BK-tree: every child of a node is at a distinct Hamming
+ * distance from it, so that by the triangle inequality a query within r
+ * bits only visits the children at d - r to d + r from a node at distance d.
+ * A query for near-duplicates (a few bits) thus visits a small part of the
+ * tree. Hashes cannot be removed; the caller filters out those which no
+ * longer hold.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PHASH_BITS 64
+
+struct phash_node {
+    uint64_t hash;
+    uint32_t id;           // given by the caller, e.g. the index of the image
+    uint32_t first_child;  // index in nodes, 0 if none (the root is nobody's child)
+    uint32_t next_sibling; // index in nodes, 0 if none
+    uint32_t distance;     // to the parent
+};
+
+struct phash_index {
+    struct phash_node* nodes; // nodes[0] is the root
+    size_t nb_nodes;
+    size_t capacity;
+};
+
+struct phash_match {
+    uint32_t id;
+    unsigned distance;
+};
+
+/**
+ * @brief Number of bits which differ between two hashes.
+ */
+static inline unsigned phash_distance(uint64_t a, uint64_t b)
+{
+    return (unsigned) __builtin_popcountll(a ^ b);
+}
+
+/**
+ * @brief Initializes an empty index.
+ */
+void phash_index_init(struct phash_index* index);
+
+/**
+ * @brief Frees the nodes of an index, which is left empty.
+ */
+void phash_index_free(struct phash_index* index);
+
+/**
+ * @brief Adds a hash to an index.
+ *
+ * @param index The index.
+ * @param hash The hash.
+ * @param id What a query returns for this hash.
+ * @return Some error code. 0 if no error.
+ */
+int phash_index_add(struct phash_index* index, uint64_t hash, uint32_t id);
+
+/**
+ * @brief Finds the hashes within some distance of a hash, in no particular order.
+ *
+ * @param index The index.
+ * @param hash The hash to look for.
+ * @param max_distance The largest distance matched.
+ * @param matches Where to put the matches.
+ * @param max_matches How many matches fit in matches; the others are not returned.
+ * @param nb_matches Where to put the number of matches returned.
+ * @return Some error code. 0 if no error.
+ */
+int phash_index_query(const struct phash_index* index, uint64_t hash, unsigned max_distance,
+                      struct phash_match* matches, size_t max_matches, size_t* nb_matches);
+
+#ifdef __cplusplus
+}
+#endif
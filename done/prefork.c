@@ -0,0 +1,310 @@
+/**
+ * @file prefork.c
+ * @brief Prefork mode of the imgFS server (see prefork.h).
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "prefork.h"
+#include "imgfs_ext.h"
+#include "volume_io.h"
+#include "error.h"
+#include "util.h" // _unused
+
+/**
+ * @brief What the workers share, followed by the metadata.
+ */
+struct prefork_shared {
+    pthread_mutex_t lock; // robust, process-shared
+    struct imgfs_header header; // as of the last release of the lock
+    atomic_uint_least64_t writes; // operations that wrote to the volume
+    struct img_metadata metadata[];
+};
+
+struct worker {
+    pid_t pid; // 0 if not running
+    time_t started;
+};
+
+static struct prefork_shared* shared = NULL;
+static size_t shared_size = 0;
+
+// in a worker
+static int is_worker = 0;
+static unsigned worker_index = 0;
+static int volume_fd = -1;
+static int wrote = 0; // since the lock was taken
+static uint_least64_t seen_writes = 0; // when the extension table was last valid
+
+// in the master
+static volatile sig_atomic_t stopping = 0;
+
+/* ---------------------------------------------------------------------
+ * The FILE of a worker: direct reads and writes, which it notes.
+ */
+
+static void note_write(uint64_t offset _unused, const char* data _unused, size_t written _unused)
+{
+    wrote = 1;
+}
+
+static int wrap_volume(struct imgfs_file* imgfs_file)
+{
+    // unbuffered: what a worker writes, the others read
+    static const struct volume_io_hooks hooks = { NULL, note_write, NULL, NULL };
+    volume_fd = fileno(imgfs_file->file);
+    return volume_io_wrap(imgfs_file, &hooks);
+}
+
+/* ---------------------------------------------------------------------
+ * Workers
+ */
+
+/**
+ * @brief Loads the header and the metadata from the file, after a worker
+ *        died holding the lock.
+ */
+static void recover(struct imgfs_file* imgfs_file)
+{
+    const size_t metadata_size = shared->header.max_files * sizeof(struct img_metadata);
+    if (pread(volume_fd, &shared->header, sizeof(struct imgfs_header), 0)
+        != (ssize_t) sizeof(struct imgfs_header)
+        || pread(volume_fd, shared->metadata, metadata_size, sizeof(struct imgfs_header))
+        != (ssize_t) metadata_size) {
+        fprintf(stderr, "Worker %u: failed to reload the volume after a worker died\n", worker_index);
+    } else {
+        fprintf(stderr, "Worker %u: volume reloaded after a worker died, at version %u\n",
+                worker_index, shared->header.version);
+    }
+    atomic_fetch_add(&shared->writes, 1);
+    (void) imgfs_file;
+}
+
+void prefork_lock(struct imgfs_file* imgfs_file)
+{
+    if (!is_worker) return;
+
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+        recover(imgfs_file);
+        pthread_mutex_consistent(&shared->lock);
+    }
+    imgfs_file->header = shared->header;
+    const uint_least64_t writes = atomic_load(&shared->writes);
+    if (writes != seen_writes) {
+        // its records may have been rewritten: loaded again when needed
+        imgfs_ext_release(imgfs_file);
+        seen_writes = writes;
+    }
+    wrote = 0;
+}
+
+void prefork_unlock(const struct imgfs_file* imgfs_file)
+{
+    if (!is_worker) return;
+
+    shared->header = imgfs_file->header;
+    if (wrote) seen_writes = atomic_fetch_add(&shared->writes, 1) + 1;
+    wrote = 0;
+    pthread_mutex_unlock(&shared->lock);
+}
+
+void prefork_detach(struct imgfs_file* imgfs_file)
+{
+    if (is_worker && imgfs_file != NULL) imgfs_file->metadata = NULL;
+}
+
+int prefork_is_worker(unsigned* index)
+{
+    if (index != NULL) *index = worker_index;
+    return is_worker;
+}
+
+/**
+ * @brief Becomes worker index, in the process just forked.
+ */
+static int become_worker(unsigned index, struct imgfs_file* imgfs_file, pid_t master)
+{
+    // the signals of the server, not those of the master
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    // stopped with the master, even if it is killed
+    if (prctl(PR_SET_PDEATHSIG, SIGTERM) != 0 || getppid() != master) return ERR_RUNTIME;
+
+    is_worker = 1;
+    worker_index = index;
+    seen_writes = atomic_load(&shared->writes);
+    return wrap_volume(imgfs_file);
+}
+
+/* ---------------------------------------------------------------------
+ * Master
+ */
+
+static void on_stop(int sig_num)
+{
+    (void) sig_num;
+    stopping = 1;
+}
+
+/**
+ * @brief Sets the signal handlers of the master, which interrupt waitpid().
+ */
+static void catch_stop_signals(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = on_stop;
+    action.sa_flags = 0; // no SA_RESTART
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+}
+
+/**
+ * @brief Forks worker index; returns 0 in the worker, 1 in the master, or
+ *        an error code (< 0).
+ */
+static int spawn(struct worker* workers, unsigned index, struct imgfs_file* imgfs_file)
+{
+    const pid_t master = getpid();
+    fflush(stdout); // or the workers would print it again
+    const pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork()");
+        return ERR_RUNTIME;
+    }
+    if (pid == 0) {
+        const int err = become_worker(index, imgfs_file, master);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Worker %u failed to start: %s\n", index, ERR_MSG(err));
+            _exit(1);
+        }
+        return 0;
+    }
+    workers[index].pid = pid;
+    workers[index].started = time(NULL);
+    return 1;
+}
+
+/**
+ * @brief Stops the workers and waits for them.
+ */
+static void stop_workers(struct worker* workers, unsigned nb_workers)
+{
+    for (unsigned i = 0; i < nb_workers; ++i) {
+        if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+    }
+    for (unsigned i = 0; i < nb_workers; ++i) {
+        if (workers[i].pid > 0) waitpid(workers[i].pid, NULL, 0);
+    }
+}
+
+/**
+ * @brief Restarts the workers that die, until stopped. Returns 0 in a
+ *        worker just forked, 1 in the master once stopped.
+ */
+static int supervise(struct worker* workers, unsigned nb_workers, struct imgfs_file* imgfs_file)
+{
+    while (!stopping) {
+        int status = 0;
+        const pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) continue; // interrupted, or no worker for now
+
+        unsigned index = 0;
+        while (index < nb_workers && workers[index].pid != pid) ++index;
+        if (index == nb_workers) continue;
+        workers[index].pid = 0;
+        if (stopping) break;
+
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "Worker %u (pid %d) killed by signal %d, restarting it\n",
+                    index, (int) pid, WTERMSIG(status));
+        } else {
+            fprintf(stderr, "Worker %u (pid %d) exited with %d, restarting it\n",
+                    index, (int) pid, WEXITSTATUS(status));
+        }
+        if (time(NULL) - workers[index].started < PREFORK_MIN_UPTIME_S) {
+            const struct timespec delay = {
+                PREFORK_RESTART_DELAY_MS / 1000, (PREFORK_RESTART_DELAY_MS % 1000) * 1000000L
+            };
+            nanosleep(&delay, NULL);
+            if (stopping) break;
+        }
+        const int spawned = spawn(workers, index, imgfs_file);
+        if (spawned == 0) return 0;
+    }
+    stop_workers(workers, nb_workers);
+    return 1;
+}
+
+/**
+ * @brief Moves the header and the metadata of the volume to shared memory.
+ */
+static int share_metadata(struct imgfs_file* imgfs_file)
+{
+    const size_t metadata_size = imgfs_file->header.max_files * sizeof(struct img_metadata);
+    shared_size = sizeof(struct prefork_shared) + metadata_size;
+    void* const mapping = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) return ERR_OUT_OF_MEMORY;
+    shared = mapping;
+
+    pthread_mutexattr_t attr;
+    if (pthread_mutexattr_init(&attr) != 0
+        || pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0
+        || pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0
+        || pthread_mutex_init(&shared->lock, &attr) != 0) {
+        munmap(mapping, shared_size);
+        shared = NULL;
+        return ERR_THREADING;
+    }
+    pthread_mutexattr_destroy(&attr);
+
+    shared->header = imgfs_file->header;
+    atomic_init(&shared->writes, 0);
+    memcpy(shared->metadata, imgfs_file->metadata, metadata_size);
+    free(imgfs_file->metadata);
+    imgfs_file->metadata = shared->metadata;
+    return ERR_NONE;
+}
+
+int prefork_start(unsigned nb_workers, struct imgfs_file* imgfs_file)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    if (nb_workers == 0 || nb_workers > PREFORK_MAX_WORKERS || shared != NULL) return ERR_INVALID_ARGUMENT;
+
+    int err = fflush(imgfs_file->file) == 0 ? share_metadata(imgfs_file) : ERR_IO;
+    if (err != ERR_NONE) return err;
+
+    struct worker workers[PREFORK_MAX_WORKERS];
+    memset(workers, 0, sizeof(workers));
+    // before forking, so that no stop request is missed
+    catch_stop_signals();
+    for (unsigned i = 0; i < nb_workers; ++i) {
+        const int spawned = spawn(workers, i, imgfs_file);
+        if (spawned == 0) return ERR_NONE;
+        if (spawned < 0) {
+            stop_workers(workers, nb_workers);
+            return spawned;
+        }
+    }
+    printf("Master of %u workers (pid %d)\n", nb_workers, (int) getpid());
+    fflush(stdout);
+
+    if (supervise(workers, nb_workers, imgfs_file) == 0) return ERR_NONE;
+    fprintf(stderr, "Shutting down the imgfs server...\n");
+    exit(0);
+}
@@ -0,0 +1,69 @@
+/**
+ * @file prefork.h
+ * @brief Prefork mode of the imgFS server: worker processes sharing the volume.
+ *
+ * The master opens the volume, moves its header and metadata to shared
+ * memory, opens the listening socket, then forks the workers, which accept
+ * on it and serve the requests as a server of their own would. A worker
+ * crashing (in libvips, say) takes only its own requests down: the master
+ * forks another one.
+ *
+ * The volume lock of the workers is a robust mutex in the shared memory:
+ * each worker takes it after its own lock. When a worker takes it, its
+ * header becomes the shared one, and the extension table it loaded is
+ * dropped if another worker wrote to the volume since. The workers read
+ * and write the file directly (no stdio buffers), so that each sees what
+ * the others wrote. If a worker dies holding the lock, the next one to
+ * take it loads the header and the metadata from the file again: what
+ * the dead worker changed in memory but did not write is forgotten.
+ *
+ * Each worker has its own metrics and logs; its trace-event export goes to
+ * a file of its own (slow_log.h). Replication, shared volumes and the
+ * intake log are not available in this mode.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#define PREFORK_WORKERS_ENV "IMGFS_WORKERS" // number of workers; no prefork if unset or 0
+#define PREFORK_MAX_WORKERS 64
+#define PREFORK_RESTART_DELAY_MS 1000 // before restarting a worker that died young
+#define PREFORK_MIN_UPTIME_S 1 // a worker dying sooner "died young"
+
+/**
+ * @brief Shares the volume, then forks the workers. Only the workers
+ *        return: the master supervises them until SIGINT or SIGTERM,
+ *        then stops them and exits.
+ *
+ * @param nb_workers The number of workers, 1 to PREFORK_MAX_WORKERS.
+ * @param imgfs_file The volume, opened; the listening socket must be open too.
+ * @return In a worker, some error code (0 if no error). The master returns
+ *         an error only if it could not start.
+ */
+int prefork_start(unsigned nb_workers, struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Whether this process is a worker; its index (0 to nb_workers - 1)
+ *        if index is not NULL.
+ */
+int prefork_is_worker(unsigned* index);
+
+/**
+ * @brief Takes the lock shared by the workers, and brings the volume up to
+ *        date. To be called after the volume lock of the worker is taken.
+ *        Does nothing if not a worker.
+ */
+void prefork_lock(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Publishes the header and releases the lock shared by the workers.
+ *        Does nothing if not a worker.
+ */
+void prefork_unlock(const struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Forgets the shared metadata before do_close(), which would free it.
+ *        Does nothing if not a worker.
+ */
+void prefork_detach(struct imgfs_file* imgfs_file);
@@ -0,0 +1,489 @@
+/**
+ * @file prewarm.c
+ * @brief Prewarming of the imgFS server from its access history.
+ *
+ * The reads are counted in an open addressing table of TRACKED_SLOTS
+ * entries. When it is TRACKED_MAX full, all the counts are halved and the
+ * pairs left at 0 are dropped, so that the table keeps the recently hot
+ * pairs rather than the first ones seen. The summary file has one line per
+ * pair, "<count> <resolution> <img_id>", hottest first; its counts seed
+ * the table, halved, so that a summary saved soon after a restart does not
+ * forget the previous run.
+ *
+ * A read is first counted in a batch of its thread, which is merged into
+ * the table when full, when the thread exits, and before each save: the
+ * table lock is not taken by every read.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "prewarm.h"
+#include "imgfs.h"
+#include "error.h"
+#include "lock_prof.h"
+#include "prefork.h" // PREFORK_MAX_WORKERS
+#include "util.h" // _unused, block_stop_signals
+
+#define TRACKED_SLOTS 4096 // must be a power of two
+#define TRACKED_MAX (TRACKED_SLOTS * 3 / 4)
+#define RECORD_BATCH 64 // pairs a thread counts before merging them into the table
+#define SAVE_CHECK_MS 100 // how often the worker checks whether to stop
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+struct hot_entry {
+    uint32_t count; // 0 if the slot is free
+    int resolution;
+    char img_id[MAX_IMG_ID + 1];
+};
+
+struct hot_table {
+    struct hot_entry* slots; // TRACKED_SLOTS
+    size_t used;
+};
+
+/**
+ * @brief The reads counted by a thread, not yet merged into the table.
+ */
+struct read_batch {
+    // a plain mutex, not profiled: one per thread, only contended while saving
+    pthread_mutex_t lock;
+    size_t nb_pairs;
+    struct hot_entry pairs[RECORD_BATCH];
+    struct read_batch* prev;
+    struct read_batch* next;
+};
+
+static struct hot_table table = { NULL, 0 };
+static struct prof_mutex table_lock = PROF_MUTEX_INITIALIZER("prewarm");
+
+static pthread_key_t batch_key;
+static pthread_once_t batch_key_once = PTHREAD_ONCE_INIT;
+static int batch_key_ok = 0;
+static struct read_batch* batches = NULL;
+static struct prof_mutex batches_lock = PROF_MUTEX_INITIALIZER("prewarm_batches");
+
+static char* summary_path = NULL;
+static char* save_path = NULL; // the summary, or that of the worker
+static int replays = 0;
+static unsigned replay_rate = PREWARM_DEFAULT_RATE;
+static prewarm_fn warm_fn = NULL;
+static atomic_int running;
+static pthread_t worker;
+
+static uint32_t hash_key(const char* img_id, int resolution)
+{
+    uint32_t h = 2166136261u ^ (uint32_t) resolution; // FNV-1a
+    for (const char* c = img_id; *c != '\0'; ++c) {
+        h ^= (unsigned char) *c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Finds the slot of a pair, or the free slot where it goes; the
+ *        table is never full.
+ */
+static struct hot_entry* probe(struct hot_entry* slots, const char* img_id, int resolution)
+{
+    size_t i = hash_key(img_id, resolution) & (TRACKED_SLOTS - 1);
+    while (slots[i].count != 0
+           && (slots[i].resolution != resolution || strcmp(slots[i].img_id, img_id) != 0)) {
+        i = (i + 1) & (TRACKED_SLOTS - 1);
+    }
+    return &slots[i];
+}
+
+/**
+ * @brief Halves the counts and drops the pairs left at 0.
+ */
+static void age(struct hot_table* t)
+{
+    struct hot_entry* const old = malloc(TRACKED_SLOTS * sizeof(struct hot_entry));
+    if (old == NULL) return;
+    memcpy(old, t->slots, TRACKED_SLOTS * sizeof(struct hot_entry));
+    memset(t->slots, 0, TRACKED_SLOTS * sizeof(struct hot_entry));
+    t->used = 0;
+    for (size_t i = 0; i < TRACKED_SLOTS; ++i) {
+        if (old[i].count / 2 == 0) continue;
+        struct hot_entry* const e = probe(t->slots, old[i].img_id, old[i].resolution);
+        *e = old[i];
+        e->count /= 2;
+        ++t->used;
+    }
+    free(old);
+}
+
+/**
+ * @brief Adds count reads of a pair.
+ */
+static void add(struct hot_table* t, const char* img_id, int resolution, uint32_t count)
+{
+    if (count == 0) return;
+    struct hot_entry* e = probe(t->slots, img_id, resolution);
+    if (e->count == 0) {
+        if (t->used >= TRACKED_MAX) {
+            age(t);
+            if (t->used >= TRACKED_MAX) return; // only hot pairs: this one is not tracked
+            e = probe(t->slots, img_id, resolution);
+        }
+        strncpy(e->img_id, img_id, MAX_IMG_ID);
+        e->img_id[MAX_IMG_ID] = '\0';
+        e->resolution = resolution;
+        ++t->used;
+    }
+    e->count = count > UINT32_MAX - e->count ? UINT32_MAX : e->count + count;
+}
+
+/**
+ * @brief Merges a batch into the table; the caller holds the lock of the batch.
+ */
+static void merge_batch(struct read_batch* batch)
+{
+    prof_mutex_lock(&table_lock);
+    if (table.slots != NULL) { // NULL once stopped
+        for (size_t i = 0; i < batch->nb_pairs; ++i) {
+            add(&table, batch->pairs[i].img_id, batch->pairs[i].resolution, batch->pairs[i].count);
+        }
+    }
+    prof_mutex_unlock(&table_lock);
+    batch->nb_pairs = 0;
+}
+
+/**
+ * @brief Merges the batch of a thread that exits, and frees it.
+ */
+static void retire_batch(void* arg)
+{
+    struct read_batch* const batch = arg;
+    prof_mutex_lock(&batches_lock);
+    if (batch->prev != NULL) batch->prev->next = batch->next;
+    else batches = batch->next;
+    if (batch->next != NULL) batch->next->prev = batch->prev;
+    prof_mutex_unlock(&batches_lock);
+
+    pthread_mutex_lock(&batch->lock);
+    merge_batch(batch);
+    pthread_mutex_unlock(&batch->lock);
+    pthread_mutex_destroy(&batch->lock);
+    free(batch);
+}
+
+static void create_batch_key(void)
+{
+    batch_key_ok = pthread_key_create(&batch_key, retire_batch) == 0;
+}
+
+/**
+ * @brief The batch of the calling thread, created if needed; NULL if it
+ *        cannot be.
+ */
+static struct read_batch* my_batch(void)
+{
+    pthread_once(&batch_key_once, create_batch_key);
+    if (!batch_key_ok) return NULL;
+    struct read_batch* batch = pthread_getspecific(batch_key);
+    if (batch != NULL) return batch;
+
+    batch = calloc(1, sizeof(struct read_batch));
+    if (batch == NULL) return NULL;
+    if (pthread_mutex_init(&batch->lock, NULL) != 0) {
+        free(batch);
+        return NULL;
+    }
+    if (pthread_setspecific(batch_key, batch) != 0) {
+        pthread_mutex_destroy(&batch->lock);
+        free(batch);
+        return NULL;
+    }
+    prof_mutex_lock(&batches_lock);
+    batch->next = batches;
+    if (batches != NULL) batches->prev = batch;
+    batches = batch;
+    prof_mutex_unlock(&batches_lock);
+    return batch;
+}
+
+void prewarm_record(const char* img_id, int resolution)
+{
+    if (!atomic_load_explicit(&running, memory_order_relaxed) || img_id == NULL
+        || resolution < 0 || resolution >= NB_RES) {
+        return;
+    }
+    struct read_batch* const batch = my_batch();
+    if (batch == NULL) {
+        prof_mutex_lock(&table_lock);
+        if (table.slots != NULL) add(&table, img_id, resolution, 1);
+        prof_mutex_unlock(&table_lock);
+        return;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    size_t i = 0;
+    while (i < batch->nb_pairs
+           && (batch->pairs[i].resolution != resolution || strcmp(batch->pairs[i].img_id, img_id) != 0)) {
+        ++i;
+    }
+    if (i == batch->nb_pairs) {
+        if (i == RECORD_BATCH) {
+            merge_batch(batch);
+            i = 0;
+        }
+        struct hot_entry* const e = &batch->pairs[i];
+        strncpy(e->img_id, img_id, MAX_IMG_ID);
+        e->img_id[MAX_IMG_ID] = '\0';
+        e->resolution = resolution;
+        e->count = 0;
+        ++batch->nb_pairs;
+    }
+    if (batch->pairs[i].count < UINT32_MAX) ++batch->pairs[i].count;
+    pthread_mutex_unlock(&batch->lock);
+}
+
+static int hotter(const void* a, const void* b)
+{
+    const uint32_t x = ((const struct hot_entry*) a)->count;
+    const uint32_t y = ((const struct hot_entry*) b)->count;
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Writes the hottest pairs of a table to a summary, through a
+ *        temporary file so that it is never seen half written.
+ */
+static int write_summary(const struct hot_entry* slots, const char* path)
+{
+    struct hot_entry* const hot = malloc(TRACKED_SLOTS * sizeof(struct hot_entry));
+    if (hot == NULL) return ERR_OUT_OF_MEMORY;
+    size_t n = 0;
+    for (size_t i = 0; i < TRACKED_SLOTS; ++i) {
+        if (slots[i].count != 0) hot[n++] = slots[i];
+    }
+    qsort(hot, n, sizeof(struct hot_entry), hotter);
+    if (n > PREWARM_MAX_ENTRIES) n = PREWARM_MAX_ENTRIES;
+
+    const size_t tmp_len = strlen(path) + sizeof(".tmp");
+    char* const tmp = malloc(tmp_len);
+    if (tmp == NULL) {
+        free(hot);
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE* const f = fopen(tmp, "w");
+    int err = f == NULL ? ERR_IO : ERR_NONE;
+    if (f != NULL) {
+        fprintf(f, "# count resolution img_id, hottest first\n");
+        for (size_t i = 0; i < n; ++i) {
+            fprintf(f, "%" PRIu32 " %s %s\n", hot[i].count, res_names[hot[i].resolution], hot[i].img_id);
+        }
+        if (fclose(f) != 0 || rename(tmp, path) != 0) err = ERR_IO;
+    }
+    if (err != ERR_NONE) perror("prewarm summary");
+    free(tmp);
+    free(hot);
+    return err;
+}
+
+/**
+ * @brief Merges the batches of all the threads, then saves the table.
+ */
+static int save(void)
+{
+    prof_mutex_lock(&batches_lock);
+    for (struct read_batch* batch = batches; batch != NULL; batch = batch->next) {
+        pthread_mutex_lock(&batch->lock);
+        merge_batch(batch);
+        pthread_mutex_unlock(&batch->lock);
+    }
+    prof_mutex_unlock(&batches_lock);
+
+    struct hot_entry* const copy = malloc(TRACKED_SLOTS * sizeof(struct hot_entry));
+    if (copy == NULL) return ERR_OUT_OF_MEMORY;
+    prof_mutex_lock(&table_lock);
+    memcpy(copy, table.slots, TRACKED_SLOTS * sizeof(struct hot_entry));
+    prof_mutex_unlock(&table_lock);
+    const int err = write_summary(copy, save_path);
+    free(copy);
+    return err;
+}
+
+/**
+ * @brief Parses a line of a summary.
+ *
+ * @param line Without its newline; img_id points into it.
+ * @return 1 if it is a valid pair, 0 otherwise (comments included).
+ */
+static int parse_line(const char* line, uint32_t* count, int* resolution, const char** img_id)
+{
+    if (line[0] == '#') return 0;
+    char res_name[16];
+    int id_start = 0;
+    if (sscanf(line, "%" SCNu32 " %15s %n", count, res_name, &id_start) != 2 || id_start == 0) return 0;
+    *resolution = resolution_atoi(res_name);
+    *img_id = line + id_start;
+    return *resolution >= 0 && (*img_id)[0] != '\0' && strlen(*img_id) <= MAX_IMG_ID;
+}
+
+static void sleep_ns(uint64_t ns)
+{
+    const struct timespec t = { (time_t) (ns / 1000000000ULL), (long) (ns % 1000000000ULL) };
+    nanosleep(&t, NULL);
+}
+
+/**
+ * @brief Warms the pairs of the previous summary, at replay_rate per second.
+ */
+static void replay(void)
+{
+    FILE* const f = fopen(summary_path, "r");
+    if (f == NULL) return; // first run
+
+    char line[64 + MAX_IMG_ID];
+    unsigned warmed = 0;
+    unsigned total = 0;
+    const uint64_t interval_ns = 1000000000ULL / replay_rate;
+    while (atomic_load(&running) && fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\n")] = '\0';
+        uint32_t count = 0;
+        int resolution = -1;
+        const char* img_id = NULL;
+        if (!parse_line(line, &count, &resolution, &img_id)) continue;
+
+        ++total;
+        if (warm_fn(img_id, resolution) == ERR_NONE) {
+            ++warmed; // images deleted since fail, and are forgotten
+            prof_mutex_lock(&table_lock);
+            add(&table, img_id, resolution, count / 2 > 0 ? count / 2 : 1);
+            prof_mutex_unlock(&table_lock);
+        }
+        sleep_ns(interval_ns);
+    }
+    fclose(f);
+    fprintf(stderr, "Prewarmed %u of %u images from %s\n", warmed, total, summary_path);
+}
+
+static void* worker_main(void* arg _unused)
+{
+    block_stop_signals();
+
+    if (replays) replay();
+    unsigned waited_ms = 0;
+    while (atomic_load(&running)) {
+        sleep_ns(SAVE_CHECK_MS * 1000000ULL);
+        waited_ms += SAVE_CHECK_MS;
+        if (waited_ms >= PREWARM_SAVE_INTERVAL_S * 1000) {
+            save();
+            waited_ms = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief The summary of a worker, "<path>.<worker>"; to be freed.
+ */
+static char* worker_path(const char* path, unsigned index)
+{
+    const size_t len = strlen(path) + sizeof(".") + 10;
+    char* const name = malloc(len);
+    if (name != NULL) snprintf(name, len, "%s.%u", path, index);
+    return name;
+}
+
+int prewarm_merge(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+
+    struct hot_table merged = { calloc(TRACKED_SLOTS, sizeof(struct hot_entry)), 0 };
+    if (merged.slots == NULL) return ERR_OUT_OF_MEMORY;
+    char* names[PREFORK_MAX_WORKERS] = { NULL };
+    size_t nb_files = 0;
+    int err = ERR_NONE;
+    for (unsigned i = 0; i < PREFORK_MAX_WORKERS && err == ERR_NONE; ++i) {
+        char* const name = worker_path(path, i);
+        FILE* const f = name == NULL ? NULL : fopen(name, "r");
+        if (name == NULL) err = ERR_OUT_OF_MEMORY;
+        if (f == NULL) {
+            free(name);
+            continue;
+        }
+        names[nb_files++] = name;
+        char line[64 + MAX_IMG_ID];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            line[strcspn(line, "\n")] = '\0';
+            uint32_t count = 0;
+            int resolution = -1;
+            const char* img_id = NULL;
+            if (parse_line(line, &count, &resolution, &img_id)) add(&merged, img_id, resolution, count);
+        }
+        fclose(f);
+    }
+
+    // the workers' summaries replace the previous one, which worker 0 carried on
+    if (err == ERR_NONE && nb_files > 0) err = write_summary(merged.slots, path);
+    for (size_t i = 0; i < nb_files; ++i) {
+        if (err == ERR_NONE) remove(names[i]);
+        free(names[i]);
+    }
+    free(merged.slots);
+    return err;
+}
+
+int prewarm_start(const char* path, int worker_index, unsigned rate, prewarm_fn warm)
+{
+    M_REQUIRE_NON_NULL(path);
+    M_REQUIRE_NON_NULL(warm);
+    if (rate == 0 || worker_index >= PREFORK_MAX_WORKERS || atomic_load(&running)) return ERR_INVALID_ARGUMENT;
+
+    table.slots = calloc(TRACKED_SLOTS, sizeof(struct hot_entry));
+    summary_path = strdup(path);
+    save_path = worker_index < 0 ? strdup(path) : worker_path(path, (unsigned) worker_index);
+    if (table.slots == NULL || summary_path == NULL || save_path == NULL) {
+        free(table.slots);
+        free(summary_path);
+        free(save_path);
+        table.slots = NULL;
+        summary_path = NULL;
+        save_path = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    table.used = 0;
+    replays = worker_index <= 0;
+    replay_rate = rate;
+    warm_fn = warm;
+
+    atomic_store(&running, 1);
+    if (pthread_create(&worker, NULL, worker_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        free(table.slots);
+        free(summary_path);
+        free(save_path);
+        table.slots = NULL;
+        summary_path = NULL;
+        save_path = NULL;
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+void prewarm_stop(void)
+{
+    if (!atomic_exchange(&running, 0)) return;
+    pthread_join(worker, NULL);
+    save();
+    prof_mutex_lock(&table_lock);
+    free(table.slots);
+    table.slots = NULL;
+    prof_mutex_unlock(&table_lock);
+    free(summary_path);
+    free(save_path);
+    summary_path = NULL;
+    save_path = NULL;
+}
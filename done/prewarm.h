@@ -0,0 +1,61 @@
+/**
+ * @file prewarm.h
+ * @brief Prewarming of the imgFS server from its access history.
+ *
+ * The server counts its reads by (image, resolution) and saves the hottest
+ * pairs to a summary file, periodically and at shutdown. At startup, a
+ * background thread replays the summary of the previous run, hottest first
+ * and at a bounded rate, while the server already serves: each read
+ * creates the missing derivative, if any, and brings the bytes into the
+ * page cache, ideally before the clients ask for them.
+ *
+ * In prefork mode, each worker counts its own reads and saves them to a
+ * summary of its own; these are merged into the summary at the next start,
+ * and only worker 0 replays it.
+ */
+
+#pragma once
+
+#define PREWARM_FILE_ENV "IMGFS_PREWARM_FILE" // the summary; no prewarming if unset
+#define PREWARM_RATE_ENV "IMGFS_PREWARM_RATE" // reads per second at startup
+#define PREWARM_DEFAULT_RATE 50
+#define PREWARM_MAX_ENTRIES 1024 // pairs in the summary
+#define PREWARM_SAVE_INTERVAL_S 60
+
+/**
+ * @brief Warms one image at one resolution; returns some error code.
+ */
+typedef int (*prewarm_fn)(const char* img_id, int resolution);
+
+/**
+ * @brief Merges the summaries of the workers of the previous run, if any,
+ *        into the summary, and removes them. To be called before forking
+ *        the workers.
+ *
+ * @param path The summary file.
+ * @return Some error code. 0 if no error.
+ */
+int prewarm_merge(const char* path);
+
+/**
+ * @brief Starts the background thread, which replays the summary (if the
+ *        file exists) then saves a new one every PREWARM_SAVE_INTERVAL_S.
+ *
+ * @param path The summary file.
+ * @param worker The index of the worker in prefork mode, which saves to
+ *               "<path>.<worker>" and replays only if 0; -1 otherwise.
+ * @param rate The largest number of images warmed per second.
+ * @param warm What warms an image.
+ * @return Some error code. 0 if no error.
+ */
+int prewarm_start(const char* path, int worker, unsigned rate, prewarm_fn warm);
+
+/**
+ * @brief Counts a read. Does nothing if prewarming is not started.
+ */
+void prewarm_record(const char* img_id, int resolution);
+
+/**
+ * @brief Stops the background thread and saves the summary.
+ */
+void prewarm_stop(void);
@@ -0,0 +1,796 @@
+/**
+ * @file replication.c
+ * @brief Replication of an imgFS volume to read-only replicas (see replication.h).
+ *
+ * The stream of a replica is a sequence of records: a header (struct
+ * repl_record), followed for REPL_WRITE by the bytes written. It starts
+ * with REPL_BASE, whose offset is the size of the volume: the whole volume
+ * follows as REPL_WRITE records, then the commits made since the replica
+ * connected. The base may have been read while an operation was writing:
+ * the replica writes it aside and only installs it at the commit flagged
+ * REPL_END_OF_BASE, the first one after which no write of the base is
+ * uncommitted.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <json-c/json.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "replication.h"
+#include "error.h"
+#include "lock_prof.h"
+#include "socket_layer.h"
+#include "util.h" // _unused, block_stop_signals
+#include "volume_io.h"
+
+#define REPL_CHUNK (1024 * 1024) // largest REPL_WRITE
+#define POLL_MS 100 // how often the threads check whether to stop
+
+enum repl_type { REPL_BASE = 1, REPL_WRITE, REPL_COMMIT, REPL_HEARTBEAT };
+#define REPL_END_OF_BASE 0x1 // REPL_COMMIT: the replica installs its base
+
+struct repl_record {
+    uint32_t type; // enum repl_type
+    uint32_t size; // REPL_WRITE: bytes following the record
+    uint64_t offset; // REPL_WRITE: where they go; REPL_BASE: size of the base
+    uint64_t position; // log position (REPL_BASE: that of the base)
+    uint32_t version; // header version at this position
+    uint32_t flags; // REPL_END_OF_BASE
+};
+
+enum repl_role { ROLE_NONE, ROLE_PRIMARY, ROLE_REPLICA };
+
+static enum repl_role role = ROLE_NONE; // set before any thread starts
+static atomic_int running;
+static struct prof_mutex repl_lock = PROF_MUTEX_INITIALIZER("replication");
+
+struct byte_buffer {
+    char* data;
+    size_t len;
+    size_t capacity;
+};
+
+static int buffer_append(struct byte_buffer* buffer, const void* data, size_t len)
+{
+    if (buffer->len + len > buffer->capacity) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+        while (capacity < buffer->len + len) capacity *= 2;
+        char* const grown = realloc(buffer->data, capacity);
+        if (grown == NULL) return ERR_OUT_OF_MEMORY;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return ERR_NONE;
+}
+
+static void buffer_free(struct byte_buffer* buffer)
+{
+    free(buffer->data);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static int send_all(int socket, const void* data, size_t len)
+{
+    const char* p = data;
+    while (len > 0) {
+        const ssize_t n = send(socket, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO;
+        p += n;
+        len -= (size_t) n;
+    }
+    return ERR_NONE;
+}
+
+// ======================================================================
+// Primary
+
+enum base_state {
+    BASE_SENDING, // the base is being read
+    BASE_ENDING, // read, the next commit ends it
+    STREAMING
+};
+
+struct replica_conn {
+    int socket;
+    char peer[INET_ADDRSTRLEN + 8];
+    pthread_t sender;
+    pthread_cond_t wake;
+    uint64_t base_position; // set before the sender starts, then only read by it
+    uint32_t base_version;
+    // the following fields are protected by repl_lock
+    struct byte_buffer queue; // committed records, not sent yet
+    enum base_state state;
+    uint64_t base_size;
+    uint64_t queued_position; // of the last commit queued (or of the base)
+    uint32_t queued_version;
+    uint64_t sent_position;
+    uint32_t sent_version;
+    int dropped; // the sender must close the connection
+    int done; // the sender exited
+    struct replica_conn* next;
+};
+
+static int volume_fd = -1;
+static int listen_fd = -1;
+static pthread_t listener;
+// protected by repl_lock
+static struct byte_buffer pending; // writes since the last commit, as records
+static uint64_t pending_bytes = 0;
+static int pending_lost = 0; // a write could not be recorded: the replicas need a new base
+static uint64_t committed_position = 0;
+static uint32_t committed_version = 0;
+static struct replica_conn* replicas = NULL;
+
+/**
+ * @brief Records a write, in chunks of at most REPL_CHUNK bytes; the caller holds repl_lock.
+ */
+static void log_write(uint64_t offset, const char* data, size_t size)
+{
+    for (size_t done = 0; done < size; ) {
+        const size_t chunk = size - done < REPL_CHUNK ? size - done : REPL_CHUNK;
+        const struct repl_record record = { REPL_WRITE, (uint32_t) chunk, offset + done, 0, 0, 0 };
+        if (buffer_append(&pending, &record, sizeof(record)) != ERR_NONE
+            || buffer_append(&pending, data + done, chunk) != ERR_NONE) {
+            pending_lost = 1;
+        }
+        done += chunk;
+    }
+    pending_bytes += size;
+}
+
+/**
+ * @brief Before a write to the volume: written and recorded at once, so
+ *        that a base never sees a write not recorded yet.
+ */
+static void lock_write(void)
+{
+    prof_mutex_lock(&repl_lock);
+}
+
+static void record_write(uint64_t offset, const char* data, size_t written)
+{
+    if (role == ROLE_PRIMARY) log_write(offset, data, written); // the wrapper outlives a failed start
+    prof_mutex_unlock(&repl_lock);
+}
+
+static int queue_end_of_base(struct replica_conn* conn)
+{
+    const struct repl_record commit = {
+        REPL_COMMIT, 0, 0, conn->queued_position, conn->queued_version, REPL_END_OF_BASE
+    };
+    conn->state = STREAMING;
+    return buffer_append(&conn->queue, &commit, sizeof(commit));
+}
+
+void repl_commit(uint32_t version)
+{
+    if (role != ROLE_PRIMARY) return;
+
+    prof_mutex_lock(&repl_lock);
+    if (pending.len == 0 && !pending_lost && version == committed_version) {
+        prof_mutex_unlock(&repl_lock);
+        return;
+    }
+    committed_position += pending_bytes;
+    committed_version = version;
+    for (struct replica_conn* conn = replicas; conn != NULL; conn = conn->next) {
+        if (conn->done || conn->dropped) continue;
+        const struct repl_record commit = {
+            REPL_COMMIT, 0, 0, committed_position, version,
+            conn->state == BASE_ENDING ? REPL_END_OF_BASE : 0
+        };
+        if (pending_lost || conn->queue.len + pending.len + sizeof(commit) > REPL_MAX_QUEUE
+            || buffer_append(&conn->queue, pending.data, pending.len) != ERR_NONE
+            || buffer_append(&conn->queue, &commit, sizeof(commit)) != ERR_NONE) {
+            fprintf(stderr, "Dropping replica %s: too far behind\n", conn->peer);
+            conn->dropped = 1; // it reconnects, and gets a new base
+        } else {
+            if (conn->state == BASE_ENDING) conn->state = STREAMING;
+            conn->queued_position = committed_position;
+            conn->queued_version = version;
+        }
+        pthread_cond_signal(&conn->wake);
+    }
+    pending.len = 0;
+    pending_bytes = 0;
+    pending_lost = 0;
+    prof_mutex_unlock(&repl_lock);
+}
+
+/**
+ * @brief Sends the whole volume, as it is now, then queues the end of the
+ *        base or defers it to the next commit if a write is uncommitted.
+ */
+static int send_base(struct replica_conn* conn)
+{
+    const struct repl_record base = {
+        REPL_BASE, 0, conn->base_size, conn->base_position, conn->base_version, 0
+    };
+    int err = send_all(conn->socket, &base, sizeof(base));
+    char* const chunk = malloc(REPL_CHUNK);
+    if (chunk == NULL) err = ERR_OUT_OF_MEMORY;
+    for (uint64_t offset = 0; err == ERR_NONE && offset < conn->base_size; ) {
+        const uint64_t left = conn->base_size - offset;
+        const ssize_t n = pread(volume_fd, chunk, left < REPL_CHUNK ? (size_t) left : REPL_CHUNK,
+                                (off_t) offset);
+        if (n <= 0 || !atomic_load(&running)) { // the volume never shrinks
+            err = ERR_IO;
+            break;
+        }
+        const struct repl_record record = { REPL_WRITE, (uint32_t) n, offset, 0, 0, 0 };
+        err = send_all(conn->socket, &record, sizeof(record));
+        if (err == ERR_NONE) err = send_all(conn->socket, chunk, (size_t) n);
+        offset += (uint64_t) n;
+    }
+    free(chunk);
+    if (err != ERR_NONE) return err;
+
+    prof_mutex_lock(&repl_lock);
+    if (pending.len > 0 || pending_lost) {
+        conn->state = BASE_ENDING;
+    } else if (queue_end_of_base(conn) != ERR_NONE) {
+        err = ERR_OUT_OF_MEMORY;
+    }
+    prof_mutex_unlock(&repl_lock);
+    return err;
+}
+
+static void deadline_in(struct timespec* deadline, unsigned ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec += (time_t) (ms / 1000);
+    deadline->tv_nsec += (long) (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+static void* sender_main(void* arg)
+{
+    struct replica_conn* const conn = arg;
+    block_stop_signals();
+
+    int err = send_base(conn);
+    struct byte_buffer batch = { NULL, 0, 0 };
+    while (err == ERR_NONE && atomic_load(&running)) {
+        prof_mutex_lock(&repl_lock);
+        if (conn->queue.len == 0 && !conn->dropped) {
+            struct timespec deadline;
+            deadline_in(&deadline, REPL_HEARTBEAT_MS);
+            prof_cond_timedwait(&conn->wake, &repl_lock, &deadline);
+        }
+        if (conn->dropped) err = ERR_IO;
+        const struct byte_buffer queued = conn->queue;
+        conn->queue = batch;
+        batch = queued;
+        const uint64_t position = conn->queued_position;
+        const uint32_t version = conn->queued_version;
+        const struct repl_record heartbeat = {
+            REPL_HEARTBEAT, 0, 0, committed_position, committed_version, 0
+        };
+        prof_mutex_unlock(&repl_lock);
+        if (err != ERR_NONE || !atomic_load(&running)) break;
+
+        if (batch.len == 0) {
+            err = send_all(conn->socket, &heartbeat, sizeof(heartbeat));
+        } else {
+            err = send_all(conn->socket, batch.data, batch.len);
+            batch.len = 0;
+            prof_mutex_lock(&repl_lock);
+            conn->sent_position = position;
+            conn->sent_version = version;
+            prof_mutex_unlock(&repl_lock);
+        }
+    }
+    buffer_free(&batch);
+    if (err != ERR_NONE && atomic_load(&running)) {
+        fprintf(stderr, "Replica %s disconnected\n", conn->peer);
+    }
+
+    prof_mutex_lock(&repl_lock);
+    conn->done = 1;
+    prof_mutex_unlock(&repl_lock);
+    return NULL;
+}
+
+/**
+ * @brief Registers a replica and starts its sender; its base is the volume
+ *        as it is now, at the last committed position.
+ */
+static int add_replica(int socket)
+{
+    struct replica_conn* const conn = calloc(1, sizeof(struct replica_conn));
+    if (conn == NULL) return ERR_OUT_OF_MEMORY;
+    conn->socket = socket;
+    struct sockaddr_in address;
+    socklen_t address_len = sizeof(address);
+    if (getpeername(socket, (struct sockaddr*) &address, &address_len) == 0
+        && address.sin_family == AF_INET) {
+        char host[INET_ADDRSTRLEN] = "";
+        inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+        snprintf(conn->peer, sizeof(conn->peer), "%s:%u", host, (unsigned) ntohs(address.sin_port));
+    }
+    if (pthread_cond_init(&conn->wake, NULL) != 0) {
+        free(conn);
+        return ERR_THREADING;
+    }
+
+    prof_mutex_lock(&repl_lock);
+    struct stat st;
+    int err = fstat(volume_fd, &st) == 0 ? ERR_NONE : ERR_IO;
+    if (err == ERR_NONE) {
+        conn->base_size = (uint64_t) st.st_size;
+        conn->base_position = conn->queued_position = conn->sent_position = committed_position;
+        conn->base_version = conn->queued_version = conn->sent_version = committed_version;
+        conn->state = BASE_SENDING;
+        if (pthread_create(&conn->sender, NULL, sender_main, conn) != 0) {
+            err = ERR_THREADING;
+        } else {
+            conn->next = replicas;
+            replicas = conn;
+        }
+    }
+    prof_mutex_unlock(&repl_lock);
+    if (err != ERR_NONE) {
+        pthread_cond_destroy(&conn->wake);
+        free(conn);
+        return err;
+    }
+    fprintf(stderr, "Replica %s connected, sending a base of %" PRIu64 " bytes\n",
+            conn->peer, conn->base_size);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Joins and frees the replicas whose sender exited, or all of them.
+ */
+static void reap_replicas(int all)
+{
+    struct replica_conn* reaped = NULL;
+    prof_mutex_lock(&repl_lock);
+    for (struct replica_conn** link = &replicas; *link != NULL; ) {
+        struct replica_conn* const conn = *link;
+        if (all || conn->done) {
+            *link = conn->next;
+            conn->next = reaped;
+            reaped = conn;
+            if (all) {
+                shutdown(conn->socket, SHUT_RDWR); // unblocks its sender
+                pthread_cond_signal(&conn->wake);
+            }
+        } else {
+            link = &conn->next;
+        }
+    }
+    prof_mutex_unlock(&repl_lock);
+
+    while (reaped != NULL) {
+        struct replica_conn* const conn = reaped;
+        reaped = conn->next;
+        pthread_join(conn->sender, NULL);
+        close(conn->socket);
+        buffer_free(&conn->queue);
+        pthread_cond_destroy(&conn->wake);
+        free(conn);
+    }
+}
+
+static void* listener_main(void* arg _unused)
+{
+    block_stop_signals();
+    while (atomic_load(&running)) {
+        reap_replicas(0);
+        struct pollfd ready = { listen_fd, POLLIN, 0 };
+        if (poll(&ready, 1, POLL_MS) <= 0) continue;
+        const int socket = tcp_accept(listen_fd);
+        if (socket < 0) continue;
+        if (add_replica(socket) != ERR_NONE) close(socket);
+    }
+    return NULL;
+}
+
+int repl_primary_start(struct imgfs_file* imgfs_file, uint16_t port)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    if (role != ROLE_NONE || port == 0) return ERR_INVALID_ARGUMENT;
+
+    listen_fd = tcp_server_init(port);
+    if (listen_fd < 0) return ERR_IO;
+
+    // unbuffered: each fwrite() is recorded when made
+    static const struct volume_io_hooks hooks = { lock_write, record_write, NULL, NULL };
+    volume_fd = volume_io_fd(imgfs_file->file);
+    const int err = volume_io_wrap(imgfs_file, &hooks);
+    if (err != ERR_NONE) {
+        close(listen_fd);
+        return err;
+    }
+    committed_version = imgfs_file->header.version;
+    role = ROLE_PRIMARY;
+
+    atomic_store(&running, 1);
+    if (pthread_create(&listener, NULL, listener_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        role = ROLE_NONE;
+        close(listen_fd);
+        listen_fd = -1;
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+// ======================================================================
+// Replica
+
+static struct repl_volume volume;
+static char* volume_path = NULL; // volume.path, owned
+static char* primary_host = NULL; // "<host>:<port>", split at the last ':'
+static const char* primary_port = NULL;
+static pthread_t follower;
+// protected by repl_lock
+static int follower_socket = -1;
+static int connected = 0;
+static uint64_t applied_position = 0;
+static uint32_t applied_version = 0;
+static uint64_t primary_position = 0;
+static uint32_t primary_version = 0;
+
+static int connect_primary(void)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* found = NULL;
+    if (getaddrinfo(primary_host, primary_port, &hints, &found) != 0) return -1;
+
+    int fd = -1;
+    for (const struct addrinfo* ai = found; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+/**
+ * @brief Receives exactly len bytes; fails if the primary is silent for
+ *        REPL_TIMEOUT_MS or if the replication stops.
+ */
+static int recv_all(int socket, void* data, size_t len)
+{
+    char* p = data;
+    unsigned silent_ms = 0;
+    while (len > 0) {
+        if (!atomic_load(&running) || silent_ms >= REPL_TIMEOUT_MS) return ERR_IO;
+        struct pollfd ready = { socket, POLLIN, 0 };
+        const int n_ready = poll(&ready, 1, POLL_MS);
+        if (n_ready < 0 && errno != EINTR) return ERR_IO;
+        if (n_ready <= 0) {
+            silent_ms += POLL_MS;
+            continue;
+        }
+        const ssize_t n = recv(socket, p, len, 0);
+        if (n <= 0) return ERR_IO;
+        p += n;
+        len -= (size_t) n;
+        silent_ms = 0;
+    }
+    return ERR_NONE;
+}
+
+static int pwrite_all(int fd, const char* data, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        const ssize_t n = pwrite(fd, data, len, (off_t) offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return ERR_IO;
+        data += n;
+        len -= (size_t) n;
+        offset += (uint64_t) n;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Opens the volume file again, replacing the imgfs_file; the caller
+ *        holds the volume lock. On error, the previous one is kept.
+ */
+static int reload_volume(void)
+{
+    struct imgfs_file fresh;
+    memset(&fresh, 0, sizeof(fresh));
+    const int err = do_open(volume.path, "rb+", &fresh);
+    if (err != ERR_NONE) return err;
+    do_close(volume.imgfs_file);
+    *volume.imgfs_file = fresh;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Applies the writes of a commit, then reloads the volume.
+ */
+static int apply_commit(const struct byte_buffer* writes)
+{
+    volume.lock();
+    FILE* const file = volume.imgfs_file->file;
+    int err = ERR_NONE;
+    for (size_t at = 0; err == ERR_NONE && at < writes->len; ) {
+        struct repl_record record;
+        memcpy(&record, writes->data + at, sizeof(record));
+        at += sizeof(record);
+        if (fseek(file, (long) record.offset, SEEK_SET) != 0
+            || fwrite(writes->data + at, record.size, 1, file) != 1) {
+            err = ERR_IO;
+        }
+        at += record.size;
+    }
+    if (err == ERR_NONE && fflush(file) != 0) err = ERR_IO;
+    if (err == ERR_NONE) err = reload_volume();
+    volume.unlock();
+    return err;
+}
+
+/**
+ * @brief Replaces the volume by the base received.
+ */
+static int install_base(int base_fd, const char* base_path)
+{
+    int err = fsync(base_fd) == 0 ? ERR_NONE : ERR_IO;
+    close(base_fd);
+    if (err != ERR_NONE) return err;
+    volume.lock();
+    err = rename(base_path, volume.path) == 0 ? reload_volume() : ERR_IO;
+    volume.unlock();
+    return err;
+}
+
+/**
+ * @brief Applies the stream of the primary until the connection fails.
+ */
+static int follow(int socket)
+{
+    const size_t base_path_len = strlen(volume.path) + sizeof(".base");
+    char* const base_path = malloc(base_path_len);
+    char* const chunk = malloc(REPL_CHUNK);
+    if (base_path == NULL || chunk == NULL) {
+        free(base_path);
+        free(chunk);
+        return ERR_OUT_OF_MEMORY;
+    }
+    snprintf(base_path, base_path_len, "%s.base", volume.path);
+
+    struct byte_buffer writes = { NULL, 0, 0 }; // of the current commit
+    int base_fd = -1;
+    int has_base = 0;
+    int err = ERR_NONE;
+    while (err == ERR_NONE) {
+        struct repl_record record;
+        err = recv_all(socket, &record, sizeof(record));
+        if (err != ERR_NONE) break;
+
+        if (record.type == REPL_BASE) {
+            if (base_fd >= 0) close(base_fd);
+            base_fd = open(base_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (base_fd < 0 || ftruncate(base_fd, (off_t) record.offset) != 0) err = ERR_IO;
+            has_base = 1;
+            writes.len = 0;
+        } else if (record.type == REPL_WRITE && has_base && record.size <= REPL_CHUNK) {
+            err = recv_all(socket, chunk, record.size);
+            if (err == ERR_NONE && base_fd >= 0) {
+                err = pwrite_all(base_fd, chunk, record.size, record.offset);
+            } else if (err == ERR_NONE) {
+                err = buffer_append(&writes, &record, sizeof(record));
+                if (err == ERR_NONE) err = buffer_append(&writes, chunk, record.size);
+            }
+        } else if (record.type == REPL_COMMIT && has_base) {
+            if (base_fd < 0) {
+                err = apply_commit(&writes);
+                writes.len = 0;
+            } else if (record.flags & REPL_END_OF_BASE) {
+                err = install_base(base_fd, base_path);
+                base_fd = -1;
+                if (err == ERR_NONE) {
+                    fprintf(stderr, "Installed the base of the primary at version %" PRIu32 "\n",
+                            record.version);
+                }
+            }
+            prof_mutex_lock(&repl_lock);
+            if (err == ERR_NONE && base_fd < 0) {
+                applied_position = record.position;
+                applied_version = record.version;
+            }
+            primary_position = record.position;
+            primary_version = record.version;
+            prof_mutex_unlock(&repl_lock);
+        } else if (record.type == REPL_HEARTBEAT) {
+            prof_mutex_lock(&repl_lock);
+            primary_position = record.position;
+            primary_version = record.version;
+            prof_mutex_unlock(&repl_lock);
+        } else {
+            fprintf(stderr, "Invalid replication record of type %" PRIu32 "\n", record.type);
+            err = ERR_IO;
+        }
+    }
+
+    if (base_fd >= 0) {
+        close(base_fd);
+        unlink(base_path);
+    }
+    buffer_free(&writes);
+    free(chunk);
+    free(base_path);
+    return err;
+}
+
+static void* follower_main(void* arg _unused)
+{
+    block_stop_signals();
+    while (atomic_load(&running)) {
+        const int socket = connect_primary();
+        if (socket < 0) {
+            for (unsigned ms = 0; ms < REPL_HEARTBEAT_MS && atomic_load(&running); ms += POLL_MS) {
+                const struct timespec t = { 0, POLL_MS * 1000000L };
+                nanosleep(&t, NULL);
+            }
+            continue;
+        }
+        prof_mutex_lock(&repl_lock);
+        follower_socket = socket;
+        connected = 1;
+        prof_mutex_unlock(&repl_lock);
+
+        follow(socket);
+
+        prof_mutex_lock(&repl_lock);
+        follower_socket = -1;
+        connected = 0;
+        prof_mutex_unlock(&repl_lock);
+        close(socket);
+        if (atomic_load(&running)) {
+            fprintf(stderr, "Lost the primary %s:%s, reconnecting\n", primary_host, primary_port);
+        }
+    }
+    return NULL;
+}
+
+int repl_replica_start(const struct repl_volume* replica_volume, const char* primary)
+{
+    M_REQUIRE_NON_NULL(replica_volume);
+    M_REQUIRE_NON_NULL(replica_volume->imgfs_file);
+    M_REQUIRE_NON_NULL(replica_volume->path);
+    M_REQUIRE_NON_NULL(replica_volume->lock);
+    M_REQUIRE_NON_NULL(replica_volume->unlock);
+    M_REQUIRE_NON_NULL(primary);
+    if (role != ROLE_NONE) return ERR_INVALID_ARGUMENT;
+
+    char* const colon = strrchr(primary, ':');
+    if (colon == NULL || colon == primary || colon[1] == '\0') return ERR_INVALID_ARGUMENT;
+    primary_host = strdup(primary);
+    char* const path = strdup(replica_volume->path);
+    if (primary_host == NULL || path == NULL) {
+        free(primary_host);
+        free(path);
+        primary_host = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    primary_host[colon - primary] = '\0';
+    primary_port = primary_host + (colon - primary) + 1;
+    volume = *replica_volume;
+    volume.path = volume_path = path;
+    applied_version = primary_version = volume.imgfs_file->header.version;
+    role = ROLE_REPLICA;
+
+    atomic_store(&running, 1);
+    if (pthread_create(&follower, NULL, follower_main, NULL) != 0) {
+        atomic_store(&running, 0);
+        return ERR_THREADING;
+    }
+    return ERR_NONE;
+}
+
+int repl_is_replica(void)
+{
+    return role == ROLE_REPLICA;
+}
+
+// ======================================================================
+
+static uint64_t lag(uint64_t ahead, uint64_t behind)
+{
+    return ahead > behind ? ahead - behind : 0;
+}
+
+int repl_status_json(char** json)
+{
+    M_REQUIRE_NON_NULL(json);
+
+    json_object* jobj = json_object_new_object();
+    prof_mutex_lock(&repl_lock);
+    if (role == ROLE_PRIMARY) {
+        json_object_object_add(jobj, "role", json_object_new_string("primary"));
+        json_object_object_add(jobj, "position", json_object_new_int64((int64_t) committed_position));
+        json_object_object_add(jobj, "version", json_object_new_int64(committed_version));
+        json_object* jreplicas = json_object_new_array();
+        for (const struct replica_conn* conn = replicas; conn != NULL; conn = conn->next) {
+            if (conn->done) continue;
+            json_object* jconn = json_object_new_object();
+            json_object_object_add(jconn, "peer", json_object_new_string(conn->peer));
+            json_object_object_add(jconn, "state",
+                                   json_object_new_string(conn->state == STREAMING ? "streaming" : "base"));
+            json_object_object_add(jconn, "sent_position", json_object_new_int64((int64_t) conn->sent_position));
+            json_object_object_add(jconn, "lag_bytes",
+                                   json_object_new_int64((int64_t) lag(committed_position, conn->sent_position)));
+            json_object_object_add(jconn, "lag_versions",
+                                   json_object_new_int64((int64_t) lag(committed_version, conn->sent_version)));
+            json_object_array_add(jreplicas, jconn);
+        }
+        json_object_object_add(jobj, "replicas", jreplicas);
+    } else if (role == ROLE_REPLICA) {
+        char primary[256];
+        snprintf(primary, sizeof(primary), "%s:%s", primary_host, primary_port);
+        json_object_object_add(jobj, "role", json_object_new_string("replica"));
+        json_object_object_add(jobj, "primary", json_object_new_string(primary));
+        json_object_object_add(jobj, "connected", json_object_new_boolean(connected));
+        json_object_object_add(jobj, "applied_position", json_object_new_int64((int64_t) applied_position));
+        json_object_object_add(jobj, "applied_version", json_object_new_int64(applied_version));
+        json_object_object_add(jobj, "primary_position", json_object_new_int64((int64_t) primary_position));
+        json_object_object_add(jobj, "primary_version", json_object_new_int64(primary_version));
+        json_object_object_add(jobj, "lag_bytes",
+                               json_object_new_int64((int64_t) lag(primary_position, applied_position)));
+        json_object_object_add(jobj, "lag_versions",
+                               json_object_new_int64((int64_t) lag(primary_version, applied_version)));
+    } else {
+        json_object_object_add(jobj, "role", json_object_new_string("none"));
+    }
+    prof_mutex_unlock(&repl_lock);
+
+    *json = strdup(json_object_to_json_string(jobj));
+    json_object_put(jobj);
+    return *json != NULL ? ERR_NONE : ERR_OUT_OF_MEMORY;
+}
+
+void repl_stop(void)
+{
+    if (!atomic_exchange(&running, 0)) return;
+    if (role == ROLE_PRIMARY) {
+        pthread_join(listener, NULL);
+        reap_replicas(1);
+        close(listen_fd);
+        listen_fd = -1;
+        prof_mutex_lock(&repl_lock);
+        buffer_free(&pending);
+        prof_mutex_unlock(&repl_lock);
+    } else if (role == ROLE_REPLICA) {
+        prof_mutex_lock(&repl_lock);
+        if (follower_socket >= 0) shutdown(follower_socket, SHUT_RDWR);
+        prof_mutex_unlock(&repl_lock);
+        pthread_join(follower, NULL);
+        free(primary_host);
+        free(volume_path);
+        primary_host = NULL;
+        volume.path = volume_path = NULL;
+    }
+}
@@ -0,0 +1,98 @@
+/**
+ * @file replication.h
+ * @brief Replication of an imgFS volume to read-only replicas.
+ *
+ * The primary records the writes made to its volume (offset and bytes)
+ * through the FILE of its imgfs_file, which repl_primary_start() wraps.
+ * When the server releases the volume lock, the writes of the operation
+ * are committed: they are queued to each connected replica, followed by a
+ * commit record carrying the header version. A replica that connects
+ * first receives the whole volume (its base), then the commits made since
+ * it connected, in order. It applies each commit under its volume lock and
+ * reloads the header and the metadata, so that its readers only see
+ * committed states. The writes being physical, a base read while the
+ * volume changes is fixed by the commits that follow it.
+ *
+ * The log position is the number of bytes written by the commits since the
+ * primary started. The lag of a replica is the difference, in positions
+ * and in versions, between the last commit of the primary it knows of (the
+ * primary sends heartbeats when idle) and the last commit it applied.
+ *
+ * Records are sent in the byte order of the primary, as the volume itself
+ * is written: replicas run on the same architecture.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#include <stdint.h> // for uint16_t, uint32_t
+
+#define REPL_PORT_ENV "IMGFS_REPL_PORT" // primary: the port replicas connect to
+#define REPL_PRIMARY_ENV "IMGFS_REPLICA_OF" // replica: <host>:<port> of the primary
+#define REPL_HEARTBEAT_MS 1000
+#define REPL_TIMEOUT_MS (5 * REPL_HEARTBEAT_MS) // silence after which a replica reconnects
+#define REPL_MAX_QUEUE (64 * 1024 * 1024) // bytes queued for a replica before it is dropped
+
+/**
+ * @brief The volume of a replica, which its server shares with the replication.
+ */
+struct repl_volume {
+    struct imgfs_file* imgfs_file; // opened, replaced on each commit
+    const char* path; // its file, replaced by each base
+    void (*lock)(void); // takes the volume lock
+    void (*unlock)(void); // releases it
+};
+
+/**
+ * @brief Starts recording the writes to a volume, and accepting replicas.
+ *
+ * @param imgfs_file The volume, opened; its FILE is replaced by a wrapper.
+ * @param port The port replicas connect to.
+ * @return Some error code. 0 if no error.
+ */
+int repl_primary_start(struct imgfs_file* imgfs_file, uint16_t port);
+
+/**
+ * @brief Commits the writes recorded since the last commit. To be called
+ *        with the volume lock held, after each operation on the volume.
+ *        Does nothing if not a primary.
+ *
+ * @param version The version of the header after the operation.
+ */
+void repl_commit(uint32_t version);
+
+/**
+ * @brief Starts following a primary: connects to it (again, if the
+ *        connection is lost) and applies its commits to the volume.
+ *
+ * @param volume The volume of the replica; copied.
+ * @param primary <host>:<port> of the primary.
+ * @return Some error code. 0 if no error.
+ */
+int repl_replica_start(const struct repl_volume* volume, const char* primary);
+
+/**
+ * @brief Whether this server is a replica, whose volume only its primary writes.
+ */
+int repl_is_replica(void);
+
+/**
+ * @brief Describes the replication in JSON.
+ *
+ * Primary: {"role": "primary", "position", "version", "replicas": [{"peer",
+ * "state": "base"|"streaming", "sent_position", "lag_bytes", "lag_versions"}]}.
+ * Replica: {"role": "replica", "primary", "connected", "applied_position",
+ * "applied_version", "primary_position", "primary_version", "lag_bytes",
+ * "lag_versions"}. Otherwise: {"role": "none"}.
+ *
+ * @param json Where to put the description (to be freed with free()).
+ * @return Some error code. 0 if no error.
+ */
+int repl_status_json(char** json);
+
+/**
+ * @brief Stops the replication threads and closes the connections. The
+ *        volume stays opened.
+ */
+void repl_stop(void);
@@ -0,0 +1,110 @@
+/**
+ * @file request_ctx.c
+ * @brief Per-request context of the imgFS server.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "request_ctx.h"
+#include "metrics.h"
+#include "access_log.h"
+#include "slow_log.h"
+#include "trace.h"
+#include "util.h" // MIN
+
+static const char* const route_names[NB_ROUTES] = {
+    "index", "list", "read", "insert", "delete", "metrics", "lockprof", "sprite", "replication", "snapshot", "intake", "other"
+};
+
+static _Thread_local struct request_ctx current;
+
+uint64_t request_now_ns(void)
+{
+    return trace_now_ns();
+}
+
+const char* request_route_name(enum request_route route)
+{
+    return (unsigned int) route < NB_ROUTES ? route_names[route] : route_names[ROUTE_OTHER];
+}
+
+struct request_ctx* request_current(void)
+{
+    return &current;
+}
+
+void request_begin(void)
+{
+    memset(&current, 0, sizeof(current));
+    trace_start();
+    current.start_ns = request_now_ns();
+    current.route = ROUTE_OTHER;
+    current.lock_span = -1;
+    current.resolution = -1;
+    current.cache_hit = -1;
+}
+
+void request_parsed(const char* method, size_t method_len)
+{
+    current.parsed_ns = request_now_ns();
+    if (method != NULL) {
+        const size_t len = MIN(method_len, sizeof(current.method) - 1);
+        memcpy(current.method, method, len);
+        current.method[len] = '\0';
+    }
+}
+
+void request_set_route(enum request_route route)
+{
+    if ((unsigned int) route < NB_ROUTES) current.route = route;
+}
+
+void request_set_image(const char* img_id, int resolution)
+{
+    if (img_id != NULL) {
+        strncpy(current.img_id, img_id, sizeof(current.img_id) - 1);
+    }
+    current.resolution = resolution;
+}
+
+void request_set_cache_hit(int hit)
+{
+    current.cache_hit = hit != 0;
+}
+
+void request_locked(uint64_t wait_ns)
+{
+    current.wait_ns += wait_ns;
+    current.locked_at_ns = request_now_ns();
+    if (wait_ns > 0) {
+        trace_span_add("lock_wait", current.locked_at_ns - wait_ns, current.locked_at_ns);
+    }
+    current.lock_span = trace_span_begin("volume_locked");
+}
+
+void request_unlocked(void)
+{
+    if (current.locked_at_ns != 0) {
+        current.op_ns += request_now_ns() - current.locked_at_ns;
+        current.locked_at_ns = 0;
+    }
+    trace_span_end(current.lock_span);
+    current.lock_span = -1;
+}
+
+void request_reply(const char* status, size_t body_len, uint64_t send_ns)
+{
+    if (status == NULL) return;
+    current.status = atoi(status);
+    current.bytes += body_len;
+    current.send_ns += send_ns;
+}
+
+void request_end(void)
+{
+    current.end_ns = request_now_ns();
+    metrics_request(&current);
+    access_log_request(&current);
+    slow_log_request(&current, trace_stop());
+}
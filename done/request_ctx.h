@@ -0,0 +1,128 @@
+/**
+ * @file request_ctx.h
+ * @brief Per-request context of the imgFS server.
+ *
+ * A thread serves one request at a time: an HTTP connection thread serves
+ * the requests of its connection one after the other (kept alive or
+ * pipelined), a binary protocol worker the frames it takes. The context of
+ * the current request is thread-local: the network layer starts it (which
+ * resets every field) and ends it, and the handlers fill in what they know
+ * (route, image, lock and reply times) without having to pass it around. A
+ * trace of its phases (see trace.h) is recorded alongside. When the request
+ * ends, the context is handed to the metrics, to the access log and, with
+ * its trace, to the slow log.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#include "imgfs.h" // MAX_IMG_ID
+
+#define REQUEST_METHOD_MAX 8
+
+/**
+ * @brief Routes the server reports on.
+ */
+enum request_route {
+    ROUTE_INDEX,
+    ROUTE_LIST,
+    ROUTE_READ,
+    ROUTE_INSERT,
+    ROUTE_DELETE,
+    ROUTE_METRICS,
+    ROUTE_LOCKPROF,
+    ROUTE_SPRITE,
+    ROUTE_REPLICATION,
+    ROUTE_SNAPSHOT,
+    ROUTE_INTAKE,
+    ROUTE_OTHER,
+    NB_ROUTES
+};
+
+struct request_ctx {
+    uint64_t start_ns;      // request started: its connection accepted, or its first bytes received
+    uint64_t parsed_ns;     // request received and parsed, 0 if it never was
+    uint64_t wait_ns;       // total time waiting for the volume lock
+    uint64_t op_ns;         // total time holding the volume lock
+    uint64_t send_ns;       // total time sending replies
+    uint64_t end_ns;        // request ended
+    uint64_t locked_at_ns;  // when the volume lock was last taken
+    int lock_span;          // trace span of the volume lock, -1 if none
+    enum request_route route;
+    char method[REQUEST_METHOD_MAX];
+    char img_id[MAX_IMG_ID + 1]; // empty if the request is not about an image
+    int resolution;         // -1 if the request is not about a resolution
+    int cache_hit;          // 1 if served from a stored derivative, 0 if resized, -1 if n/a
+    int status;             // HTTP status code, 0 if nothing was answered
+    size_t bytes;           // body bytes sent
+};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t request_now_ns(void);
+
+/**
+ * @brief Returns the name of a route ("read", "list", ...).
+ */
+const char* request_route_name(enum request_route route);
+
+/**
+ * @brief Returns the context of the request served by the calling thread.
+ */
+struct request_ctx* request_current(void);
+
+/**
+ * @brief Starts a new request in the calling thread, resetting its context.
+ */
+void request_begin(void);
+
+/**
+ * @brief Records that the request was received and parsed.
+ *
+ * @param method The HTTP method (not NUL-terminated).
+ * @param method_len Its length.
+ */
+void request_parsed(const char* method, size_t method_len);
+
+/**
+ * @brief Sets the route of the current request.
+ */
+void request_set_route(enum request_route route);
+
+/**
+ * @brief Sets the image (and resolution, -1 if none) the current request is about.
+ */
+void request_set_image(const char* img_id, int resolution);
+
+/**
+ * @brief Records whether the image was served from a stored derivative (1) or resized (0).
+ */
+void request_set_cache_hit(int hit);
+
+/**
+ * @brief Records that the volume lock was taken, after waiting wait_ns for it.
+ */
+void request_locked(uint64_t wait_ns);
+
+/**
+ * @brief Records that the volume lock is about to be released.
+ */
+void request_unlocked(void);
+
+/**
+ * @brief Records a reply.
+ *
+ * @param status The HTTP status line, e.g. "200 OK".
+ * @param body_len The number of body bytes sent.
+ * @param send_ns The time spent sending it.
+ */
+void request_reply(const char* status, size_t body_len, uint64_t send_ns);
+
+/**
+ * @brief Ends the request of the calling thread, reporting it to the
+ *        metrics, to the access log and to the slow log.
+ */
+void request_end(void);
@@ -0,0 +1,309 @@
+/**
+ * @file resize_sandbox.c
+ * @brief Resizing in helper processes (see resize_sandbox.h).
+ */
+
+#define _GNU_SOURCE // for memfd_create(), mremap()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h> // PATH_MAX
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "resize_sandbox.h"
+#include "error.h"
+#include "lock_prof.h"
+
+#define INITIAL_MEMORY (1024 * 1024) // of each helper, grown as needed
+#define HIGH_FD 10 // above the descriptors of a helper (RESIZE_*_FD)
+#define RESULT_ROOM (256 * 1024) // reserved for the metadata a derivative may keep
+
+struct helper {
+    pid_t pid; // 0 if not running
+    int socket; // our end of its socket
+    int memory_fd;
+    char* memory;
+    size_t mapped;
+    int busy;
+};
+
+static struct helper helpers[RESIZE_MAX_HELPERS];
+static unsigned nb_helpers = 0;
+static unsigned next_helper = 0;
+static struct prof_mutex pool_lock = PROF_MUTEX_INITIALIZER("resize_pool");
+static pthread_cond_t helper_free = PTHREAD_COND_INITIALIZER;
+
+static char helper_path[PATH_MAX];
+static char memory_arg[32]; // max_memory, for the command line of the helpers
+static unsigned job_timeout_ms = RESIZE_DEFAULT_TIMEOUT_MS;
+
+/**
+ * @brief Maps at least size bytes of the memory of a helper, growing it if
+ *        needed.
+ */
+static int map_memory(struct helper* h, size_t size)
+{
+    struct stat st;
+    if (fstat(h->memory_fd, &st) != 0) return ERR_IO;
+    if ((size_t) st.st_size < size) {
+        if (ftruncate(h->memory_fd, (off_t) size) != 0) return ERR_OUT_OF_MEMORY;
+    } else {
+        size = (size_t) st.st_size; // grown by the helper
+    }
+    if (size <= h->mapped) return ERR_NONE;
+
+    void* const memory = h->memory == NULL
+                         ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, h->memory_fd, 0)
+                         : mremap(h->memory, h->mapped, size, MREMAP_MAYMOVE);
+    if (memory == MAP_FAILED) return ERR_OUT_OF_MEMORY;
+    h->memory = memory;
+    h->mapped = size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Starts the process of a helper, with a new socket: that of the
+ *        previous one tells when it died. Only async-signal-safe calls
+ *        between fork() and execv(): the server has threads.
+ */
+static int spawn(struct helper* h)
+{
+    int sockets[2] = { -1, -1 };
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) != 0) return ERR_IO;
+    // above the descriptors it gets, so that dup2() does not overwrite it
+    const int child_socket = fcntl(sockets[1], F_DUPFD_CLOEXEC, HIGH_FD);
+    close(sockets[1]);
+    if (child_socket < 0) {
+        close(sockets[0]);
+        return ERR_IO;
+    }
+
+    // no PR_SET_PDEATHSIG: it follows the thread that forks, not the server;
+    // a helper exits when its socket is closed instead
+    char* const argv[] = { helper_path, memory_arg, NULL };
+    const long max_fd = sysconf(_SC_OPEN_MAX);
+    const pid_t pid = fork();
+    if (pid == 0) {
+        if (dup2(child_socket, RESIZE_SOCKET_FD) < 0 || dup2(h->memory_fd, RESIZE_MEMORY_FD) < 0) {
+            _exit(127);
+        }
+        // nothing else of the server: its sockets, its volume, its logs
+        if (close_range(RESIZE_MEMORY_FD + 1, ~0U, 0) != 0) {
+            for (long fd = RESIZE_MEMORY_FD + 1; fd < max_fd; ++fd) close((int) fd);
+        }
+        execv(helper_path, argv);
+        _exit(127);
+    }
+    close(child_socket);
+    if (pid < 0) {
+        close(sockets[0]);
+        return ERR_RUNTIME;
+    }
+    if (h->socket >= 0) close(h->socket);
+    h->socket = sockets[0];
+    h->pid = pid;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Kills the process of a helper, if running.
+ */
+static void kill_helper(struct helper* h)
+{
+    if (h->pid <= 0) return;
+    kill(h->pid, SIGKILL);
+    waitpid(h->pid, NULL, 0);
+    h->pid = 0;
+}
+
+/**
+ * @brief Replaces the process of a helper which failed.
+ */
+static void restart(struct helper* h, const char* why)
+{
+    fprintf(stderr, "Resize helper %d %s, restarting it\n", (int) h->pid, why);
+    kill_helper(h);
+    if (spawn(h) != ERR_NONE) perror("Failed to restart a resize helper");
+}
+
+/**
+ * @brief Sets up a helper: its memory, its process.
+ */
+static int helper_init(struct helper* h)
+{
+    const int memory_fd = memfd_create("imgfs-resize", MFD_CLOEXEC);
+    if (memory_fd < 0) return ERR_IO;
+    h->memory_fd = fcntl(memory_fd, F_DUPFD_CLOEXEC, HIGH_FD);
+    close(memory_fd);
+    if (h->memory_fd < 0) return ERR_IO;
+
+    const int err = map_memory(h, INITIAL_MEMORY);
+    return err != ERR_NONE ? err : spawn(h);
+}
+
+static void helper_cleanup(struct helper* h)
+{
+    kill_helper(h);
+    if (h->memory != NULL) munmap(h->memory, h->mapped);
+    if (h->socket >= 0) close(h->socket);
+    if (h->memory_fd >= 0) close(h->memory_fd);
+    memset(h, 0, sizeof(*h));
+    h->socket = h->memory_fd = -1;
+}
+
+int resize_sandbox_start(unsigned count, const char* path, uint64_t max_memory, unsigned timeout_ms)
+{
+    M_REQUIRE_NON_NULL(path);
+    if (count == 0 || count > RESIZE_MAX_HELPERS || nb_helpers != 0 || max_memory == 0
+        || timeout_ms == 0 || strlen(path) >= sizeof(helper_path)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if (access(path, X_OK) != 0) return ERR_INVALID_FILENAME;
+
+    strcpy(helper_path, path);
+    snprintf(memory_arg, sizeof(memory_arg), "%llu", (unsigned long long) max_memory);
+    job_timeout_ms = timeout_ms;
+
+    for (unsigned i = 0; i < count; ++i) {
+        memset(&helpers[i], 0, sizeof(helpers[i]));
+        helpers[i].socket = helpers[i].memory_fd = -1;
+        const int err = helper_init(&helpers[i]);
+        if (err != ERR_NONE) {
+            for (unsigned j = 0; j <= i; ++j) helper_cleanup(&helpers[j]);
+            return err;
+        }
+    }
+    nb_helpers = count;
+    return ERR_NONE;
+}
+
+int resize_sandbox_enabled(void)
+{
+    return nb_helpers != 0;
+}
+
+int resize_job_begin(struct resize_job* job, uint32_t original_size, uint16_t width, int format,
+                     uint16_t encoding)
+{
+    M_REQUIRE_NON_NULL(job);
+    if (nb_helpers == 0) return ERR_INVALID_ARGUMENT;
+
+    // in turn, so that a helper that died is noticed soon
+    prof_mutex_lock(&pool_lock);
+    unsigned i = 0;
+    for (;;) {
+        unsigned tried = 0;
+        for (i = next_helper; tried < nb_helpers && helpers[i].busy; i = (i + 1) % nb_helpers) ++tried;
+        if (tried < nb_helpers) break;
+        prof_cond_wait(&helper_free, &pool_lock);
+    }
+    helpers[i].busy = 1;
+    next_helper = (i + 1) % nb_helpers;
+    prof_mutex_unlock(&pool_lock);
+
+    // died since its last job, or could not be started again then
+    struct helper* const h = &helpers[i];
+    if (h->pid > 0 && waitpid(h->pid, NULL, WNOHANG) == h->pid) {
+        fprintf(stderr, "Resize helper %d died, restarting it\n", (int) h->pid);
+        h->pid = 0;
+    }
+    int err = h->pid > 0 ? ERR_NONE : spawn(h);
+
+    // room for the original, and for a result of up to width x width, at 4 bytes a pixel
+    if (err == ERR_NONE) {
+        err = map_memory(h, resize_result_offset(original_size) + 4 * (size_t) width * width + RESULT_ROOM);
+    }
+    if (err != ERR_NONE) {
+        job->helper = i;
+        resize_job_end(job);
+        return err;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->helper = i;
+    job->original = h->memory;
+    job->request.original_size = original_size;
+    job->request.width = width;
+    job->request.encoding = encoding;
+    job->request.format = format;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Waits for the reply of a helper, up to the time limit.
+ */
+static int wait_reply(struct helper* h, struct resize_reply* reply)
+{
+    struct pollfd pfd = { h->socket, POLLIN, 0 };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, (int) job_timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+    if (ready == 0) {
+        restart(h, "timed out");
+        return ERR_IMGLIB;
+    }
+    const ssize_t n = ready < 0 ? -1 : recv(h->socket, reply, sizeof(*reply), 0);
+    if (n != (ssize_t) sizeof(*reply)) {
+        restart(h, "died");
+        return ERR_IMGLIB;
+    }
+    return ERR_NONE;
+}
+
+int resize_job_run(struct resize_job* job)
+{
+    M_REQUIRE_NON_NULL(job);
+    if (job->helper >= nb_helpers) return ERR_INVALID_ARGUMENT;
+    struct helper* const h = &helpers[job->helper];
+
+    if (send(h->socket, &job->request, sizeof(job->request), MSG_NOSIGNAL)
+        != (ssize_t) sizeof(job->request)) {
+        // died since its last job: this one is not the cause
+        restart(h, "is gone");
+        if (send(h->socket, &job->request, sizeof(job->request), MSG_NOSIGNAL)
+            != (ssize_t) sizeof(job->request)) {
+            return ERR_IMGLIB;
+        }
+    }
+
+    struct resize_reply reply;
+    int err = wait_reply(h, &reply);
+    if (err != ERR_NONE) return err;
+    if (reply.err != ERR_NONE) return reply.err;
+
+    const size_t offset = resize_result_offset(job->request.original_size);
+    err = map_memory(h, offset + reply.size);
+    if (err != ERR_NONE) return err;
+    job->original = h->memory;
+    job->resized = h->memory + offset;
+    job->resized_size = reply.size;
+    return ERR_NONE;
+}
+
+void resize_job_end(struct resize_job* job)
+{
+    if (job == NULL || job->helper >= nb_helpers) return;
+    prof_mutex_lock(&pool_lock);
+    helpers[job->helper].busy = 0;
+    pthread_cond_signal(&helper_free);
+    prof_mutex_unlock(&pool_lock);
+    job->original = NULL;
+    job->resized = NULL;
+}
+
+void resize_sandbox_stop(void)
+{
+    for (unsigned i = 0; i < nb_helpers; ++i) helper_cleanup(&helpers[i]);
+    nb_helpers = 0;
+}
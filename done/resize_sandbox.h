@@ -0,0 +1,134 @@
+/**
+ * @file resize_sandbox.h
+ * @brief Resizing in helper processes, away from the server.
+ *
+ * Decoding an original is the riskiest thing the server does: the JPEG
+ * comes from a client, and a pathological one may crash libvips or take
+ * all the memory. With the sandbox on, the derivatives are made by a pool
+ * of long-lived helper processes (RESIZE_HELPER_NAME), one job at a time
+ * each, with resize_original().
+ *
+ * Each helper shares a memory file (memfd) with the server: the server
+ * reads the original from the volume straight into it, and writes the
+ * derivative to the volume straight from it; only the job and its result
+ * go through a socket. A helper rejects the originals that would decode
+ * to more than the memory limit, and runs under an RLIMIT_DATA close to
+ * it; one that takes longer than the time limit is killed. A helper that
+ * dies is started again, and the job it had fails with ERR_IMGLIB. The
+ * helpers exit when the server closes their socket, or dies.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint16_t, uint32_t, uint64_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RESIZE_HELPERS_ENV "IMGFS_RESIZE_HELPERS" // number of helpers; in-process resizing if unset or 0
+#define RESIZE_MEMORY_ENV "IMGFS_RESIZE_MEMORY_MB" // memory limit of a job
+#define RESIZE_TIMEOUT_ENV "IMGFS_RESIZE_TIMEOUT_MS" // time limit of a job
+
+#define RESIZE_HELPER_NAME "imgfs_resizer" // executable of the helpers, next to that of the server
+#define RESIZE_MAX_HELPERS 64
+#define RESIZE_DEFAULT_MEMORY_MB 512
+#define RESIZE_DEFAULT_TIMEOUT_MS 10000
+
+// file descriptors of a helper
+#define RESIZE_SOCKET_FD 3
+#define RESIZE_MEMORY_FD 4
+
+/**
+ * @brief A job, sent to a helper. The original is at the start of the
+ *        shared memory.
+ */
+struct resize_request {
+    uint32_t original_size;
+    uint16_t width; // resized resolution
+    uint16_t encoding; // ENC_*
+    int32_t format; // FORMAT_*
+};
+
+/**
+ * @brief The answer of a helper. The result is in the shared memory, at
+ *        resize_result_offset() (the helper grows the memory if needed).
+ */
+struct resize_reply {
+    int32_t err;
+    uint32_t size;
+};
+
+/**
+ * @brief Where the result of a job is in the shared memory.
+ */
+static inline size_t resize_result_offset(uint32_t original_size)
+{
+    return ((size_t) original_size + 63) & ~(size_t) 63;
+}
+
+/**
+ * @brief A job of the server, from resize_job_begin() to resize_job_end().
+ */
+struct resize_job {
+    char* original; // where to put the original, in the shared memory
+    const char* resized; // the result, in the shared memory, once run
+    size_t resized_size;
+    unsigned helper; // taken for the job
+    struct resize_request request;
+};
+
+/**
+ * @brief Starts the helpers.
+ *
+ * @param nb_helpers How many, 1 to RESIZE_MAX_HELPERS.
+ * @param helper_path The executable of the helpers.
+ * @param max_memory The memory limit of a job, in bytes.
+ * @param timeout_ms The time limit of a job.
+ * @return Some error code. 0 if no error.
+ */
+int resize_sandbox_start(unsigned nb_helpers, const char* helper_path, uint64_t max_memory,
+                         unsigned timeout_ms);
+
+/**
+ * @brief Whether the helpers are started.
+ */
+int resize_sandbox_enabled(void);
+
+/**
+ * @brief Takes a helper (waiting for one to be free), with room for the
+ *        original in its memory.
+ *
+ * @param job The job, to be ended with resize_job_end() if no error.
+ * @param original_size The size of the original, to be put in job->original.
+ * @param width The resized resolution.
+ * @param format The format of the result (FORMAT_*).
+ * @param encoding The encoding settings (ENC_*).
+ * @return Some error code. 0 if no error.
+ */
+int resize_job_begin(struct resize_job* job, uint32_t original_size, uint16_t width, int format,
+                     uint16_t encoding);
+
+/**
+ * @brief Has the helper resize the original, and sets job->resized and
+ *        job->resized_size.
+ *
+ * @return Some error code (ERR_IMGLIB if the helper failed, died or timed
+ *         out). 0 if no error.
+ */
+int resize_job_run(struct resize_job* job);
+
+/**
+ * @brief Gives the helper back; job->resized is not valid anymore.
+ */
+void resize_job_end(struct resize_job* job);
+
+/**
+ * @brief Stops the helpers (does nothing if not started).
+ */
+void resize_sandbox_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
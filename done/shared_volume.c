@@ -0,0 +1,288 @@
+/**
+ * @file shared_volume.c
+ * @brief A writer and read-only readers on one volume file (see shared_volume.h).
+ *
+ * Both sides wrap the FILE of the volume (volume_io.h): the writer to
+ * notice its first write in an operation, the readers to read from their
+ * mapping, which they extend when the volume grows.
+ */
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shared_volume.h"
+#include "imgfs_ext.h"
+#include "volume_io.h"
+#include "error.h"
+
+#define SEQ_MAGIC 0x716573736667696dULL // "imgfsseq"
+
+/**
+ * @brief The content of the sequence file.
+ */
+struct publication {
+    uint64_t magic;
+    atomic_uint_least64_t seq; // odd while the writer changes the volume
+};
+
+static struct publication* publication = NULL;
+static int publication_fd = -1; // writer: holds its lock
+static int is_writer = 0;
+static int is_reader = 0;
+
+static int map_publication(const char* imgfs_path, int writable)
+{
+    const size_t len = strlen(imgfs_path) + sizeof(SHARED_SEQ_SUFFIX);
+    char* const path = malloc(len);
+    if (path == NULL) return ERR_OUT_OF_MEMORY;
+    snprintf(path, len, "%s" SHARED_SEQ_SUFFIX, imgfs_path);
+    const int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    free(path);
+    if (fd < 0) return ERR_IO;
+
+    struct stat st;
+    int err = ERR_NONE;
+    if (writable) {
+        // one writer per volume
+        if (flock(fd, LOCK_EX | LOCK_NB) != 0
+            || ftruncate(fd, sizeof(struct publication)) != 0) err = ERR_IO;
+    } else if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(struct publication)) {
+        err = ERR_IO;
+    }
+    void* map = MAP_FAILED;
+    if (err == ERR_NONE) {
+        map = mmap(NULL, sizeof(struct publication), writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) err = ERR_IO;
+    }
+    if (err != ERR_NONE || !writable) {
+        close(fd);
+    } else {
+        publication_fd = fd;
+    }
+    if (err == ERR_NONE) publication = map;
+    return err;
+}
+
+// ======================================================================
+// Writer
+
+static int writing = 0; // the sequence number is odd
+
+static void begin_write(void)
+{
+    if (!writing) {
+        atomic_fetch_add_explicit(&publication->seq, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release); // odd before any byte changes
+        writing = 1;
+    }
+}
+
+static void stop_writer(void)
+{
+    is_writer = 0;
+}
+
+int shared_volume_publish(struct imgfs_file* imgfs_file, const char* imgfs_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_path);
+    if (is_writer || is_reader) return ERR_INVALID_ARGUMENT;
+
+    int err = map_publication(imgfs_path, 1);
+    if (err != ERR_NONE) return err;
+    if (publication->magic != SEQ_MAGIC) {
+        atomic_store(&publication->seq, 0);
+        publication->magic = SEQ_MAGIC;
+    } else if (atomic_load(&publication->seq) & 1) {
+        atomic_fetch_add(&publication->seq, 1); // the previous writer stopped while writing
+    }
+
+    static const struct volume_io_hooks hooks = { begin_write, NULL, NULL, stop_writer };
+    err = volume_io_wrap(imgfs_file, &hooks);
+    if (err == ERR_NONE) is_writer = 1;
+    return err;
+}
+
+void shared_volume_end(void)
+{
+    if (!is_writer || !writing) return;
+    // written with pwrite(), nothing to flush
+    atomic_fetch_add_explicit(&publication->seq, 1, memory_order_release);
+    writing = 0;
+}
+
+// ======================================================================
+// Readers
+
+struct volume_map {
+    int fd;
+    char* map;
+    size_t map_size;
+};
+
+static struct volume_map* reader = NULL;
+static struct img_metadata* scratch = NULL; // the next snapshot is copied here
+static uint64_t snapshot_seq = 1; // odd: no snapshot yet
+
+/**
+ * @brief Maps the volume again if it grew.
+ */
+static int remap(struct volume_map* mapping)
+{
+    struct stat st;
+    if (fstat(mapping->fd, &st) != 0) return ERR_IO;
+    const size_t size = (size_t) st.st_size;
+    if (size <= mapping->map_size) return ERR_NONE;
+    char* const map = mmap(NULL, size, PROT_READ, MAP_SHARED, mapping->fd, 0);
+    if (map == MAP_FAILED) return ERR_IO;
+    if (mapping->map != NULL) munmap(mapping->map, mapping->map_size);
+    mapping->map = map;
+    mapping->map_size = size;
+    return ERR_NONE;
+}
+
+static ssize_t reader_read(char* buf, size_t size, uint64_t offset)
+{
+    if (offset + size > reader->map_size && remap(reader) != ERR_NONE) return -1;
+    if (offset >= reader->map_size) return 0;
+    const size_t available = reader->map_size - (size_t) offset;
+    const size_t n = size < available ? size : available;
+    memcpy(buf, reader->map + offset, n);
+    return (ssize_t) n;
+}
+
+static void reader_close(void)
+{
+    if (reader->map != NULL) munmap(reader->map, reader->map_size);
+    free(reader);
+    reader = NULL;
+}
+
+/**
+ * @brief Copies the header, the metadata and the extension table if the
+ *        writer published a change and is not changing the volume, and
+ *        keeps the copy if the sequence number did not change meanwhile.
+ *
+ * @param taken Where to put whether the snapshot was replaced.
+ */
+static int take_snapshot(struct imgfs_file* imgfs_file, int* taken)
+{
+    *taken = 0;
+    const uint64_t before = atomic_load_explicit(&publication->seq, memory_order_acquire);
+    if ((before & 1) != 0 || before == snapshot_seq) return ERR_NONE;
+
+    const size_t metadata_size = imgfs_file->header.max_files * sizeof(struct img_metadata);
+    if (reader->map_size < sizeof(struct imgfs_header) + metadata_size
+        && remap(reader) != ERR_NONE) return ERR_IO;
+    if (reader->map_size < sizeof(struct imgfs_header) + metadata_size) return ERR_IO;
+    struct imgfs_file copy;
+    copy.file = imgfs_file->file;
+    copy.metadata = scratch;
+    memcpy(&copy.header, reader->map, sizeof(copy.header));
+    memcpy(scratch, reader->map + sizeof(copy.header), metadata_size);
+    if (copy.header.max_files != imgfs_file->header.max_files) {
+        // torn, or not the same volume: told apart below
+        copy.header.ext_offset = 0;
+    }
+    // in the same window: its records are rewritten in place, and tables moved
+    struct imgfs_ext_record* ext = NULL;
+    const int ext_err = imgfs_ext_load(&copy, &ext);
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&publication->seq, memory_order_relaxed) != before) {
+        free(ext);
+        return ERR_NONE; // the writer changed the volume meanwhile: kept for the next operation
+    }
+    if (copy.header.max_files != imgfs_file->header.max_files || ext_err != ERR_NONE) {
+        free(ext);
+        return ext_err != ERR_NONE ? ext_err : ERR_IO;
+    }
+
+    imgfs_file->header = copy.header;
+    struct img_metadata* const previous = imgfs_file->metadata;
+    imgfs_file->metadata = scratch;
+    scratch = previous;
+    snapshot_seq = before;
+    *taken = 1;
+    return imgfs_ext_adopt(imgfs_file, ext);
+}
+
+int shared_volume_attach(struct imgfs_file* imgfs_file, const char* imgfs_path)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(imgfs_file->metadata);
+    M_REQUIRE_NON_NULL(imgfs_path);
+    if (is_writer || is_reader) return ERR_INVALID_ARGUMENT;
+
+    int err = map_publication(imgfs_path, 0);
+    if (err != ERR_NONE) return err;
+    struct volume_map* const mapping = calloc(1, sizeof(struct volume_map));
+    scratch = malloc(imgfs_file->header.max_files * sizeof(struct img_metadata));
+    if (mapping == NULL || scratch == NULL) {
+        free(mapping);
+        free(scratch);
+        scratch = NULL;
+        return ERR_OUT_OF_MEMORY;
+    }
+    mapping->fd = fileno(imgfs_file->file);
+    err = remap(mapping);
+    if (err != ERR_NONE) {
+        free(mapping);
+        free(scratch);
+        scratch = NULL;
+        return err;
+    }
+    reader = mapping;
+    // unbuffered: the mapping is the buffer
+    static const struct volume_io_hooks hooks = { NULL, NULL, reader_read, reader_close };
+    err = volume_io_wrap(imgfs_file, &hooks);
+    if (err != ERR_NONE) {
+        reader_close();
+        return err;
+    }
+    is_reader = 1;
+
+    // what do_open() read may be half-written: wait for a consistent snapshot
+    for (unsigned waited_ms = 0; ; ++waited_ms) {
+        int taken = 0;
+        err = take_snapshot(imgfs_file, &taken);
+        if (err != ERR_NONE || taken) return err;
+        if (waited_ms >= SHARED_ATTACH_TIMEOUT_MS) return ERR_IO;
+        const struct timespec t = { 0, 1000000L };
+        nanosleep(&t, NULL);
+    }
+}
+
+int shared_volume_refresh(struct imgfs_file* imgfs_file)
+{
+    if (!is_reader) return ERR_NONE;
+    M_REQUIRE_NON_NULL(imgfs_file);
+    int taken = 0;
+    return take_snapshot(imgfs_file, &taken);
+}
+
+int shared_volume_is_reader(void)
+{
+    return is_reader;
+}
+
+void shared_volume_close(void)
+{
+    if (publication != NULL) munmap(publication, sizeof(struct publication));
+    if (publication_fd >= 0) close(publication_fd);
+    publication = NULL;
+    publication_fd = -1;
+    free(scratch);
+    scratch = NULL;
+    is_writer = is_reader = 0;
+}
@@ -0,0 +1,77 @@
+/**
+ * @file shared_volume.h
+ * @brief Several servers on one volume file: a writer and read-only readers.
+ *
+ * The writer publishes its changes through a sequence number, in a small
+ * file next to the volume ("<volume>.seq") that all the processes map: the
+ * number becomes odd at the first write of an operation, and even again
+ * once the writes of the operation are flushed.
+ *
+ * A reader opens the volume read-only, maps it and serves its reads from the
+ * mapping, with its own snapshot of the header and the metadata. Before
+ * each operation, it checks the number; if it is even and has changed, the
+ * reader copies the header and the metadata again, and keeps the copy only
+ * if the number did not change meanwhile (a sequence lock). Readers take no
+ * lock shared with the writer, never make it wait, and never see
+ * half-written metadata: while the writer changes the volume, they serve
+ * their previous snapshot. The images a snapshot refers to are not
+ * overwritten afterwards, the volume being append-only, except by
+ * "imgfscmd gc" which must not run while readers do.
+ */
+
+#pragma once
+
+#include "imgfs.h" // for struct imgfs_file
+
+#define SHARED_WRITER_ENV "IMGFS_SHARED_WRITER" // if set (and not "0"), publish for readers
+#define SHARED_READER_ENV "IMGFS_SHARED_READER" // if set (and not "0"), read-only reader
+#define SHARED_SEQ_SUFFIX ".seq"
+#define SHARED_ATTACH_TIMEOUT_MS 10000 // longest wait for a first snapshot
+
+/**
+ * @brief Makes this process the writer of a volume: creates its sequence
+ *        file if needed, and wraps the FILE of the volume to detect writes.
+ *
+ * @param imgfs_file The volume, opened for writing.
+ * @param imgfs_path Its file.
+ * @return Some error code. 0 if no error.
+ */
+int shared_volume_publish(struct imgfs_file* imgfs_file, const char* imgfs_path);
+
+/**
+ * @brief Ends the current operation of the writer: if it wrote, flushes the
+ *        volume and publishes the change. To be called with the volume lock
+ *        held. Does nothing in the other processes.
+ */
+void shared_volume_end(void);
+
+/**
+ * @brief Makes this process a reader of a volume whose writer publishes:
+ *        maps it, wraps its FILE to read from the mapping, and takes a
+ *        first consistent snapshot (waiting for the writer if needed).
+ *
+ * @param imgfs_file The volume, opened read-only.
+ * @param imgfs_path Its file.
+ * @return Some error code (ERR_IO if no writer ever published). 0 if no error.
+ */
+int shared_volume_attach(struct imgfs_file* imgfs_file, const char* imgfs_path);
+
+/**
+ * @brief Takes a new snapshot of the header and the metadata if the writer
+ *        published a change, and is not changing the volume. To be called
+ *        with the volume lock held. Does nothing if not a reader.
+ *
+ * @param imgfs_file The volume given to shared_volume_attach().
+ * @return Some error code. 0 if no error (including when the snapshot is kept).
+ */
+int shared_volume_refresh(struct imgfs_file* imgfs_file);
+
+/**
+ * @brief Whether this process is a reader.
+ */
+int shared_volume_is_reader(void);
+
+/**
+ * @brief Unmaps the sequence file, after the volume is closed.
+ */
+void shared_volume_close(void);
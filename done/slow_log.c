@@ -0,0 +1,179 @@
+/**
+ * @file slow_log.c
+ * @brief Slow request log of the imgFS server.
+ *
+ * Only slow requests reach this code, so lines are written synchronously
+ * under a mutex. In the trace-event export, each request gets its own
+ * track (tid), numbered in the order requests were found slow.
+ */
+
+#include <json-c/json.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "slow_log.h"
+#include "error.h"
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+static atomic_int opened;
+static uint64_t threshold;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE* log_file = NULL;
+static FILE* trace_file = NULL;
+static unsigned long nb_traced = 0;
+static int first_event = 1;
+
+int slow_log_open(uint64_t threshold_ns, const char* path, const char* trace_path)
+{
+    if (atomic_load(&opened)) return ERR_INVALID_ARGUMENT;
+
+    if (path == NULL || strcmp(path, "-") == 0) {
+        log_file = stderr;
+    } else if ((log_file = fopen(path, "a")) == NULL) {
+        perror("slow log fopen()");
+        return ERR_IO;
+    }
+
+    if (trace_path != NULL) {
+        trace_file = fopen(trace_path, "w");
+        if (trace_file == NULL) {
+            perror("trace fopen()");
+            if (log_file != stderr) fclose(log_file);
+            log_file = NULL;
+            return ERR_IO;
+        }
+        fputs("[", trace_file);
+    }
+
+    threshold = threshold_ns;
+    nb_traced = 0;
+    first_event = 1;
+    atomic_store(&opened, 1);
+    return ERR_NONE;
+}
+
+static double to_us(uint64_t ns)
+{
+    return (double) ns / 1e3;
+}
+
+static json_object* new_us(uint64_t ns)
+{
+    return json_object_new_double(to_us(ns));
+}
+
+/**
+ * @brief Builds an object with what identifies a request.
+ */
+static json_object* request_fields(const struct request_ctx* ctx)
+{
+    json_object* const jreq = json_object_new_object();
+    json_object_object_add(jreq, "method", json_object_new_string(ctx->method));
+    json_object_object_add(jreq, "route", json_object_new_string(request_route_name(ctx->route)));
+    if (ctx->img_id[0] != '\0') {
+        json_object_object_add(jreq, "img_id", json_object_new_string(ctx->img_id));
+    }
+    if (ctx->resolution >= 0 && ctx->resolution < NB_RES) {
+        json_object_object_add(jreq, "res", json_object_new_string(res_names[ctx->resolution]));
+    }
+    json_object_object_add(jreq, "status", json_object_new_int(ctx->status));
+    return jreq;
+}
+
+/**
+ * @brief Builds the slow log entry of a request.
+ */
+static json_object* request_json(const struct request_ctx* ctx, const struct trace* trace)
+{
+    json_object* const jreq = request_fields(ctx);
+    json_object_object_add(jreq, "total_us", new_us(trace->end_ns - trace->start_ns));
+
+    json_object* const jphases = json_object_new_array();
+    for (size_t i = 0; i < trace->nb_spans; ++i) {
+        const struct trace_span* const s = &trace->spans[i];
+        json_object* const jphase = json_object_new_object();
+        json_object_object_add(jphase, "name", json_object_new_string(s->name));
+        json_object_object_add(jphase, "depth", json_object_new_int((int) s->depth));
+        json_object_object_add(jphase, "start_us", new_us(s->start_ns - trace->start_ns));
+        json_object_object_add(jphase, "dur_us", new_us(s->end_ns - s->start_ns));
+        json_object_array_add(jphases, jphase);
+    }
+    json_object_object_add(jreq, "phases", jphases);
+    if (trace->dropped_spans > 0) {
+        json_object_object_add(jreq, "dropped_phases", json_object_new_uint64(trace->dropped_spans));
+    }
+    return jreq;
+}
+
+/**
+ * @brief Writes one complete trace event.
+ */
+static void write_event(const char* name, const char* cat, uint64_t start_ns, uint64_t end_ns,
+                        unsigned long tid, json_object* args)
+{
+    json_object* const jev = json_object_new_object();
+    json_object_object_add(jev, "name", json_object_new_string(name));
+    json_object_object_add(jev, "cat", json_object_new_string(cat));
+    json_object_object_add(jev, "ph", json_object_new_string("X"));
+    json_object_object_add(jev, "ts", new_us(start_ns));
+    json_object_object_add(jev, "dur", new_us(end_ns - start_ns));
+    json_object_object_add(jev, "pid", json_object_new_int(getpid()));
+    json_object_object_add(jev, "tid", json_object_new_uint64(tid));
+    if (args != NULL) json_object_object_add(jev, "args", args);
+
+    fprintf(trace_file, "%s\n%s", first_event ? "" : ",", json_object_to_json_string(jev));
+    first_event = 0;
+    json_object_put(jev);
+}
+
+void slow_log_request(const struct request_ctx* ctx, const struct trace* trace)
+{
+    if (ctx == NULL || trace == NULL || !atomic_load_explicit(&opened, memory_order_acquire)) return;
+    if (trace->end_ns - trace->start_ns < threshold) return;
+
+    json_object* const jreq = request_json(ctx, trace);
+
+    pthread_mutex_lock(&log_lock);
+    if (log_file == NULL) { // closed since opened was checked
+        pthread_mutex_unlock(&log_lock);
+        json_object_put(jreq);
+        return;
+    }
+    fprintf(log_file, "%s\n", json_object_to_json_string(jreq));
+    fflush(log_file);
+
+    if (trace_file != NULL) {
+        char name[REQUEST_METHOD_MAX + 16];
+        snprintf(name, sizeof(name), "%s %s", ctx->method, request_route_name(ctx->route));
+        write_event(name, "request", trace->start_ns, trace->end_ns, nb_traced,
+                    request_fields(ctx));
+        for (size_t i = 0; i < trace->nb_spans; ++i) {
+            const struct trace_span* const s = &trace->spans[i];
+            write_event(s->name, "phase", s->start_ns, s->end_ns, nb_traced, NULL);
+        }
+        fflush(trace_file);
+        ++nb_traced;
+    }
+    pthread_mutex_unlock(&log_lock);
+
+    json_object_put(jreq);
+}
+
+void slow_log_close(void)
+{
+    if (!atomic_exchange(&opened, 0)) return;
+
+    pthread_mutex_lock(&log_lock);
+    if (trace_file != NULL) {
+        fputs("\n]\n", trace_file);
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    if (log_file != stderr) fclose(log_file);
+    log_file = NULL;
+    pthread_mutex_unlock(&log_lock);
+}
@@ -0,0 +1,40 @@
+/**
+ * @file slow_log.h
+ * @brief Slow request log of the imgFS server.
+ *
+ * Requests that take longer than a threshold are dumped with the timings
+ * of all their phases, one JSON line per request. Optionally, they are
+ * also exported as Chrome trace events ("ph":"X" complete events), to be
+ * opened in chrome://tracing or Perfetto.
+ */
+
+#pragma once
+
+#include <stdint.h> // uint64_t
+
+#include "request_ctx.h"
+#include "trace.h"
+
+#define SLOW_LOG_THRESHOLD_ENV "IMGFS_SLOW_MS"
+#define SLOW_LOG_ENV "IMGFS_SLOW_LOG"
+#define SLOW_LOG_TRACE_ENV "IMGFS_TRACE_JSON" // in prefork mode, one file per worker: trace.json gives trace.<worker>.json
+
+/**
+ * @brief Opens the slow log.
+ *
+ * @param threshold_ns Requests taking longer than this are logged.
+ * @param path The slow log file, appended to; NULL or "-" for the standard error.
+ * @param trace_path The Chrome trace-event JSON file to write, NULL for none.
+ * @return Some error code. 0 if no error.
+ */
+int slow_log_open(uint64_t threshold_ns, const char* path, const char* trace_path);
+
+/**
+ * @brief Logs a finished request if it was slow. Does nothing if the log is not open.
+ */
+void slow_log_request(const struct request_ctx* ctx, const struct trace* trace);
+
+/**
+ * @brief Closes the slow log, terminating the trace-event file.
+ */
+void slow_log_close(void);
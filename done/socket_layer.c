@@ -1,56 +1,57 @@
 /**
  * @file socket_layer.c
- * @brief Socket layer of the project (TCP) for network communication.
+ * @brief Socket layer of the project (TCP, Unix domain) for network communication.
  *
  * This file primarily consists of interfaces to the corresponding
  * system-level socket operations.
  */
 
+#define _GNU_SOURCE // for accept4()
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <arpa/inet.h>
 #include "error.h"
 #include "util.h"
 
 #define MAX_PENDING_CONNECTIONS 25
+#define MAX_PASSED_FDS 4 // taken along one read; more are truncated by the kernel
 
 /**
- * @brief Initializes the TCP server socket.
+ * @brief Listens on a new stream socket bound to the given address.
  *
- * @param port Port number.
+ * @param domain AF_INET or AF_UNIX.
+ * @param address The address to bind to.
+ * @param address_len Its size.
  * @return The file descriptor or ERR_IO if there is one.
  */
-int tcp_server_init(uint16_t port)
+static int stream_server_init(int domain, const struct sockaddr* address, socklen_t address_len)
 {
-    int server_fd;
-    struct sockaddr_in address;
-
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    // not inherited by the resize helpers (resize_sandbox.h)
+    const int server_fd = socket(domain, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_fd == -1) {
         perror("The creation of the socket failed");
         return ERR_IO;
     }
 
     int optval = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
+    if (domain == AF_INET && setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0) {
         perror("Setting socket option failed");
         close(server_fd);
         return ERR_IO;
     }
 
-    // Set up the server address structure
-    zero_init_var(address);
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(port);
-
     // Bind the socket to the address
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    if (bind(server_fd, address, address_len) < 0) {
         perror("The binding of the socket failed");
         close(server_fd);
         return ERR_IO;
@@ -66,6 +67,117 @@ int tcp_server_init(uint16_t port)
     return server_fd;
 }
 
+/**
+ * @brief Initializes the TCP server socket.
+ *
+ * @param port Port number.
+ * @return The file descriptor or ERR_IO if there is one.
+ */
+int tcp_server_init(uint16_t port)
+{
+    struct sockaddr_in address;
+
+    // Set up the server address structure
+    zero_init_var(address);
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    return stream_server_init(AF_INET, (const struct sockaddr*) &address, sizeof(address));
+}
+
+/**
+ * @brief Initializes a Unix domain stream server socket, replacing the
+ *        socket file of a previous server, if any.
+ *
+ * @param path Path of the socket file.
+ * @return The file descriptor, ERR_INVALID_ARGUMENT if the path is too
+ *         long, or ERR_IO.
+ */
+int unix_server_init(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+    struct sockaddr_un address;
+    zero_init_var(address);
+    address.sun_family = AF_UNIX;
+    if (path[0] == '\0' || strlen(path) >= sizeof(address.sun_path)) return ERR_INVALID_ARGUMENT;
+    strcpy(address.sun_path, path);
+
+    // a file left there is only a socket: a server never unlinks anything else
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "%s exists and is not a socket\n", path);
+            return ERR_IO;
+        }
+        unlink(path);
+    }
+
+    return stream_server_init(AF_UNIX, (const struct sockaddr*) &address, sizeof(address));
+}
+
+/**
+ * @brief Connects to a TCP server.
+ *
+ * @param host Name or address of the server.
+ * @param port Its port.
+ * @return The file descriptor or ERR_IO if there is one.
+ */
+int tcp_connect(const char* host, uint16_t port)
+{
+    M_REQUIRE_NON_NULL(host);
+    char service[8];
+    snprintf(service, sizeof(service), "%u", (unsigned) port);
+
+    struct addrinfo hints;
+    zero_init_var(hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* addresses = NULL;
+    if (getaddrinfo(host, service, &hints, &addresses) != 0) return ERR_IO;
+
+    int fd = ERR_IO;
+    for (const struct addrinfo* a = addresses; a != NULL && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+            close(fd);
+            fd = ERR_IO;
+        }
+    }
+    freeaddrinfo(addresses);
+    if (fd >= 0) {
+        // requests are small and answered at once: do not wait to fill packets
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    }
+    return fd < 0 ? ERR_IO : fd;
+}
+
+/**
+ * @brief Connects to a Unix domain stream server socket.
+ *
+ * @param path Path of the socket file.
+ * @return The file descriptor, ERR_INVALID_ARGUMENT if the path is too
+ *         long, or ERR_IO.
+ */
+int unix_connect(const char* path)
+{
+    M_REQUIRE_NON_NULL(path);
+    struct sockaddr_un address;
+    zero_init_var(address);
+    address.sun_family = AF_UNIX;
+    if (path[0] == '\0' || strlen(path) >= sizeof(address.sun_path)) return ERR_INVALID_ARGUMENT;
+    strcpy(address.sun_path, path);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return ERR_IO;
+    if (connect(fd, (const struct sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return ERR_IO;
+    }
+    return fd;
+}
+
 /**
  * @brief Accepts new connections on a TCP server socket.
  *
@@ -74,7 +186,7 @@ int tcp_server_init(uint16_t port)
  */
 int tcp_accept(int passive_socket)
 {
-    return accept(passive_socket, NULL, NULL);
+    return accept4(passive_socket, NULL, NULL, SOCK_CLOEXEC);
 }
 
 
@@ -102,6 +214,51 @@ ssize_t tcp_read(int active_socket, char* buf, size_t buf_len)
     return result;
 }
 
+/**
+ * @brief Reads data from a socket once, like tcp_read(), and takes the file
+ *        descriptor the peer may have passed along (SCM_RIGHTS, Unix domain
+ *        sockets only).
+ *
+ * @param active_socket The file descriptor of the socket to read from.
+ * @param buf The buffer to store the data we read.
+ * @param buf_len Length of the buffer.
+ * @param passed_fd Set to the descriptor passed (close-on-exec), or left as is if none.
+ * @return Number of bytes read, ERR_IO on error, or ERR_INVALID_ARGUMENT if args are invalid.
+ */
+ssize_t socket_read_fd(int active_socket, char* buf, size_t buf_len, int* passed_fd)
+{
+    M_REQUIRE_NON_NULL(passed_fd);
+    if (buf == NULL || buf_len == 0) return ERR_INVALID_ARGUMENT;
+
+    struct iovec iov = { buf, buf_len };
+    union {
+        struct cmsghdr align;
+        char bytes[CMSG_SPACE(MAX_PASSED_FDS * sizeof(int))];
+    } control;
+    struct msghdr msg;
+    zero_init_var(msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.bytes;
+    msg.msg_controllen = sizeof(control.bytes);
+
+    const ssize_t result = recvmsg(active_socket, &msg, MSG_CMSG_CLOEXEC);
+    if (result < 0) return ERR_IO;
+
+    for (struct cmsghdr* c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        const size_t nb_fds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < nb_fds; ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(fd));
+            // the first one is kept, the others are not expected
+            if (*passed_fd < 0) *passed_fd = fd;
+            else close(fd);
+        }
+    }
+    return result;
+}
+
 /**
  * @brief Sends data over a TCP socket.
  *
@@ -13,6 +13,22 @@
 
 int tcp_server_init(uint16_t port);
 
+/**
+ * @brief Listens on a Unix domain stream socket at path (replacing a stale
+ *        socket file), for clients on the same machine.
+ */
+int unix_server_init(const char* path);
+
+/**
+ * @brief Connects to the TCP server host:port (name or address)
+ */
+int tcp_connect(const char* host, uint16_t port);
+
+/**
+ * @brief Connects to the Unix domain socket at path
+ */
+int unix_connect(const char* path);
+
 /**
  * @brief Blocking call that accepts a new TCP connection
  */
@@ -23,4 +39,10 @@ int tcp_accept(int passive_socket);
  */
 ssize_t tcp_read(int active_socket, char* buf, size_t buflen);
 
+/**
+ * @brief Like tcp_read(), also taking a file descriptor the peer passed
+ *        along the data (Unix domain sockets), if any, in *passed_fd
+ */
+ssize_t socket_read_fd(int active_socket, char* buf, size_t buf_len, int* passed_fd);
+
 ssize_t tcp_send(int active_socket, const char* response, size_t response_len);
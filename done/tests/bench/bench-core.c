@@ -0,0 +1,368 @@
+/**
+ * @file bench-core.c
+ * @brief Microbenchmarks of the imgFS library on synthetic volumes.
+ *
+ * For each volume size (10^3 slots up to -m slots, by factors of 10), a
+ * volume is synthesized with every other slot used. All its images share
+ * the same original (one copy of the image file at the end of the volume)
+ * but have distinct SHAs, and none has a resized derivative yet. Then are
+ * timed: do_open, do_list (both modes), do_read of each resolution (on
+ * stored derivatives, and on missing ones, which resizes), lazily_resize,
+ * do_insert of new and of duplicate content, and do_delete.
+ */
+
+#include <getopt.h>
+#include <limits.h> // PATH_MAX
+#include <vips/vips.h>
+
+#include "bench.h"
+#include "imgfs.h"
+#include "image_content.h"
+
+#define MIN_SLOTS 1000U
+#define CHUNK 4096U
+#define THUMB_SIZE 64
+#define SMALL_SIZE 256
+#define RESIZES 20 // images resized per resolution
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+static char* image = NULL;
+static size_t image_size = 0;
+static uint32_t image_width = 0;
+static uint32_t image_height = 0;
+static uint64_t rng = 0x2545F4914F6CDD1DULL;
+
+static uint32_t random_below(uint32_t n)
+{
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return (uint32_t) ((rng * 0x2545F4914F6CDD1DULL) >> 32) % n;
+}
+
+/**
+ * @brief Iterations of an operation whose cost grows with the number of slots.
+ */
+static size_t iterations(uint32_t slots, uint64_t budget, size_t lo, size_t hi)
+{
+    const uint64_t n = budget / slots;
+    return n < lo ? lo : n > hi ? hi : (size_t) n;
+}
+
+// slot i holds image "img<i>" if i is even
+static void image_id(char* id, uint32_t slot)
+{
+    snprintf(id, MAX_IMG_ID + 1, "img%u", slot);
+}
+
+static uint32_t random_used_slot(uint32_t slots)
+{
+    return random_below(slots / 2) * 2;
+}
+
+/**
+ * @brief Writes a volume with slots metadata slots, half of them used.
+ */
+static int synthesize(const char* path, uint32_t slots)
+{
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) return ERR_IO;
+
+    struct imgfs_header header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.name, CAT_TXT, MAX_IMGFS_NAME);
+    header.version = slots / 2;
+    header.nb_files = slots / 2;
+    header.max_files = slots;
+    header.resized_res[0] = header.resized_res[1] = THUMB_SIZE;
+    header.resized_res[2] = header.resized_res[3] = SMALL_SIZE;
+
+    const uint64_t blob_offset = sizeof(header) + (uint64_t) slots * sizeof(struct img_metadata);
+    struct img_metadata* chunk = calloc(CHUNK, sizeof(struct img_metadata));
+    int err = chunk == NULL ? ERR_OUT_OF_MEMORY : ERR_NONE;
+    if (err == ERR_NONE && fwrite(&header, sizeof(header), 1, f) != 1) err = ERR_IO;
+
+    for (uint32_t first = 0; err == ERR_NONE && first < slots; first += CHUNK) {
+        const uint32_t n = slots - first < CHUNK ? slots - first : CHUNK;
+        memset(chunk, 0, n * sizeof(struct img_metadata));
+        for (uint32_t k = 0; k < n; ++k) {
+            const uint32_t slot = first + k;
+            if (slot % 2 != 0) continue;
+            struct img_metadata* const m = &chunk[k];
+            image_id(m->img_id, slot);
+            memcpy(m->SHA, &slot, sizeof(slot));
+            m->SHA[SHA256_DIGEST_LENGTH - 1] = 0xA5;
+            m->orig_res[0] = image_width;
+            m->orig_res[1] = image_height;
+            m->size[ORIG_RES] = (uint32_t) image_size;
+            m->offset[ORIG_RES] = blob_offset;
+            m->is_valid = NON_EMPTY;
+        }
+        if (fwrite(chunk, sizeof(struct img_metadata), n, f) != n) err = ERR_IO;
+    }
+    if (err == ERR_NONE && fwrite(image, image_size, 1, f) != 1) err = ERR_IO;
+
+    free(chunk);
+    if (fclose(f) != 0 && err == ERR_NONE) err = ERR_IO;
+    return err;
+}
+
+/********************************************************************
+ * Benchmarks
+ */
+
+static void bench_open(const char* path, const char* params, uint32_t slots)
+{
+    const size_t n = iterations(slots, 20000000ULL, 3, 100);
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+    for (size_t i = 0; i < n; ++i) {
+        struct imgfs_file f;
+        const uint64_t t0 = bench_now_ns();
+        const int err = do_open(path, "rb", &f);
+        t[i] = bench_now_ns() - t0;
+        if (err != ERR_NONE) {
+            fprintf(stderr, "do_open(): %s\n", ERR_MSG(err));
+            free(t);
+            return;
+        }
+        do_close(&f);
+    }
+    bench_report("do_open", "rb", params, t, n);
+    free(t);
+}
+
+static void bench_list(struct imgfs_file* f, const char* params, uint32_t slots)
+{
+    const size_t n = iterations(slots, 10000000ULL, 3, 100);
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+
+    const int saved = bench_silence_stdout();
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t t0 = bench_now_ns();
+        do_list(f, STDOUT, NULL);
+        t[i] = bench_now_ns() - t0;
+    }
+    bench_restore_stdout(saved);
+    bench_report("do_list", "stdout", params, t, n);
+
+    for (size_t i = 0; i < n; ++i) {
+        char* json = NULL;
+        const uint64_t t0 = bench_now_ns();
+        do_list(f, JSON, &json);
+        t[i] = bench_now_ns() - t0;
+        free(json);
+    }
+    bench_report("do_list", "json", params, t, n);
+    free(t);
+}
+
+/**
+ * @brief Times do_read on random used slots.
+ *
+ * @param slots_list If not NULL, reads these slots instead of random ones.
+ */
+static void bench_read(struct imgfs_file* f, const char* params, uint32_t slots, int res,
+                       const char* variant, const uint32_t* slots_list, size_t n)
+{
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+    size_t done = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char id[MAX_IMG_ID + 1];
+        image_id(id, slots_list != NULL ? slots_list[i] : random_used_slot(slots));
+        char* buffer = NULL;
+        uint32_t size = 0;
+        const uint64_t t0 = bench_now_ns();
+        const int err = do_read(id, res, &buffer, &size, f);
+        t[done] = bench_now_ns() - t0;
+        free(buffer);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "do_read(%s, %s): %s\n", id, res_names[res], ERR_MSG(err));
+            continue;
+        }
+        ++done;
+    }
+    bench_report("do_read", variant, params, t, done);
+    free(t);
+}
+
+static void bench_resize(struct imgfs_file* f, const char* params, int res, const uint32_t* list, size_t n)
+{
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+    size_t done = 0;
+    for (size_t i = 0; i < n; ++i) {
+        const uint64_t t0 = bench_now_ns();
+        const int err = lazily_resize(res, f, list[i]);
+        t[done] = bench_now_ns() - t0;
+        if (err != ERR_NONE) {
+            fprintf(stderr, "lazily_resize(%s): %s\n", res_names[res], ERR_MSG(err));
+            continue;
+        }
+        ++done;
+    }
+    bench_report("lazily_resize", res_names[res], params, t, done);
+    free(t);
+}
+
+/**
+ * @brief Times inserts of new content (the image with a distinct trailer) or of duplicates.
+ */
+static void bench_insert(struct imgfs_file* f, const char* params, int duplicate, size_t n)
+{
+    static unsigned int inserted = 0;
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    char* content = malloc(image_size + sizeof(inserted));
+    if (t == NULL || content == NULL) {
+        free(t);
+        free(content);
+        return;
+    }
+    memcpy(content, image, image_size);
+    if (duplicate) {
+        // store the content once, untimed; all the timed inserts are then duplicates of it
+        memset(content + image_size, 0, sizeof(inserted));
+        char id[MAX_IMG_ID + 1];
+        snprintf(id, sizeof(id), "new%u", ++inserted);
+        do_insert(content, image_size + sizeof(inserted), id, f);
+    }
+
+    size_t done = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char id[MAX_IMG_ID + 1];
+        snprintf(id, sizeof(id), "new%u", ++inserted);
+        // bytes after the end of the JPEG are ignored by decoders, but change the SHA
+        if (!duplicate) memcpy(content + image_size, &inserted, sizeof(inserted));
+        const uint64_t t0 = bench_now_ns();
+        const int err = do_insert(content, image_size + sizeof(inserted), id, f);
+        t[done] = bench_now_ns() - t0;
+        if (err != ERR_NONE) {
+            fprintf(stderr, "do_insert(%s): %s\n", id, ERR_MSG(err));
+            continue;
+        }
+        ++done;
+    }
+    bench_report("do_insert", duplicate ? "duplicate" : "new", params, t, done);
+    free(content);
+    free(t);
+}
+
+static void bench_delete(struct imgfs_file* f, const char* params, uint32_t slots, size_t n)
+{
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+    size_t done = 0;
+    for (size_t i = 0; i < n; ++i) {
+        char id[MAX_IMG_ID + 1];
+        // images of the second half, which the other benchmarks only read
+        image_id(id, slots / 2 + (uint32_t) (2 * i) + (slots / 2) % 2);
+        const uint64_t t0 = bench_now_ns();
+        const int err = do_delete(id, f);
+        t[done] = bench_now_ns() - t0;
+        if (err != ERR_NONE) {
+            fprintf(stderr, "do_delete(%s): %s\n", id, ERR_MSG(err));
+            continue;
+        }
+        ++done;
+    }
+    bench_report("do_delete", "valid", params, t, done);
+    free(t);
+}
+
+static void bench_volume(const char* dir, uint32_t slots)
+{
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bench-core-%u.imgfs", dir, slots);
+    char params[64];
+    snprintf(params, sizeof(params), "\"slots\":%u,\"files\":%u", slots, slots / 2);
+
+    fprintf(stderr, "%u slots: synthesizing %s\n", slots, path);
+    int err = synthesize(path, slots);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, ERR_MSG(err));
+        remove(path);
+        return;
+    }
+
+    bench_open(path, params, slots);
+
+    struct imgfs_file f;
+    err = do_open(path, "rb+", &f);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "do_open(): %s\n", ERR_MSG(err));
+        remove(path);
+        return;
+    }
+
+    bench_list(&f, params, slots);
+    bench_read(&f, params, slots, ORIG_RES, "orig", NULL, iterations(slots, 100000000ULL, 10, 1000));
+
+    // resize distinct images of the first half, then read them back
+    uint32_t resized[RESIZES];
+    uint32_t missing[RESIZES];
+    for (uint32_t i = 0; i < RESIZES; ++i) {
+        resized[i] = 2 * i;
+        missing[i] = 2 * (RESIZES + i);
+    }
+    for (int res = THUMB_RES; res < ORIG_RES; ++res) {
+        bench_resize(&f, params, res, resized, RESIZES);
+        char variant[16];
+        snprintf(variant, sizeof(variant), "%s_hit", res_names[res]);
+        bench_read(&f, params, slots, res, variant, resized, RESIZES);
+        snprintf(variant, sizeof(variant), "%s_miss", res_names[res]);
+        bench_read(&f, params, slots, res, variant, missing, RESIZES);
+    }
+
+    const size_t n = iterations(slots, 10000000ULL, 5, 50);
+    bench_insert(&f, params, 0, n);
+    bench_insert(&f, params, 1, n);
+    bench_delete(&f, params, slots, n);
+
+    do_close(&f);
+    remove(path);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* dir = "/tmp";
+    const char* image_path = DATA_DIR "papillon.jpg";
+    unsigned long max_slots = 1000000UL;
+    unsigned long min_slots = MIN_SLOTS;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:m:s:i:")) != -1) {
+        switch (c) {
+        case 'd': dir = optarg; break;
+        case 'm': max_slots = strtoul(optarg, NULL, 10); break;
+        case 's': min_slots = strtoul(optarg, NULL, 10); break;
+        case 'i': image_path = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-d dir] [-s min_slots] [-m max_slots] [-i image.jpg]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (min_slots < 2 * RESIZES * 2 || max_slots > UINT32_MAX || min_slots > max_slots) {
+        fprintf(stderr, "Slots must be between %d and %u\n", 4 * RESIZES, UINT32_MAX);
+        return EXIT_FAILURE;
+    }
+
+    if (VIPS_INIT(argv[0]) != 0) return EXIT_FAILURE;
+
+    image = bench_read_file(image_path, &image_size);
+    if (image == NULL || get_resolution(&image_height, &image_width, image, image_size) != ERR_NONE) {
+        fprintf(stderr, "Cannot load image %s\n", image_path);
+        free(image);
+        return EXIT_FAILURE;
+    }
+
+    for (unsigned long slots = min_slots; slots <= max_slots; slots *= 10) {
+        bench_volume(dir, (uint32_t) slots);
+    }
+
+    free(image);
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
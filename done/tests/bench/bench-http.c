@@ -0,0 +1,243 @@
+/**
+ * @file bench-http.c
+ * @brief Benchmark of the HTTP parser.
+ *
+ * Replays the recorded messages of the test data (DATA_DIR/http_*.bin),
+ * a generated corpus of requests (typical GETs, inserts of several body
+ * sizes, many headers, long URIs, partial and malformed messages) and any
+ * file given on the command line (e.g. a fuzzing corpus). Each message
+ * goes through parse_entry(), the entry point the fuzz target also uses.
+ *
+ * The parser is too fast to time one call, so each sample is a batch of
+ * calls and is reported in ns per request. The parser prints diagnostics
+ * on stderr for some inputs; stderr is sent to /dev/null while timing.
+ */
+
+#include <getopt.h>
+#include <glob.h>
+
+#include "bench.h"
+#include "parse-entry.h"
+
+#define MAX_MESSAGES 256
+#define NAME_MAX_LEN 64
+#define BATCH_NS 200000ULL // target duration of one sample
+#define DEFAULT_SAMPLES 200
+
+struct message {
+    char name[NAME_MAX_LEN];
+    char* data; // NUL-terminated
+    size_t size;
+};
+
+static struct message corpus[MAX_MESSAGES];
+static size_t nb_messages = 0;
+
+/**
+ * @brief Adds a copy of data to the corpus.
+ */
+static void add_message(const char* name, const char* data, size_t size)
+{
+    if (nb_messages >= MAX_MESSAGES) return;
+    char* const copy = malloc(size + 1);
+    if (copy == NULL) return;
+    memcpy(copy, data, size);
+    copy[size] = '\0';
+
+    struct message* const m = &corpus[nb_messages++];
+    snprintf(m->name, sizeof(m->name), "%s", name);
+    m->data = copy;
+    m->size = size;
+}
+
+static void add_file(const char* path)
+{
+    size_t size = 0;
+    char* const data = bench_read_file(path, &size);
+    if (data == NULL) {
+        fprintf(stderr, "cannot read %s\n", path);
+        return;
+    }
+    const char* const base = strrchr(path, '/');
+    add_message(base != NULL ? base + 1 : path, data, size);
+    free(data);
+}
+
+static void add_recorded(void)
+{
+    glob_t g;
+    if (glob(DATA_DIR "http_*.bin", 0, NULL, &g) != 0) {
+        fprintf(stderr, "no recorded message in " DATA_DIR "\n");
+        return;
+    }
+    for (size_t i = 0; i < g.gl_pathc; ++i) add_file(g.gl_pathv[i]);
+    globfree(&g);
+}
+
+#define BROWSER_HEADERS \
+    "Host: localhost:8000\r\n" \
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n" \
+    "Accept: image/avif,image/webp,*/*\r\n" \
+    "Accept-Language: en-US,en;q=0.5\r\n" \
+    "Accept-Encoding: gzip, deflate, br\r\n" \
+    "Connection: keep-alive\r\n" \
+    "Referer: http://localhost:8000/index.html\r\n" \
+    "Sec-Fetch-Dest: image\r\n" \
+    "Sec-Fetch-Mode: no-cors\r\n" \
+    "Sec-Fetch-Site: same-origin\r\n"
+
+static void add_insert(const char* name, size_t body_size)
+{
+    char header[256];
+    const int len = snprintf(header, sizeof(header),
+                             "POST /imgfs/insert?name=pic%zu.jpg HTTP/1.1\r\n"
+                             "Host: localhost:8000\r\n"
+                             "Content-Type: application/octet-stream\r\n"
+                             "Content-Length: %zu\r\n\r\n", body_size, body_size);
+    if (len < 0) return;
+    char* const buf = malloc((size_t) len + body_size);
+    if (buf == NULL) return;
+    memcpy(buf, header, (size_t) len);
+    // JPEG-like body, without NUL bytes so that string functions do not stop early
+    for (size_t i = 0; i < body_size; ++i) buf[(size_t) len + i] = (char) (1 + (i * 131) % 255);
+    add_message(name, buf, (size_t) len + body_size);
+    free(buf);
+}
+
+static void add_generated(void)
+{
+    static const char* const simple[][2] = {
+        { "gen_list_curl", "GET /imgfs/list HTTP/1.1\r\nHost: localhost:8000\r\n"
+          "User-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n" },
+        { "gen_read_curl", "GET /imgfs/read?res=small&img_id=pic1 HTTP/1.1\r\nHost: localhost:8000\r\n"
+          "User-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n" },
+        { "gen_read_browser", "GET /imgfs/read?res=thumb&img_id=papillon HTTP/1.1\r\n"
+          BROWSER_HEADERS "\r\n" },
+        { "gen_delete", "GET /imgfs/delete?img_id=pic2 HTTP/1.1\r\nHost: localhost:8000\r\n\r\n" },
+        { "gen_index", "GET / HTTP/1.1\r\n" BROWSER_HEADERS "\r\n" },
+        { "gen_partial_headers", "GET /imgfs/read?res=orig&img_id=pic1 HTTP/1.1\r\n"
+          "Host: localhost:8000\r\nUser-Agent: curl/8.5.0\r\nAcc" },
+        { "gen_bare_lf", "GET /imgfs/list HTTP/1.1\nHost: localhost:8000\n\n" },
+        { "gen_no_space", "GET/imgfs/listHTTP/1.1\r\n\r\n" },
+        { "gen_garbage", "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03 TLS hello on the HTTP port" },
+    };
+    for (size_t i = 0; i < sizeof(simple) / sizeof(simple[0]); ++i) {
+        add_message(simple[i][0], simple[i][1], strlen(simple[i][1]));
+    }
+
+    add_insert("gen_insert_1k", 1024);
+    add_insert("gen_insert_64k", 64 * 1024);
+    add_insert("gen_insert_1m", 1024 * 1024);
+
+    char buf[8192];
+    size_t len = 0;
+
+    // as many headers as the parser keeps
+    len = (size_t) snprintf(buf, sizeof(buf), "GET /imgfs/list HTTP/1.1\r\n");
+    for (int i = 0; i < MAX_HEADERS - 1 && len < sizeof(buf); ++i) {
+        len += (size_t) snprintf(buf + len, sizeof(buf) - len, "X-Header-%02d: value %d\r\n", i, i);
+    }
+    len += (size_t) snprintf(buf + len, sizeof(buf) - len, "\r\n");
+    add_message("gen_max_headers", buf, len);
+
+    // 4 KiB of query string
+    len = (size_t) snprintf(buf, sizeof(buf), "GET /imgfs/read?res=orig");
+    while (len < 4096) len += (size_t) snprintf(buf + len, sizeof(buf) - len, "&pad=0123456789");
+    len += (size_t) snprintf(buf + len, sizeof(buf) - len,
+                             "&img_id=pic1 HTTP/1.1\r\nHost: localhost:8000\r\n\r\n");
+    add_message("gen_long_uri", buf, len);
+}
+
+/**
+ * @brief Number of calls of parse_entry() on m that take about BATCH_NS.
+ */
+static size_t batch_size(const struct message* m)
+{
+    size_t n = 0;
+    const uint64_t start = bench_now_ns();
+    do {
+        (void) parse_entry(m->data, m->size);
+        ++n;
+    } while (bench_now_ns() - start < BATCH_NS);
+    return n;
+}
+
+static void bench_message(const struct message* m, uint64_t* samples, size_t nb_samples)
+{
+    const size_t batch = batch_size(m);
+    int ret = 0;
+    for (size_t s = 0; s < nb_samples; ++s) {
+        const uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < batch; ++i) ret = parse_entry(m->data, m->size);
+        samples[s] = (bench_now_ns() - start) / batch;
+    }
+
+    char params[128];
+    snprintf(params, sizeof(params), "\"bytes\":%zu,\"result\":%d,\"batch\":%zu", m->size, ret, batch);
+    bench_report("http_parse", m->name, params, samples, nb_samples);
+}
+
+/**
+ * @brief Replays the whole corpus in turn; a sample is the mean over one pass.
+ */
+static void bench_replay(uint64_t* samples, size_t nb_samples)
+{
+    size_t total_bytes = 0;
+    for (size_t i = 0; i < nb_messages; ++i) total_bytes += corpus[i].size;
+
+    for (size_t s = 0; s < nb_samples; ++s) {
+        const uint64_t start = bench_now_ns();
+        for (size_t i = 0; i < nb_messages; ++i) (void) parse_entry(corpus[i].data, corpus[i].size);
+        samples[s] = (bench_now_ns() - start) / nb_messages;
+    }
+
+    char params[128];
+    snprintf(params, sizeof(params), "\"messages\":%zu,\"bytes\":%zu", nb_messages, total_bytes);
+    bench_report("http_parse", "replay_all", params, samples, nb_samples);
+}
+
+int main(int argc, char* argv[])
+{
+    size_t nb_samples = DEFAULT_SAMPLES;
+    int no_generated = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:f")) != -1) {
+        switch (c) {
+        case 'n': nb_samples = strtoul(optarg, NULL, 10); break;
+        case 'f': no_generated = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-n samples] [-f] [message files...]\n"
+                    "  -f: only the given files (no recorded nor generated messages)\n", argv[0]);
+            return 1;
+        }
+    }
+    if (nb_samples == 0) nb_samples = 1;
+
+    if (!no_generated) {
+        add_recorded();
+        add_generated();
+    }
+    for (int i = optind; i < argc; ++i) add_file(argv[i]);
+    if (nb_messages == 0) {
+        fprintf(stderr, "no message to parse\n");
+        return 1;
+    }
+
+    uint64_t* const samples = calloc(nb_samples, sizeof(uint64_t));
+    if (samples == NULL) return 1;
+
+    for (size_t i = 0; i < nb_messages; ++i) {
+        fprintf(stderr, "parsing %s (%zu bytes)\n", corpus[i].name, corpus[i].size);
+        const int saved = bench_silence(STDERR_FILENO);
+        bench_message(&corpus[i], samples, nb_samples);
+        bench_restore(STDERR_FILENO, saved);
+    }
+    const int saved = bench_silence(STDERR_FILENO);
+    bench_replay(samples, nb_samples);
+    bench_restore(STDERR_FILENO, saved);
+
+    free(samples);
+    for (size_t i = 0; i < nb_messages; ++i) free(corpus[i].data);
+    return 0;
+}
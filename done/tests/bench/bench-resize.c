@@ -0,0 +1,305 @@
+/**
+ * @file bench-resize.c
+ * @brief Benchmark of the resize pipeline (lazily_resize) against the size
+ *        of the original image.
+ *
+ * JPEGs of 0.3 MP up to 50 MP (4:3) are generated from a source image,
+ * upscaled and with noise added so that they compress like photographs,
+ * and saved at each of the given input qualities. Each one is inserted in
+ * a fresh volume, then each derivative of the volume's resized_res is
+ * created again and again by lazily_resize(): read of the original,
+ * decoding, resizing, encoding and write of the derivative.
+ *
+ * Per (size, quality, resolution), the wall times are reported as usual,
+ * with the mean CPU time of the process (all vips threads included), the
+ * peak RSS during the resizes (and its growth over the RSS before them),
+ * and the size of the derivative.
+ *
+ * The vips operation cache is disabled so that no iteration reuses the
+ * work of a previous one.
+ *
+ * With -x, the resizes go through the resize sandbox (resize_sandbox.h),
+ * with one helper started from the given executable: the wall times then
+ * include the hand-off, while the CPU time and the RSS are only those of
+ * the benchmark, not of the helper.
+ */
+
+#include <getopt.h>
+#include <limits.h> // PATH_MAX
+#include <math.h>
+#include <sys/resource.h>
+#include <vips/vips.h>
+
+#include "bench.h"
+#include "imgfs.h"
+#include "image_content.h"
+#include "resize_sandbox.h"
+
+#define MAX_SIZES 16
+#define MAX_QUALITIES 8
+#define NOISE_SIGMA 12.0
+#define SANDBOX_MEMORY (1024ULL * 1024 * 1024) // enough for 50 MP
+#define SANDBOX_TIMEOUT_MS 60000
+
+static const char* const res_names[NB_RES] = { "thumb", "small", "orig" };
+
+static uint64_t cpu_now_ns(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL
+           + (uint64_t) (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+}
+
+/**
+ * @brief Reads a "Vm...:" field of /proc/self/status, in KiB (0 if unavailable).
+ */
+static unsigned long proc_status_kb(const char* field)
+{
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL) return 0;
+    char line[128];
+    unsigned long kb = 0;
+    const size_t len = strlen(field);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0) {
+            kb = strtoul(line + len, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/**
+ * @brief Resets the peak RSS of the process (Linux 4.0+); returns 0 on success.
+ */
+static int reset_peak_rss(void)
+{
+    FILE* f = fopen("/proc/self/clear_refs", "w");
+    if (f == NULL) return -1;
+    const int ret = fputs("5", f) < 0 ? -1 : 0;
+    return fclose(f) != 0 ? -1 : ret;
+}
+
+static unsigned long peak_rss_kb(int reset_ok)
+{
+    if (reset_ok) return proc_status_kb("VmHWM:");
+    // lifetime peak only
+    struct rusage usage;
+    return getrusage(RUSAGE_SELF, &usage) == 0 ? (unsigned long) usage.ru_maxrss : 0;
+}
+
+/**
+ * @brief Generates a JPEG of about mp megapixels (4:3) from the source image.
+ *
+ * @return ERR_NONE or ERR_IMGLIB; on success, *jpeg (to be freed with g_free) and *size.
+ */
+static int generate(VipsImage* source, double mp, int quality, void** jpeg, size_t* size,
+                    int* width, int* height)
+{
+    *width = (int) lround(sqrt(mp * 1e6 * 4.0 / 3.0));
+    *height = (int) lround(*width * 3.0 / 4.0);
+
+    VipsImage* resized = NULL;
+    VipsImage* noise = NULL;
+    VipsImage* sum = NULL;
+    VipsImage* out = NULL;
+    int err = ERR_IMGLIB;
+    if (vips_resize(source, &resized, (double) *width / vips_image_get_width(source),
+                    "vscale", (double) *height / vips_image_get_height(source), NULL) == 0
+        && vips_gaussnoise(&noise, vips_image_get_width(resized), vips_image_get_height(resized),
+                           "sigma", NOISE_SIGMA, NULL) == 0
+        && vips_add(resized, noise, &sum, NULL) == 0
+        && vips_cast_uchar(sum, &out, NULL) == 0
+        && vips_jpegsave_buffer(out, jpeg, size, "Q", quality, NULL) == 0) {
+        *width = vips_image_get_width(out);
+        *height = vips_image_get_height(out);
+        err = ERR_NONE;
+    }
+    if (out != NULL) g_object_unref(out);
+    if (sum != NULL) g_object_unref(sum);
+    if (noise != NULL) g_object_unref(noise);
+    if (resized != NULL) g_object_unref(resized);
+    return err;
+}
+
+/**
+ * @brief Creates a volume holding only the given image.
+ */
+static int create_volume(const char* path, const uint16_t* resized_res, const char* jpeg,
+                         size_t size, struct imgfs_file* f)
+{
+    memset(f, 0, sizeof(*f));
+    f->header.max_files = 1;
+    memcpy(f->header.resized_res, resized_res, sizeof(f->header.resized_res));
+    const int saved = bench_silence_stdout(); // do_create() prints what it wrote
+    int err = do_create(path, f);
+    bench_restore_stdout(saved);
+    if (err != ERR_NONE) return err;
+    do_close(f);
+
+    err = do_open(path, "rb+", f);
+    if (err != ERR_NONE) return err;
+    err = do_insert(jpeg, size, "bench", f);
+    if (err != ERR_NONE) do_close(f);
+    return err;
+}
+
+static void bench_resolution(struct imgfs_file* f, int res, const char* params, size_t n)
+{
+    uint64_t* t = calloc(n, sizeof(uint64_t));
+    if (t == NULL) return;
+
+    const unsigned long rss_before = proc_status_kb("VmRSS:");
+    const int reset_ok = reset_peak_rss() == 0;
+    uint64_t cpu = 0;
+    uint32_t out_size = 0;
+    size_t done = 0;
+    for (size_t i = 0; i < n; ++i) {
+        // forget the previous derivative (its bytes stay in the file, unreferenced)
+        f->metadata[0].size[res] = 0;
+        f->metadata[0].offset[res] = 0;
+
+        const uint64_t c0 = cpu_now_ns();
+        const uint64_t t0 = bench_now_ns();
+        const int err = lazily_resize(res, f, 0);
+        t[done] = bench_now_ns() - t0;
+        if (err != ERR_NONE) {
+            fprintf(stderr, "lazily_resize(%s): %s\n", res_names[res], ERR_MSG(err));
+            continue;
+        }
+        cpu += cpu_now_ns() - c0;
+        out_size = f->metadata[0].size[res];
+        ++done;
+    }
+    const unsigned long peak = peak_rss_kb(reset_ok);
+
+    if (done > 0) {
+        char all[512];
+        snprintf(all, sizeof(all), "%s,\"max_width\":%u,\"max_height\":%u,\"cpu_ns\":%llu,"
+                 "\"peak_rss_kb\":%lu,\"rss_growth_kb\":%lu,\"output_bytes\":%u,\"sandbox\":%d",
+                 params, f->header.resized_res[2 * res], f->header.resized_res[2 * res + 1],
+                 (unsigned long long) (cpu / done), peak, peak > rss_before ? peak - rss_before : 0,
+                 out_size, resize_sandbox_enabled());
+        bench_report("lazily_resize", res_names[res], all, t, done);
+    }
+    free(t);
+}
+
+static void bench_size(VipsImage* source, const char* dir, double mp, int quality,
+                       const uint16_t* resized_res, size_t n)
+{
+    void* jpeg = NULL;
+    size_t size = 0;
+    int width = 0;
+    int height = 0;
+    fprintf(stderr, "%.1f MP, Q%d: generating\n", mp, quality);
+    if (generate(source, mp, quality, &jpeg, &size, &width, &height) != ERR_NONE) {
+        fprintf(stderr, "Cannot generate the image: %s\n", vips_error_buffer());
+        vips_error_clear();
+        return;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/bench-resize-%d.imgfs", dir, (int) getpid());
+    struct imgfs_file f;
+    const int err = create_volume(path, resized_res, jpeg, size, &f);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "Cannot create %s: %s\n", path, ERR_MSG(err));
+    } else {
+        char params[160];
+        snprintf(params, sizeof(params), "\"mp\":%.1f,\"input_width\":%d,\"input_height\":%d,"
+                 "\"input_quality\":%d,\"input_bytes\":%zu", mp, width, height, quality, size);
+        for (int res = THUMB_RES; res < ORIG_RES; ++res) {
+            bench_resolution(&f, res, params, n);
+        }
+        do_close(&f);
+    }
+    remove(path);
+    g_free(jpeg);
+}
+
+/**
+ * @brief Parses a comma-separated list of numbers; returns how many were read.
+ */
+static size_t parse_list(const char* arg, double* values, size_t max)
+{
+    size_t n = 0;
+    char* end = NULL;
+    while (n < max && *arg != '\0') {
+        values[n] = strtod(arg, &end);
+        if (end == arg || values[n] <= 0) return 0;
+        ++n;
+        arg = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* dir = "/tmp";
+    const char* image_path = DATA_DIR "papillon.jpg";
+    double sizes[MAX_SIZES] = { 0.3, 1, 3, 12, 24, 50 };
+    size_t nb_sizes = 6;
+    double qualities[MAX_QUALITIES] = { 75, 95 };
+    size_t nb_qualities = 2;
+    uint16_t resized_res[2 * (NB_RES - 1)] = { 64, 64, 256, 256 };
+    size_t n = 5;
+    const char* helper = NULL;
+
+    int c;
+    while ((c = getopt(argc, argv, "d:i:m:q:t:s:n:x:")) != -1) {
+        switch (c) {
+        case 'd': dir = optarg; break;
+        case 'i': image_path = optarg; break;
+        case 'm': nb_sizes = parse_list(optarg, sizes, MAX_SIZES); break;
+        case 'q': nb_qualities = parse_list(optarg, qualities, MAX_QUALITIES); break;
+        case 't': resized_res[0] = resized_res[1] = (uint16_t) strtoul(optarg, NULL, 10); break;
+        case 's': resized_res[2] = resized_res[3] = (uint16_t) strtoul(optarg, NULL, 10); break;
+        case 'n': n = strtoul(optarg, NULL, 10); break;
+        case 'x': helper = optarg; break;
+        default:
+            nb_sizes = 0;
+            break;
+        }
+    }
+    if (nb_sizes == 0 || nb_qualities == 0 || n == 0 || resized_res[0] == 0 || resized_res[2] == 0) {
+        fprintf(stderr, "Usage: %s [-d dir] [-i source.jpg] [-m megapixels,...] [-q qualities,...]\n"
+                "       [-t thumb_res] [-s small_res] [-n iterations] [-x imgfs_resizer]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (VIPS_INIT(argv[0]) != 0) return EXIT_FAILURE;
+    vips_cache_set_max(0);
+    if (helper != NULL) {
+        const int err = resize_sandbox_start(1, helper, SANDBOX_MEMORY, SANDBOX_TIMEOUT_MS);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "Cannot start the resize helper %s: %s\n", helper, ERR_MSG(err));
+            vips_shutdown();
+            return EXIT_FAILURE;
+        }
+    }
+
+    size_t source_size = 0;
+    char* const source_jpeg = bench_read_file(image_path, &source_size);
+    VipsImage* source = NULL;
+    if (source_jpeg == NULL || vips_jpegload_buffer(source_jpeg, source_size, &source, NULL) != 0) {
+        fprintf(stderr, "Cannot load image %s\n", image_path);
+        free(source_jpeg);
+        vips_shutdown();
+        return EXIT_FAILURE;
+    }
+
+    for (size_t s = 0; s < nb_sizes; ++s) {
+        for (size_t q = 0; q < nb_qualities; ++q) {
+            bench_size(source, dir, sizes[s], (int) qualities[q], resized_res, n);
+        }
+    }
+
+    g_object_unref(source);
+    free(source_jpeg);
+    resize_sandbox_stop();
+    vips_shutdown();
+    return EXIT_SUCCESS;
+}
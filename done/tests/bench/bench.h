@@ -0,0 +1,113 @@
+#pragma once
+
+/**
+ * @file bench.h
+ * @brief Utilities for the benchmarks: timing and result output.
+ *
+ * Every measurement is printed on stdout as one JSON object per line:
+ *   {"bench":"do_read","variant":"thumb_hit","slots":1000,...,
+ *    "iterations":100,"mean_ns":..,"median_ns":..,"p90_ns":..,"min_ns":..,"max_ns":..}
+ * Progress and diagnostics go to stderr.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static inline int bench_cmp_u64(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Prints the statistics of n samples (sorted in place).
+ *
+ * @param params Extra JSON members describing the run, e.g. "\"slots\":1000"; may be empty.
+ */
+static inline void bench_report(const char* bench, const char* variant, const char* params,
+                                uint64_t* samples, size_t n)
+{
+    if (n == 0) return;
+    qsort(samples, n, sizeof(uint64_t), bench_cmp_u64);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i) sum += samples[i];
+    printf("{\"bench\":\"%s\",\"variant\":\"%s\",%s%s\"iterations\":%zu,\"mean_ns\":%llu,"
+           "\"median_ns\":%llu,\"p90_ns\":%llu,\"min_ns\":%llu,\"max_ns\":%llu}\n",
+           bench, variant, params, params[0] != '\0' ? "," : "", n,
+           (unsigned long long) (sum / n), (unsigned long long) samples[n / 2],
+           (unsigned long long) samples[n * 9 / 10], (unsigned long long) samples[0],
+           (unsigned long long) samples[n - 1]);
+    fflush(stdout);
+}
+
+/**
+ * @brief Redirects fd (stdout or stderr) to /dev/null, for functions that
+ *        print; returns the saved descriptor.
+ */
+static inline int bench_silence(int fd)
+{
+    fflush(fd == STDERR_FILENO ? stderr : stdout);
+    const int saved = dup(fd);
+    const int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, fd);
+        close(null);
+    }
+    return saved;
+}
+
+static inline void bench_restore(int fd, int saved)
+{
+    if (saved < 0) return;
+    fflush(fd == STDERR_FILENO ? stderr : stdout);
+    dup2(saved, fd);
+    close(saved);
+}
+
+static inline int bench_silence_stdout(void)
+{
+    return bench_silence(STDOUT_FILENO);
+}
+
+static inline void bench_restore_stdout(int saved)
+{
+    bench_restore(STDOUT_FILENO, saved);
+}
+
+/**
+ * @brief Reads a whole file in a dynamically allocated buffer.
+ *
+ * @return The buffer (to be freed), NULL on error.
+ */
+static inline char* bench_read_file(const char* path, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) return NULL;
+    char* buf = NULL;
+    if (fseek(f, 0, SEEK_END) == 0) {
+        const long len = ftell(f);
+        if (len > 0 && fseek(f, 0, SEEK_SET) == 0 && (buf = malloc((size_t) len)) != NULL) {
+            if (fread(buf, (size_t) len, 1, f) == 1) {
+                *size = (size_t) len;
+            } else {
+                free(buf);
+                buf = NULL;
+            }
+        }
+    }
+    fclose(f);
+    return buf;
+}
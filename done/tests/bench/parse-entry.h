@@ -0,0 +1,54 @@
+#pragma once
+
+/**
+ * @file parse-entry.h
+ * @brief Parsing of one raw request the way the server does it, shared by
+ *        the HTTP parser benchmark and the fuzz target.
+ */
+
+#include <stddef.h>
+#include <string.h>
+
+#include "http_prot.h"
+
+#define PARSE_URI_ROOT "/imgfs" // as in imgfs_server_service.c
+#define PARSE_VALUE_MAX 128
+
+/**
+ * @brief Parses a raw message like serve_connection() and the router do:
+ *        headers first, then the whole message once Content-Length is known,
+ *        then URI matching and query-string extraction.
+ *
+ * @param buf the message, which must be followed by a NUL byte (buf[size] == '\0')
+ * @param size the number of bytes of the message
+ * @return the result of the last http_parse_message() call
+ */
+static inline int parse_entry(const char* buf, size_t size)
+{
+    struct http_message msg;
+    int content_len = 0;
+
+    size_t header_size = size;
+    const char* const header_end = strstr(buf, HTTP_HDR_END_DELIM);
+    if (header_end != NULL) {
+        header_size = (size_t) (header_end - buf) + strlen(HTTP_HDR_END_DELIM);
+    }
+
+    int ret = http_parse_message(buf, header_size, &msg, &content_len);
+    if (ret == 0 && content_len > 0 && header_size + (size_t) content_len <= size) {
+        ret = http_parse_message(buf, header_size + (size_t) content_len, &msg, &content_len);
+    }
+    if (ret <= 0) return ret;
+
+    char value[PARSE_VALUE_MAX];
+    if (http_match_uri(&msg, PARSE_URI_ROOT "/read") || http_match_uri(&msg, PARSE_URI_ROOT "/delete")) {
+        (void) http_get_var(&msg.uri, "res", value, sizeof(value));
+        (void) http_get_var(&msg.uri, "img_id", value, sizeof(value));
+    } else if (http_match_uri(&msg, PARSE_URI_ROOT "/insert")) {
+        (void) http_match_verb(&msg.method, "POST");
+        (void) http_get_var(&msg.uri, "name", value, sizeof(value));
+    } else {
+        (void) http_match_uri(&msg, PARSE_URI_ROOT "/list");
+    }
+    return ret;
+}
@@ -0,0 +1,164 @@
+# Binary protocol scenarios: an imgfs_server also serving the compact
+# binary protocol on a port of its own (IMGFS_BINARY_PORT).
+#
+# Each scenario starts its own server, on a copy of a data file, and
+# stops it at the end.
+
+import json
+import socket
+import struct
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import IMAGES, copy_dump, http_request, read_image, start_server, stop_server
+
+
+OP_LIST, OP_READ, OP_INSERT, OP_DELETE = 1, 2, 3, 4
+THUMB_RES, SMALL_RES, ORIG_RES = 0, 1, 2
+RESOLUTIONS = {THUMB_RES: "thumb", SMALL_RES: "small", ORIG_RES: "orig"}
+
+
+def frame(request_id, opcode, img_id=b"", resolution=0, payload=b""):
+    """A request of the binary protocol."""
+    body = struct.pack("!IBBBB", request_id, opcode, resolution, len(img_id), 0) + img_id + payload
+    return struct.pack("!I", len(body)) + body
+
+
+def recv_exactly(sock, size):
+    data = b""
+    while len(data) < size:
+        chunk = sock.recv(size - len(data))
+        if not chunk:
+            raise ConnectionError("connection closed")
+        data += chunk
+    return data
+
+
+def read_response(sock):
+    """(request id, status, bytes) of the next response."""
+    length, request_id, status, size = struct.unpack("!IIiI", recv_exactly(sock, 16))
+    if length != 12 + size:
+        raise ValueError(f"length {length} for a size of {size}")
+    return request_id, status, recv_exactly(sock, size)
+
+
+class BinaryProtocol:
+    """
+    Binary protocol scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+
+    def _connect(self, binary_port):
+        return socket.create_connection((self.host, int(binary_port)), timeout=30)
+
+    def _call(self, binary_port, *args, **kwargs):
+        with self._connect(binary_port) as s:
+            s.sendall(frame(1, *args, **kwargs))
+            request_id, status, data = read_response(s)
+        self.builtin.should_be_equal_as_integers(request_id, 1)
+        return status, data
+
+    def _start(self, source, port, binary_port):
+        def ready(process):
+            http_request(self.host, port, "GET", "/imgfs/list")
+            self._call(binary_port, OP_LIST)
+
+        self.dump = copy_dump(self.data_dir, source, f"dump_binary_{port}.imgfs")
+        self.process = start_server(self.server_executable, self.dump, port,
+                                    env={"IMGFS_BINARY_PORT": str(binary_port)}, ready=ready, host=self.host)
+
+    def _stop(self):
+        if self.process is not None:
+            process, self.process = self.process, None
+            stop_server(process, [self.dump])
+
+    def binary_protocol_serves_like_http(self, port, binary_port):
+        """
+        Inserts, reads, lists and deletes images with the binary protocol:
+        the images and the list must be those served over HTTP, and each
+        error its own code.
+        """
+        try:
+            self._start("test02", port, binary_port)
+            for i, name in enumerate(IMAGES[:3]):
+                status, _ = self._call(binary_port, OP_INSERT, f"bin{i}".encode(), payload=read_image(self.data_dir, name))
+                self.builtin.should_be_equal_as_integers(status, 0)
+
+            for i in range(3):
+                for res, res_name in RESOLUTIONS.items():
+                    status, data = self._call(binary_port, OP_READ, f"bin{i}".encode(), res)
+                    self.builtin.should_be_equal_as_integers(status, 0)
+                    http_status, http_data = http_request(self.host, port, "GET", f"/imgfs/read?res={res_name}&img_id=bin{i}")
+                    self.builtin.should_be_equal_as_integers(http_status, 200)
+                    if data != http_data:
+                        self.builtin.fail(f"bin{i} {res_name}: the binary read differs")
+
+            status, data = self._call(binary_port, OP_LIST)
+            self.builtin.should_be_equal_as_integers(status, 0)
+            self.builtin.should_be_equal(json.loads(data), json.loads(http_request(self.host, port, "GET", "/imgfs/list")[1]))
+
+            status, _ = self._call(binary_port, OP_DELETE, b"bin0")
+            self.builtin.should_be_equal_as_integers(status, 0)
+            self.builtin.should_be_equal_as_integers(http_request(self.host, port, "GET", "/imgfs/read?res=orig&img_id=bin0")[0], 500)
+            status, data = self._call(binary_port, OP_READ, b"bin0", ORIG_RES)
+            if status >= 0 or data != b"":
+                self.builtin.fail(f"read of a deleted image: status {status}")
+            # an unknown opcode and an unknown resolution: other errors
+            status_invalid, _ = self._call(binary_port, 99)
+            status_resolution, _ = self._call(binary_port, OP_READ, b"bin1", 7)
+            if len({status, status_invalid, status_resolution}) != 3 or status_invalid >= 0:
+                self.builtin.fail(f"errors {status}, {status_invalid}, {status_resolution}")
+        finally:
+            self._stop()
+
+    def binary_protocol_multiplexes_requests(self, port, binary_port):
+        """
+        Sends many requests on one connection without waiting, then a frame
+        too long: every request is answered once, matched by its id, and the
+        connection is closed after the last one.
+        """
+        try:
+            self._start("test02", port, binary_port)
+            for i, name in enumerate(IMAGES):
+                self._call(binary_port, OP_INSERT, f"mux{i}".encode(), payload=read_image(self.data_dir, name))
+            expected = {}
+            requests = b""
+            for request_id in range(1, 101):
+                i = request_id % len(IMAGES)
+                res = request_id % 2  # thumbnails and small images
+                expected[request_id] = http_request(self.host, port, "GET", f"/imgfs/read?res={RESOLUTIONS[res]}&img_id=mux{i}")[1]
+                requests += frame(request_id, OP_READ, f"mux{i}".encode(), res)
+            expected[101] = None  # not found
+            requests += frame(101, OP_READ, b"nope", THUMB_RES)
+
+            with self._connect(binary_port) as s:
+                s.sendall(requests)
+                s.sendall(struct.pack("!I", 0xFFFFFFFF))
+                answered = {}
+                for _ in expected:
+                    request_id, status, data = read_response(s)
+                    if request_id in answered:
+                        self.builtin.fail(f"request {request_id} answered twice")
+                    answered[request_id] = (status, data)
+                if s.recv(1) != b"":
+                    self.builtin.fail("the connection was not closed after the frame too long")
+
+            for request_id, data in expected.items():
+                status, got = answered[request_id]
+                if data is None:
+                    if status >= 0:
+                        self.builtin.fail(f"request {request_id}: status {status}")
+                elif status != 0 or got != data:
+                    self.builtin.fail(f"request {request_id}: status {status}, {len(got)} bytes")
+        finally:
+            self._stop()
@@ -0,0 +1,91 @@
+# Format negotiation scenarios: an imgfs_server serving resized images in
+# the format the Accept header of a read prefers, among those enabled
+# (IMGFS_FORMATS).
+#
+# Each scenario starts its own server, on a copy of a data file, and
+# stops it at the end.
+
+import http.client
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import copy_dump, start_server, stop_server
+
+
+class Formats:
+    """
+    Format negotiation scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+
+    def _read(self, port, res, accept=None):
+        """(Content-Type, Vary, image) of a read of pic1, with this Accept header if any."""
+        conn = http.client.HTTPConnection(self.host, int(port), timeout=30)
+        try:
+            conn.request("GET", f"/imgfs/read?res={res}&img_id=pic1",
+                         headers={} if accept is None else {"Accept": accept})
+            resp = conn.getresponse()
+            data = resp.read()
+            self.builtin.should_be_equal_as_integers(resp.status, 200)
+            return resp.getheader("Content-Type"), resp.getheader("Vary"), data
+        finally:
+            conn.close()
+
+    def _start(self, port, formats=None):
+        self.dump = copy_dump(self.data_dir, "test02", f"dump_formats_{port}.imgfs")
+        env = {} if formats is None else {"IMGFS_FORMATS": formats}
+        self.process = start_server(self.server_executable, self.dump, port, env=env, host=self.host)
+
+    def _stop(self):
+        if self.process is not None:
+            process, self.process = self.process, None
+            stop_server(process, [self.dump])
+
+    def formats_follow_the_accept_header(self, port):
+        """
+        With WebP enabled, a small image is served as WebP to a client
+        accepting it, and as JPEG to one accepting anything (*/*), sending
+        no Accept header, or refusing WebP (q=0); each with "Vary: Accept".
+        Originals are served as stored, without Vary.
+        """
+        try:
+            self._start(port, "webp")
+            content_type, vary, webp = self._read(port, "small", "image/webp")
+            self.builtin.should_be_equal(content_type, "image/webp")
+            self.builtin.should_be_equal(vary, "Accept")
+
+            for accept in ("*/*", None, "image/webp;q=0, image/jpeg", "text/html"):
+                content_type, vary, jpeg = self._read(port, "small", accept)
+                self.builtin.should_be_equal(content_type, "image/jpeg", f"Accept: {accept}")
+                self.builtin.should_be_equal(vary, "Accept", f"Accept: {accept}")
+                if jpeg == webp:
+                    self.builtin.fail(f"Accept: {accept}: the WebP image served as JPEG")
+
+            content_type, vary, _ = self._read(port, "orig", "image/webp")
+            self.builtin.should_be_equal(content_type, "image/jpeg")
+            self.builtin.should_be_equal(vary, None)
+        finally:
+            self._stop()
+
+    def formats_are_jpeg_only_by_default(self, port):
+        """
+        Without IMGFS_FORMATS, a client accepting WebP is served JPEG,
+        without Vary.
+        """
+        try:
+            self._start(port)
+            content_type, vary, _ = self._read(port, "small", "image/webp")
+            self.builtin.should_be_equal(content_type, "image/jpeg")
+            self.builtin.should_be_equal(vary, None)
+        finally:
+            self._stop()
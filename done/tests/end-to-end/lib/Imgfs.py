@@ -1,9 +1,12 @@
 # Author: Aurélien (2021)
 # Modified by Ludovic Mermod
 
+import http.client
 import os
 import re
 import shlex
+import shutil
+import subprocess
 import time
 
 from robot.libraries.Process import Process
@@ -23,6 +26,83 @@ def log_crash_if_any(res):
         raise Exception("A crash occurred. Here is the output:\n{}".format(res.stdout))
 
 
+IMAGES = ["brouillard.jpg", "coquelicots.jpg", "foret.jpg", "mure.jpg", "papillon.jpg"]
+""" The images of the data directory inserted by the scenarios. """
+
+START_TIMEOUT = 10
+
+
+def read_image(data_dir, name):
+    with open(os.path.join(data_dir, name), "rb") as f:
+        return f.read()
+
+
+def http_exchange(conn, method, path, body=None, header=None):
+    """
+    (status, response) of one request on conn, closed after.
+
+    :param header  If given, the value of this header of the response is returned between them
+    """
+    try:
+        conn.request(method, path, body=body)
+        resp = conn.getresponse()
+        if header is not None:
+            return resp.status, resp.getheader(header), resp.read()
+        return resp.status, resp.read()
+    finally:
+        conn.close()
+
+
+def http_request(host, port, method, path, body=None, header=None):
+    return http_exchange(http.client.HTTPConnection(host, int(port), timeout=30), method, path, body, header)
+
+
+def copy_dump(data_dir, name, dump):
+    """Copies the data file name (without .imgfs) to dump, in data_dir, and returns its path."""
+    dst = os.path.normpath(os.path.join(data_dir, dump))
+    shutil.copyfile(os.path.normpath(os.path.join(data_dir, name + ".imgfs")), dst)
+    return dst
+
+
+def start_server(executable, dump, port, *args, env=None, ready=None, host="localhost"):
+    """
+    Starts a server on dump, in the background, and waits until it is ready.
+
+    :param env    Variables added to the environment of the server
+
+    :param ready  Called with the process until it raises no OSError; by default, lists the images
+    """
+    process = subprocess.Popen([executable, dump, str(port), *args],
+                               env={**os.environ, **(env or {})},
+                               stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if ready is None:
+        ready = lambda process: http_request(host, port, "GET", "/imgfs/list")
+    deadline = time.time() + START_TIMEOUT
+    while time.time() < deadline and process.poll() is None:
+        try:
+            ready(process)
+            return process
+        except OSError:
+            time.sleep(0.05)
+    process.kill()
+    BuiltIn().log(process.communicate(timeout=10)[0].decode(errors="replace"))
+    BuiltIn().fail(f"Timeout while waiting for the server on port {port}")
+
+
+def stop_server(process, files=(), kill=False):
+    """Stops a server started by start_server(), removes files, and fails if it did not exit cleanly."""
+    if kill:
+        process.kill()
+    else:
+        process.terminate()
+    BuiltIn().log(process.communicate(timeout=15)[0].decode(errors="replace"))
+    for path in files:
+        if path is not None and os.path.exists(path):
+            os.remove(path)
+    if not kill and process.returncode != 0:
+        BuiltIn().fail(f"server exited with {process.returncode}")
+
+
 class Imgfs:
     """
     Utils specific to the ckvs project
@@ -114,12 +194,8 @@ class Imgfs:
         )
 
     def copy_dump_file(self, name):
-        dump = self.imgfs_dump()
-
+        dst = copy_dump(self.data_dir, name, self.imgfs_dump())
         src = os.path.normpath(os.path.join(self.data_dir, name + ".imgfs"))
-        dst = os.path.normpath(os.path.join(self.data_dir, dump))
-
-        self.os.copy_file(src, dst)
         self.logged_commands.append(shlex.join(["cp", src, dst]))
         return dst
 
@@ -174,7 +250,11 @@ class Imgfs:
 
         return res
 
-    def imgfs_start_server(self, file, port):
+    def imgfs_start_server(self, file, port, *args, **env):
+        """
+        Starts the server on a copy of file, with the extra args, its
+        environment extended by env (e.g. IMGFS_WORKERS=2).
+        """
         already_running = False
         try:
             self.telnet.open_connection("localhost", port=port)
@@ -189,10 +269,12 @@ class Imgfs:
         dump = self.copy_dump_file(file)
 
         self.logged_commands.append(
-            shlex.join([f"./{os.path.basename(self.server_executable)}", dump, port])
+            shlex.join([*(f"{name}={value}" for name, value in env.items()),
+                        f"./{os.path.basename(self.server_executable)}", dump, port, *args])
         )
 
-        self.server_process = self.process.start_process(self.server_executable, dump, port)
+        self.server_process = self.process.start_process(self.server_executable, dump, port, *args,
+                                                         env={**os.environ, **env})
 
         timeout = time.time() + 10
         while True:
@@ -0,0 +1,180 @@
+# Intake scenarios: an imgfs_server answering inserts with 202 Accepted once
+# they are in its intake log (IMGFS_INTAKE_LOG), and inserting them in the
+# background.
+#
+# Each scenario starts its own server, on a copy of a data file, and
+# stops it at the end.
+
+import json
+import os
+import socket
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from BinaryProtocol import OP_INSERT, frame, read_response
+from Imgfs import IMAGES, copy_dump, http_request, read_image, start_server, stop_server
+
+
+
+class Intake:
+    """
+    Intake scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    INSERT_TIMEOUT = 30
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+        self.log = None
+
+    def _http(self, port, method, path, body=None):
+        return http_request(self.host, port, method, path, body, header="Location")
+
+    def _status(self, port, img_id):
+        status, _, body = self._http(port, "GET", f"/imgfs/intake?img_id={img_id}")
+        self.builtin.should_be_equal_as_integers(status, 200)
+        return json.loads(body)
+
+    def _wait_settled(self, port, img_id):
+        deadline = time.time() + self.INSERT_TIMEOUT
+        while time.time() < deadline:
+            status = self._status(port, img_id)
+            if status["state"] != "queued":
+                return status
+            time.sleep(0.05)
+        self.builtin.fail(f"{img_id} still queued")
+
+    def _start(self, port, fresh=True, env=None):
+        if fresh:
+            self.dump = copy_dump(self.data_dir, "test02", f"dump_intake_{port}.imgfs")
+            self.log = os.path.join(self.data_dir, f"dump_intake_{port}.log")
+            if os.path.exists(self.log):
+                os.remove(self.log)
+        self.process = start_server(self.server_executable, self.dump, port,
+                                    env={"IMGFS_INTAKE_LOG": self.log, **(env or {})}, host=self.host)
+
+    def _kill(self):
+        process, self.process = self.process, None
+        stop_server(process, kill=True)
+
+    def _stop(self):
+        if self.process is not None:
+            process, self.process = self.process, None
+            stop_server(process, [self.dump, self.log])
+
+    def intake_acknowledges_then_inserts(self, port):
+        """
+        Inserts images in intake mode: each is acknowledged with 202 and the
+        location of its status, becomes readable, and reads back as sent. A
+        duplicate id is refused at once; an image that cannot be inserted is
+        acknowledged, then reported as failed.
+        """
+        try:
+            self._start(port)
+            for i, name in enumerate(IMAGES):
+                status, location, _ = self._http(port, "POST", f"/imgfs/insert?name=in{i}", read_image(self.data_dir, name))
+                self.builtin.should_be_equal_as_integers(status, 202)
+                if not location.endswith(f"/imgfs/intake?img_id=in{i}"):
+                    self.builtin.fail(f"in{i}: location {location}")
+
+            for i, name in enumerate(IMAGES):
+                status = self._wait_settled(port, f"in{i}")
+                self.builtin.should_be_equal(status["state"], "readable")
+                if status["readable_ms"] < status["accepted_ms"]:
+                    self.builtin.fail(f"in{i}: readable before accepted")
+                http_status, _, data = self._http(port, "GET", f"/imgfs/read?res=orig&img_id=in{i}")
+                self.builtin.should_be_equal_as_integers(http_status, 200)
+                if data != read_image(self.data_dir, name):
+                    self.builtin.fail(f"in{i}: the image read differs")
+
+            status, _, _ = self._http(port, "POST", "/imgfs/insert?name=in0", read_image(self.data_dir, IMAGES[0]))
+            self.builtin.should_be_equal_as_integers(status, 500)
+
+            status, _, _ = self._http(port, "POST", "/imgfs/insert?name=garbage", b"not an image")
+            self.builtin.should_be_equal_as_integers(status, 202)
+            status = self._wait_settled(port, "garbage")
+            self.builtin.should_be_equal(status["state"], "failed")
+            if not status.get("error"):
+                self.builtin.fail("no error for an image that failed")
+            self.builtin.should_be_equal(self._status(port, "nope")["state"], "unknown")
+
+            _, _, summary = self._http(port, "GET", "/imgfs/intake")
+            summary = json.loads(summary)
+            self.builtin.should_be_equal_as_integers(summary["queued"], 0)
+            self.builtin.should_be_equal_as_integers(summary["inserted"], len(IMAGES))
+            self.builtin.should_be_equal_as_integers(summary["failed"], 1)
+        finally:
+            self._stop()
+
+    def intake_survives_a_crash(self, port):
+        """
+        Kills the server (SIGKILL) right after a burst of acknowledged
+        inserts: once restarted on the same volume and intake log, every
+        acknowledged image is inserted, once.
+        """
+        try:
+            self._start(port)
+            acknowledged = {f"crash{i}": IMAGES[i % len(IMAGES)] for i in range(30)}
+
+            def insert(img_id):
+                return self._http(port, "POST", f"/imgfs/insert?name={img_id}", read_image(self.data_dir, acknowledged[img_id]))[0]
+
+            # concurrent, so that some are still queued when killed
+            with ThreadPoolExecutor(max_workers=10) as pool:
+                statuses = list(pool.map(insert, acknowledged))
+            self._kill()
+            for status in statuses:
+                self.builtin.should_be_equal_as_integers(status, 202)
+
+            self._start(port, fresh=False)
+            for img_id, name in acknowledged.items():
+                self.builtin.should_be_equal(self._wait_settled(port, img_id)["state"], "readable")
+                http_status, _, data = self._http(port, "GET", f"/imgfs/read?res=orig&img_id={img_id}")
+                self.builtin.should_be_equal_as_integers(http_status, 200)
+                if data != read_image(self.data_dir, name):
+                    self.builtin.fail(f"{img_id}: the image read differs")
+            _, _, listing = self._http(port, "GET", "/imgfs/list")
+            ids = [img["img_id"] if isinstance(img, dict) else img for img in json.loads(listing)["Images"]]
+            for img_id in acknowledged:
+                self.builtin.should_be_equal_as_integers(ids.count(img_id), 1)
+        finally:
+            self._stop()
+
+    def intake_takes_binary_inserts(self, port, binary_port):
+        """
+        Inserts images with the binary protocol in intake mode: each is
+        acknowledged once in the intake log, then inserted in the
+        background like those sent over HTTP; a duplicate id is refused.
+        """
+        def insert(img_id, data):
+            with socket.create_connection((self.host, int(binary_port)), timeout=30) as s:
+                s.sendall(frame(1, OP_INSERT, img_id.encode(), payload=data))
+                return read_response(s)[1]
+
+        try:
+            self._start(port, env={"IMGFS_BINARY_PORT": str(binary_port)})
+            for i, name in enumerate(IMAGES):
+                self.builtin.should_be_equal_as_integers(insert(f"bin{i}", read_image(self.data_dir, name)), 0)
+
+            for i, name in enumerate(IMAGES):
+                self.builtin.should_be_equal(self._wait_settled(port, f"bin{i}")["state"], "readable")
+                http_status, _, data = self._http(port, "GET", f"/imgfs/read?res=orig&img_id=bin{i}")
+                self.builtin.should_be_equal_as_integers(http_status, 200)
+                if data != read_image(self.data_dir, name):
+                    self.builtin.fail(f"bin{i}: the image read differs")
+
+            if insert("bin0", read_image(self.data_dir, IMAGES[0])) >= 0:
+                self.builtin.fail("a duplicate binary insert was accepted")
+            _, _, summary = self._http(port, "GET", "/imgfs/intake")
+            self.builtin.should_be_equal_as_integers(json.loads(summary)["inserted"], len(IMAGES))
+        finally:
+            self._stop()
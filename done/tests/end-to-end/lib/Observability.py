@@ -0,0 +1,431 @@
+# Observability scenarios: what an imgfs_server reports about itself, on
+# /metrics and in the logs it is asked to write.
+#
+# Each scenario starts its own server, on a copy of a data file, and
+# stops it at the end.
+
+import json
+import os
+import re
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import copy_dump, http_request, read_image, start_server, stop_server
+
+SAMPLE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)(?:\{(.*)\})? (\S+)$')
+LABEL = re.compile(r'(\w+)="([^"]*)"')
+HISTOGRAM_SUFFIXES = ("_bucket", "_sum", "_count")
+SETTLE_TIMEOUT = 10
+PREWARM_TIMEOUT = 10
+
+
+class Observability:
+    """
+    Observability scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+        self.metrics_reads = 0
+
+    def _http(self, port, method, path, body=None):
+        return http_request(self.host, port, method, path, body)
+
+    def _start(self, port, env=None, fresh=True):
+        if fresh:
+            self.dump = copy_dump(self.data_dir, "test02", f"dump_observability_{port}.imgfs")
+        self.process = start_server(self.server_executable, self.dump, port, env=env, host=self.host)
+
+    def _stop(self, files=()):
+        if self.process is not None:
+            process, self.process = self.process, None
+            stop_server(process, files)
+
+    def _metrics(self, port):
+        """
+        The samples of /metrics, {(name, labels): value}, labels as a tuple
+        of (label, value) in the order printed. Fails unless each family is
+        one group: its HELP, its TYPE, then its samples.
+        """
+        status, body = self._http(port, "GET", "/metrics")
+        self.builtin.should_be_equal_as_integers(status, 200)
+        self.metrics_reads += 1
+        samples = {}
+        types = {}
+        family = None
+        for line in body.decode().splitlines():
+            if line.startswith("# HELP "):
+                family = line.split()[2]
+                if family in types:
+                    self.builtin.fail(f"{family}: two groups")
+                types[family] = None
+            elif line.startswith("# TYPE "):
+                _, _, name, kind = line.split()
+                if name != family or types[name] is not None:
+                    self.builtin.fail(f"{name}: TYPE not right after its HELP")
+                types[name] = kind
+            elif line:
+                match = SAMPLE.match(line)
+                if match is None:
+                    self.builtin.fail(f"not a sample: {line}")
+                name, labels, value = match.groups()
+                base = name
+                if types.get(family) == "histogram" and name.endswith(HISTOGRAM_SUFFIXES):
+                    base = name[:name.rindex("_")]
+                if base != family or types[family] is None:
+                    self.builtin.fail(f"{name}: outside of its family")
+                samples[(name, tuple(LABEL.findall(labels or "")))] = float(value)
+        return samples
+
+    @staticmethod
+    def _sample(samples, name, **labels):
+        return samples.get((name, tuple(labels.items())), 0)
+
+    def _settled_metrics(self, port, route, requests):
+        """
+        The samples of /metrics once requests on route are counted, and only
+        the connection reading them is open: a request is counted once its
+        reply is sent, so its client may go on before.
+        """
+        deadline = time.time() + SETTLE_TIMEOUT
+        while True:
+            samples = self._metrics(port)
+            if self._sample(samples, "imgfs_request_duration_seconds_count", route=route) >= requests \
+                    and self._sample(samples, "imgfs_open_connections") == 1:
+                return samples
+            if time.time() > deadline:
+                self.builtin.fail(f"{requests} requests on {route} never counted")
+            time.sleep(0.01)
+
+    def _check_histogram(self, samples, name, route):
+        buckets = [(float(dict(labels)["le"]), value) for (n, labels), value in samples.items()
+                   if n == name + "_bucket" and dict(labels)["route"] == route]
+        if not buckets:
+            self.builtin.fail(f"{name}: no bucket for {route}")
+        buckets.sort()
+        for (_, lower), (le, upper) in zip(buckets, buckets[1:]):
+            if upper < lower:
+                self.builtin.fail(f"{name}: {route} bucket le={le} below the previous one")
+        if buckets[-1][0] != float("inf"):
+            self.builtin.fail(f"{name}: no +Inf bucket for {route}")
+        self.builtin.should_be_equal_as_numbers(buckets[-1][1], self._sample(samples, name + "_count", route=route))
+
+    def metrics_count_requests(self, port):
+        """
+        Reads /metrics before and after an insert, a list, a read of a
+        resolution not stored yet, the same read again and a read of a
+        missing image: the text is well formed, and the counters moved by
+        what was asked, by route and status class, with the bytes sent, the
+        derivative hits and misses, the connections and the volume gauges.
+        """
+        try:
+            self._start(port)
+            before = self._settled_metrics(port, "list", 1)  # the list checking that the server is up
+            metrics_reads = self.metrics_reads
+
+            insert, _ = self._http(port, "POST", "/imgfs/insert?name=observed",
+                                   read_image(self.data_dir, "papillon.jpg"))
+            status, listing = self._http(port, "GET", "/imgfs/list")
+            self.builtin.should_be_equal_as_integers(status, 200)
+            read_bytes = 0
+            for img_id, expected in (("pic1", 200), ("pic1", 200), ("nope", 500)):
+                status, body = self._http(port, "GET", f"/imgfs/read?res=small&img_id={img_id}")
+                self.builtin.should_be_equal_as_integers(status, expected)
+                read_bytes += len(body)
+
+            reads = self._sample(before, "imgfs_request_duration_seconds_count", route="read")
+            after = self._settled_metrics(port, "read", reads + 3)
+            metrics_reads = self.metrics_reads - metrics_reads  # the last one of before, and those before after
+
+            def delta(name, **labels):
+                return self._sample(after, name, **labels) - self._sample(before, name, **labels)
+
+            requests = "imgfs_requests_total"
+            self.builtin.should_be_equal_as_numbers(delta(requests, route="insert", code=f"{insert // 100}xx"), 1)
+            self.builtin.should_be_equal_as_numbers(delta(requests, route="list", code="2xx"), 1)
+            self.builtin.should_be_equal_as_numbers(delta(requests, route="read", code="2xx"), 2)
+            self.builtin.should_be_equal_as_numbers(delta(requests, route="read", code="5xx"), 1)
+            self.builtin.should_be_equal_as_numbers(delta(requests, route="metrics", code="2xx"), metrics_reads)
+
+            duration = "imgfs_request_duration_seconds"
+            self.builtin.should_be_equal_as_numbers(delta(duration + "_count", route="read"), 3)
+            if delta(duration + "_sum", route="read") <= 0:
+                self.builtin.fail("no time spent reading")
+            for route in ("insert", "list", "read", "metrics"):
+                self._check_histogram(after, duration, route)
+
+            sent = "imgfs_sent_bytes_total"
+            self.builtin.should_be_equal_as_numbers(delta(sent, route="list"), len(listing))
+            self.builtin.should_be_equal_as_numbers(delta(sent, route="read"), read_bytes)
+
+            self.builtin.should_be_equal_as_numbers(delta("imgfs_derivative_misses_total", res="small"), 1)
+            self.builtin.should_be_equal_as_numbers(delta("imgfs_derivative_hits_total", res="small"), 1)
+
+            self.builtin.should_be_equal_as_numbers(delta("imgfs_connections_total"), 5 + metrics_reads)
+            self.builtin.should_be_equal_as_numbers(self._sample(after, "imgfs_open_connections"), 1)
+
+            images = len(json.loads(listing)["Images"])
+            self.builtin.should_be_equal_as_numbers(self._sample(after, "imgfs_volume_images"), images)
+            self.builtin.should_be_equal_as_numbers(delta("imgfs_volume_images"), 1)
+            self.builtin.should_be_equal_as_numbers(self._sample(after, "imgfs_volume_max_images"), 100)
+            if delta("imgfs_volume_version") <= 0:
+                self.builtin.fail("the version of the volume did not grow")
+        finally:
+            self._stop([self.dump])
+
+    def _lock_profile(self, port, query=""):
+        status, body = self._http(port, "GET", "/imgfs/lockprof" + query)
+        self.builtin.should_be_equal_as_integers(status, 200)
+        profile = json.loads(body)
+        locks = {lock["name"]: lock for lock in profile["locks"]}
+        if "volume" not in locks:
+            self.builtin.fail("the volume lock is not profiled")
+        return profile["enabled"], locks["volume"]
+
+    def _check_lock(self, lock):
+        if lock["contended"] > lock["acquisitions"] or lock["max_wait_ns"] > lock["wait_ns"] \
+                or lock["max_hold_ns"] > lock["hold_ns"]:
+            self.builtin.fail(f"inconsistent statistics: {lock}")
+        self.builtin.should_be_equal_as_integers(lock["waiters"], 0)
+        self.builtin.should_be_equal(lock["holder"], None)
+        for site in lock["sites"]:
+            if not re.fullmatch(r"[\w.]+\.c:\d+", site["site"]):
+                self.builtin.fail(f"not a call site: {site['site']}")
+        if sum(site["acquisitions"] for site in lock["sites"]) > lock["acquisitions"]:
+            self.builtin.fail(f"more acquisitions by site than in all: {lock}")
+
+    def lock_profile_enables_and_resets(self, port):
+        """
+        Turns the lock profiler on, reads, and checks that the volume lock
+        was held, from which call sites; resets it, turns it off, reads
+        again and checks that only the acquisitions are counted then.
+        Restarted with IMGFS_LOCK_PROF=1, the server profiles from the start.
+        """
+        try:
+            self._start(port)
+            enabled, volume = self._lock_profile(port)
+            self.builtin.should_be_equal(enabled, False)
+            self.builtin.should_be_equal_as_integers(volume["hold_ns"], 0)
+
+            enabled, before = self._lock_profile(port, "?enable=1")
+            self.builtin.should_be_equal(enabled, True)
+            for img_id in ("pic1", "pic1", "pic2"):
+                status, _ = self._http(port, "GET", f"/imgfs/read?res=small&img_id={img_id}")
+                self.builtin.should_be_equal_as_integers(status, 200)
+            enabled, volume = self._lock_profile(port)
+            self.builtin.should_be_equal(enabled, True)
+            self._check_lock(volume)
+            if volume["acquisitions"] < before["acquisitions"] + 3 or volume["hold_ns"] <= before["hold_ns"]:
+                self.builtin.fail(f"the reads were not profiled: {volume}")
+            if sum(site["acquisitions"] for site in volume["sites"]) < 3:
+                self.builtin.fail(f"the reads have no call site: {volume}")
+
+            enabled, volume = self._lock_profile(port, "?reset=1")
+            self.builtin.should_be_equal(enabled, True)
+            self._check_lock(volume)
+            for stat in ("acquisitions", "contended", "wait_ns", "hold_ns", "max_hold_ns"):
+                self.builtin.should_be_equal_as_integers(volume[stat], 0)
+            for site in volume["sites"]:
+                self.builtin.should_be_equal_as_integers(site["acquisitions"], 0)
+                self.builtin.should_be_equal_as_integers(site["hold_ns"], 0)
+
+            enabled, _ = self._lock_profile(port, "?enable=0")
+            self.builtin.should_be_equal(enabled, False)
+            status, _ = self._http(port, "GET", "/imgfs/read?res=small&img_id=pic1")
+            self.builtin.should_be_equal_as_integers(status, 200)
+            _, volume = self._lock_profile(port)
+            self.builtin.should_be_equal_as_integers(volume["acquisitions"], 1)
+            self.builtin.should_be_equal_as_integers(volume["hold_ns"], 0)
+            self._stop()
+
+            self._start(port, env={"IMGFS_LOCK_PROF": "1"}, fresh=False)
+            enabled, volume = self._lock_profile(port)
+            self.builtin.should_be_equal(enabled, True)
+            self._check_lock(volume)
+            if volume["hold_ns"] == 0:
+                self.builtin.fail("the volume was not profiled from the start")
+        finally:
+            self._stop([self.dump])
+
+    def _slow_logged(self, port, threshold_ms, expected):
+        """
+        Runs a list and two reads on a server with a slow log and a trace
+        export, stops it once expected requests are logged, and returns
+        (slow log entries, trace events).
+        """
+        log = os.path.join(self.data_dir, f"dump_observability_{port}.slow")
+        trace = os.path.join(self.data_dir, f"dump_observability_{port}.json")
+        try:
+            for path in (log, trace):
+                if os.path.exists(path):
+                    os.remove(path)
+            self._start(port, env={"IMGFS_SLOW_MS": str(threshold_ms), "IMGFS_SLOW_LOG": log,
+                                   "IMGFS_TRACE_JSON": trace})
+            status, _ = self._http(port, "GET", "/imgfs/list")
+            self.builtin.should_be_equal_as_integers(status, 200)
+            for res in ("small", "small"):
+                status, _ = self._http(port, "GET", f"/imgfs/read?res={res}&img_id=pic1")
+                self.builtin.should_be_equal_as_integers(status, 200)
+            # a request is logged once its reply is sent
+            deadline = time.time() + SETTLE_TIMEOUT
+            while time.time() < deadline:
+                with open(log) as f:
+                    if len(f.readlines()) >= expected:
+                        break
+                time.sleep(0.01)
+            self._stop()
+
+            with open(log) as f:
+                entries = [json.loads(line) for line in f]
+            with open(trace) as f:
+                events = json.load(f)  # the export is terminated at shutdown
+            return entries, events
+        finally:
+            self._stop()
+            for path in (self.dump, log, trace):
+                if path is not None and os.path.exists(path):
+                    os.remove(path)
+
+    def slow_log_keeps_slow_requests(self, port):
+        """
+        With a threshold of 0, every request is slow: each is logged with
+        its phases, and exported as a complete trace event ("ph":"X") with
+        an event per phase, within it. With a threshold no request reaches,
+        nothing is logged and the export is an empty array.
+        """
+        entries, events = self._slow_logged(port, 0, 4)
+        # the list checking that the server was up, and the three requests
+        self.builtin.should_be_equal_as_integers(len(entries), 4)
+        self.builtin.should_be_equal([e["route"] for e in entries], ["list", "list", "read", "read"])
+        for entry in entries:
+            self.builtin.should_be_equal(entry["method"], "GET")
+            self.builtin.should_be_equal_as_integers(entry["status"], 200)
+            if not entry["phases"]:
+                self.builtin.fail(f"no phase: {entry}")
+            for phase in entry["phases"]:
+                if phase["start_us"] < 0 or phase["start_us"] + phase["dur_us"] > entry["total_us"] + 1:
+                    self.builtin.fail(f"{phase['name']} outside of its request: {entry}")
+        for entry in entries[2:]:
+            self.builtin.should_be_equal(entry["img_id"], "pic1")
+            self.builtin.should_be_equal(entry["res"], "small")
+        if "volume_locked" not in [phase["name"] for phase in entries[2]["phases"]]:
+            self.builtin.fail(f"the read has no volume lock phase: {entries[2]}")
+
+        for event in events:
+            self.builtin.should_be_equal(event["ph"], "X")
+            for field in ("name", "cat", "ts", "dur", "pid", "tid"):
+                if field not in event:
+                    self.builtin.fail(f"no {field} in {event}")
+        requests = [e for e in events if e["cat"] == "request"]
+        self.builtin.should_be_equal([e["name"] for e in requests], ["GET list", "GET list", "GET read", "GET read"])
+        for request, entry in zip(requests, entries):
+            phases = [e for e in events if e["cat"] == "phase" and e["tid"] == request["tid"]]
+            self.builtin.should_be_equal([e["name"] for e in phases], [p["name"] for p in entry["phases"]])
+            for phase in phases:
+                if phase["ts"] < request["ts"] - 1 or phase["ts"] + phase["dur"] > request["ts"] + request["dur"] + 1:
+                    self.builtin.fail(f"{phase['name']} outside of its request")
+        self.builtin.should_be_equal_as_integers(len(events), len(requests) + sum(len(e["phases"]) for e in entries))
+
+        entries, events = self._slow_logged(port, 60000, 0)
+        self.builtin.should_be_equal(entries, [])
+        self.builtin.should_be_equal(events, [])
+
+    def _summary(self, path):
+        """The pairs of a prewarming summary, [(count, res, img_id)], in order."""
+        with open(path) as f:
+            return [(int(count), res, img_id) for count, res, img_id in
+                    (line.split() for line in f if not line.startswith("#"))]
+
+    def _read(self, port, res, img_id, times=1):
+        for _ in range(times):
+            status, _ = self._http(port, "GET", f"/imgfs/read?res={res}&img_id={img_id}")
+            self.builtin.should_be_equal_as_integers(status, 200)
+
+    def prewarm_records_and_replays(self, port):
+        """
+        Reads derivatives not stored yet, and checks the summary saved at
+        shutdown, hottest first. Restarted on a fresh copy of the volume
+        with that summary, the server reads them in the background: once it
+        is done, reading them is a hit.
+        """
+        summary = os.path.join(self.data_dir, f"dump_observability_{port}.prewarm")
+        env = {"IMGFS_PREWARM_FILE": summary, "IMGFS_PREWARM_RATE": "100"}
+        try:
+            if os.path.exists(summary):
+                os.remove(summary)
+            self._start(port, env=env)
+            before = self._settled_metrics(port, "list", 1)
+            self._read(port, "small", "pic1", times=3)
+            self._read(port, "thumb", "pic2")
+            after = self._settled_metrics(port, "read", 4)
+            for res in ("small", "thumb"):
+                # none of them was stored: the replay has something to do
+                self.builtin.should_be_equal_as_numbers(
+                    self._sample(after, "imgfs_derivative_misses_total", res=res)
+                    - self._sample(before, "imgfs_derivative_misses_total", res=res), 1)
+            self._stop([self.dump])
+            self.builtin.should_be_equal(self._summary(summary), [(3, "small", "pic1"), (1, "thumb", "pic2")])
+
+            self._start(port, env=env)
+            # the volume is locked once to check that the server is up, then once per pair replayed
+            deadline = time.time() + PREWARM_TIMEOUT
+            while self._lock_profile(port)[1]["acquisitions"] < 3:
+                if time.time() > deadline:
+                    self.builtin.fail("the summary was not replayed")
+                time.sleep(0.05)
+            before = self._settled_metrics(port, "list", 1)
+            self._read(port, "small", "pic1")
+            self._read(port, "thumb", "pic2")
+            after = self._settled_metrics(port, "read", 2)
+            for res in ("small", "thumb"):
+                self.builtin.should_be_equal_as_numbers(
+                    self._sample(after, "imgfs_derivative_hits_total", res=res)
+                    - self._sample(before, "imgfs_derivative_hits_total", res=res), 1)
+                self.builtin.should_be_equal_as_numbers(
+                    self._sample(after, "imgfs_derivative_misses_total", res=res), 0)
+        finally:
+            self._stop([self.dump, summary])
+
+    def prewarm_merges_worker_summaries(self, port, workers):
+        """
+        With IMGFS_WORKERS, each worker saves the reads it served to a
+        summary of its own; at the next start, they are merged into the
+        summary, which counts all the reads, and removed.
+        """
+        summary = os.path.join(self.data_dir, f"dump_observability_{port}.prewarm")
+        worker_summaries = [f"{summary}.{i}" for i in range(int(workers))]
+        env = {"IMGFS_PREWARM_FILE": summary, "IMGFS_WORKERS": str(workers)}
+        try:
+            for path in [summary] + worker_summaries:
+                if os.path.exists(path):
+                    os.remove(path)
+            self._start(port, env=env)
+            self._read(port, "small", "pic1", times=20)
+            self._read(port, "thumb", "pic2", times=10)
+            self._stop()
+
+            saved = [path for path in worker_summaries if os.path.exists(path)]
+            self.builtin.should_be_equal(saved, worker_summaries)
+            counts = {}
+            for path in saved:
+                for count, res, img_id in self._summary(path):
+                    counts[(res, img_id)] = counts.get((res, img_id), 0) + count
+            self.builtin.should_be_equal(counts, {("small", "pic1"): 20, ("thumb", "pic2"): 10})
+            if os.path.exists(summary):
+                self.builtin.fail("the workers saved to the summary itself")
+
+            self._start(port, env=env, fresh=False)
+            self.builtin.should_be_equal(self._summary(summary), [(20, "small", "pic1"), (10, "thumb", "pic2")])
+            for path in worker_summaries:
+                if os.path.exists(path):
+                    self.builtin.fail(f"{path} was not removed once merged")
+        finally:
+            self._stop([self.dump, summary] + worker_summaries)
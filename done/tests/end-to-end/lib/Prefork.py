@@ -0,0 +1,169 @@
+# Prefork scenarios: an imgfs_server forking workers (IMGFS_WORKERS).
+#
+# Each scenario starts its own server, on a copy of a data file, with
+# concurrent clients, and stops it at the end. The workers are found as
+# the children of the server.
+
+import http.client
+import json
+import os
+import signal
+import threading
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import IMAGES, copy_dump, http_request, read_image, start_server, stop_server
+
+
+
+class Prefork:
+    """
+    Prefork scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    RESTART_TIMEOUT = 10
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+
+    def _start(self, source, port, workers):
+        def ready(process):
+            if len(self._workers(process)) != int(workers):
+                raise OSError("not all the workers are forked")
+            http_request(self.host, port, "GET", "/imgfs/list")
+
+        self.dump = copy_dump(self.data_dir, source, f"dump_prefork_{port}.imgfs")
+        self.process = start_server(self.server_executable, self.dump, port,
+                                    env={"IMGFS_WORKERS": str(workers)}, ready=ready, host=self.host)
+
+    def _stop(self):
+        if self.process is not None:
+            process, self.process = self.process, None
+            stop_server(process, [self.dump])
+
+    def _workers(self, process=None):
+        """The pids of the children of the server."""
+        process = process or self.process
+        workers = []
+        for pid in os.listdir("/proc"):
+            if not pid.isdigit():
+                continue
+            try:
+                with open(f"/proc/{pid}/stat") as f:
+                    # the name, in parentheses, may contain spaces
+                    fields = f.read().rsplit(")", 1)[1].split()
+            except OSError:
+                continue
+            if int(fields[1]) == process.pid:
+                workers.append(int(pid))
+        return workers
+
+    def _list(self, port):
+        status, data = http_request(self.host, port, "GET", "/imgfs/list")
+        if status != 200:
+            self.builtin.fail(f"list: status {status}")
+        return json.loads(data)["Images"]
+
+    def _insert_concurrently(self, port, prefix, inserts, clients, failures):
+        def writer(client):
+            for i in range(client, inserts, clients):
+                try:
+                    status, data = http_request(self.host, port, "POST", f"/imgfs/insert?name={prefix}{i}",
+                                                 read_image(self.data_dir, IMAGES[i % len(IMAGES)]))
+                    if status != 302:
+                        failures.append(f"insert {prefix}{i}: status {status} {data[:100]!r}")
+                    http_request(self.host, port, "GET", f"/imgfs/read?res=thumb&img_id={prefix}{i}")
+                except (OSError, http.client.HTTPException) as e:
+                    # a worker killed meanwhile
+                    failures.append(f"insert {prefix}{i}: {e!r}")
+
+        threads = [threading.Thread(target=writer, args=(client,)) for client in range(clients)]
+        for thread in threads:
+            thread.start()
+        return threads
+
+    def _check_volume(self, port, expected):
+        """Each worker must list the expected images, with their bytes."""
+        images = self._list(port)
+        for img_id in expected:
+            if img_id not in images:
+                self.builtin.fail(f"{img_id} is not listed: {images}")
+        for _ in range(2 * len(self._workers())):
+            self.builtin.should_be_equal(self._list(port), images)
+        for img_id in expected:
+            status, data = http_request(self.host, port, "GET", f"/imgfs/read?res=orig&img_id={img_id}")
+            self.builtin.should_be_equal_as_integers(status, 200)
+            if data != read_image(self.data_dir, IMAGES[int(img_id[3:]) % len(IMAGES)]):
+                self.builtin.fail(f"{img_id} read back differs")
+
+    def workers_share_the_volume(self, port, workers=4, inserts=20, clients=4):
+        """
+        Inserts images from concurrent clients, served by different workers,
+        then deletes some: every worker must list the same images, and read
+        them back as inserted.
+        """
+        inserts = int(inserts)
+        try:
+            self._start("test02", port, workers)
+            failures = []
+            for thread in self._insert_concurrently(port, "pre", inserts, int(clients), failures):
+                thread.join()
+            if failures:
+                self.builtin.fail("\n".join(failures))
+            for i in range(0, inserts, 3):
+                status, _ = http_request(self.host, port, "GET", f"/imgfs/delete?img_id=pre{i}")
+                self.builtin.should_be_equal_as_integers(status, 302)
+            expected = [f"pre{i}" for i in range(inserts) if i % 3 != 0]
+            self._check_volume(port, expected)
+            for i in range(0, inserts, 3):
+                if f"pre{i}" in self._list(port):
+                    self.builtin.fail(f"pre{i} is still listed")
+        finally:
+            self._stop()
+
+    def crashed_worker_is_restarted(self, port, workers=4, inserts=20, clients=4):
+        """
+        Kills a worker while clients insert: the server must keep serving,
+        fork another worker, and keep a consistent volume.
+        """
+        inserts = int(inserts)
+        try:
+            self._start("test02", port, workers)
+            failures = []
+            threads = self._insert_concurrently(port, "cra", inserts, int(clients), failures)
+            time.sleep(0.2)
+            killed = self._workers()[0]
+            os.kill(killed, signal.SIGKILL)
+            for thread in threads:
+                thread.join()
+
+            deadline = time.time() + self.RESTART_TIMEOUT
+            while time.time() < deadline:
+                current = self._workers()
+                if len(current) == int(workers) and killed not in current:
+                    break
+                time.sleep(0.1)
+            else:
+                self.builtin.fail(f"no worker replaced {killed}: {self._workers()}")
+
+            # the requests of the killed worker may have failed: those inserted again must work
+            for failure in failures:
+                self.builtin.log(failure)
+            listed = self._list(port)
+            for i in range(inserts):
+                if f"cra{i}" not in listed:
+                    status, data = http_request(self.host, port, "POST", f"/imgfs/insert?name=cra{i}",
+                                                 read_image(self.data_dir, IMAGES[i % len(IMAGES)]))
+                    if status != 302:
+                        self.builtin.fail(f"insert cra{i} again: status {status} {data[:100]!r}")
+            self._check_volume(port, [f"cra{i}" for i in range(inserts)])
+        finally:
+            self._stop()
@@ -0,0 +1,196 @@
+# Replication scenarios: a primary imgfs_server and a replica following it.
+#
+# Each scenario starts its own servers, on copies of the data files: the
+# primary with IMGFS_REPL_PORT, the replica with IMGFS_REPLICA_OF pointing
+# at it over localhost, and stops them at the end. The shared volume
+# scenario starts a writer and readers on the same copy instead.
+
+import json
+import threading
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import IMAGES, copy_dump, http_request, read_image, start_server, stop_server
+
+
+
+class Replication:
+    """
+    Replication scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    CATCH_UP_TIMEOUT = 15
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.servers = []
+
+    def _start(self, source, port, env, dump=None):
+        if dump is None:
+            dump = copy_dump(self.data_dir, source, f"dump_replication_{port}.imgfs")
+        ready = lambda process: http_request(self.host, port, "GET", "/imgfs/replication")
+        process = start_server(self.server_executable, dump, port, env=env, ready=ready, host=self.host)
+        self.servers.append((process, dump))
+        return dump
+
+    def _stop_all(self):
+        servers, self.servers = self.servers, []
+        for process, dump in servers:
+            stop_server(process, [dump, dump + ".seq"])
+
+    def _status(self, port):
+        status, data = http_request(self.host, port, "GET", "/imgfs/replication")
+        if status != 200:
+            self.builtin.fail(f"replication status: {status} {data[:100]!r}")
+        return json.loads(data)
+
+    def _wait_caught_up(self, primary_port, replica_port):
+        deadline = time.time() + self.CATCH_UP_TIMEOUT
+        while time.time() < deadline:
+            primary = self._status(primary_port)
+            replica = self._status(replica_port)
+            if (replica["connected"] and replica["lag_bytes"] == 0 and replica["lag_versions"] == 0
+                    and replica["applied_version"] == primary["version"]
+                    and replica["applied_position"] == primary["position"]):
+                return replica
+            time.sleep(0.1)
+        self.builtin.fail(f"the replica did not catch up: {replica}, primary {primary}")
+
+    def _list(self, port):
+        status, data = http_request(self.host, port, "GET", "/imgfs/list")
+        if status != 200:
+            self.builtin.fail(f"list: status {status}")
+        return json.loads(data)["Images"]
+
+    def replica_follows_primary(self, primary_port, repl_port, replica_port, inserts=10):
+        """
+        Inserts images on the primary, the replica connecting meanwhile, then
+        deletes some: the replica must end with the same images, the same
+        bytes, and a volume identical to that of the primary.
+        """
+        inserts = int(inserts)
+        try:
+            primary_dump = self._start("test02", primary_port, {"IMGFS_REPL_PORT": str(repl_port)})
+            failures = []
+
+            def writer():
+                for i in range(inserts):
+                    status, data = http_request(self.host, primary_port, "POST", f"/imgfs/insert?name=rep{i}",
+                                                 read_image(self.data_dir, IMAGES[i % len(IMAGES)]))
+                    if status != 302:
+                        failures.append(f"insert rep{i}: status {status} {data[:100]!r}")
+                    http_request(self.host, primary_port, "GET", f"/imgfs/read?res=small&img_id=rep{i}")
+
+            thread = threading.Thread(target=writer)
+            thread.start()
+            replica_dump = self._start("empty", replica_port,
+                                       {"IMGFS_REPLICA_OF": f"{self.host}:{repl_port}"})
+            thread.join()
+            if failures:
+                self.builtin.fail("\n".join(failures))
+            for i in range(0, inserts, 3):
+                http_request(self.host, primary_port, "GET", f"/imgfs/delete?img_id=rep{i}")
+
+            self._wait_caught_up(primary_port, replica_port)
+            images = self._list(primary_port)
+            self.builtin.should_be_equal(self._list(replica_port), images)
+            for img_id in images:
+                for res in ("orig", "small"):
+                    path = f"/imgfs/read?res={res}&img_id={img_id}"
+                    self.builtin.should_be_equal(http_request(self.host, replica_port, "GET", path),
+                                                 http_request(self.host, primary_port, "GET", path))
+            # the reads of the replica resize without storing
+            http_request(self.host, replica_port, "GET", f"/imgfs/read?res=thumb&img_id={images[-1]}")
+            with open(primary_dump, "rb") as p, open(replica_dump, "rb") as r:
+                if p.read() != r.read():
+                    self.builtin.fail("the volume of the replica differs from that of the primary")
+        finally:
+            self._stop_all()
+
+    def replica_rejects_writes(self, primary_port, repl_port, replica_port):
+        """
+        Inserts and deletes on the replica fail and leave it unchanged.
+        """
+        try:
+            self._start("test02", primary_port, {"IMGFS_REPL_PORT": str(repl_port)})
+            self._start("empty", replica_port, {"IMGFS_REPLICA_OF": f"{self.host}:{repl_port}"})
+            self._wait_caught_up(primary_port, replica_port)
+            status, _ = http_request(self.host, replica_port, "POST", "/imgfs/insert?name=pic3",
+                                      read_image(self.data_dir, IMAGES[0]))
+            self.builtin.should_be_equal_as_integers(status, 500)
+            status, _ = http_request(self.host, replica_port, "GET", "/imgfs/delete?img_id=pic1")
+            self.builtin.should_be_equal_as_integers(status, 500)
+            self.builtin.should_be_equal(self._list(replica_port), self._list(primary_port))
+        finally:
+            self._stop_all()
+
+    def readers_follow_writer(self, writer_port, reader_ports, inserts=10):
+        """
+        Inserts and deletes images on the writer of a shared volume while
+        readers of the same file list and read them: each reader must end
+        with the images and the bytes of the writer, reject writes, and
+        leave the file unchanged.
+        """
+        inserts = int(inserts)
+        reader_ports = [int(port) for port in str(reader_ports).split(",")]
+        try:
+            dump = self._start("test02", writer_port, {"IMGFS_SHARED_WRITER": "1"})
+            for port in reader_ports:
+                self._start(None, port, {"IMGFS_SHARED_READER": "1"}, dump)
+            failures = []
+
+            def reader(port):
+                while not done.is_set():
+                    for img_id in self._list(port):
+                        status, data = http_request(self.host, port, "GET", f"/imgfs/read?res=orig&img_id={img_id}")
+                        # a deleted image may be listed by an older snapshot
+                        if status != 200 and status != 500:
+                            failures.append(f"read {img_id} on {port}: status {status} {data[:100]!r}")
+
+            done = threading.Event()
+            threads = [threading.Thread(target=reader, args=(port,)) for port in reader_ports]
+            for thread in threads:
+                thread.start()
+            for i in range(inserts):
+                status, data = http_request(self.host, writer_port, "POST", f"/imgfs/insert?name=shr{i}",
+                                             read_image(self.data_dir, IMAGES[i % len(IMAGES)]))
+                if status != 302:
+                    failures.append(f"insert shr{i}: status {status} {data[:100]!r}")
+            for i in range(0, inserts, 3):
+                http_request(self.host, writer_port, "GET", f"/imgfs/delete?img_id=shr{i}")
+            http_request(self.host, writer_port, "GET", "/imgfs/read?res=small&img_id=shr1")
+            done.set()
+            for thread in threads:
+                thread.join()
+            if failures:
+                self.builtin.fail("\n".join(failures))
+
+            images = self._list(writer_port)
+            with open(dump, "rb") as f:
+                volume = f.read()
+            for port in reader_ports:
+                self.builtin.should_be_equal(self._list(port), images)
+                for img_id in images:
+                    path = f"/imgfs/read?res=orig&img_id={img_id}"
+                    self.builtin.should_be_equal(http_request(self.host, port, "GET", path),
+                                                 http_request(self.host, writer_port, "GET", path))
+                path = "/imgfs/read?res=small&img_id=shr1"
+                self.builtin.should_be_equal(http_request(self.host, port, "GET", path),
+                                             http_request(self.host, writer_port, "GET", path))
+                # the reads of a reader resize without storing
+                http_request(self.host, port, "GET", f"/imgfs/read?res=thumb&img_id={images[-1]}")
+                status, _ = http_request(self.host, port, "POST", "/imgfs/insert?name=pic3", read_image(self.data_dir, IMAGES[0]))
+                self.builtin.should_be_equal_as_integers(status, 500)
+                status, _ = http_request(self.host, port, "GET", f"/imgfs/delete?img_id={images[0]}")
+                self.builtin.should_be_equal_as_integers(status, 500)
+            with open(dump, "rb") as f:
+                if f.read() != volume:
+                    self.builtin.fail("a reader changed the shared volume")
+        finally:
+            self._stop_all()
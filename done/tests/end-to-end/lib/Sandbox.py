@@ -0,0 +1,130 @@
+# Resize sandbox scenarios: an imgfs_server resizing in helper processes
+# (IMGFS_RESIZE_HELPERS).
+#
+# Each scenario starts its own servers, on copies of a data file, and
+# stops them at the end. The helpers are found as the children of the
+# server.
+
+import json
+import os
+import signal
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import IMAGES, copy_dump, http_request, read_image, start_server, stop_server
+
+
+
+class Sandbox:
+    """
+    Resize sandbox scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+
+    def __init__(self, server_exec_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.data_dir = data_dir
+        self.host = host
+        self.servers = []
+
+    def _start(self, source, port, env):
+        dump = copy_dump(self.data_dir, source, f"dump_sandbox_{port}.imgfs")
+        process = start_server(self.server_executable, dump, port, env=env, host=self.host)
+        self.servers.append((process, dump))
+        return process
+
+    def _stop_all(self):
+        servers, self.servers = self.servers, []
+        for process, dump in servers:
+            stop_server(process, [dump])
+
+    def _helpers(self, process):
+        """The pids of the children of the server."""
+        helpers = []
+        for pid in os.listdir("/proc"):
+            if not pid.isdigit():
+                continue
+            try:
+                with open(f"/proc/{pid}/stat") as f:
+                    # the name, in parentheses, may contain spaces
+                    fields = f.read().rsplit(")", 1)[1].split()
+            except OSError:
+                continue
+            # zombies are reaped when the server next uses them
+            if int(fields[1]) == process.pid and fields[0] != "Z":
+                helpers.append(int(pid))
+        return helpers
+
+    def _insert(self, port, img_id, image):
+        status, data = http_request(self.host, port, "POST", f"/imgfs/insert?name={img_id}", image)
+        if status != 302:
+            self.builtin.fail(f"insert {img_id}: status {status} {data[:100]!r}")
+
+    def _bomb(self):
+        """papillon.jpg, claiming to be 60000 x 60000: its header decodes, its pixels would not fit."""
+        jpeg = bytearray(read_image(self.data_dir, "papillon.jpg"))
+        i = 2
+        while i < len(jpeg):
+            marker = jpeg[i + 1]
+            length = int.from_bytes(jpeg[i + 2:i + 4], "big")
+            if marker in (0xC0, 0xC1, 0xC2):  # start of frame: precision, height, width
+                jpeg[i + 5:i + 9] = (60000).to_bytes(2, "big") * 2
+                return bytes(jpeg)
+            i += 2 + length
+        self.builtin.fail("no start of frame in papillon.jpg")
+
+    def sandboxed_resizes_match_in_process(self, port, sandbox_port, helpers=2):
+        """
+        Inserts the same images in a server resizing in process and in one
+        resizing in helpers: the derivatives must be the same bytes.
+        """
+        try:
+            self._start("test02", port, {})
+            self._start("test02", sandbox_port, {"IMGFS_RESIZE_HELPERS": str(helpers)})
+            for i, name in enumerate(IMAGES):
+                for p in (port, sandbox_port):
+                    self._insert(p, f"sbx{i}", read_image(self.data_dir, name))
+            for i in range(len(IMAGES)):
+                for res in ("thumb", "small"):
+                    path = f"/imgfs/read?res={res}&img_id=sbx{i}"
+                    self.builtin.should_be_equal(http_request(self.host, sandbox_port, "GET", path),
+                                                 http_request(self.host, port, "GET", path))
+        finally:
+            self._stop_all()
+
+    def pathological_original_is_contained(self, port, helpers=2):
+        """
+        An original too large to decode fails to resize, a helper killed is
+        replaced, and the server keeps resizing the other images.
+        """
+        helpers = int(helpers)
+        try:
+            server = self._start("test02", port, {"IMGFS_RESIZE_HELPERS": str(helpers),
+                                                  "IMGFS_RESIZE_MEMORY_MB": "64"})
+            self.builtin.should_be_equal_as_integers(len(self._helpers(server)), helpers)
+            self._insert(port, "bomb", self._bomb())
+            start = time.time()
+            status, _ = http_request(self.host, port, "GET", "/imgfs/read?res=small&img_id=bomb")
+            self.builtin.should_be_equal_as_integers(status, 500)
+            if time.time() - start > 5:
+                self.builtin.fail("the pathological original was decoded")
+
+            for i, name in enumerate(IMAGES):
+                self._insert(port, f"sbx{i}", read_image(self.data_dir, name))
+            for pid in self._helpers(server):
+                os.kill(pid, signal.SIGKILL)
+            for i in range(len(IMAGES)):
+                status, data = http_request(self.host, port, "GET", f"/imgfs/read?res=thumb&img_id=sbx{i}")
+                self.builtin.should_be_equal_as_integers(status, 200)
+                if not data.startswith(b"\xff\xd8"):
+                    self.builtin.fail(f"sbx{i}: not a JPEG")
+            images = json.loads(http_request(self.host, port, "GET", "/imgfs/list")[1])["Images"]
+            if "bomb" not in images:
+                self.builtin.fail(f"bomb is not listed: {images}")
+            self.builtin.should_be_equal_as_integers(len(self._helpers(server)), helpers)
+        finally:
+            self._stop_all()
@@ -0,0 +1,127 @@
+# Sprite sheet checks (GET /imgfs/sprite) against a running imgfs_server,
+# e.g. the one started by the test setup of week13.robot.
+
+import json
+import os
+import struct
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import http_request, read_image
+
+
+def jpeg_size(data):
+    """(width, height) of a JPEG, from its start of frame."""
+    i = 2
+    while i + 4 <= len(data):
+        if data[i] != 0xFF:
+            raise ValueError(f"no marker at {i}")
+        marker, length = data[i + 1], struct.unpack("!H", data[i + 2:i + 4])[0]
+        if 0xC0 <= marker <= 0xC3:
+            height, width = struct.unpack("!HH", data[i + 5:i + 9])
+            return width, height
+        i += 2 + length
+    raise ValueError("no start of frame")
+
+
+class Sprite:
+    """
+    Sprite sheet checks for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    LOG_TIMEOUT = 10
+
+    def __init__(self, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.data_dir = data_dir
+        self.host = host
+
+    def _get(self, port, ids, want_map=False):
+        path = f"/imgfs/sprite?ids={ids}" + ("&map=1" if want_map else "")
+        status, data = http_request(self.host, port, "GET", path)
+        self.builtin.should_be_equal_as_integers(status, 200)
+        return json.loads(data) if want_map else data
+
+    def _sprite_lines(self, access_log):
+        if not os.path.exists(access_log):
+            return []
+        with open(access_log) as f:
+            lines = [json.loads(line) for line in f if line.strip()]
+        return [line for line in lines if line["route"] == "sprite"]
+
+    def _next_sprite_line(self, access_log, seen):
+        # logged after the reply is sent, by a writer thread
+        deadline = time.time() + self.LOG_TIMEOUT
+        while time.time() < deadline:
+            lines = self._sprite_lines(access_log)
+            if len(lines) > seen:
+                return lines[seen]
+            time.sleep(0.05)
+        self.builtin.fail(f"no sprite request logged in {access_log}")
+
+    def sprite_sheets_should_be_equal(self, port, ids, *other_ids):
+        """
+        The sheets (and their maps) of ids and of each of other_ids, the
+        same ids in another order or repeated, are the same.
+        """
+        sheet, sheet_map = self._get(port, ids), self._get(port, ids, want_map=True)
+        for other in other_ids:
+            if self._get(port, other) != sheet:
+                self.builtin.fail(f"the sheet of {other} differs from that of {ids}")
+            self.builtin.should_be_equal(self._get(port, other, want_map=True), sheet_map)
+
+    def sprite_map_should_fit_the_sheet(self, port, ids):
+        """
+        The map of ids has a tile per id, each inside the sheet, none
+        overlapping, and the width and height of the sheet.
+        """
+        sheet, sheet_map = self._get(port, ids), self._get(port, ids, want_map=True)
+        width, height = jpeg_size(sheet)
+        self.builtin.should_be_equal_as_integers(sheet_map["width"], width)
+        self.builtin.should_be_equal_as_integers(sheet_map["height"], height)
+        tiles = sheet_map["tiles"]
+        self.builtin.should_be_equal(sorted(tiles), sorted(set(ids.split(","))))
+        for img_id, tile in tiles.items():
+            if tile["width"] <= 0 or tile["height"] <= 0 or tile["x"] < 0 or tile["y"] < 0 \
+                    or tile["x"] + tile["width"] > width or tile["y"] + tile["height"] > height:
+                self.builtin.fail(f"the tile of {img_id} is outside the {width}x{height} sheet: {tile}")
+        boxes = list(tiles.values())
+        for i, a in enumerate(boxes):
+            for b in boxes[i + 1:]:
+                if a["x"] < b["x"] + b["width"] and b["x"] < a["x"] + a["width"] \
+                        and a["y"] < b["y"] + b["height"] and b["y"] < a["y"] + a["height"]:
+                    self.builtin.fail(f"tiles {a} and {b} overlap")
+
+    def sprite_should_be_cached(self, port, ids, access_log):
+        """
+        Requests the sheet of ids twice: the second request is a cache hit,
+        as logged in access_log, and gets the same sheet.
+        """
+        seen = len(self._sprite_lines(access_log))
+        sheet = self._get(port, ids)
+        self._next_sprite_line(access_log, seen)
+        if self._get(port, ids) != sheet:
+            self.builtin.fail(f"the sheet of {ids} differs when cached")
+        self.builtin.should_be_equal(self._next_sprite_line(access_log, seen + 1)["cache"], "hit")
+
+    def sprite_should_follow_the_version(self, port, ids, access_log, name):
+        """
+        Requests the map of ids, inserts the image name, then requests it
+        again: the insertion changed the header version, so the sheet is
+        composed again (a cache miss, as logged in access_log) for the new
+        version.
+        """
+        before = self._get(port, ids, want_map=True)
+        status, _ = http_request(self.host, port, "POST", f"/imgfs/insert?name={name}",
+                                 read_image(self.data_dir, "brouillard.jpg"))
+        self.builtin.should_be_equal_as_integers(status, 302)
+
+        seen = len(self._sprite_lines(access_log))
+        after = self._get(port, ids, want_map=True)
+        self.builtin.should_be_equal(self._next_sprite_line(access_log, seen)["cache"], "miss")
+        if after["version"] <= before["version"]:
+            self.builtin.fail(f"sheet version {after['version']} after an insert, {before['version']} before")
+        self.builtin.should_be_equal(after["tiles"], before["tiles"])
@@ -0,0 +1,310 @@
+# Concurrent stress scenarios against a running imgfs_server.
+#
+# Each scenario runs client threads against the server (started with
+# "Imgfs Start Server"), checks the answers for consistency and records
+# throughput and latency percentiles per kind of request. The results are
+# logged and, if a results file is given (library argument or the
+# IMGFS_STRESS_RESULTS environment variable), appended to it as one JSON
+# object per scenario.
+
+import http.client
+import json
+import os
+import random
+import threading
+import time
+
+from robot.libraries.BuiltIn import BuiltIn
+
+
+JPEG_SOI = b"\xff\xd8"
+JPEG_EOI = b"\xff\xd9"
+IMAGES = ["brouillard.jpg", "coquelicots.jpg", "foret.jpg", "mure.jpg", "papillon.jpg"]
+
+
+class Recorder:
+    """
+    Latencies and failures collected by the client threads.
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.latencies = {}
+        self.failures = []
+        self.retries = 0
+
+    def record(self, kind, seconds):
+        with self.lock:
+            self.latencies.setdefault(kind, []).append(seconds)
+
+    def fail(self, message):
+        with self.lock:
+            self.failures.append(message)
+
+    def retried(self):
+        with self.lock:
+            self.retries += 1
+
+
+def percentile(values, p):
+    # values must be sorted
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Stress:
+    """
+    Stress scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+    CONNECT_RETRIES = 20
+    TIMEOUT = 30
+
+    def __init__(self, data_dir, results_file=None, host="localhost"):
+        self.builtin = BuiltIn()
+        self.data_dir = data_dir
+        self.host = host
+        self.results_file = results_file or os.environ.get("IMGFS_STRESS_RESULTS")
+        self.images = {}
+
+    def _image(self, name):
+        if name not in self.images:
+            with open(os.path.join(self.data_dir, name), "rb") as f:
+                self.images[name] = f.read()
+        return self.images[name]
+
+    # Requests made to set up or check a scenario pass record=False, so
+    # that only the requests of the run itself count in the statistics.
+
+    def _request(self, rec, port, kind, method, path, body=None, record=True):
+        """
+        Sends one request on a new connection (the server closes it after
+        each answer) and returns (status, body). The listen backlog of the
+        server is short, so refused connections are retried.
+        """
+        for attempt in range(self.CONNECT_RETRIES):
+            conn = http.client.HTTPConnection(self.host, int(port), timeout=self.TIMEOUT)
+            try:
+                start = time.perf_counter()
+                conn.request(method, path, body=body)
+                resp = conn.getresponse()
+                data = resp.read()
+                if record:
+                    rec.record(kind, time.perf_counter() - start)
+                return resp.status, data
+            except (ConnectionRefusedError, ConnectionResetError, BrokenPipeError):
+                rec.retried()
+                time.sleep(0.005 * (attempt + 1))
+            finally:
+                conn.close()
+        rec.fail(f"{kind}: no connection to the server after {self.CONNECT_RETRIES} attempts")
+        return None, b""
+
+    def _list(self, rec, port, record=True):
+        status, data = self._request(rec, port, "list", "GET", "/imgfs/list", record=record)
+        if status != 200:
+            rec.fail(f"list: status {status}")
+            return None
+        try:
+            images = json.loads(data)["Images"]
+        except (ValueError, KeyError, TypeError):
+            rec.fail(f"list: invalid JSON {data[:200]!r}")
+            return None
+        if len(images) != len(set(images)):
+            rec.fail(f"list: duplicate ids in {images}")
+        return images
+
+    def _read(self, rec, port, img_id, res, record=True):
+        status, data = self._request(rec, port, f"read_{res}", "GET",
+                                     f"/imgfs/read?res={res}&img_id={img_id}", record=record)
+        if status != 200:
+            rec.fail(f"read {img_id} {res}: status {status} {data[:100]!r}")
+            return None
+        if not (data.startswith(JPEG_SOI) and data.endswith(JPEG_EOI)):
+            rec.fail(f"read {img_id} {res}: torn or truncated JPEG ({len(data)} bytes)")
+            return None
+        return data
+
+    def _insert(self, rec, port, img_id, image, record=True):
+        status, data = self._request(rec, port, "insert", "POST",
+                                     f"/imgfs/insert?name={img_id}", body=image, record=record)
+        if status != 302:
+            rec.fail(f"insert {img_id}: status {status} {data[:100]!r}")
+            return False
+        return True
+
+    def _delete(self, rec, port, img_id, record=True):
+        status, data = self._request(rec, port, "delete", "GET", f"/imgfs/delete?img_id={img_id}",
+                                     record=record)
+        if status != 302:
+            rec.fail(f"delete {img_id}: status {status} {data[:100]!r}")
+            return False
+        return True
+
+    def _run(self, threads):
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+
+    def _report(self, scenario, params, rec, elapsed):
+        """
+        Logs the statistics of a scenario and fails if a check failed.
+        """
+        result = {"scenario": scenario, **params, "seconds": round(elapsed, 3),
+                  "retries": rec.retries, "failures": len(rec.failures), "requests": {}}
+        total = 0
+        for kind, values in sorted(rec.latencies.items()):
+            values.sort()
+            total += len(values)
+            result["requests"][kind] = {
+                "count": len(values),
+                "per_s": round(len(values) / elapsed, 1),
+                "p50_ms": round(percentile(values, 50) * 1e3, 3),
+                "p90_ms": round(percentile(values, 90) * 1e3, 3),
+                "p99_ms": round(percentile(values, 99) * 1e3, 3),
+                "max_ms": round(values[-1] * 1e3, 3),
+            }
+        result["per_s"] = round(total / elapsed, 1)
+
+        line = json.dumps(result)
+        self.builtin.log(line)
+        self.builtin.log_to_console(f"\n{scenario}: {total} requests, {result['per_s']}/s, "
+                                    f"{rec.retries} retries, {len(rec.failures)} failures")
+        if self.results_file:
+            with open(self.results_file, "a") as f:
+                f.write(line + "\n")
+
+        if rec.failures:
+            self.builtin.fail(f"{len(rec.failures)} failed checks, first ones:\n"
+                              + "\n".join(rec.failures[:10]))
+        return result
+
+    def stress_readers_writers(self, port, readers=8, writers=2, duration=5):
+        """
+        Readers read the originals of the images present at start (which
+        must not change) and list the volume (which must be valid and keep
+        listing them); meanwhile writers insert, read back and delete their
+        own images. At the end, the volume must list what it did at start.
+        """
+        readers, writers, duration = int(readers), int(writers), float(duration)
+        rec = Recorder()
+        stable = self._list(rec, port, record=False) or []
+        references = {img_id: self._read(rec, port, img_id, "orig", record=False) for img_id in stable}
+        deadline = time.monotonic() + duration
+
+        def reader(seed):
+            rnd = random.Random(seed)
+            while time.monotonic() < deadline:
+                if stable and rnd.random() < 0.7:
+                    img_id = rnd.choice(stable)
+                    data = self._read(rec, port, img_id, "orig")
+                    if data is not None and data != references[img_id]:
+                        rec.fail(f"read {img_id} orig: content changed ({len(data)} bytes)")
+                else:
+                    images = self._list(rec, port)
+                    if images is not None and not set(stable) <= set(images):
+                        rec.fail(f"list: {images} misses some of {stable}")
+
+        def writer(wid):
+            k = 0
+            while time.monotonic() < deadline:
+                img_id = f"w{wid}-{k}"
+                image = self._image(IMAGES[(wid + k) % len(IMAGES)])
+                k += 1
+                if not self._insert(rec, port, img_id, image):
+                    continue
+                data = self._read(rec, port, img_id, "orig")
+                if data is not None and data != image:
+                    rec.fail(f"read {img_id} orig: not the inserted image")
+                self._delete(rec, port, img_id)
+
+        threads = [threading.Thread(target=reader, args=(i,)) for i in range(readers)]
+        threads += [threading.Thread(target=writer, args=(i,)) for i in range(writers)]
+        start = time.perf_counter()
+        self._run(threads)
+        elapsed = time.perf_counter() - start
+
+        final = self._list(rec, port, record=False)
+        if final is not None and sorted(final) != sorted(stable):
+            rec.fail(f"list after the run: {final}, expected {stable}")
+        return self._report("readers_writers",
+                            {"readers": readers, "writers": writers, "duration": duration},
+                            rec, elapsed)
+
+    def stress_insert_delete_churn(self, port, workers=4, rounds=25):
+        """
+        Each worker repeatedly inserts an image, checks that it is listed,
+        deletes it and checks that it is not listed anymore.
+        """
+        workers, rounds = int(workers), int(rounds)
+        rec = Recorder()
+        initial = self._list(rec, port, record=False) or []
+
+        def worker(wid):
+            for k in range(rounds):
+                img_id = f"c{wid}-{k}"
+                if not self._insert(rec, port, img_id, self._image(IMAGES[k % len(IMAGES)])):
+                    continue
+                images = self._list(rec, port)
+                if images is not None and img_id not in images:
+                    rec.fail(f"list after inserting {img_id}: {images}")
+                if not self._delete(rec, port, img_id):
+                    continue
+                images = self._list(rec, port)
+                if images is not None and img_id in images:
+                    rec.fail(f"list after deleting {img_id}: {images}")
+
+        start = time.perf_counter()
+        self._run([threading.Thread(target=worker, args=(i,)) for i in range(workers)])
+        elapsed = time.perf_counter() - start
+
+        final = self._list(rec, port, record=False)
+        if final is not None and sorted(final) != sorted(initial):
+            rec.fail(f"list after the run: {final}, expected {initial}")
+        return self._report("insert_delete_churn", {"workers": workers, "rounds": rounds},
+                            rec, elapsed)
+
+    def stress_cold_thumbnails(self, port, clients=16, images=4):
+        """
+        Inserts images, then all clients request their thumbnail and small
+        derivatives at once, none of which exists yet. Every client must get
+        the same content for a given derivative, which must also be what
+        is read afterwards.
+        """
+        clients, images = int(clients), min(int(images), len(IMAGES))
+        rec = Recorder()
+        ids = [f"cold{i}" for i in range(images)]
+        for i, img_id in enumerate(ids):
+            self._insert(rec, port, img_id, self._image(IMAGES[i]), record=False)
+
+        targets = [(img_id, res) for img_id in ids for res in ("thumb", "small")]
+        seen = {target: [] for target in targets}
+        seen_lock = threading.Lock()
+        barrier = threading.Barrier(clients)
+
+        def client(seed):
+            order = list(targets)
+            random.Random(seed).shuffle(order)
+            barrier.wait()
+            for img_id, res in order:
+                data = self._read(rec, port, img_id, res)
+                if data is not None:
+                    with seen_lock:
+                        seen[(img_id, res)].append(data)
+
+        start = time.perf_counter()
+        self._run([threading.Thread(target=client, args=(i,)) for i in range(clients)])
+        elapsed = time.perf_counter() - start
+
+        for (img_id, res), bodies in seen.items():
+            if len(set(bodies)) > 1:
+                rec.fail(f"read {img_id} {res}: {len(set(bodies))} different contents")
+            after = self._read(rec, port, img_id, res, record=False)
+            if bodies and after is not None and after != bodies[0]:
+                rec.fail(f"read {img_id} {res}: stored derivative differs from the served one")
+        for img_id in ids:
+            self._delete(rec, port, img_id, record=False)
+        return self._report("cold_thumbnails", {"clients": clients, "images": images},
+                            rec, elapsed)
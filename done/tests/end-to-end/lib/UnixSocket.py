@@ -0,0 +1,183 @@
+# Unix domain socket scenarios: an imgfs_server also listening on a
+# socket file (IMGFS_UNIX_SOCKET).
+#
+# Each scenario starts its own server, on a copy of a data file, and
+# stops it at the end. The socket file is in a temporary directory.
+
+import fcntl
+import http.client
+import json
+import os
+import shutil
+import socket
+import subprocess
+import tempfile
+
+from robot.libraries.BuiltIn import BuiltIn
+
+from Imgfs import IMAGES, copy_dump, http_exchange, http_request, read_image, start_server, stop_server
+
+
+
+class UnixHTTPConnection(http.client.HTTPConnection):
+    """An HTTP connection to a Unix domain socket."""
+
+    def __init__(self, path, timeout=30):
+        super().__init__("localhost", timeout=timeout)
+        self.path = path
+
+    def connect(self):
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+        self.sock.settimeout(self.timeout)
+        self.sock.connect(self.path)
+
+
+class UnixSocket:
+    """
+    Unix domain socket scenarios for the imgfs server.
+    """
+
+    ROBOT_LIBRARY_SCOPE = "SUITE"
+
+
+    def __init__(self, server_exec_path, loadgen_path, data_dir, host="localhost"):
+        self.builtin = BuiltIn()
+        self.server_executable = server_exec_path
+        self.loadgen = loadgen_path
+        self.data_dir = data_dir
+        self.host = host
+        self.process = None
+        self.dump = None
+        self.tmp_dir = None
+        self.socket_path = None
+
+    def _unix(self, method, path, body=None):
+        return http_exchange(UnixHTTPConnection(self.socket_path), method, path, body)
+
+    def _insert_fd(self, img_id, fd, size):
+        """Inserts the image of size bytes in the file fd, passed along the header."""
+        with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+            s.settimeout(30)
+            s.connect(self.socket_path)
+            head = (f"POST /imgfs/insert?name={img_id} HTTP/1.1\r\nHost: localhost\r\n"
+                    f"Content-Length: {size}\r\n\r\n").encode()
+            socket.send_fds(s, [head], [fd])
+            response = b""
+            while True:
+                data = s.recv(4096)
+                if not data:
+                    break
+                response += data
+        return int(response.split(b" ", 2)[1])
+
+    def _start(self, source, port):
+        def ready(process):
+            http_request(self.host, port, "GET", "/imgfs/list")
+            self._unix("GET", "/imgfs/list")
+
+        self.tmp_dir = tempfile.mkdtemp(prefix="imgfs-")
+        self.socket_path = os.path.join(self.tmp_dir, "imgfs.sock")
+        self.dump = copy_dump(self.data_dir, source, f"dump_unix_{port}.imgfs")
+        self.process = start_server(self.server_executable, self.dump, port,
+                                    env={"IMGFS_UNIX_SOCKET": self.socket_path}, ready=ready, host=self.host)
+
+    def _stop(self):
+        if self.process is None:
+            return
+        process, self.process = self.process, None
+        try:
+            stop_server(process, [self.dump])
+        finally:
+            socket_left = os.path.exists(self.socket_path)
+            shutil.rmtree(self.tmp_dir, ignore_errors=True)
+        if socket_left:
+            self.builtin.fail(f"{self.socket_path} was not removed")
+
+    def _loadgen(self, *transport):
+        result = subprocess.run([self.loadgen, *transport, "-d", "2", "-c", "4", "-n", str(len(IMAGES)),
+                                 "-m", "list=1,thumb=4,small=2", "-j"],
+                                capture_output=True, timeout=60)
+        if result.returncode != 0:
+            self.builtin.fail(f"loadgen {' '.join(transport)}: {result.stderr.decode(errors='replace')}")
+        return json.loads(result.stdout)
+
+    def unix_socket_serves_like_tcp(self, port):
+        """
+        Inserts images on the Unix domain socket, as bytes and as file
+        descriptors: they must read back the same on both transports.
+        """
+        try:
+            self._start("test02", port)
+            self.builtin.should_be_equal(self._unix("GET", "/imgfs/list"), http_request(self.host, port, "GET", "/imgfs/list"))
+
+            status, data = self._unix("POST", "/imgfs/insert?name=uds0", read_image(self.data_dir, IMAGES[0]))
+            if status != 302:
+                self.builtin.fail(f"insert uds0: status {status} {data[:100]!r}")
+
+            # a sealed memory file, mapped by the server
+            image = read_image(self.data_dir, IMAGES[1])
+            memory = os.memfd_create("imgfs-upload", os.MFD_ALLOW_SEALING)
+            try:
+                os.write(memory, image)
+                fcntl.fcntl(memory, fcntl.F_ADD_SEALS,
+                            fcntl.F_SEAL_SHRINK | fcntl.F_SEAL_GROW | fcntl.F_SEAL_WRITE)
+                self.builtin.should_be_equal_as_integers(self._insert_fd("uds1", memory, len(image)), 302)
+            finally:
+                os.close(memory)
+
+            # a memory file sealed against shrinking only, still writable: read, not mapped
+            memory = os.memfd_create("imgfs-upload", os.MFD_ALLOW_SEALING)
+            try:
+                os.write(memory, read_image(self.data_dir, IMAGES[3]))
+                fcntl.fcntl(memory, fcntl.F_ADD_SEALS, fcntl.F_SEAL_SHRINK)
+                self.builtin.should_be_equal_as_integers(
+                    self._insert_fd("uds4", memory, len(read_image(self.data_dir, IMAGES[3]))), 302)
+            finally:
+                os.close(memory)
+
+            # a plain file, read by the server
+            path = os.path.join(self.data_dir, IMAGES[2])
+            with open(path, "rb") as f:
+                size = os.fstat(f.fileno()).st_size
+                self.builtin.should_be_equal_as_integers(self._insert_fd("uds2", f.fileno(), size), 302)
+                # more bytes than the file has
+                self.builtin.should_be_equal_as_integers(self._insert_fd("uds3", f.fileno(), size + 1), 400)
+
+            for i in range(3):
+                path = f"/imgfs/read?res=orig&img_id=uds{i}"
+                status, data = http_request(self.host, port, "GET", path)
+                self.builtin.should_be_equal_as_integers(status, 200)
+                if data != read_image(self.data_dir, IMAGES[i]):
+                    self.builtin.fail(f"uds{i} read back differs")
+                self.builtin.should_be_equal(self._unix("GET", path), (status, data))
+            self.builtin.should_be_equal(http_request(self.host, port, "GET", "/imgfs/read?res=orig&img_id=uds4"),
+                                         (200, read_image(self.data_dir, IMAGES[3])))
+            images = json.loads(http_request(self.host, port, "GET", "/imgfs/list")[1])["Images"]
+            if "uds3" in images:
+                self.builtin.fail("uds3 was inserted from a file too short")
+        finally:
+            self._stop()
+
+    def unix_socket_latency_against_loopback(self, port):
+        """
+        Runs the same load on loopback TCP and on the Unix domain socket,
+        and logs the latencies of both; neither may fail a request.
+        """
+        try:
+            self._start("test02", port)
+            for i, name in enumerate(IMAGES):
+                http_request(self.host, port, "POST", f"/imgfs/insert?name=lg{i + 1}", read_image(self.data_dir, name))
+            results = {"tcp": self._loadgen("-p", str(port)),
+                       "unix": self._loadgen("-U", self.socket_path)}
+            for transport, result in results.items():
+                all_ops = {k: v for k, v in result["all"].items() if k != "histogram_ns"}
+                self.builtin.log(f"{transport}: {json.dumps(all_ops)}")
+                errors = sum(all_ops["status"].get(c, 0) for c in ("none", "4xx", "5xx"))
+                if all_ops["count"] == 0 or errors != 0:
+                    self.builtin.fail(f"{transport}: {all_ops}")
+            tcp, unix = results["tcp"]["all"], results["unix"]["all"]
+            self.builtin.log(f"p50 {tcp['percentiles_ns']['p50'] / 1e6:.3f} ms on loopback, "
+                             f"{unix['percentiles_ns']['p50'] / 1e6:.3f} ms on the Unix domain socket; "
+                             f"{tcp['rps']:.0f} and {unix['rps']:.0f} requests/s")
+        finally:
+            self._stop()
@@ -0,0 +1,219 @@
+#include "access_log.h"
+#include "error.h"
+#include "imgfs.h"
+#include "request_ctx.h"
+#include "test.h"
+#include <check.h>
+#include <fcntl.h>
+#include <json-c/json.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A finished read of a small derivative, as the handlers would leave it.
+ */
+static void fill_read(struct request_ctx* ctx, const char* img_id)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->start_ns = 1000000;
+    ctx->parsed_ns = ctx->start_ns + 2000;
+    ctx->wait_ns = 3000;
+    ctx->op_ns = 40000;
+    ctx->send_ns = 5000;
+    ctx->end_ns = ctx->start_ns + 60000;
+    ctx->lock_span = -1;
+    ctx->route = ROUTE_READ;
+    strcpy(ctx->method, "GET");
+    strncpy(ctx->img_id, img_id, MAX_IMG_ID);
+    ctx->resolution = SMALL_RES;
+    ctx->cache_hit = 1;
+    ctx->status = 200;
+    ctx->bytes = 1234;
+}
+
+static char* temp_path(char* dir, size_t size, const char* name)
+{
+    char* const path = malloc(size + strlen(name) + 2);
+    ck_assert_ptr_nonnull(path);
+    ck_assert_ptr_nonnull(mkdtemp(dir));
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
+
+// ======================================================================
+START_TEST(access_log_writes_json_lines)
+{
+    start_test_print;
+
+    char dir[] = "/tmp/imgfs-access-log-XXXXXX";
+    char* const path = temp_path(dir, sizeof(dir), "access.log");
+
+    struct request_ctx ctx;
+    ck_assert_err_none(access_log_open(path));
+    fill_read(&ctx, "pic\"1");
+    access_log_request(&ctx);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.start_ns = 1000;
+    ctx.end_ns = 2000;
+    ctx.lock_span = -1;
+    ctx.route = ROUTE_LIST;
+    strcpy(ctx.method, "GET");
+    ctx.resolution = -1;
+    ctx.cache_hit = -1;
+    ctx.status = 200;
+    access_log_request(&ctx);
+    access_log_close();
+
+    FILE* const file = fopen(path, "r");
+    ck_assert_ptr_nonnull(file);
+    char line[1024];
+
+    ck_assert_ptr_nonnull(fgets(line, sizeof(line), file));
+    json_object* obj = json_tokener_parse(line);
+    ck_assert_ptr_nonnull(obj);
+    json_object* field = NULL;
+    ck_assert(json_object_object_get_ex(obj, "ts", &field));
+    ck_assert_int_eq(strlen(json_object_get_string(field)), strlen("2024-01-01T00:00:00.000Z"));
+    ck_assert(json_object_object_get_ex(obj, "method", &field));
+    ck_assert_str_eq(json_object_get_string(field), "GET");
+    ck_assert(json_object_object_get_ex(obj, "route", &field));
+    ck_assert_str_eq(json_object_get_string(field), "read");
+    ck_assert(json_object_object_get_ex(obj, "img_id", &field));
+    ck_assert_str_eq(json_object_get_string(field), "pic\"1");
+    ck_assert(json_object_object_get_ex(obj, "res", &field));
+    ck_assert_str_eq(json_object_get_string(field), "small");
+    ck_assert(json_object_object_get_ex(obj, "status", &field));
+    ck_assert_int_eq(json_object_get_int(field), 200);
+    ck_assert(json_object_object_get_ex(obj, "bytes", &field));
+    ck_assert_int_eq(json_object_get_int(field), 1234);
+    ck_assert(json_object_object_get_ex(obj, "cache", &field));
+    ck_assert_str_eq(json_object_get_string(field), "hit");
+    ck_assert(json_object_object_get_ex(obj, "recv_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 2);
+    ck_assert(json_object_object_get_ex(obj, "wait_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 3);
+    ck_assert(json_object_object_get_ex(obj, "op_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 40);
+    ck_assert(json_object_object_get_ex(obj, "send_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 5);
+    ck_assert(json_object_object_get_ex(obj, "total_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 60);
+    json_object_put(obj);
+
+    // what a request has not is null
+    ck_assert_ptr_nonnull(fgets(line, sizeof(line), file));
+    obj = json_tokener_parse(line);
+    ck_assert_ptr_nonnull(obj);
+    ck_assert(json_object_object_get_ex(obj, "route", &field));
+    ck_assert_str_eq(json_object_get_string(field), "list");
+    ck_assert(json_object_object_get_ex(obj, "img_id", &field));
+    ck_assert_ptr_null(field);
+    ck_assert(json_object_object_get_ex(obj, "res", &field));
+    ck_assert_ptr_null(field);
+    ck_assert(json_object_object_get_ex(obj, "cache", &field));
+    ck_assert_ptr_null(field);
+    ck_assert(json_object_object_get_ex(obj, "recv_us", &field));
+    ck_assert_int_eq(json_object_get_int(field), 0);
+    json_object_put(obj);
+
+    ck_assert_ptr_null(fgets(line, sizeof(line), file));
+    fclose(file);
+    ck_assert_int_eq(access_log_dropped(), 0);
+
+    unlink(path);
+    rmdir(dir);
+    free(path);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+static void* drain_fifo(void* arg)
+{
+    const int fd = *(const int*) arg;
+    char buf[64 * 1024];
+    ssize_t n;
+    size_t* const lines = calloc(1, sizeof(size_t));
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0) {
+            usleep(1000); // nothing written yet
+            continue;
+        }
+        for (ssize_t i = 0; i < n; ++i) {
+            if (buf[i] == '\n') ++*lines;
+        }
+    }
+    return lines;
+}
+
+START_TEST(access_log_drops_when_rings_are_full)
+{
+    start_test_print;
+
+    char dir[] = "/tmp/imgfs-access-log-XXXXXX";
+    char* const path = temp_path(dir, sizeof(dir), "access.fifo");
+    ck_assert_int_eq(mkfifo(path, 0600), 0);
+
+    // a reader that does not read yet: the writer thread blocks once the pipe is full
+    int reader = open(path, O_RDONLY | O_NONBLOCK);
+    ck_assert_int_ge(reader, 0);
+    ck_assert_err_none(access_log_open(path));
+
+    char img_id[MAX_IMG_ID + 1];
+    memset(img_id, 'x', MAX_IMG_ID);
+    img_id[MAX_IMG_ID] = '\0';
+    struct request_ctx ctx;
+    fill_read(&ctx, img_id);
+
+    const uint64_t before = access_log_dropped();
+    size_t logged = 0;
+    while (access_log_dropped() == before) {
+        ck_assert_uint_lt(logged, 1000000);
+        access_log_request(&ctx);
+        ++logged;
+    }
+    // more than the rings hold: once they are all full, every line is dropped
+    for (size_t i = 0; i < 20000; ++i) access_log_request(&ctx);
+    const uint64_t full = access_log_dropped();
+    for (size_t i = 0; i < 100; ++i) access_log_request(&ctx);
+    ck_assert_uint_eq(access_log_dropped() - full, 100);
+    logged += 20100;
+    const uint64_t dropped = access_log_dropped() - before;
+
+    // the lines kept are all written once read
+    pthread_t thread;
+    ck_assert_int_eq(pthread_create(&thread, NULL, drain_fifo, &reader), 0);
+    access_log_close();
+    size_t* lines = NULL;
+    ck_assert_int_eq(pthread_join(thread, (void**) &lines), 0);
+    ck_assert_ptr_nonnull(lines);
+    ck_assert_uint_eq(*lines + dropped, logged);
+
+    free(lines);
+    close(reader);
+    unlink(path);
+    rmdir(dir);
+    free(path);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *accesslog_test_suite()
+{
+    Suite *s = suite_create("Tests of the access log");
+
+    Add_Test(s, access_log_writes_json_lines);
+    Add_Test(s, access_log_drops_when_rings_are_full);
+
+    return s;
+}
+
+TEST_SUITE(accesslog_test_suite)
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE // for memmem
+#include "error.h"
+#include "imgfs.h"
+#include "imgfs_client.h"
+#include "socket_layer.h"
+#include "test.h"
+#include <check.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * A fake server, on a Unix domain socket, serving one connection at a
+ * time: a read replies its query string, "missing" images are not found,
+ * and inserts are answered 302. With keep_alive off, it closes each
+ * connection after one response, as a server not keeping them alive.
+ */
+struct fake_server {
+    char dir[64];
+    char path[128];
+    int listener;
+    int keep_alive;
+    pthread_t thread;
+
+    // counted by the server
+    int connections;
+    int requests;
+    size_t bytes_inserted;
+};
+
+static int send_all(int fd, const char* data, size_t size)
+{
+    while (size > 0) {
+        const ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+        if (sent <= 0) return -1;
+        data += sent;
+        size -= (size_t) sent;
+    }
+    return 0;
+}
+
+static int reply(struct fake_server* server, int fd, const char* head)
+{
+    char query[256] = "";
+    sscanf(head, "%*s %*[^?]?%255s", query);
+    const char* const connection = server->keep_alive ? "Connection: keep-alive\r\n" : "";
+
+    char response[1024];
+    if (strncmp(head, "POST", 4) == 0) {
+        snprintf(response, sizeof(response), "HTTP/1.1 302 Found\r\n%sContent-Length: 0\r\n\r\n", connection);
+    } else if (strstr(query, "missing") != NULL) {
+        char body[128];
+        snprintf(body, sizeof(body), "Error: %s\n", ERR_MSG(ERR_IMAGE_NOT_FOUND));
+        snprintf(response, sizeof(response), "HTTP/1.1 500 Internal Server Error\r\n%s"
+                 "Content-Length: %zu\r\n\r\n%s", connection, strlen(body), body);
+    } else {
+        snprintf(response, sizeof(response), "HTTP/1.1 200 OK\r\n%sContent-Length: %zu\r\n\r\n%s",
+                 connection, strlen(query), query);
+    }
+    ++server->requests;
+    return send_all(fd, response, strlen(response));
+}
+
+static void serve(struct fake_server* server, int fd)
+{
+    char* const buffer = malloc(1 << 20);
+    size_t filled = 0;
+    for (;;) {
+        char* const end = filled > 0 ? memmem(buffer, filled, "\r\n\r\n", 4) : NULL;
+        if (end == NULL) {
+            const ssize_t got = recv(fd, buffer + filled, (1 << 20) - filled, 0);
+            if (got <= 0) break;
+            filled += (size_t) got;
+            continue;
+        }
+        const size_t head_size = (size_t) (end - buffer) + 4;
+        size_t content_len = 0;
+        *end = '\0';
+        const char* const length = strstr(buffer, "Content-Length: ");
+        if (length != NULL) content_len = strtoul(length + strlen("Content-Length: "), NULL, 10);
+        while (filled < head_size + content_len) {
+            const ssize_t got = recv(fd, buffer + filled, (1 << 20) - filled, 0);
+            if (got <= 0) goto done;
+            filled += (size_t) got;
+        }
+        server->bytes_inserted += content_len;
+        if (reply(server, fd, buffer) != 0 || !server->keep_alive) break;
+        filled -= head_size + content_len;
+        memmove(buffer, buffer + head_size + content_len, filled);
+    }
+done:
+    free(buffer);
+    close(fd);
+}
+
+static void* fake_server_main(void* arg)
+{
+    struct fake_server* const server = arg;
+    int fd;
+    while ((fd = accept(server->listener, NULL, NULL)) >= 0) {
+        ++server->connections;
+        serve(server, fd);
+    }
+    return NULL;
+}
+
+static void fake_server_start(struct fake_server* server, int keep_alive)
+{
+    memset(server, 0, sizeof(*server));
+    strcpy(server->dir, "/tmp/imgfs-client-XXXXXX");
+    ck_assert_ptr_nonnull(mkdtemp(server->dir));
+    snprintf(server->path, sizeof(server->path), "%s/imgfs.sock", server->dir);
+    server->keep_alive = keep_alive;
+    server->listener = unix_server_init(server->path);
+    ck_assert_int_ge(server->listener, 0);
+    ck_assert_int_eq(pthread_create(&server->thread, NULL, fake_server_main, server), 0);
+}
+
+static void fake_server_stop(struct fake_server* server)
+{
+    shutdown(server->listener, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listener);
+    unlink(server->path);
+    rmdir(server->dir);
+}
+
+static struct imgfs_client* open_client(const struct fake_server* server)
+{
+    struct imgfs_client_config config;
+    memset(&config, 0, sizeof(config));
+    config.unix_path = server->path;
+    config.max_connections = 1;
+    struct imgfs_client* client = NULL;
+    ck_assert_err_none(imgfs_client_open(&config, &client));
+    return client;
+}
+
+// ======================================================================
+START_TEST(client_null_params)
+{
+    start_test_print;
+
+    struct imgfs_client_config config;
+    memset(&config, 0, sizeof(config));
+    struct imgfs_client* client = NULL;
+    ck_assert_invalid_arg(imgfs_client_open(NULL, &client));
+    ck_assert_invalid_arg(imgfs_client_open(&config, NULL));
+    // neither a port nor a socket
+    ck_assert_invalid_arg(imgfs_client_open(&config, &client));
+
+    config.port = 8000;
+    ck_assert_err_none(imgfs_client_open(&config, &client));
+    ck_assert_invalid_arg(imgfs_client_run(client, NULL, 1));
+    ck_assert_invalid_arg(imgfs_client_read_batch(client, THUMB_RES, NULL, 1));
+    imgfs_client_close(client);
+    imgfs_client_close(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(client_pipelines_on_one_connection)
+{
+    start_test_print;
+
+    struct fake_server server;
+    fake_server_start(&server, 1);
+    struct imgfs_client* const client = open_client(&server);
+
+    enum { COUNT = 50 };
+    char ids[COUNT][16];
+    char bodies[COUNT][64];
+    struct imgfs_batch_item items[COUNT];
+    for (size_t i = 0; i < COUNT; ++i) {
+        snprintf(ids[i], sizeof(ids[i]), "pic%zu", i);
+        items[i].img_id = ids[i];
+        items[i].data = bodies[i];
+        items[i].size = sizeof(bodies[i]);
+    }
+    ck_assert_err_none(imgfs_client_read_batch(client, SMALL_RES, items, COUNT));
+    for (size_t i = 0; i < COUNT; ++i) {
+        char expected[64];
+        snprintf(expected, sizeof(expected), "res=small&img_id=pic%zu", i);
+        ck_assert_err_none(items[i].err);
+        ck_assert_uint_eq(items[i].size, strlen(expected));
+        ck_assert_mem_eq(bodies[i], expected, items[i].size);
+    }
+
+    // a body larger than its buffer
+    char small[4];
+    size_t size = 0;
+    ck_assert_err(imgfs_client_read(client, "pic1", ORIG_RES, small, sizeof(small), &size), ERR_OUT_OF_MEMORY);
+    ck_assert_uint_eq(size, strlen("res=orig&img_id=pic1"));
+    ck_assert_mem_eq(small, "res=", sizeof(small));
+
+    const char image[] = "not quite a JPEG";
+    struct imgfs_batch_item inserts[3] = {
+        { "new0", (void*) (uintptr_t) image, sizeof(image), 0 },
+        { "new1", (void*) (uintptr_t) image, sizeof(image), 0 },
+        { "new2", (void*) (uintptr_t) image, sizeof(image), 0 }
+    };
+    ck_assert_err_none(imgfs_client_insert_batch(client, inserts, 3));
+
+    imgfs_client_close(client);
+    fake_server_stop(&server);
+    ck_assert_int_eq(server.connections, 1);
+    ck_assert_int_eq(server.requests, COUNT + 4);
+    ck_assert_uint_eq(server.bytes_inserted, 3 * sizeof(image));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(client_maps_replied_errors)
+{
+    start_test_print;
+
+    struct fake_server server;
+    fake_server_start(&server, 1);
+    struct imgfs_client* const client = open_client(&server);
+
+    char body[64];
+    size_t size = 0;
+    ck_assert_err(imgfs_client_read(client, "missing", THUMB_RES, body, sizeof(body), &size),
+                  ERR_IMAGE_NOT_FOUND);
+    ck_assert_uint_eq(size, 0);
+    ck_assert_err(imgfs_client_read(client, "pic", NB_RES, body, sizeof(body), &size), ERR_RESOLUTIONS);
+    ck_assert_err(imgfs_client_delete(client, "a b"), ERR_INVALID_IMGID);
+    ck_assert_err(imgfs_client_delete(client, "a&res=orig"), ERR_INVALID_IMGID);
+
+    // an error does not stop the others of a batch
+    struct imgfs_batch_item items[3] = {
+        { "pic0", body, sizeof(body), 0 }, { "missing", NULL, 0, 0 }, { "pic2", body, sizeof(body), 0 }
+    };
+    ck_assert_err(imgfs_client_read_batch(client, THUMB_RES, items, 3), ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(items[0].err);
+    ck_assert_err(items[1].err, ERR_IMAGE_NOT_FOUND);
+    ck_assert_err_none(items[2].err);
+
+    imgfs_client_close(client);
+    fake_server_stop(&server);
+    ck_assert_int_eq(server.connections, 1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(client_reconnects_when_server_closes)
+{
+    start_test_print;
+
+    struct fake_server server;
+    fake_server_start(&server, 0);
+    struct imgfs_client* const client = open_client(&server);
+
+    enum { COUNT = 5 };
+    char bodies[COUNT][64];
+    struct imgfs_batch_item items[COUNT];
+    for (size_t i = 0; i < COUNT; ++i) {
+        items[i].img_id = "pic";
+        items[i].data = bodies[i];
+        items[i].size = sizeof(bodies[i]);
+    }
+    ck_assert_err_none(imgfs_client_read_batch(client, THUMB_RES, items, COUNT));
+    for (size_t i = 0; i < COUNT; ++i) {
+        ck_assert_err_none(items[i].err);
+        ck_assert_mem_eq(bodies[i], "res=thumb&img_id=pic", items[i].size);
+    }
+
+    imgfs_client_close(client);
+    fake_server_stop(&server);
+    ck_assert_int_eq(server.connections, COUNT);
+    ck_assert_int_eq(server.requests, COUNT);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *client_test_suite()
+{
+    Suite *s = suite_create("Tests of the client library");
+
+    Add_Test(s, client_null_params);
+    Add_Test(s, client_pipelines_on_one_connection);
+    Add_Test(s, client_maps_replied_errors);
+    Add_Test(s, client_reconnects_when_server_closes);
+
+    return s;
+}
+
+TEST_SUITE(client_test_suite)
@@ -316,6 +316,75 @@ START_TEST(http_match_verb_additional_tests)
 }
 END_TEST
 
+// ======================================================================
+static int accept_quality(const char *accept, const char *mime_type)
+{
+    const struct http_string value = { accept, strlen(accept) };
+    return http_accept_quality(&value, mime_type);
+}
+
+START_TEST(http_accept_quality_null_params)
+{
+    start_test_print;
+
+    const struct http_string value = { "image/webp", 10 };
+    const struct http_string no_value = { NULL, 0 };
+
+    ck_assert_int_eq(http_accept_quality(NULL, "image/webp"), -1);
+    ck_assert_int_eq(http_accept_quality(&no_value, "image/webp"), -1);
+    ck_assert_int_eq(http_accept_quality(&value, NULL), -1);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_accept_quality_valid)
+{
+    start_test_print;
+
+    ck_assert_int_eq(accept_quality("image/webp", "image/webp"), 1000);
+    ck_assert_int_eq(accept_quality("image/webp;q=0", "image/webp"), 0);
+    ck_assert_int_eq(accept_quality("image/webp;q=0.000", "image/webp"), 0);
+    ck_assert_int_eq(accept_quality("image/webp;q=0.8", "image/webp"), 800);
+    ck_assert_int_eq(accept_quality("image/webp;q=0.85", "image/webp"), 850);
+    ck_assert_int_eq(accept_quality("image/webp;q=0.125", "image/webp"), 125);
+    ck_assert_int_eq(accept_quality("image/webp;q=1.0", "image/webp"), 1000);
+    ck_assert_int_eq(accept_quality("image/webp;level=1;q=0.5", "image/webp"), 500);
+
+    // mixed case
+    ck_assert_int_eq(accept_quality("Image/WebP;Q=0.5", "image/webp"), 500);
+    ck_assert_int_eq(accept_quality("image/avif,IMAGE/WEBP", "image/webp"), 1000);
+
+    // whitespace around the ranges and parameters
+    ck_assert_int_eq(accept_quality("image/avif , image/webp ; q=0.7 ,*/*", "image/webp"), 700);
+    ck_assert_int_eq(accept_quality("  image/webp  ", "image/webp"), 1000);
+
+    // the first range of the type counts
+    ck_assert_int_eq(accept_quality("image/avif;q=0.9,image/webp;q=0.3", "image/avif"), 900);
+    ck_assert_int_eq(accept_quality("image/avif;q=0.9,image/webp;q=0.3", "image/webp"), 300);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(http_accept_quality_not_listed)
+{
+    start_test_print;
+
+    ck_assert_int_eq(accept_quality("", "image/webp"), -1);
+    ck_assert_int_eq(accept_quality("image/avif;q=0.9", "image/webp"), -1);
+    ck_assert_int_eq(accept_quality("image/webpx,image/web", "image/webp"), -1);
+    // wildcards are not ranges of the type: a read then falls back to JPEG
+    ck_assert_int_eq(accept_quality("*/*", "image/webp"), -1);
+    ck_assert_int_eq(accept_quality("*/*", "image/jpeg"), -1);
+    ck_assert_int_eq(accept_quality("image/*", "image/webp"), -1);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *http_test_suite()
 {
@@ -341,6 +410,10 @@ Suite *http_test_suite()
     Add_Test(s, http_parse_message_full_headers_partial_content);
     Add_Test(s, http_parse_message_full_headers_full_content);
 
+    Add_Test(s, http_accept_quality_null_params);
+    Add_Test(s, http_accept_quality_valid);
+    Add_Test(s, http_accept_quality_not_listed);
+
     return s;
 }
 
@@ -1,4 +1,5 @@
 #include "imgfs.h"
+#include "imgfs_ext.h"
 #include "test.h"
 #include <check.h>
 #include <string.h>
@@ -253,6 +254,60 @@ START_TEST(do_insert_valid)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(do_insert_optimize)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[82234];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    read_file(image, DATA_DIR "/brouillard.jpg", 82234);
+
+    ck_assert_err_none(do_insert_flags(image, 82234, "pic3", &file, INSERT_OPTIMIZE));
+    do_close(&file);
+
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    size_t index = file.header.max_files;
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        if (strcmp(file.metadata[i].img_id, "pic3") == 0) {
+            index = i;
+            break;
+        }
+    }
+    ck_assert_msg(index < file.header.max_files, "the inserted metadata could not be found by image id");
+    const struct img_metadata* md = &file.metadata[index];
+
+    // the SHA is that of the uploaded bytes, the stored ones are smaller
+    unsigned char uploaded_sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) image, 82234, uploaded_sha);
+    ck_assert_mem_eq(md->SHA, uploaded_sha, SHA256_DIGEST_LENGTH);
+    ck_assert_int_lt(md->size[ORIG_RES], 82234);
+    ck_assert_int_eq(md->offset[ORIG_RES], 192659);
+
+    struct imgfs_ext_record* records = NULL;
+    ck_assert_err_none(imgfs_ext_get(&file, 0, &records));
+    ck_assert_ptr_nonnull(records);
+    ck_assert_int_eq(records[index].uploaded_size, 82234);
+
+    char* stored = NULL;
+    uint32_t stored_size = 0;
+    ck_assert_err_none(do_read("pic3", ORIG_RES, &stored, &stored_size, &file));
+    ck_assert_int_eq(stored_size, md->size[ORIG_RES]);
+    unsigned char stored_sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*) stored, stored_size, stored_sha);
+    ck_assert_mem_eq(records[index].stored_SHA, stored_sha, SHA256_DIGEST_LENGTH);
+    free(stored);
+
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 START_TEST(do_insert_write_correct_metadata)
 {
@@ -350,6 +405,7 @@ Suite *imgfs_content_test_suite()
     Add_Test(s, do_insert_invalid_file_mode);
     Add_Test(s, do_insert_duplicate);
     Add_Test(s, do_insert_valid);
+    Add_Test(s, do_insert_optimize);
     Add_Test(s, do_insert_write_correct_metadata);
     Add_Test(s, do_insert_write_initializes_metadata);
 
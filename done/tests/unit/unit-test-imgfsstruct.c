@@ -16,6 +16,7 @@
 #define OFFSET_img_metadata_SHA      128
 #define OFFSET_img_metadata_orig_res 160
 #define OFFSET_img_metadata_size     168
+#define OFFSET_img_metadata_version  180
 #define OFFSET_img_metadata_offset   184
 #define OFFSET_img_metadata_is_valid 208
 
@@ -73,6 +74,7 @@ START_TEST(img_metadata)
     test_member(img_metadata, SHA);
     test_member(img_metadata, orig_res);
     test_member(img_metadata, size);
+    test_member(img_metadata, version);
     test_member(img_metadata, offset);
     test_member(img_metadata, is_valid);
 
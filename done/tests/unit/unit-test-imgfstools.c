@@ -137,6 +137,78 @@ START_TEST(do_close_null_file)
 }
 END_TEST
 
+// ======================================================================
+START_TEST(encoding_parse_valid)
+{
+    start_test_print;
+
+    uint16_t enc = 1;
+    ck_assert_err_none(encoding_parse("default", &enc));
+    ck_assert_int_eq(enc, 0);
+
+    ck_assert_err_none(encoding_parse("q=60,strip,progressive,subsample=off,optimize", &enc));
+    ck_assert_int_eq(enc & ENC_QUALITY, 60);
+    ck_assert_int_eq(enc & ENC_SUBSAMPLE, ENC_SUBSAMPLE_OFF);
+    ck_assert(enc & ENC_STRIP);
+    ck_assert(enc & ENC_PROGRESSIVE);
+    ck_assert(enc & ENC_OPTIMIZE);
+
+    char str[MAX_ENCODING_STR + 1];
+    encoding_to_string(enc, str);
+    ck_assert_str_eq(str, "q=60,strip,progressive,subsample=off,optimize");
+
+    uint16_t again = 0;
+    ck_assert_err_none(encoding_parse(str, &again));
+    ck_assert_int_eq(again, enc);
+
+    encoding_to_string(0, str);
+    ck_assert_str_eq(str, "default");
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(encoding_parse_invalid)
+{
+    start_test_print;
+
+    uint16_t enc = 0;
+    ck_assert_invalid_arg(encoding_parse(NULL, &enc));
+    ck_assert_invalid_arg(encoding_parse("q=60", NULL));
+    ck_assert_invalid_arg(encoding_parse("q=0", &enc));
+    ck_assert_invalid_arg(encoding_parse("q=101", &enc));
+    ck_assert_invalid_arg(encoding_parse("subsample=maybe", &enc));
+    ck_assert_invalid_arg(encoding_parse("strip,,optimize", &enc));
+    ck_assert_invalid_arg(encoding_parse("lossless", &enc));
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(format_atoi_names)
+{
+    start_test_print;
+
+    ck_assert_int_eq(format_atoi("jpeg"), FORMAT_JPEG);
+    ck_assert_int_eq(format_atoi("jpg"), FORMAT_JPEG);
+    ck_assert_int_eq(format_atoi("webp"), FORMAT_WEBP);
+    ck_assert_int_eq(format_atoi("avif"), FORMAT_AVIF);
+    ck_assert_int_eq(format_atoi("png"), -1);
+    ck_assert_int_eq(format_atoi(NULL), -1);
+
+    for (int format = 0; format < NB_FORMATS; ++format) {
+        ck_assert_int_eq(format_atoi(format_name(format)), format);
+        ck_assert_ptr_nonnull(format_mime_type(format));
+    }
+    ck_assert_ptr_null(format_name(NB_FORMATS));
+    ck_assert_ptr_null(format_mime_type(-1));
+
+    end_test_print;
+}
+END_TEST
+
 // ======================================================================
 Suite *imgfs_tools_suite_RES()
 {
@@ -151,6 +223,10 @@ Suite *imgfs_tools_suite_RES()
     Add_Test(s, do_close_null_param);
     Add_Test(s, do_close_null_file);
 
+    Add_Test(s, encoding_parse_valid);
+    Add_Test(s, encoding_parse_invalid);
+    Add_Test(s, format_atoi_names);
+
     return s;
 }
 
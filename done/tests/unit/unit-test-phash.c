@@ -0,0 +1,111 @@
+#include "image_phash.h"
+#include "phash_index.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+
+/**
+ * @brief A smooth image (a gradient and a bright disk, as placed by
+ *        variant), shifted in brightness and with some noise.
+ */
+static void draw(unsigned char* pixels, int variant, int brightness, int noise)
+{
+    srand(42);
+    for (int y = 0; y < PHASH_SIDE; ++y) {
+        for (int x = 0; x < PHASH_SIDE; ++x) {
+            int v = variant ? 200 - 4 * x + 2 * y : 4 * x + 2 * y;
+            const int dx = x - (variant ? 8 : 20);
+            const int dy = y - (variant ? 24 : 12);
+            if (dx * dx + dy * dy < 36) v += 60;
+            v += brightness + (noise > 0 ? rand() % (2 * noise + 1) - noise : 0);
+            pixels[y * PHASH_SIDE + x] = (unsigned char) (v < 0 ? 0 : v > 255 ? 255 : v);
+        }
+    }
+}
+
+START_TEST(phash_near_copies)
+{
+    start_test_print;
+
+    unsigned char original[PHASH_SIDE * PHASH_SIDE];
+    unsigned char copy[PHASH_SIDE * PHASH_SIDE];
+    unsigned char other[PHASH_SIDE * PHASH_SIDE];
+    draw(original, 0, 0, 0);
+    draw(copy, 0, 10, 3);
+    draw(other, 1, 0, 0);
+
+    const uint64_t h = phash_of_pixels(original);
+    ck_assert_uint_eq(phash_of_pixels(original), h);
+    ck_assert_uint_le(phash_distance(h, phash_of_pixels(copy)), PHASH_DEFAULT_DISTANCE);
+    ck_assert_uint_gt(phash_distance(h, phash_of_pixels(other)), PHASH_DEFAULT_DISTANCE);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(phash_index_matches_linear_scan)
+{
+    start_test_print;
+
+    enum { N = 2000, QUERIES = 50 };
+    uint64_t* const hashes = calloc(N, sizeof(uint64_t));
+    struct phash_match* const matches = calloc(N, sizeof(struct phash_match));
+    ck_assert_ptr_nonnull(hashes);
+    ck_assert_ptr_nonnull(matches);
+
+    struct phash_index index;
+    phash_index_init(&index);
+    srand(7);
+    for (uint32_t i = 0; i < N; ++i) {
+        // clusters of near hashes, as near-duplicates make
+        hashes[i] = i % 10 == 0 ? ((uint64_t) rand() << 33) ^ ((uint64_t) rand() << 2)
+                    : hashes[i - 1] ^ ((uint64_t) 1 << (rand() % PHASH_BITS));
+        ck_assert_err_none(phash_index_add(&index, hashes[i], i));
+    }
+
+    for (unsigned max_distance = 0; max_distance <= 10; max_distance += 5) {
+        for (uint32_t q = 0; q < QUERIES; ++q) {
+            const uint64_t hash = hashes[(q * 37) % N] ^ ((uint64_t) 1 << q);
+            size_t nb_matches = 0;
+            ck_assert_err_none(phash_index_query(&index, hash, max_distance, matches, N, &nb_matches));
+
+            size_t expected = 0;
+            for (uint32_t i = 0; i < N; ++i) {
+                if (phash_distance(hash, hashes[i]) <= max_distance) ++expected;
+            }
+            ck_assert_uint_eq(nb_matches, expected);
+            for (size_t m = 0; m < nb_matches; ++m) {
+                ck_assert_uint_eq(matches[m].distance, phash_distance(hash, hashes[matches[m].id]));
+                ck_assert_uint_le(matches[m].distance, max_distance);
+            }
+        }
+    }
+
+    size_t nb_matches = 0;
+    ck_assert_err_none(phash_index_query(&index, hashes[0], 0, matches, 0, &nb_matches));
+    ck_assert_uint_eq(nb_matches, 0);
+    ck_assert_invalid_arg(phash_index_query(NULL, 0, 0, matches, N, &nb_matches));
+    ck_assert_invalid_arg(phash_index_add(NULL, 0, 0));
+
+    phash_index_free(&index);
+    ck_assert_uint_eq(index.nb_nodes, 0);
+    free(matches);
+    free(hashes);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *phash_test_suite()
+{
+    Suite *s = suite_create("Tests of the perceptual hashes and their index");
+
+    Add_Test(s, phash_near_copies);
+    Add_Test(s, phash_index_matches_linear_scan);
+
+    return s;
+}
+
+TEST_SUITE(phash_test_suite)
@@ -0,0 +1,288 @@
+#include "imgfs.h"
+#include "imgfs_ext.h"
+#include "imgfs_snapshot.h"
+#include "test.h"
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vips/vips.h>
+
+struct stream_buffer {
+    char* bytes;
+    size_t size;
+};
+
+static int append(void* arg, const char* bytes, size_t size)
+{
+    struct stream_buffer* const buffer = arg;
+    char* const grown = realloc(buffer->bytes, buffer->size + size);
+    if (grown == NULL) return ERR_OUT_OF_MEMORY;
+    memcpy(grown + buffer->size, bytes, size);
+    buffer->bytes = grown;
+    buffer->size += size;
+    return ERR_NONE;
+}
+
+static int fail_sink(void* arg, const char* bytes, size_t size)
+{
+    (void) arg;
+    (void) bytes;
+    (void) size;
+    return ERR_RUNTIME;
+}
+
+// ======================================================================
+START_TEST(snapshot_null_params)
+{
+    start_test_print;
+
+    struct imgfs_file file;
+    struct imgfs_snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+
+    ck_assert_invalid_arg(imgfs_snapshot_pin(NULL, "x", &snapshot));
+    ck_assert_invalid_arg(imgfs_snapshot_pin(&file, "x", NULL));
+    ck_assert_invalid_arg(imgfs_snapshot_stream(NULL, append, NULL));
+    ck_assert_invalid_arg(imgfs_snapshot_stream(&snapshot, append, NULL));
+    imgfs_snapshot_release(NULL);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_of_unchanged_volume)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    struct imgfs_file file;
+    struct imgfs_snapshot snapshot;
+    struct stream_buffer stream = { NULL, 0 };
+    void* expected = NULL;
+    size_t expected_size = 0;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    read_file_and_size(&expected, dump, &expected_size);
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+
+    ck_assert_err_none(imgfs_snapshot_pin(&file, dump, &snapshot));
+    ck_assert_uint_eq(snapshot.size, expected_size);
+    ck_assert_uint_eq(snapshot.header.version, file.header.version);
+    ck_assert_err_none(imgfs_snapshot_stream(&snapshot, append, &stream));
+    ck_assert_uint_eq(stream.size, expected_size);
+    ck_assert_mem_eq(stream.bytes, expected, expected_size);
+    ck_assert_err(imgfs_snapshot_stream(&snapshot, fail_sink, NULL), ERR_RUNTIME);
+
+    imgfs_snapshot_release(&snapshot);
+    ck_assert_ptr_null(snapshot.file);
+    do_close(&file);
+    free(stream.bytes);
+    free(expected);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(snapshot_ignores_later_changes)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+    struct imgfs_snapshot snapshot;
+    struct stream_buffer stream = { NULL, 0 };
+    struct imgfs_ext_record* records = NULL;
+    void* expected = NULL;
+    size_t expected_size = 0;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    read_file(image, DATA_DIR "/papillon.jpg", sizeof(image));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    // an extension table, rewritten in place afterwards
+    ck_assert_err_none(imgfs_ext_get(&file, 1, &records));
+    records[0].flags = EXT_PHASH;
+    records[0].phash = 42;
+    ck_assert_err_none(imgfs_ext_store(&file, 0));
+    ck_assert_int_eq(fflush(file.file), 0);
+    read_file_and_size(&expected, dump, &expected_size);
+
+    ck_assert_err_none(imgfs_snapshot_pin(&file, dump, &snapshot));
+    ck_assert_ptr_nonnull(snapshot.ext);
+    records[0].phash = 43;
+    ck_assert_err_none(imgfs_ext_store(&file, 0));
+    ck_assert_err_none(do_insert(image, sizeof(image), "pic3", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_int_eq(fflush(file.file), 0);
+
+    ck_assert_err_none(imgfs_snapshot_stream(&snapshot, append, &stream));
+    ck_assert_uint_eq(stream.size, expected_size);
+    ck_assert_mem_eq(stream.bytes, expected, expected_size);
+
+    imgfs_snapshot_release(&snapshot);
+    do_close(&file);
+    free(stream.bytes);
+    free(expected);
+
+    end_test_print;
+}
+END_TEST
+
+static int write_file(void* file, const char* bytes, size_t size)
+{
+    return fwrite(bytes, size, 1, file) == 1 ? ERR_NONE : ERR_IO;
+}
+
+/**
+ * @brief Exports a volume since a version, then imports it into another.
+ */
+static void export_import(const char* from, uint32_t since, struct imgfs_file* to)
+{
+    struct imgfs_file file;
+    struct imgfs_snapshot snapshot;
+    uint64_t size = 0;
+    FILE* const exported = tmpfile();
+    ck_assert_ptr_nonnull(exported);
+
+    ck_assert_err_none(do_open(from, "rb", &file));
+    ck_assert_err_none(imgfs_snapshot_pin(&file, from, &snapshot));
+    do_close(&file);
+    ck_assert_err_none(imgfs_export_size(&snapshot, since, &size));
+    ck_assert_err_none(imgfs_export(&snapshot, since, write_file, exported));
+    ck_assert_int_eq(ftell(exported), (long) size);
+    imgfs_snapshot_release(&snapshot);
+
+    rewind(exported);
+    ck_assert_err_none(imgfs_import(to, exported));
+    fclose(exported);
+}
+
+// ======================================================================
+START_TEST(entries_record_their_version)
+{
+    start_test_print;
+
+    DECLARE_DUMP;
+    char image[72876];
+    struct imgfs_file file;
+
+    DUPLICATE_FILE(dump, IMGFS("test02"));
+    read_file(image, DATA_DIR "/papillon.jpg", sizeof(image));
+    ck_assert_err_none(do_open(dump, "rb+", &file));
+    const uint32_t version = file.header.version;
+
+    ck_assert_err_none(do_insert(image, sizeof(image), "pic3", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    ck_assert_uint_eq(file.header.version, version + 2);
+    ck_assert_uint_eq(file.metadata[2].version, version + 1);
+    ck_assert_uint_eq(file.metadata[0].version, version + 2);
+    ck_assert_uint_lt(file.metadata[1].version, version + 1);
+    do_close(&file);
+
+    // as written
+    ck_assert_err_none(do_open(dump, "rb", &file));
+    ck_assert_uint_eq(file.metadata[2].version, version + 1);
+    ck_assert_uint_eq(file.metadata[0].version, version + 2);
+    do_close(&file);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+START_TEST(incremental_exports_restore_the_volume)
+{
+    start_test_print;
+
+    DECLARE_DUMP_PREFIXED(src);
+    DECLARE_DUMP_PREFIXED(dst);
+    char image[72876];
+    struct imgfs_file file;
+    struct imgfs_file restored;
+    uint64_t size = 0;
+
+    DUPLICATE_FILE(dumpsrc, IMGFS("test02"));
+    read_file(image, DATA_DIR "/papillon.jpg", sizeof(image));
+    ck_assert_err_none(do_open(dumpsrc, "rb", &file));
+    memset(&restored, 0, sizeof(restored));
+    restored.header.max_files = file.header.max_files;
+    memcpy(restored.header.resized_res, file.header.resized_res, sizeof(restored.header.resized_res));
+    do_close(&file);
+    ck_assert_err_none(do_create(dumpdst, &restored));
+    do_close(&restored);
+    ck_assert_err_none(do_open(dumpdst, "rb+", &restored));
+
+    export_import(dumpsrc, 0, &restored);
+    const uint32_t since = restored.header.version;
+    ck_assert_err_none(do_open(dumpsrc, "rb+", &file));
+    ck_assert_err_none(do_insert(image, sizeof(image), "pic3", &file));
+    ck_assert_err_none(do_insert(image, sizeof(image), "pic4", &file));
+    ck_assert_err_none(do_delete("pic1", &file));
+    do_close(&file);
+
+    // only the changes
+    struct imgfs_snapshot snapshot;
+    ck_assert_err_none(do_open(dumpsrc, "rb", &file));
+    ck_assert_err_none(imgfs_snapshot_pin(&file, dumpsrc, &snapshot));
+    ck_assert_err_none(imgfs_export_size(&snapshot, since, &size));
+    ck_assert_uint_eq(size, sizeof(struct imgfs_export_header) + 3 * sizeof(struct imgfs_export_entry)
+                      + 2 * sizeof(image));
+    imgfs_snapshot_release(&snapshot);
+
+    export_import(dumpsrc, since, &restored);
+    ck_assert_uint_eq(restored.header.version, file.header.version);
+    ck_assert_uint_eq(restored.header.nb_files, file.header.nb_files);
+    for (uint32_t i = 0; i < file.header.max_files; ++i) {
+        ck_assert_uint_eq(restored.metadata[i].is_valid, file.metadata[i].is_valid);
+        if (file.metadata[i].is_valid != NON_EMPTY) continue;
+        ck_assert_str_eq(restored.metadata[i].img_id, file.metadata[i].img_id);
+        ck_assert_uint_eq(restored.metadata[i].version, file.metadata[i].version);
+        ck_assert_uint_eq(restored.metadata[i].size[ORIG_RES], file.metadata[i].size[ORIG_RES]);
+    }
+    // pic3 and pic4 share their original again
+    ck_assert_uint_eq(restored.metadata[2].offset[ORIG_RES], restored.metadata[3].offset[ORIG_RES]);
+
+    char* read = NULL;
+    uint32_t read_size = 0;
+    ck_assert_err_none(do_read("pic4", ORIG_RES, &read, &read_size, &restored));
+    ck_assert_uint_eq(read_size, sizeof(image));
+    ck_assert_mem_eq(read, image, sizeof(image));
+    free(read);
+
+    // not at the version exported since
+    FILE* const empty = tmpfile();
+    struct imgfs_export_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, EXPORT_MAGIC, sizeof(header.magic));
+    header.since = since;
+    header.version = since;
+    header.max_files = restored.header.max_files;
+    ck_assert_uint_eq(fwrite(&header, sizeof(header), 1, empty), 1);
+    rewind(empty);
+    ck_assert_invalid_arg(imgfs_import(&restored, empty));
+    fclose(empty);
+
+    do_close(&file);
+    do_close(&restored);
+
+    end_test_print;
+}
+END_TEST
+
+// ======================================================================
+Suite *snapshot_test_suite()
+{
+    Suite *s = suite_create("Tests of the snapshots of a changing volume");
+
+    Add_Test(s, snapshot_null_params);
+    Add_Test(s, snapshot_of_unchanged_volume);
+    Add_Test(s, snapshot_ignores_later_changes);
+    Add_Test(s, entries_record_their_version);
+    Add_Test(s, incremental_exports_restore_the_volume);
+
+    return s;
+}
+
+TEST_SUITE_VIPS(snapshot_test_suite)
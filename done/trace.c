@@ -0,0 +1,81 @@
+/**
+ * @file trace.c
+ * @brief Per-thread tracing of the phases of a request.
+ */
+
+#include <time.h>
+
+#include "trace.h"
+
+static _Thread_local struct trace current;
+
+uint64_t trace_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+void trace_start(void)
+{
+    current.active = 1;
+    current.start_ns = trace_now_ns();
+    current.end_ns = 0;
+    current.depth = 0;
+    current.nb_spans = 0;
+    current.dropped_spans = 0;
+}
+
+const struct trace* trace_stop(void)
+{
+    if (current.active) {
+        current.end_ns = trace_now_ns();
+        for (size_t i = 0; i < current.nb_spans; ++i) {
+            if (current.spans[i].end_ns == 0) current.spans[i].end_ns = current.end_ns;
+        }
+        current.active = 0;
+    }
+    return &current;
+}
+
+int trace_span_begin(const char* name)
+{
+    if (!current.active) return -1;
+    if (current.nb_spans >= TRACE_MAX_SPANS) {
+        ++current.dropped_spans;
+        return -1;
+    }
+
+    struct trace_span* const s = &current.spans[current.nb_spans];
+    s->name = name;
+    s->start_ns = trace_now_ns();
+    s->end_ns = 0;
+    s->depth = current.depth++;
+    return (int) current.nb_spans++;
+}
+
+void trace_span_end(int span)
+{
+    if (!current.active || span < 0 || (size_t) span >= current.nb_spans) return;
+
+    const uint64_t now = trace_now_ns();
+    for (size_t i = (size_t) span; i < current.nb_spans; ++i) {
+        if (current.spans[i].end_ns == 0) current.spans[i].end_ns = now;
+    }
+    current.depth = current.spans[span].depth;
+}
+
+void trace_span_add(const char* name, uint64_t start_ns, uint64_t end_ns)
+{
+    if (!current.active) return;
+    if (current.nb_spans >= TRACE_MAX_SPANS) {
+        ++current.dropped_spans;
+        return;
+    }
+
+    struct trace_span* const s = &current.spans[current.nb_spans++];
+    s->name = name;
+    s->start_ns = start_ns;
+    s->end_ns = end_ns;
+    s->depth = current.depth;
+}
@@ -0,0 +1,68 @@
+/**
+ * @file trace.h
+ * @brief Per-thread tracing of the phases of a request.
+ *
+ * A trace is a list of timed, nested spans recorded by the calling thread
+ * between trace_start() and trace_stop(). Outside of a trace, the span
+ * functions do nothing, so the library can be instrumented for the server
+ * without costing anything to the command line tool.
+ */
+
+#pragma once
+
+#include <stddef.h> // size_t
+#include <stdint.h> // uint64_t
+
+#define TRACE_MAX_SPANS 32
+
+struct trace_span {
+    const char* name; // static string
+    uint64_t start_ns;
+    uint64_t end_ns;  // 0 while the span is open
+    unsigned int depth;
+};
+
+struct trace {
+    int active;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    unsigned int depth;
+    size_t nb_spans;
+    size_t dropped_spans; // spans that did not fit in spans[]
+    struct trace_span spans[TRACE_MAX_SPANS];
+};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+uint64_t trace_now_ns(void);
+
+/**
+ * @brief Starts a new trace in the calling thread.
+ */
+void trace_start(void);
+
+/**
+ * @brief Stops the trace of the calling thread, closing the spans left open.
+ *
+ * @return The trace; it stays valid until the next trace_start() in this thread.
+ */
+const struct trace* trace_stop(void);
+
+/**
+ * @brief Opens a span nested in the currently open ones.
+ *
+ * @param name Name of the phase; must be a static string.
+ * @return The span handle to pass to trace_span_end(), -1 if not traced.
+ */
+int trace_span_begin(const char* name);
+
+/**
+ * @brief Closes a span, and the spans opened inside it that were not closed.
+ */
+void trace_span_end(int span);
+
+/**
+ * @brief Records an already finished span at the current depth.
+ */
+void trace_span_add(const char* name, uint64_t start_ns, uint64_t end_ns);
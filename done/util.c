@@ -8,6 +8,8 @@
 
 #include <errno.h>
 #include <inttypes.h>   // strtoumax()
+#include <pthread.h>    // pthread_sigmask()
+#include <signal.h>
 #include <stdint.h>     // for uint16_t, uint32_t
 #include <string.h>
 
@@ -32,6 +34,18 @@ atouint ## N(const char* str) \
 define_atouintN(16)
 define_atouintN(32)
 
+/********************************************************************
+ * See util.h
+ */
+void block_stop_signals(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
 /* function strnstr() is borrowed from FreeBSD:
  *
  * Copyright (c) 2001 Mike Barcroft <mike@FreeBSD.org>
@@ -76,6 +76,12 @@ uint16_t atouint16(const char* str);
  */
 uint32_t atouint32(const char* str);
 
+/**
+ * @brief Blocks SIGINT and SIGTERM in the calling thread, so that they are
+ *        delivered to the main thread, which stops the server.
+ */
+void block_stop_signals(void);
+
 /**
  * @brief Find the first occurrence of find in s, where the search is limited to the
  *        first slen characters of s.
@@ -0,0 +1,149 @@
+/**
+ * @file volume_io.c
+ * @brief The FILE of a volume, wrapped (see volume_io.h).
+ */
+
+#define _GNU_SOURCE // for fopencookie()
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "volume_io.h"
+#include "error.h"
+
+struct volume_cookie {
+    FILE* original;
+    FILE* wrapped;
+    int fd;
+    off_t position;
+    struct volume_io_hooks hooks[VOLUME_IO_MAX_HOOKS];
+    size_t nb_hooks;
+    ssize_t (*read)(char* buf, size_t size, uint64_t offset); // NULL: pread()
+};
+
+static struct volume_cookie* current = NULL; // one volume per process
+
+static ssize_t cookie_read(void* c, char* buf, size_t size)
+{
+    struct volume_cookie* const cookie = c;
+    ssize_t n;
+    if (cookie->read != NULL) {
+        n = cookie->read(buf, size, (uint64_t) cookie->position);
+    } else {
+        do {
+            n = pread(cookie->fd, buf, size, cookie->position);
+        } while (n < 0 && errno == EINTR);
+    }
+    if (n > 0) cookie->position += n;
+    return n;
+}
+
+static ssize_t cookie_write(void* c, const char* buf, size_t size)
+{
+    struct volume_cookie* const cookie = c;
+    if (cookie->read != NULL) return 0; // read-only
+
+    for (size_t i = 0; i < cookie->nb_hooks; ++i) {
+        if (cookie->hooks[i].before_write != NULL) cookie->hooks[i].before_write();
+    }
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = pwrite(cookie->fd, buf + written, size - written,
+                                 cookie->position + (off_t) written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        written += (size_t) n;
+    }
+    // in reverse, so that each hook brackets the writes seen by those added later
+    for (size_t i = cookie->nb_hooks; i-- > 0; ) {
+        if (cookie->hooks[i].after_write != NULL) {
+            cookie->hooks[i].after_write((uint64_t) cookie->position, buf, written);
+        }
+    }
+    cookie->position += (off_t) written;
+    return (ssize_t) written; // 0 on error
+}
+
+static int cookie_seek(void* c, off64_t* offset, int whence)
+{
+    struct volume_cookie* const cookie = c;
+    off_t base = 0;
+    if (whence == SEEK_CUR) {
+        base = cookie->position;
+    } else if (whence == SEEK_END) {
+        struct stat st;
+        if (fstat(cookie->fd, &st) != 0) return -1;
+        base = st.st_size;
+    } else if (whence != SEEK_SET) {
+        return -1;
+    }
+    if (base + *offset < 0) return -1;
+    cookie->position = base + *offset;
+    *offset = cookie->position;
+    return 0;
+}
+
+static int cookie_close(void* c)
+{
+    struct volume_cookie* const cookie = c;
+    for (size_t i = cookie->nb_hooks; i-- > 0; ) {
+        if (cookie->hooks[i].close != NULL) cookie->hooks[i].close();
+    }
+    const int ret = fclose(cookie->original);
+    if (current == cookie) current = NULL;
+    free(cookie);
+    return ret;
+}
+
+int volume_io_wrap(struct imgfs_file* imgfs_file, const struct volume_io_hooks* hooks)
+{
+    M_REQUIRE_NON_NULL(imgfs_file);
+    M_REQUIRE_NON_NULL(imgfs_file->file);
+    M_REQUIRE_NON_NULL(hooks);
+
+    struct volume_cookie* cookie = current;
+    if (cookie == NULL || cookie->wrapped != imgfs_file->file) {
+        if (cookie != NULL) return ERR_INVALID_ARGUMENT; // another volume
+        if (fflush(imgfs_file->file) != 0) return ERR_IO;
+        cookie = calloc(1, sizeof(struct volume_cookie));
+        if (cookie == NULL) return ERR_OUT_OF_MEMORY;
+        cookie->original = imgfs_file->file;
+        cookie->fd = fileno(imgfs_file->file);
+        const off_t position = ftello(imgfs_file->file);
+        cookie->position = position < 0 ? 0 : position;
+        const cookie_io_functions_t io = { cookie_read, cookie_write, cookie_seek, cookie_close };
+        FILE* const wrapped = cookie->fd < 0 ? NULL : fopencookie(cookie, "r+", io);
+        if (wrapped == NULL) {
+            free(cookie);
+            return ERR_IO;
+        }
+        setvbuf(wrapped, NULL, _IONBF, 0); // each write is seen by the hooks when made
+        cookie->wrapped = wrapped;
+        imgfs_file->file = wrapped;
+        current = cookie;
+    }
+
+    if (cookie->nb_hooks == VOLUME_IO_MAX_HOOKS || (hooks->read != NULL && cookie->read != NULL)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    cookie->hooks[cookie->nb_hooks++] = *hooks;
+    if (hooks->read != NULL) cookie->read = hooks->read;
+    return ERR_NONE;
+}
+
+int volume_io_fd(FILE* file)
+{
+    if (file == NULL) return -1;
+    if (current != NULL && current->wrapped == file) return current->fd;
+    return fileno(file);
+}
+
+int volume_io_sync(FILE* file)
+{
+    M_REQUIRE_NON_NULL(file);
+    const int fd = volume_io_fd(file);
+    if (fflush(file) != 0 || fd < 0 || fsync(fd) != 0) return ERR_IO;
+    return ERR_NONE;
+}
@@ -0,0 +1,55 @@
+/**
+ * @file volume_io.h
+ * @brief The FILE of a volume, wrapped to read and write its file directly.
+ *
+ * Replication, the shared volume and the prefork workers each need to see
+ * the writes to the volume (to record them, to publish them, to note them),
+ * or to read it otherwise. They wrap the FILE of the volume through this
+ * module, with their hooks: reads and writes are unbuffered pread() and
+ * pwrite() on the file of the volume, and each write calls the hooks.
+ * Wrapping a volume already wrapped adds hooks to its wrapper.
+ */
+
+#pragma once
+
+#include <stddef.h> // for size_t
+#include <stdint.h> // for uint64_t
+#include <stdio.h>  // for FILE
+#include <sys/types.h> // for ssize_t
+
+#include "imgfs.h" // for struct imgfs_file
+
+#define VOLUME_IO_MAX_HOOKS 4 // sets of hooks of one wrapper
+
+/**
+ * @brief What a module does around the I/O of the volume; NULL if nothing.
+ */
+struct volume_io_hooks {
+    void (*before_write)(void); // before each write
+    void (*after_write)(uint64_t offset, const char* data, size_t written); // after it, with what was written
+    ssize_t (*read)(char* buf, size_t size, uint64_t offset); // instead of pread(); the volume is then read-only
+    void (*close)(void); // once the volume is closed
+};
+
+/**
+ * @brief Wraps the FILE of the volume, or adds hooks to its wrapper.
+ *
+ * @param imgfs_file The volume, its FILE flushed if needed.
+ * @param hooks Copied.
+ * @return Some error code. 0 if no error.
+ */
+int volume_io_wrap(struct imgfs_file* imgfs_file, const struct volume_io_hooks* hooks);
+
+/**
+ * @brief The file descriptor of a FILE, wrapped or not.
+ *
+ * @return The file descriptor, or -1 if it has none.
+ */
+int volume_io_fd(FILE* file);
+
+/**
+ * @brief Flushes a FILE, wrapped or not, and syncs its file to disk.
+ *
+ * @return Some error code (ERR_IO if it has no file to sync). 0 if no error.
+ */
+int volume_io_sync(FILE* file);